@@ -873,6 +873,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
         luarc_releasetable(L, hvalue(obj)->metatable);
 #endif /* LUA_REFCOUNT */
       hvalue(obj)->metatable = mt;
+      hvalue(obj)->snapflags = 0;  /* table changed (see luaH_set) */
       if (mt)
         luaC_objbarriert(L, hvalue(obj), mt);
       break;
@@ -546,6 +546,7 @@ typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */ 
   lu_byte lsizenode;  /* log2 of size of `node' array */
+  lu_byte snapflags;  /* kept for persistence libraries; 0 when changed */
   struct Table *metatable;
   TValue *array;  /* array part */
   Node *node;
@@ -428,6 +428,7 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
   luaC_link(L, obj2gco(t), LUA_TTABLE);
   t->metatable = NULL;
   t->flags = cast_byte(~0);
+  t->snapflags = 0;
   /* temporary values (kept only if some malloc fails) */
   t->array = NULL;
   t->sizearray = 0;
@@ -687,6 +688,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
 TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
   const TValue *p = luaH_get(t, key);
   t->flags = 0;
+  t->snapflags = 0;
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
@@ -700,6 +702,7 @@ TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
 
 TValue *luaH_setnum (lua_State *L, Table *t, int key) {
   const TValue *p = luaH_getnum(t, key);
+  t->snapflags = 0;
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
@@ -720,6 +723,7 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
 
 TValue *luaH_setstr (lua_State *L, Table *t, TString *key) {
   const TValue *p = luaH_getstr(t, key);
+  t->snapflags = 0;
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
@@ -742,6 +746,7 @@ TValue *luaH_setstr (lua_State *L, Table *t, TString *key) {
 
 TValue *luaH_setwstr (lua_State *L, Table *t, TString *key) {
   const TValue *p = luaH_getwstr(t, key);
+  t->snapflags = 0;
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
@@ -0,0 +1,62 @@
+/*
+** Mutexes, condition variables and threads for the modules that run
+** work on their own threads (lzlib, luasql, filefind and ziparchive).
+** Windows uses critical sections and condition variables, which need
+** Vista or later; everything else uses pthreads.  Include this header
+** before <windows.h> so the version it asks for takes effect.
+*/
+
+#ifndef MTHREAD_H
+#define MTHREAD_H
+
+#if defined(_WIN32)
+#if !defined(_WIN32_WINNT)  ||  _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  /* condition variables */
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(_WIN32)
+typedef CRITICAL_SECTION mt_mutex;
+typedef CONDITION_VARIABLE mt_cond;
+typedef HANDLE mt_thread;
+#define mt_mutex_init(m)     InitializeCriticalSection(m)
+#define mt_mutex_free(m)     DeleteCriticalSection(m)
+#define mt_mutex_lock(m)     EnterCriticalSection(m)
+#define mt_mutex_unlock(m)   LeaveCriticalSection(m)
+#define mt_cond_init(c)      InitializeConditionVariable(c)
+#define mt_cond_free(c)      ((void)0)
+#define mt_cond_wait(c, m)   SleepConditionVariableCS(c, m, INFINITE)
+#define mt_cond_signal(c)    WakeConditionVariable(c)
+#define mt_cond_broadcast(c) WakeAllConditionVariable(c)
+#define MT_THREAD_RETURN     unsigned __stdcall
+/* true if thread 't' was started running 'f(arg)' */
+#define mt_thread_start(t, f, arg) \
+    ((*(t) = (HANDLE)_beginthreadex(NULL, 0, f, arg, 0, NULL)) != 0)
+#define mt_thread_join(t)    (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define mt_thread_detach(t)  CloseHandle(t)
+#else
+typedef pthread_mutex_t mt_mutex;
+typedef pthread_cond_t mt_cond;
+typedef pthread_t mt_thread;
+#define mt_mutex_init(m)     pthread_mutex_init(m, NULL)
+#define mt_mutex_free(m)     pthread_mutex_destroy(m)
+#define mt_mutex_lock(m)     pthread_mutex_lock(m)
+#define mt_mutex_unlock(m)   pthread_mutex_unlock(m)
+#define mt_cond_init(c)      pthread_cond_init(c, NULL)
+#define mt_cond_free(c)      pthread_cond_destroy(c)
+#define mt_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define mt_cond_signal(c)    pthread_cond_signal(c)
+#define mt_cond_broadcast(c) pthread_cond_broadcast(c)
+#define MT_THREAD_RETURN     void *
+/* true if thread 't' was started running 'f(arg)' */
+#define mt_thread_start(t, f, arg) (pthread_create(t, NULL, f, arg) == 0)
+#define mt_thread_join(t)    pthread_join(t, NULL)
+#define mt_thread_detach(t)  pthread_detach(t)
+#endif
+
+#endif
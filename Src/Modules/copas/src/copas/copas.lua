@@ -21,6 +21,13 @@ local socket = require "socket"
 
 require "coxpcall"
 
+-- optional C scheduler core (timer heap)
+local _core
+do
+  local ok, core = pcall(require, "copas.core")
+  if ok then _core = core end
+end
+
 local WATCH_DOG_TIMEOUT = 120
 
 -- Redefines LuaSocket functions with coroutine safe versions
@@ -62,11 +69,28 @@ _COPYRIGHT   = "Copyright (C) 2005-2010 Kepler Project"
 _DESCRIPTION = "Coroutine Oriented Portable Asynchronous Services"
 _VERSION     = "Copas 1.1.7"
 
+-------------------------------------------------------------------------------
+-- Kernel readiness notification, when LuaSocket provides it (epoll).
+-- Sockets are registered incrementally instead of being handed to select
+-- on every step, so waiting costs O(ready) and FD_SETSIZE does not apply.
+-- The poller is created on first use, so processes forked before that
+-- (preforking servers) each get their own.
+-------------------------------------------------------------------------------
+local _poller
+
+local function getpoller()
+  if _poller == nil then
+    _poller = socket.poller and socket.poller() or false
+  end
+  return _poller
+end
+
 -------------------------------------------------------------------------------
 -- Simple set implementation based on LuaSocket's tinyirc.lua example
 -- adds a FIFO queue for each value in the set
+-- sets created with a mode ("r" or "w") mirror their members in the poller
 -------------------------------------------------------------------------------
-local function newset()
+local function newset(mode)
   local reverse = {}
   local set = {}
   local q = {}
@@ -75,6 +99,9 @@ local function newset()
 				   if not reverse[value] then
 				     set[#set + 1] = value
 				     reverse[value] = #set
+				     if mode and getpoller() then
+				       _poller:add(value, mode)
+				     end
 				   end
 				 end,
 
@@ -88,6 +115,9 @@ local function newset()
 				       reverse[top] = index
 				       set[index] = top
 				     end
+				     if mode and _poller then
+				       _poller:remove(value, mode)
+				     end
 				   end
 				 end,
 
@@ -109,17 +139,163 @@ local function newset()
 				  end
 				  return ret
 				end
-			      end
+			      end,
+
+			-- removes itm from the queue of key, and key from the
+			-- set when nothing else is queued on it
+			unqueue = function (set, key, itm)
+				    local t = q[key]
+				    if t ~= nil then
+				      for i = 1, #t do
+					if t[i] == itm then
+					  table.remove (t, i)
+					  break
+					end
+				      end
+				      if t[1] == nil then
+					q[key] = nil
+					set:remove (key)
+				      end
+				    end
+				  end
 		    }})
   return set
 end
 
+-------------------------------------------------------------------------------
+-- Binary heap of timers, keyed by value, used when copas.core is missing.
+-- Offers the same methods as the heaps created by copas.core.heap().
+-------------------------------------------------------------------------------
+local function newheap()
+  local time, value, index = {}, {}, {}
+  local floor = math.floor
+
+  local function place(i, t, v)
+    time[i], value[i], index[v] = t, v, i
+  end
+
+  local function up(i)
+    local t, v = time[i], value[i]
+    while i > 1 do
+      local parent = floor(i / 2)
+      if time[parent] <= t then break end
+      place(i, time[parent], value[parent])
+      i = parent
+    end
+    place(i, t, v)
+  end
+
+  local function down(i)
+    local n = #time
+    local t, v = time[i], value[i]
+    while true do
+      local child = 2 * i
+      if child > n then break end
+      if child < n and time[child + 1] < time[child] then
+	child = child + 1
+      end
+      if t <= time[child] then break end
+      place(i, time[child], value[child])
+      i = child
+    end
+    place(i, t, v)
+  end
+
+  local function unlink(i)
+    local n = #time
+    index[value[i]] = nil
+    if i < n then
+      place(i, time[n], value[n])
+    end
+    time[n], value[n] = nil, nil
+    if i < n then
+      up(i)
+      down(i)
+    end
+  end
+
+  return {
+    insert = function (heap, v, t)
+	       local i = index[v]
+	       if i then
+		 time[i] = t
+		 up(i)
+		 down(index[v])
+	       else
+		 i = #time + 1
+		 place(i, t, v)
+		 up(i)
+	       end
+	     end,
+
+    remove = function (heap, v)
+	       local i = v ~= nil and index[v]
+	       if i then unlink(i) end
+	       return i and true or false
+	     end,
+
+    peek = function (heap)
+	     return time[1], value[1]
+	   end,
+
+    pop = function (heap, now)
+	    local t, v = time[1], value[1]
+	    if t == nil or (now and t > now) then return nil end
+	    unlink(1)
+	    return v, t
+	  end,
+
+    gettime = function (heap, v)
+		local i = index[v]
+		return i and time[i]
+	      end,
+
+    size = function (heap)
+	     return #time
+	   end,
+  }
+end
+
 local _servers = newset() -- servers being handled
-local _reading_log = {}
-local _writing_log = {}
 
-local _reading = newset() -- sockets currently being read
-local _writing = newset() -- sockets currently being written
+local _reading = newset("r") -- sockets currently being read
+local _writing = newset("w") -- sockets currently being written
+
+-------------------------------------------------------------------------------
+-- Timers. Every suspended coroutine has at most one timer: a sleeping one
+-- is resumed when it expires, and one waiting on a socket is resumed with
+-- a timeout (or, without a socket timeout, by the watch dog) instead of
+-- having its socket polled.
+-------------------------------------------------------------------------------
+local gettime = socket.gettime
+local _timers = _core and _core.heap() or newheap()
+
+local _sleeping = setmetatable({}, {__mode = "k"})  -- sleeping coroutines
+local _waitskt = setmetatable({}, {__mode = "k"})   -- coroutine -> socket
+local _waitset = setmetatable({}, {__mode = "k"})   -- coroutine -> set
+local _timeouts = setmetatable({}, {__mode = "k"})  -- socket -> seconds
+local _timedout = setmetatable({}, {__mode = "k"})  -- sockets that timed out
+
+-- checks if the last wait on a socket ended by its timeout
+local function timedout(skt)
+  if _timedout[skt] then
+    _timedout[skt] = nil
+    return true
+  end
+  return false
+end
+
+-------------------------------------------------------------------------------
+-- Sets the timeout in seconds for Copas operations on a socket. A nil or
+-- negative timeout makes them wait indefinitely.
+-------------------------------------------------------------------------------
+function settimeout(skt, timeout)
+  if timeout and timeout >= 0 then
+    _timeouts[skt] = timeout
+  else
+    _timeouts[skt] = nil
+  end
+end
 
 -------------------------------------------------------------------------------
 -- Coroutine based socket I/O functions.
@@ -131,11 +307,12 @@ function receive(client, pattern, part)
   repeat
     s, err, part = client:receive(pattern, part)
     if s or err ~= "timeout" then
-      _reading_log[client] = nil
       return s, err, part
     end
-    _reading_log[client] = os.time()
     coroutine.yield(client, _reading)
+    if timedout(client) then
+      return nil, "timeout", part
+    end
   until false
 end
 
@@ -148,11 +325,12 @@ function receivePartial(client, pattern)
     s, err, part = client:receive(pattern)
     if s or ( (type(pattern)=="number") and part~="" and part ~=nil ) or
     err ~= "timeout" then
-    _reading_log[client] = nil
     return s, err, part
   end
-  _reading_log[client] = os.time()
   coroutine.yield(client, _reading)
+  if timedout(client) then
+    return nil, "timeout", part
+  end
 until false
 end
 
@@ -168,15 +346,16 @@ function send(client,data, from, to)
     -- adds extra corrotine swap
     -- garantees that high throuput dont take other threads to starvation
     if (math.random(100) > 90) then
-      _writing_log[client] = os.time()
       coroutine.yield(client, _writing)
     end
     if s or err ~= "timeout" then
-      _writing_log[client] = nil
+      timedout(client)
       return s, err,lastIndex
     end
-    _writing_log[client] = os.time()
     coroutine.yield(client, _writing)
+    if timedout(client) then
+      return nil, "timeout", lastIndex
+    end
   until false
 end
 
@@ -187,11 +366,12 @@ function connect(skt, host, port)
   repeat
     ret, err = skt:connect (host, port)
     if ret or err ~= "timeout" then
-      _writing_log[skt] = nil
       return ret, err
     end
-    _writing_log[skt] = os.time()
     coroutine.yield(skt, _writing)
+    if timedout(skt) then
+      return nil, "timeout"
+    end
   until false
   return ret, err
 end
@@ -219,6 +399,8 @@ local _skt_mt = {__index = {
 
 		   settimeout = function (self,time)
 				  self.timeout=time
+				  -- 0 selects partial reads, not an immediate timeout
+				  settimeout (self.socket, time ~= 0 and time or nil)
 				  return
 				end,
 	       }}
@@ -253,9 +435,13 @@ local function _doTick (co, skt, ...)
 
   local ok, res, new_q = coroutine.resume(co, skt, ...)
 
-  if ok and res and new_q then
+  if ok and new_q == _sleeping then
+    -- the timer (if any) was set by sleep()
+  elseif ok and res and new_q then
     new_q:insert (res)
     new_q:push (res, co)
+    _waitskt[co], _waitset[co] = res, new_q
+    _timers:insert (co, gettime() + (_timeouts[res] or WATCH_DOG_TIMEOUT))
   else
     if not ok then copcall (_errhandlers [co] or _deferror, res, co, skt) end
     if skt then skt:close() end
@@ -276,12 +462,88 @@ local function _accept(input, handler)
 end
 
 -- handle threads on a queue
+local function _tickQueue (set, skt)
+  local co = set:pop (skt)
+  if co then
+    _waitskt[co], _waitset[co] = nil, nil
+    _timers:remove (co)
+  end
+  _doTick (co, skt)
+end
+
 local function _tickRead (skt)
-  _doTick (_reading:pop (skt), skt)
+  _tickQueue (_reading, skt)
 end
 
 local function _tickWrite (skt)
-  _doTick (_writing:pop (skt), skt)
+  _tickQueue (_writing, skt)
+end
+
+-- resumes a coroutine whose timer expired
+local function _tickTimer (co)
+  local skt = _waitskt[co]
+  if skt then
+    -- a socket wait: drop the coroutine from the socket queue and
+    -- report a timeout if the socket has one, otherwise simply let the
+    -- coroutine retry its operation (watch dog)
+    _waitset[co]:unqueue (skt, co)
+    _waitskt[co], _waitset[co] = nil, nil
+    if _timeouts[skt] then
+      _timedout[skt] = true
+    end
+  else
+    _sleeping[co] = nil
+  end
+  _doTick (co, skt)
+end
+
+-- resumes the coroutines whose timers expired, but not the ones
+-- scheduled while doing so
+local function _runTimers ()
+  local now = gettime()
+  for i = 1, _timers:size() do
+    local co = _timers:pop (now)
+    if not co then break end
+    _tickTimer (co)
+  end
+end
+
+-- returns how long the dispatcher may block waiting for I/O
+local function _waitTime (timeout)
+  local first = _timers:peek()
+  if first then
+    local delay = first - gettime()
+    if delay < 0 then delay = 0 end
+    if not timeout or timeout < 0 or delay < timeout then
+      return delay
+    end
+  end
+  return timeout
+end
+
+-------------------------------------------------------------------------------
+-- Suspends the running coroutine for sleeptime seconds (0 by default), or
+-- until it is woken up with copas.wakeup() if sleeptime is negative.
+-------------------------------------------------------------------------------
+function sleep(sleeptime)
+  local co = coroutine.running()
+  sleeptime = sleeptime or 0
+  _sleeping[co] = true
+  if sleeptime < 0 then
+    _timers:remove (co)
+  else
+    _timers:insert (co, gettime() + sleeptime)
+  end
+  coroutine.yield(nil, _sleeping)
+end
+
+-------------------------------------------------------------------------------
+-- Makes a sleeping coroutine runnable in the next dispatcher step.
+-------------------------------------------------------------------------------
+function wakeup(co)
+  if _sleeping[co] then
+    _timers:insert (co, 0)
+  end
 end
 
 -------------------------------------------------------------------------------
@@ -293,6 +555,22 @@ function addserver(server, handler, timeout)
   _reading:insert(server)
 end
 
+-------------------------------------------------------------------------------
+-- Removes a server from Copas dispatcher and closes it. With drain, the
+-- connections already queued on the server are accepted and handed to its
+-- handler first, instead of being reset by the close
+-------------------------------------------------------------------------------
+function removeserver(server, drain)
+  local handler = _servers[server]
+  _servers[server] = nil
+  _reading:remove(server)
+  if drain and handler then
+    server:settimeout(0)
+    while _accept(server, handler) do end
+  end
+  return server:close()
+end
+
 -------------------------------------------------------------------------------
 -- Adds an new courotine thread to Copas dispatcher
 -------------------------------------------------------------------------------
@@ -370,47 +648,18 @@ local _writable_t = {
 
 addtaskWrite (_writable_t)
 
-local last_cleansing = 0
-
 -------------------------------------------------------------------------------
 -- Checks for reads and writes on sockets
 -------------------------------------------------------------------------------
 local function _select (timeout)
   local err
-  local readable={}
-  local writable={}
-  local r={}
-  local w={}
-  local now = os.time()
-  local duration = os.difftime
-
-  _readable_t._evs, _writable_t._evs, err = socket.select(_reading, _writing, timeout)
-  local r_evs, w_evs = _readable_t._evs, _writable_t._evs
-
-  if duration(now, last_cleansing) > WATCH_DOG_TIMEOUT then
-    last_cleansing = now
-    for k,v in pairs(_reading_log) do
-      if not r_evs[k] and duration(now, v) > WATCH_DOG_TIMEOUT then
-	_reading_log[k] = nil
-	r_evs[#r_evs + 1] = k
-	r_evs[k] = #r_evs
-      end
-    end
 
-    for k,v in pairs(_writing_log) do
-      if not w_evs[k] and duration(now, v) > WATCH_DOG_TIMEOUT then
-	_writing_log[k] = nil
-	w_evs[#w_evs + 1] = k
-	w_evs[k] = #w_evs
-      end
-    end
-  end
-
-  if err == "timeout" and #r_evs + #w_evs > 0 then
-    return nil
+  if getpoller() then
+    _readable_t._evs, _writable_t._evs, err = _poller:wait(timeout)
   else
-    return err
+    _readable_t._evs, _writable_t._evs, err = socket.select(_reading, _writing, timeout)
   end
+  return err
 end
 
 
@@ -419,18 +668,21 @@ end
 -- Listen to client requests and handles them
 -------------------------------------------------------------------------------
 function step(timeout)
-  local err = _select (timeout)
-  if err == "timeout" then return end
+  local err = _select (_waitTime (timeout))
 
-  if err then
+  if err and err ~= "timeout" then
     error(err)
   end
 
-  for tsk in tasks() do
-    for ev in tsk:events() do
-      tsk:tick (ev)
+  if not err then
+    for tsk in tasks() do
+      for ev in tsk:events() do
+	tsk:tick (ev)
+      end
     end
   end
+
+  _runTimers ()
 end
 
 -------------------------------------------------------------------------------
@@ -0,0 +1,320 @@
+/*
+** Copas scheduler core
+**
+** An indexed binary heap of timers. Each entry associates a Lua value
+** (usually a coroutine) with an absolute deadline. Inserting a value that
+** is already scheduled moves it to its new deadline, and scheduled values
+** can be cancelled in O(log n), so a dispatcher can keep one timer per
+** waiting coroutine and only pay for the ones that actually expire.
+**
+** Values are anchored in the environment table of the heap, which maps
+** each value to its slot number and each slot number back to its value,
+** so numbers cannot be used as values.
+**
+** Copyright (c) 2005-2010 Kepler Project
+*/
+
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#ifndef COPAS_API
+#define COPAS_API
+#endif
+
+#define HEAP_META "copas heap"
+
+/* initial number of entries allocated for a heap */
+#define HEAP_MINSIZE 16
+
+typedef struct {
+  double time;   /* deadline */
+  int slot;      /* key of the value in the environment table */
+} t_entry;
+
+typedef struct {
+  t_entry *entry;  /* heap ordered by deadline */
+  int *pos;        /* heap position of each slot, or -1 if the slot is free */
+  int *freeslot;   /* stack of free slots */
+  int n;           /* entries in use */
+  int nfree;       /* entries in freeslot */
+  int size;        /* entries allocated in entry, pos and freeslot */
+} t_heap;
+
+static t_heap *checkheap (lua_State *L) {
+  return (t_heap *) luaL_checkudata(L, 1, HEAP_META);
+}
+
+/*
+** Heap ordering.
+*/
+static void place (t_heap *h, int i, t_entry e) {
+  h->entry[i] = e;
+  h->pos[e.slot] = i;
+}
+
+static void siftup (t_heap *h, int i) {
+  t_entry e = h->entry[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (h->entry[parent].time <= e.time)
+      break;
+    place(h, i, h->entry[parent]);
+    i = parent;
+  }
+  place(h, i, e);
+}
+
+static void siftdown (t_heap *h, int i) {
+  t_entry e = h->entry[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= h->n)
+      break;
+    if (child + 1 < h->n && h->entry[child + 1].time < h->entry[child].time)
+      child++;
+    if (e.time <= h->entry[child].time)
+      break;
+    place(h, i, h->entry[child]);
+    i = child;
+  }
+  place(h, i, e);
+}
+
+/* removes the entry at heap position i and frees its slot */
+static void unlink_entry (t_heap *h, int i) {
+  int slot = h->entry[i].slot;
+  h->pos[slot] = -1;
+  h->freeslot[h->nfree++] = slot;
+  if (--h->n > i) {
+    place(h, i, h->entry[h->n]);
+    siftup(h, i);
+    siftdown(h, i);
+  }
+}
+
+static int grow (t_heap *h) {
+  int size = h->size ? 2 * h->size : HEAP_MINSIZE;
+  t_entry *entry = (t_entry *) realloc(h->entry, size * sizeof(t_entry));
+  int *pos, *freeslot, i;
+  if (entry == NULL) return 0;
+  h->entry = entry;
+  pos = (int *) realloc(h->pos, size * sizeof(int));
+  if (pos == NULL) return 0;
+  h->pos = pos;
+  freeslot = (int *) realloc(h->freeslot, size * sizeof(int));
+  if (freeslot == NULL) return 0;
+  h->freeslot = freeslot;
+  /* new slots are pushed so that lower numbers are handed out first */
+  for (i = size - 1; i >= h->size; i--) {
+    h->pos[i] = -1;
+    h->freeslot[h->nfree++] = i;
+  }
+  h->size = size;
+  return 1;
+}
+
+/* pushes the value stored in a slot */
+static void pushslot (lua_State *L, int slot) {
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, slot + 1);
+  lua_remove(L, -2);
+}
+
+/* returns the slot of the value at idx, or -1 if it is not scheduled */
+static int getslot (lua_State *L, int idx) {
+  int slot = -1;
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1))
+    slot = (int) lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return slot;
+}
+
+/* removes the value in a slot from the environment table */
+static void clearslot (lua_State *L, int slot) {
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, slot + 1);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, slot + 1);
+  lua_pop(L, 1);
+}
+
+/*
+** heap:insert(value, time)
+** Schedules value at time, or moves it there if already scheduled.
+*/
+static int heap_insert (lua_State *L) {
+  t_heap *h = checkheap(L);
+  double time = luaL_checknumber(L, 3);
+  int slot, i;
+  luaL_argcheck(L, !lua_isnoneornil(L, 2) && lua_type(L, 2) != LUA_TNUMBER,
+                2, "non-numeric value expected");
+  slot = getslot(L, 2);
+  if (slot >= 0) {
+    i = h->pos[slot];
+    h->entry[i].time = time;
+    siftup(h, i);
+    siftdown(h, h->pos[slot]);
+    return 0;
+  }
+  if (h->nfree == 0 && !grow(h))
+    luaL_error(L, "not enough memory");
+  slot = h->freeslot[--h->nfree];
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, slot);
+  lua_rawset(L, -3);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, slot + 1);
+  lua_pop(L, 1);
+  i = h->n++;
+  h->entry[i].time = time;
+  h->entry[i].slot = slot;
+  h->pos[slot] = i;
+  siftup(h, i);
+  return 0;
+}
+
+/*
+** heap:remove(value)
+** Cancels the timer of value. Returns true if it was scheduled.
+*/
+static int heap_remove (lua_State *L) {
+  t_heap *h = checkheap(L);
+  int slot = getslot(L, 2);
+  if (slot < 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  unlink_entry(h, h->pos[slot]);
+  clearslot(L, slot);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+** heap:peek()
+** Returns the earliest deadline and its value, or nil if the heap is empty.
+*/
+static int heap_peek (lua_State *L) {
+  t_heap *h = checkheap(L);
+  if (h->n == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushnumber(L, h->entry[0].time);
+  pushslot(L, h->entry[0].slot);
+  return 2;
+}
+
+/*
+** heap:pop([now])
+** Removes and returns the value with the earliest deadline, followed by
+** the deadline itself. If now is given, only a value whose deadline is not
+** after now is returned. Returns nil when there is none.
+*/
+static int heap_pop (lua_State *L) {
+  t_heap *h = checkheap(L);
+  int slot;
+  double time;
+  if (h->n == 0 ||
+      (!lua_isnoneornil(L, 2) && h->entry[0].time > luaL_checknumber(L, 2))) {
+    lua_pushnil(L);
+    return 1;
+  }
+  slot = h->entry[0].slot;
+  time = h->entry[0].time;
+  pushslot(L, slot);
+  unlink_entry(h, 0);
+  clearslot(L, slot);
+  lua_pushnumber(L, time);
+  return 2;
+}
+
+/*
+** heap:gettime(value)
+** Returns the deadline of value, or nil if it is not scheduled.
+*/
+static int heap_gettime (lua_State *L) {
+  t_heap *h = checkheap(L);
+  int slot = getslot(L, 2);
+  if (slot < 0)
+    lua_pushnil(L);
+  else
+    lua_pushnumber(L, h->entry[h->pos[slot]].time);
+  return 1;
+}
+
+static int heap_len (lua_State *L) {
+  lua_pushinteger(L, checkheap(L)->n);
+  return 1;
+}
+
+static int heap_tostring (lua_State *L) {
+  lua_pushfstring(L, "copas heap (%p)", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int heap_gc (lua_State *L) {
+  t_heap *h = checkheap(L);
+  free(h->entry);
+  free(h->pos);
+  free(h->freeslot);
+  h->entry = NULL;
+  h->pos = h->freeslot = NULL;
+  h->n = h->nfree = h->size = 0;
+  return 0;
+}
+
+/*
+** heap()
+** Creates an empty timer heap.
+*/
+static int core_heap (lua_State *L) {
+  t_heap *h = (t_heap *) lua_newuserdata(L, sizeof(t_heap));
+  h->entry = NULL;
+  h->pos = h->freeslot = NULL;
+  h->n = h->nfree = h->size = 0;
+  luaL_getmetatable(L, HEAP_META);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+static const luaL_reg heap_methods[] = {
+  {"insert", heap_insert},
+  {"remove", heap_remove},
+  {"peek", heap_peek},
+  {"pop", heap_pop},
+  {"gettime", heap_gettime},
+  {"size", heap_len},
+  {NULL, NULL}
+};
+
+static const luaL_reg core_funcs[] = {
+  {"heap", core_heap},
+  {NULL, NULL}
+};
+
+COPAS_API int luaopen_copas_core (lua_State *L) {
+  luaL_newmetatable(L, HEAP_META);
+  lua_newtable(L);
+  luaL_register(L, NULL, heap_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, heap_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, heap_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, heap_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_register(L, "copas.core", core_funcs);
+  return 1;
+}
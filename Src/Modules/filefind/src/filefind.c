@@ -946,7 +946,10 @@ static int glob_create_metatable(lua_State *L) {
 
 static int l_fileglob_first(lua_State *L) {
 	const char* pattern = luaL_checkstring(L, 1);
-	*(void **)(lua_newuserdata(L, sizeof(void *))) = fileglob_Create(pattern);
+	int threads = luaL_optint(L, 2, 1);
+	struct _fileglob* glob = fileglob_Create(pattern);
+	fileglob_SetThreads(glob, threads);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = glob;
 
 	luaL_getmetatable(L, FILEGLOB_METATABLE);
 	lua_setmetatable(L, -2);
@@ -1,6 +1,5 @@
-#if defined(WIN32)
-#include <windows.h>
-#else
+#include "mthread.h"
+#if !defined(WIN32)
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +27,7 @@ static void* fileglob_DefaultAllocFunction(void* userData, void* ptr, unsigned i
 
 typedef struct fileglob_StringNode {
 	struct fileglob_StringNode* next;
+	struct fileglob_Matcher* matcher;
 	char buffer[1];
 } fileglob_StringNode;
 
@@ -89,6 +89,9 @@ typedef struct _fileglob {
 	BUFFER combinedName;
 
 	int filesAndFolders;
+
+	int threads;
+	struct fileglob_Parallel* parallel;
 } fileglob;
 
 #include "fileglob.h"
@@ -143,6 +146,8 @@ static void _fileglob_list_clear(fileglob* self, fileglob_StringNode** head, fil
 	for (node = *head; node;) {
 		fileglob_StringNode* oldNode = node;
 		node = node->next;
+		if (oldNode->matcher)
+			self->allocFunction(self->userData, oldNode->matcher, 0);
 		self->allocFunction(self->userData, oldNode, 0);
 	}
 
@@ -160,6 +165,7 @@ static void _fileglob_list_append(fileglob* self, fileglob_StringNode** head, fi
 		(*tail)->next = newNode;
 	*tail = newNode;
 	newNode->next = NULL;
+	newNode->matcher = NULL;
 	memcpy(newNode->buffer, theString, patternLen + 1);
 }
 
@@ -245,8 +251,116 @@ int fileglob_WildMatch(const char* pattern, const char *string, int caseSensitiv
 	return !*pattern;
 }
 
+
+/**
+	A wildcard pattern compiled once for repeated case insensitive matching.
+	The pattern is split at each run of '*' into chunks, already uppercased.
+	The first chunk is anchored at the start of the text and the last chunk
+	at the end.  Each middle chunk goes at its leftmost position after the
+	previous chunk, which is always a correct placement when only '*' and
+	'?' are involved.  It matches the same texts as fileglob_WildMatch(),
+	without restarting on every mismatch.
+**/
+typedef struct fileglob_MatcherChunk {
+	const unsigned char* text;
+	size_t length;
+} fileglob_MatcherChunk;
+
+
+typedef struct fileglob_Matcher {
+	size_t minLength;
+	size_t numChunks;
+	fileglob_MatcherChunk chunks[1];
+} fileglob_Matcher;
+
+
+static fileglob_Matcher* _fileglob_MatcherCreate(fileglob* self, const char* pattern) {
+	fileglob_Matcher* matcher;
+	fileglob_MatcherChunk* chunk;
+	unsigned char* text;
+	const char* ptr;
+	size_t numChunks = 1;
+
+	for (ptr = pattern; *ptr; ++ptr) {
+		if (ptr[0] == '*'  &&  ptr[1] != '*')
+			numChunks++;
+	}
+
+	matcher = (fileglob_Matcher*)self->allocFunction(self->userData, NULL,
+			(unsigned int)(sizeof(fileglob_Matcher) + (numChunks - 1) * sizeof(fileglob_MatcherChunk) + strlen(pattern) + 1));
+	matcher->minLength = 0;
+	matcher->numChunks = numChunks;
+
+	text = (unsigned char*)(matcher->chunks + numChunks);
+	chunk = matcher->chunks;
+	chunk->text = text;
+	chunk->length = 0;
+	for (ptr = pattern; *ptr; ++ptr) {
+		if (*ptr == '*') {
+			if (ptr[1] == '*')
+				continue;
+			matcher->minLength += chunk->length;
+			++chunk;
+			chunk->text = text;
+			chunk->length = 0;
+		} else {
+			*text++ = (unsigned char)toupper((unsigned char)*ptr);
+			chunk->length++;
+		}
+	}
+	matcher->minLength += chunk->length;
+
+	return matcher;
+}
+
+
+static int _fileglob_MatcherChunkMatch(const fileglob_MatcherChunk* chunk, const char* text) {
+	size_t i;
+	for (i = 0; i < chunk->length; ++i) {
+		unsigned char ch = chunk->text[i];
+		if (ch != '?'  &&  ch != toupper((unsigned char)text[i]))
+			return 0;
+	}
+	return 1;
+}
+
+
+static int _fileglob_MatcherMatch(const fileglob_Matcher* matcher, const char* text, size_t textLen) {
+	const fileglob_MatcherChunk* chunk = matcher->chunks;
+	const fileglob_MatcherChunk* lastChunk = matcher->chunks + matcher->numChunks - 1;
+	size_t pos;
+	size_t endPos;
+
+	if (textLen < matcher->minLength)
+		return 0;
+
+	// No '*' at all.
+	if (chunk == lastChunk)
+		return textLen == chunk->length  &&  _fileglob_MatcherChunkMatch(chunk, text);
+
+	if (!_fileglob_MatcherChunkMatch(chunk, text)  ||
+			!_fileglob_MatcherChunkMatch(lastChunk, text + textLen - lastChunk->length))
+		return 0;
+
+	pos = chunk->length;
+	endPos = textLen - lastChunk->length;
+	for (++chunk; chunk != lastChunk; ++chunk) {
+		for (;;) {
+			if (pos + chunk->length > endPos)
+				return 0;
+			if (_fileglob_MatcherChunkMatch(chunk, text + pos))
+				break;
+			pos++;
+		}
+		pos += chunk->length;
+	}
+
+	return 1;
+}
+
 /* Forward declares. */
 int _fileglob_GlobHelper(fileglob* self, const char* inPattern);
+static void _fileglob_ParallelStop(fileglob* self);
 
 /**
 **/
@@ -313,6 +427,8 @@ fileglob* fileglob_CreateWithAlloc(const char* inPattern, fileglob_Alloc allocFu
 void fileglob_Destroy(fileglob* self) {
 	if (!self)
 		return;
+	if (self->parallel)
+		_fileglob_ParallelStop(self);
 	_fileglob_Reset(self);
 	buffer_free(&self->combinedName);
 	self->allocFunction(self->userData, self, 0);
@@ -549,6 +665,7 @@ void fileglob_AddExclusivePattern(fileglob* self, const char* pattern) {
 		}
 
 		_fileglob_list_append(self, &self->exclusiveDirectoryPatternsHead, &self->exclusiveDirectoryPatternsTail, pattern);
+		self->exclusiveDirectoryPatternsTail->matcher = _fileglob_MatcherCreate(self, pattern);
 	} else {
 		for (node = self->exclusiveFilePatternsHead; node; node = node->next) {
 #if defined(WIN32)
@@ -560,6 +677,7 @@ void fileglob_AddExclusivePattern(fileglob* self, const char* pattern) {
 		}
 
 		_fileglob_list_append(self, &self->exclusiveFilePatternsHead, &self->exclusiveFilePatternsTail, pattern);
+		self->exclusiveFilePatternsTail->matcher = _fileglob_MatcherCreate(self, pattern);
 	}
 }
 
@@ -586,6 +704,7 @@ void fileglob_AddIgnorePattern(fileglob* self, const char* pattern) {
 		}
 
 		_fileglob_list_append(self, &self->ignoreDirectoryPatternsHead, &self->ignoreDirectoryPatternsTail, pattern);
+		self->ignoreDirectoryPatternsTail->matcher = _fileglob_MatcherCreate(self, pattern);
 	} else {
 		for (node = self->ignoreFilePatternsHead; node; node = node->next) {
 #if defined(WIN32)
@@ -597,6 +716,7 @@ void fileglob_AddIgnorePattern(fileglob* self, const char* pattern) {
 		}
 
 		_fileglob_list_append(self, &self->ignoreFilePatternsHead, &self->ignoreFilePatternsTail, pattern);
+		self->ignoreFilePatternsTail->matcher = _fileglob_MatcherCreate(self, pattern);
 	}
 }
 
@@ -609,9 +729,10 @@ void fileglob_AddIgnorePattern(fileglob* self, const char* pattern) {
 **/
 int _fileglob_MatchExclusiveDirectoryPattern(fileglob* self, const char* text) {
 	fileglob_StringNode* node;
+	size_t textLen = strlen(text);
 
 	for (node = self->exclusiveDirectoryPatternsHead; node; node = node->next) {
-		if (fileglob_WildMatch(node->buffer, text, 0))
+		if (_fileglob_MatcherMatch(node->matcher, text, textLen))
 			return 1;
 	}
 
@@ -627,9 +748,10 @@ int _fileglob_MatchExclusiveDirectoryPattern(fileglob* self, const char* text) {
 **/
 int _fileglob_MatchExclusiveFilePattern(fileglob* self, const char* text) {
 	fileglob_StringNode* node;
+	size_t textLen = strlen(text);
 
 	for (node = self->exclusiveFilePatternsHead; node; node = node->next) {
-		if (fileglob_WildMatch(node->buffer, text, 0))
+		if (_fileglob_MatcherMatch(node->matcher, text, textLen))
 			return 1;
 	}
 
@@ -645,9 +767,10 @@ int _fileglob_MatchExclusiveFilePattern(fileglob* self, const char* text) {
 **/
 static int _fileglob_MatchIgnoreDirectoryPattern(fileglob* self, const char* text) {
 	fileglob_StringNode* node;
+	size_t textLen = strlen(text);
 
 	for (node = self->ignoreDirectoryPatternsHead; node; node = node->next) {
-		if (fileglob_WildMatch(node->buffer, text, 0))
+		if (_fileglob_MatcherMatch(node->matcher, text, textLen))
 			return 1;
 	}
 
@@ -663,9 +786,10 @@ static int _fileglob_MatchIgnoreDirectoryPattern(fileglob* self, const char* tex
 **/
 static int _fileglob_MatchIgnoreFilePattern(fileglob* self, const char* text) {
 	fileglob_StringNode* node;
+	size_t textLen = strlen(text);
 
 	for (node = self->ignoreFilePatternsHead; node; node = node->next) {
-		if (fileglob_WildMatch(node->buffer, text, 0))
+		if (_fileglob_MatcherMatch(node->matcher, text, textLen))
 			return 1;
 	}
 
@@ -695,12 +819,562 @@ static void SplicePath(BUFFER* dest, const char * p1, const char * p2) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+#define FILEGLOB_MAX_THREADS			64
+#define FILEGLOB_MAX_QUEUED_RESULTS		4096
+#define FILEGLOB_RESULT_BATCH			256
+
+typedef struct fileglob_Result {
+	struct fileglob_Result* next;
+#if defined(WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+#endif
+	char filename[1];
+} fileglob_Result;
+
+
+typedef struct fileglob_Parallel {
+	mt_mutex lock;
+	mt_cond workCond;			// Work was queued or the walk is over.
+	mt_cond resultCond;			// Results were queued or the walk is over.
+	mt_cond spaceCond;			// The reader drained the result queue.
+
+	mt_thread* threads;
+	int threadCount;
+
+	// Directory patterns waiting for a worker, most recent first so the
+	// walk stays depth first and the queue stays short.
+	fileglob_StringNode* workHead;
+	int busyCount;
+	int done;
+	int quit;
+
+	fileglob_Result* resultHead;
+	fileglob_Result* resultTail;
+	size_t resultCount;
+
+	// Only touched by the reader.
+	fileglob_Result* readyHead;
+	fileglob_Result* current;
+#if !defined(WIN32)
+	struct stat attr;
+	int hasattr;
+#endif
+} fileglob_Parallel;
+
+
+typedef struct fileglob_Worker {
+	fileglob* self;
+	BUFFER name;
+
+	fileglob_Result* batchHead;
+	fileglob_Result* batchTail;
+	size_t batchCount;
+
+	fileglob_StringNode* childHead;
+	fileglob_StringNode* childTail;
+} fileglob_Worker;
+
+
+static void _fileglob_ResultListFree(fileglob* self, fileglob_Result* result) {
+	while (result) {
+		fileglob_Result* oldResult = result;
+		result = result->next;
+		self->allocFunction(self->userData, oldResult, 0);
+	}
+}
+
+
+/**
+	\internal Hands the worker's batch of results to the reader, waiting for
+	room in the result queue first.
+
+	\return Returns false if the glob is being destroyed.
+**/
+static int _fileglob_WorkerFlush(fileglob_Worker* worker) {
+	fileglob* self = worker->self;
+	fileglob_Parallel* parallel = self->parallel;
+	int quit;
+
+	if (!worker->batchHead)
+		return 1;
+
+	mt_mutex_lock(&parallel->lock);
+	while (!parallel->quit  &&  parallel->resultCount >= FILEGLOB_MAX_QUEUED_RESULTS)
+		mt_cond_wait(&parallel->spaceCond, &parallel->lock);
+	quit = parallel->quit;
+	if (!quit) {
+		if (parallel->resultTail)
+			parallel->resultTail->next = worker->batchHead;
+		else
+			parallel->resultHead = worker->batchHead;
+		parallel->resultTail = worker->batchTail;
+		parallel->resultCount += worker->batchCount;
+		mt_cond_signal(&parallel->resultCond);
+	}
+	mt_mutex_unlock(&parallel->lock);
+
+	if (quit)
+		_fileglob_ResultListFree(self, worker->batchHead);
+	worker->batchHead = worker->batchTail = NULL;
+	worker->batchCount = 0;
+	return !quit;
+}
+
+
+/**
+	\internal Creates the match [basePath][name][suffix].
+**/
+static fileglob_Result* _fileglob_ResultCreate(fileglob* self, const char* basePath, size_t basePathLen,
+		const char* name, size_t nameLen, const char* suffix, const void* attributes) {
+	size_t suffixLen = strlen(suffix);
+	fileglob_Result* result = (fileglob_Result*)self->allocFunction(self->userData, NULL,
+			(unsigned int)(sizeof(fileglob_Result) + basePathLen + nameLen + suffixLen));
+	result->next = NULL;
+#if defined(WIN32)
+	memcpy(&result->attributes, attributes, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+#else
+	(void)attributes;
+#endif
+	memcpy(result->filename, basePath, basePathLen);
+	memcpy(result->filename + basePathLen, name, nameLen);
+	memcpy(result->filename + basePathLen + nameLen, suffix, suffixLen + 1);
+	return result;
+}
+
+
+static void _fileglob_ResultListAppend(fileglob_Result** head, fileglob_Result** tail, fileglob_Result* result) {
+	if (*tail)
+		(*tail)->next = result;
+	else
+		*head = result;
+	*tail = result;
+}
+
+
+/**
+	\internal Queues [basePath][name][remainder] as a directory pattern for
+	the workers.
+**/
+static void _fileglob_WorkerAddChild(fileglob_Worker* worker, const char* basePath, size_t basePathLen,
+		const char* name, const char* remainder) {
+	BUFFER* buff = &worker->name;
+	buffer_reset(buff);
+	buffer_addstring(buff, basePath, basePathLen);
+	buffer_addstring(buff, name, strlen(name));
+	buffer_addstring(buff, remainder, strlen(remainder) + 1);
+	_fileglob_list_append(worker->self, &worker->childHead, &worker->childTail, buffer_ptr(buff));
+}
+
+
+/**
+	\internal Reads one directory for a worker.  [pattern] is split and
+	matched exactly like one level of _fileglob_GlobHelper().  A '**' level
+	there reads the directory twice, once for the rest of the pattern and
+	once more to recurse; here a single read serves both passes.
+**/
+static void _fileglob_WorkerScan(fileglob_Worker* worker, char* pattern) {
+	fileglob* self = worker->self;
+	fileglob_Matcher* matcher;
+	fileglob_StringNode* matchedHead = NULL;
+	fileglob_StringNode* matchedTail = NULL;
+	fileglob_StringNode* recurseHead = NULL;
+	fileglob_StringNode* recurseTail = NULL;
+	fileglob_Result* recurseResultHead = NULL;
+	fileglob_Result* recurseResultTail = NULL;
+	size_t recurseResultCount = 0;
+	fileglob_StringNode* node;
+	size_t basePathEndPos = 0;
+	size_t recurseAtPos = (size_t)-1;
+	int hasWildcard = 0;
+	int matchFiles;
+	int aborted = 0;
+	char* remainder;
+	char* matchEnd;
+	char savedChar;
+	const void* attributes = NULL;
+#if defined(WIN32)
+	WIN32_FIND_DATA fd;
+	WIN32_FILE_ATTRIBUTE_DATA findAttributes;
+	HANDLE handle;
+#else
+	DIR* dirp;
+	struct dirent* dp;
+#endif
+
+	// Split the path into base path and pattern to match against.
+	for (remainder = pattern; *remainder != '\0'; ++remainder) {
+		char ch = *remainder;
+
+		if (ch == '?')
+			hasWildcard = 1;
+
+		else if (ch == '*') {
+			hasWildcard = 1;
+
+			if (remainder[1] == '*') {
+				if (remainder == pattern  ||  remainder[-1] == '/'  ||  remainder[-1] == ':') {
+					char ch2 = remainder[2];
+					if (ch2 == '/') {
+						recurseAtPos = remainder - pattern;
+						memmove(remainder, remainder + 3, strlen(remainder) - 2);
+					} else if (ch2 == '\0') {
+						recurseAtPos = remainder - pattern;
+						*remainder = '\0';
+					}
+				}
+			}
+		}
+
+		if (ch == '/'  ||  ch == ':') {
+			if (hasWildcard)
+				break;
+			else
+				basePathEndPos = remainder - pattern + 1;
+		}
+	}
+
+	matchFiles = *remainder == 0;
+
+	// The wildcard matching string keeps a closing slash.
+	matchEnd = *remainder == '/' ? remainder + 1 : remainder;
+	savedChar = *matchEnd;
+	*matchEnd = 0;
+	matcher = _fileglob_MatcherCreate(self, pattern + basePathEndPos);
+	*matchEnd = savedChar;
+
+	// Start the find.
+	buffer_reset(&worker->name);
+	buffer_addstring(&worker->name, pattern, basePathEndPos);
+#if defined(WIN32)
+	buffer_addstring(&worker->name, "*.*", 4);
+	handle = FindFirstFile(buffer_ptr(&worker->name), &fd);
+	if (handle != INVALID_HANDLE_VALUE) {
+		attributes = &findAttributes;
+		do {
+			const char* filename = fd.cFileName;
+			int isDirectory = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			findAttributes.dwFileAttributes = fd.dwFileAttributes;
+			findAttributes.ftCreationTime = fd.ftCreationTime;
+			findAttributes.ftLastAccessTime = fd.ftLastAccessTime;
+			findAttributes.ftLastWriteTime = fd.ftLastWriteTime;
+			findAttributes.nFileSizeHigh = fd.nFileSizeHigh;
+			findAttributes.nFileSizeLow = fd.nFileSizeLow;
+#else
+	buffer_addchar(&worker->name, 0);
+	dirp = opendir(basePathEndPos ? buffer_ptr(&worker->name) : ".");
+	if (dirp) {
+		while ((dp = readdir(dirp)) != NULL) {
+			const char* filename = dp->d_name;
+			int isDirectory = dp->d_type == DT_DIR;
+#endif
+			size_t len = strlen(filename);
+
+			if (isDirectory) {
+				// Knock out "." or ".."
+				if (filename[0] == '.'  &&  (filename[1] == 0  ||  (filename[1] == '.'  &&  filename[2] == 0)))
+					continue;
+
+				buffer_reset(&worker->name);
+				buffer_addstring(&worker->name, filename, len);
+				buffer_addstring(&worker->name, "/", 2);
+
+				// Should this directory be ignored?
+				if (!_fileglob_MatchIgnoreDirectoryPattern(self, buffer_ptr(&worker->name))) {
+					// Is this pattern exclusive?
+					int yield = self->exclusiveDirectoryPatternsHead ?
+							_fileglob_MatchExclusiveDirectoryPattern(self, buffer_ptr(&worker->name)) :
+							self->filesAndFolders;
+
+					if (_fileglob_MatcherMatch(matcher, buffer_ptr(&worker->name), len + 1)) {
+						_fileglob_list_append(self, &matchedHead, &matchedTail, filename);
+						if (yield  ||  (!self->exclusiveDirectoryPatternsHead  &&  !matchFiles  &&  remainder[0] == '/'  &&  remainder[1] == 0)) {
+							_fileglob_ResultListAppend(&worker->batchHead, &worker->batchTail,
+									_fileglob_ResultCreate(self, pattern, basePathEndPos, filename, len, "/", attributes));
+							worker->batchCount++;
+						}
+					}
+
+					if (recurseAtPos != (size_t)-1) {
+						_fileglob_list_append(self, &recurseHead, &recurseTail, filename);
+						if (yield) {
+							_fileglob_ResultListAppend(&recurseResultHead, &recurseResultTail,
+									_fileglob_ResultCreate(self, pattern, basePathEndPos, filename, len, "/", attributes));
+							recurseResultCount++;
+						}
+					}
+				}
+			} else if (matchFiles) {
+				// Do a wildcard match.
+				if (_fileglob_MatcherMatch(matcher, filename, len)) {
+					// It matched.  Let's see if the file should be ignored.
+					int ignore = _fileglob_MatchIgnoreFilePattern(self, filename);
+
+					// Is this pattern exclusive?
+					if (!ignore  &&  self->exclusiveFilePatternsHead) {
+						ignore = !_fileglob_MatchExclusiveFilePattern(self, filename);
+					}
+
+					if (!ignore) {
+						_fileglob_ResultListAppend(&worker->batchHead, &worker->batchTail,
+								_fileglob_ResultCreate(self, pattern, basePathEndPos, filename, len, "", attributes));
+						worker->batchCount++;
+					}
+				}
+			}
+
+			if (worker->batchCount >= FILEGLOB_RESULT_BATCH  &&  !_fileglob_WorkerFlush(worker)) {
+				aborted = 1;
+				break;
+			}
+#if defined(WIN32)
+		} while (FindNextFile(handle, &fd));
+		FindClose(handle);
+	}
+#else
+		}
+		closedir(dirp);
+	}
+#endif
+
+	self->allocFunction(self->userData, matcher, 0);
+
+	if (!aborted) {
+		// Directories matching this level continue with the rest of the
+		// pattern.
+		if (!matchFiles) {
+			for (node = matchedHead; node; node = node->next)
+				_fileglob_WorkerAddChild(worker, pattern, basePathEndPos, node->buffer, remainder);
+		}
+
+		// A '**' level also goes down every directory with the '**' still in
+		// front.  When matching files, _fileglob_GlobHelper() only goes down
+		// the directories that matched the file pattern, if there are any.
+		if (recurseAtPos != (size_t)-1) {
+			fileglob_StringNode* recurseNode = matchFiles  &&  matchedHead ? matchedHead : recurseHead;
+			BUFFER rest;
+			buffer_initwithalloc(&rest, self->allocFunction, self->userData);
+			buffer_addstring(&rest, "/**/", 4);
+			buffer_addstring(&rest, pattern + recurseAtPos, strlen(pattern + recurseAtPos) + 1);
+			for (node = recurseNode; node; node = node->next)
+				_fileglob_WorkerAddChild(worker, pattern, basePathEndPos, node->buffer, buffer_ptr(&rest));
+			buffer_free(&rest);
+
+			if (recurseNode == recurseHead  &&  recurseResultHead) {
+				_fileglob_ResultListAppend(&worker->batchHead, &worker->batchTail, recurseResultHead);
+				worker->batchTail = recurseResultTail;
+				worker->batchCount += recurseResultCount;
+				recurseResultHead = NULL;
+			}
+		}
+
+		_fileglob_WorkerFlush(worker);
+	}
+
+	_fileglob_ResultListFree(self, recurseResultHead);
+	_fileglob_list_clear(self, &matchedHead, &matchedTail);
+	_fileglob_list_clear(self, &recurseHead, &recurseTail);
+}
+
+
+/**
+	\internal Takes directory patterns off the work queue until the walk is
+	over.
+**/
+static MT_THREAD_RETURN _fileglob_WorkerThread(void* userData) {
+	fileglob_Worker worker;
+	fileglob_Parallel* parallel;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.self = (fileglob*)userData;
+	buffer_initwithalloc(&worker.name, worker.self->allocFunction, worker.self->userData);
+	parallel = worker.self->parallel;
+
+	mt_mutex_lock(&parallel->lock);
+	for (;;) {
+		fileglob_StringNode* work;
+
+		while (!parallel->quit  &&  !parallel->done  &&  !parallel->workHead)
+			mt_cond_wait(&parallel->workCond, &parallel->lock);
+		if (parallel->quit  ||  parallel->done)
+			break;
+
+		work = parallel->workHead;
+		parallel->workHead = work->next;
+		parallel->busyCount++;
+		mt_mutex_unlock(&parallel->lock);
+
+		_fileglob_WorkerScan(&worker, work->buffer);
+		worker.self->allocFunction(worker.self->userData, work, 0);
+
+		mt_mutex_lock(&parallel->lock);
+		if (worker.childHead) {
+			worker.childTail->next = parallel->workHead;
+			parallel->workHead = worker.childHead;
+			worker.childHead = worker.childTail = NULL;
+			mt_cond_broadcast(&parallel->workCond);
+		}
+		parallel->busyCount--;
+		if (parallel->busyCount == 0  &&  !parallel->workHead) {
+			parallel->done = 1;
+			mt_cond_broadcast(&parallel->workCond);
+			mt_cond_signal(&parallel->resultCond);
+		}
+	}
+	mt_mutex_unlock(&parallel->lock);
+
+	_fileglob_list_clear(worker.self, &worker.childHead, &worker.childTail);
+	buffer_free(&worker.name);
+	return 0;
+}
+
+
+static void _fileglob_ParallelStop(fileglob* self) {
+	fileglob_Parallel* parallel = self->parallel;
+	fileglob_StringNode* workTail = NULL;
+	int i;
+
+	mt_mutex_lock(&parallel->lock);
+	parallel->quit = 1;
+	mt_cond_broadcast(&parallel->workCond);
+	mt_cond_broadcast(&parallel->spaceCond);
+	mt_mutex_unlock(&parallel->lock);
+
+	for (i = 0; i < parallel->threadCount; ++i) {
+		mt_thread_join(parallel->threads[i]);
+	}
+	self->allocFunction(self->userData, parallel->threads, 0);
+
+	_fileglob_list_clear(self, &parallel->workHead, &workTail);
+	_fileglob_ResultListFree(self, parallel->resultHead);
+	_fileglob_ResultListFree(self, parallel->readyHead);
+	_fileglob_ResultListFree(self, parallel->current);
+
+	mt_mutex_free(&parallel->lock);
+	mt_cond_free(&parallel->workCond);
+	mt_cond_free(&parallel->resultCond);
+	mt_cond_free(&parallel->spaceCond);
+	self->allocFunction(self->userData, parallel, 0);
+	self->parallel = NULL;
+}
+
+
+/**
+	\internal Hands the pattern of the root context to the worker threads.
+
+	\return Returns false if no thread could be started.
+**/
+static int _fileglob_ParallelStart(fileglob* self) {
+	fileglob_Parallel* parallel;
+	fileglob_StringNode* workTail = NULL;
+	int threadCount = self->threads < FILEGLOB_MAX_THREADS ? self->threads : FILEGLOB_MAX_THREADS;
+
+	parallel = (fileglob_Parallel*)self->allocFunction(self->userData, NULL, sizeof(fileglob_Parallel));
+	memset(parallel, 0, sizeof(fileglob_Parallel));
+	mt_mutex_init(&parallel->lock);
+	mt_cond_init(&parallel->workCond);
+	mt_cond_init(&parallel->resultCond);
+	mt_cond_init(&parallel->spaceCond);
+	_fileglob_list_append(self, &parallel->workHead, &workTail, buffer_ptr(&self->context->patternBuf));
+	self->parallel = parallel;
+
+	parallel->threads = (mt_thread*)self->allocFunction(self->userData, NULL, threadCount * sizeof(mt_thread));
+	for (parallel->threadCount = 0; parallel->threadCount < threadCount; ++parallel->threadCount) {
+		if (!mt_thread_start(&parallel->threads[parallel->threadCount], _fileglob_WorkerThread, self))
+			break;
+	}
+
+	if (parallel->threadCount == 0) {
+		_fileglob_ParallelStop(self);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static int _fileglob_ParallelNext(fileglob* self) {
+	fileglob_Parallel* parallel = self->parallel;
+
+	if (parallel->current) {
+		self->allocFunction(self->userData, parallel->current, 0);
+		parallel->current = NULL;
+	}
+
+	// Take everything queued so far in one go.
+	if (!parallel->readyHead) {
+		mt_mutex_lock(&parallel->lock);
+		while (!parallel->resultHead  &&  !parallel->done)
+			mt_cond_wait(&parallel->resultCond, &parallel->lock);
+		parallel->readyHead = parallel->resultHead;
+		parallel->resultHead = parallel->resultTail = NULL;
+		parallel->resultCount = 0;
+		mt_cond_broadcast(&parallel->spaceCond);
+		mt_mutex_unlock(&parallel->lock);
+	}
+
+	parallel->current = parallel->readyHead;
+	if (!parallel->current)
+		return 0;
+	parallel->readyHead = parallel->current->next;
+	parallel->current->next = NULL;
+#if !defined(WIN32)
+	parallel->hasattr = 0;
+#endif
+	return 1;
+}
+
+
+#if !defined(WIN32)
+
+static struct stat* _fileglob_ParallelStat(fileglob* self) {
+	fileglob_Parallel* parallel = self->parallel;
+	if (!parallel->hasattr) {
+		stat(parallel->current->filename, &parallel->attr);
+		parallel->hasattr = 1;
+	}
+	return &parallel->attr;
+}
+
+#endif
+
+
+/**
+	Walks the directories on [threads] worker threads.  Must be called before
+	the first fileglob_Next().  Matches then come back in no particular
+	order, and the alloc function must be safe to call from several threads
+	at once, as the default one is.
+
+	\param threads The number of worker threads.  1 walks on the calling
+		thread, in order.
+**/
+void fileglob_SetThreads(fileglob* self, int threads) {
+	self->threads = threads;
+}
+
+
 int fileglob_Next(fileglob* self) {
+	// The root context has not split its pattern until the first read.
+	if (self->threads > 1  &&  !self->parallel  &&  self->context  &&  !self->context->prev  &&  !self->context->pattern) {
+		if (_fileglob_ParallelStart(self)) {
+			while (self->context)
+				_fileglob_FreeContextLevel(self);
+		}
+	}
+
+	if (self->parallel)
+		return _fileglob_ParallelNext(self);
+
 	return _fileglob_GlobHelper(self, 0);
 }
 
 
 const char* fileglob_FileName(fileglob* self) {
+	if (self->parallel)
+		return self->parallel->current ? self->parallel->current->filename : NULL;
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		SplicePath(&self->combinedName, buffer_ptr(&self->context->basePath), self->context->fd.cFileName);
@@ -720,6 +1394,18 @@ const char* fileglob_FileName(fileglob* self) {
 
 
 fileglob_uint64 fileglob_CreationTime(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return fileglob_ConvertToTime_t(&result->attributes.ftCreationTime);
+#else
+			return _fileglob_ParallelStat(self)->st_ctime;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return fileglob_ConvertToTime_t(&self->context->fd.ftCreationTime);
@@ -739,6 +1425,18 @@ fileglob_uint64 fileglob_CreationTime(fileglob* self) {
 
 
 fileglob_uint64 fileglob_AccessTime(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return fileglob_ConvertToTime_t(&result->attributes.ftLastAccessTime);
+#else
+			return _fileglob_ParallelStat(self)->st_atime;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return fileglob_ConvertToTime_t(&self->context->fd.ftLastAccessTime);
@@ -758,6 +1456,18 @@ fileglob_uint64 fileglob_AccessTime(fileglob* self) {
 
 
 fileglob_uint64 fileglob_WriteTime(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return fileglob_ConvertToTime_t(&result->attributes.ftLastWriteTime);
+#else
+			return _fileglob_ParallelStat(self)->st_mtime;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return fileglob_ConvertToTime_t(&self->context->fd.ftLastWriteTime);
@@ -777,6 +1487,16 @@ fileglob_uint64 fileglob_WriteTime(fileglob* self) {
 
 
 fileglob_uint64 fileglob_CreationFILETIME(fileglob* self) {
+	if (self->parallel) {
+#if defined(WIN32)
+		fileglob_Result* result = self->parallel->current;
+		if (result)
+			return ((fileglob_uint64)result->attributes.ftCreationTime.dwHighDateTime << 32) |
+				(fileglob_uint64)result->attributes.ftCreationTime.dwLowDateTime;
+#endif
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return ((fileglob_uint64)self->context->fd.ftCreationTime.dwHighDateTime << 32) |
@@ -792,6 +1512,16 @@ fileglob_uint64 fileglob_CreationFILETIME(fileglob* self) {
 
 
 fileglob_uint64 fileglob_AccessFILETIME(fileglob* self) {
+	if (self->parallel) {
+#if defined(WIN32)
+		fileglob_Result* result = self->parallel->current;
+		if (result)
+			return ((fileglob_uint64)result->attributes.ftLastAccessTime.dwHighDateTime << 32) |
+				(fileglob_uint64)result->attributes.ftLastAccessTime.dwLowDateTime;
+#endif
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return ((fileglob_uint64)self->context->fd.ftLastAccessTime.dwHighDateTime << 32) |
@@ -807,6 +1537,16 @@ fileglob_uint64 fileglob_AccessFILETIME(fileglob* self) {
 
 
 fileglob_uint64 fileglob_WriteFILETIME(fileglob* self) {
+	if (self->parallel) {
+#if defined(WIN32)
+		fileglob_Result* result = self->parallel->current;
+		if (result)
+			return ((fileglob_uint64)result->attributes.ftLastWriteTime.dwHighDateTime << 32) |
+				(fileglob_uint64)result->attributes.ftLastWriteTime.dwLowDateTime;
+#endif
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return ((fileglob_uint64)self->context->fd.ftLastWriteTime.dwHighDateTime << 32) |
@@ -822,6 +1562,18 @@ fileglob_uint64 fileglob_WriteFILETIME(fileglob* self) {
 
 
 fileglob_uint64 fileglob_FileSize(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return ((fileglob_uint64)result->attributes.nFileSizeLow + ((fileglob_uint64)result->attributes.nFileSizeHigh << 32));
+#else
+			return _fileglob_ParallelStat(self)->st_size;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return ((fileglob_uint64)self->context->fd.nFileSizeLow + ((fileglob_uint64)self->context->fd.nFileSizeHigh << 32));
@@ -841,6 +1593,18 @@ fileglob_uint64 fileglob_FileSize(fileglob* self) {
 
 
 int fileglob_IsDirectory(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return (result->attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+			return (_fileglob_ParallelStat(self)->st_mode & S_IFDIR) != 0;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return (self->context->fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
@@ -860,6 +1624,15 @@ int fileglob_IsDirectory(fileglob* self) {
 
 
 int fileglob_IsLink(fileglob* self) {
+	if (self->parallel) {
+#if defined(WIN32)
+		fileglob_Result* result = self->parallel->current;
+		if (result)
+			return (result->attributes.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+#endif
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return (self->context->fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
@@ -879,6 +1652,18 @@ int fileglob_IsLink(fileglob* self) {
 
 
 int fileglob_IsReadOnly(fileglob* self) {
+	if (self->parallel) {
+		fileglob_Result* result = self->parallel->current;
+		if (result) {
+#if defined(WIN32)
+			return (result->attributes.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0;
+#else
+			return (_fileglob_ParallelStat(self)->st_mode & S_IWUSR) != 0;
+#endif
+		}
+		return 0;
+	}
+
 #if defined(WIN32)
 	if (self->context->handle != INVALID_HANDLE_VALUE) {
 		return (self->context->fd.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0;
@@ -899,7 +1684,7 @@ int fileglob_IsReadOnly(fileglob* self) {
 
 fileglob_uint64 fileglob_NumberOfLinks(fileglob* self) {
 #if defined(WIN32)
-	if (self->context->handle != INVALID_HANDLE_VALUE) {
+	if (self->parallel ? self->parallel->current != NULL : self->context->handle != INVALID_HANDLE_VALUE) {
 //		return ((fileglob_uint64)self->context->fd.nFileSizeLow + ((fileglob_uint64)self->context->fd.nFileSizeHigh << 32));
 		HANDLE handle;
 		BY_HANDLE_FILE_INFORMATION fileInformation;
@@ -919,6 +1704,12 @@ fileglob_uint64 fileglob_NumberOfLinks(fileglob* self) {
 		return fileInformation.nNumberOfLinks;
 	}
 #else
+	if (self->parallel) {
+		if (self->parallel->current)
+			return _fileglob_ParallelStat(self)->st_size;
+		return 0;
+	}
+
 	if (self->context->dirp) {
 		if (!self->context->hasattr) {
 			stat(fileglob_FileName(self), &self->context->attr);
@@ -1015,7 +1806,7 @@ DoRecursion:
 						char ch2 = pattern[2];
 						if (ch2 == '/') {
 							context->recurseAtPos = pattern - buffer_ptr(&context->patternBuf);
-							memcpy(pattern, pattern + 3, strlen(pattern) - 2);
+							memmove(pattern, pattern + 3, strlen(pattern) - 2);
 							buffer_deltapos(&context->patternBuf, -3);
 						} else if (ch2 == '\0') {
 							context->recurseAtPos = pattern - buffer_ptr(&context->patternBuf);
@@ -1247,9 +2038,9 @@ NextDirectory:
 
 	buffer_reset(&context->matchPattern);
 	buffer_setpos(&context->patternBuf, context->recurseAtPos);
-	buffer_addstring(&context->matchPattern, buffer_posptr(&context->patternBuf), strlen(buffer_posptr(&context->patternBuf)));
+	buffer_addstring(&context->matchPattern, buffer_posptr(&context->patternBuf), strlen(buffer_posptr(&context->patternBuf)) + 1);
 	buffer_addstring(&context->patternBuf, "*/**/", 5);
-	buffer_addstring(&context->patternBuf, buffer_ptr(&context->matchPattern), buffer_pos(&context->matchPattern) + 1);
+	buffer_addstring(&context->patternBuf, buffer_ptr(&context->matchPattern), buffer_pos(&context->matchPattern));
 
 	inPattern = buffer_ptr(&context->patternBuf);
 	context->pattern = NULL;
@@ -24,6 +24,7 @@ fileglob* fileglob_CreateWithAlloc(const char* inPattern, fileglob_Alloc alloc,
 void fileglob_Destroy(fileglob* self);
 void fileglob_AddExclusivePattern(fileglob* self, const char* name);
 void fileglob_AddIgnorePattern(fileglob* self, const char* name);
+void fileglob_SetThreads(fileglob* self, int threads);
 
 int fileglob_Next(fileglob* self);
 
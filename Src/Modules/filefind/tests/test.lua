@@ -1,14 +1,20 @@
 require 'filefind'
 require 'ex'
 
-function TestList(expectedList, wildcard)
+function TestList(expectedList, wildcard, threads)
+	if not threads then
+		TestList(expectedList, wildcard, 1)
+		TestList(expectedList, wildcard, 4)
+		return
+	end
+
 	local expectedListMap = {}
 	for _, name in ipairs(expectedList) do
 		expectedListMap[name] = true
 	end
 
 	local foundMap = {}
-	for handle in filefind.glob(wildcard) do
+	for handle in filefind.glob(wildcard, threads) do
 		foundMap[handle.filename] = true
 	end
 
@@ -83,6 +89,16 @@ assert(entryTable.size == handle.size)
 assert(entryTable.is_directory == handle.is_directory)
 assert(entryTable.is_readonly == handle.is_readonly)
 
+-------------------------------------------------------------------------------
+iterfunc = filefind.glob('*', 4)
+handle = iterfunc()
+assert(type(handle) == 'userdata')
+assert(handle.filename == 'test.lua')
+assert(handle.is_directory == false)
+assert(handle.size > 0)
+assert(handle.write_time == entryTable.write_time)
+assert(iterfunc() == nil)
+
 -------------------------------------------------------------------------------
 os.remove('a/')
 os.remove('b/')
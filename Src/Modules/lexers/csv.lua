@@ -12,12 +12,35 @@ local record = Ct(field * (',' * field)^0)
 local nonemptyrecord = #P(1 - eol) * record
 local records = Ct((record * eol)^0 * nonemptyrecord^-1) * -1
 local one_line_record = record * (eol + -1)
+local stream_record = #P(1) * one_line_record
 
 function parse_line(line)
    assert(type(line) == 'string', 'bad argument #1 (expected string)')
    return lpeg.match(one_line_record, line)
 end
 
+-- Returns an iterator over the records read from 'file' (or anything with
+-- a 'read' method), 'chunksize' bytes at a time, so that the whole input
+-- is never in memory.
+function read_records(file, chunksize)
+   chunksize = chunksize or 65536
+   local stream = lpeg.stream(stream_record, 0)
+   return function()
+      while true do
+         local r = stream:match()
+         if r then return r end
+         if r == false then
+            if stream:pending() > 0 then
+               error('invalid record at position ' .. stream:pos())
+            end
+            return nil
+         end
+         local chunk = file:read(chunksize)
+         if chunk then stream:feed(chunk) else stream:finish() end
+      end
+   end
+end
+
 -- public interface
 getmetatable(getfenv(1)).__call = function(self, input)
    assert(type(input) == 'string', 'bad argument #1 (expected string)')
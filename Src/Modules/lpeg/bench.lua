@@ -0,0 +1,190 @@
+#!/usr/bin/env lua5.1
+
+-- Benchmark for LPeg matching
+--
+-- Runs the lexers in ../lexers and some grammars written with 're' over
+-- generated input, and prints the throughput of each in MB/s (best of
+-- several runs, CPU time).
+--
+-- usage: lua bench.lua [name ...]
+--
+-- BENCH_SIZE sets the size of each input in megabytes (default 1). The
+-- lexers are found with LUA_PATH="../?.lua;;" when run from this
+-- directory.
+
+local m = require"lpeg"
+local re = require"re"
+
+local size = (tonumber(os.getenv("BENCH_SIZE")) or 1) * 1024 * 1024
+
+
+-- repeats the result of 'gen(i)' until the text has 'size' bytes
+local function fill (gen)
+  local t, n, i = {}, 0, 0
+  while n < size do
+    i = i + 1
+    t[i] = gen(i)
+    n = n + #t[i]
+  end
+  return table.concat(t)
+end
+
+
+local words = { "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta",
+                "theta", "iota", "kappa", "lambda", "mu", "omicron" }
+
+local function word (i) return words[i % #words + 1] end
+
+
+local benchmarks = {}
+local order = {}
+
+local function add (name, subject, f)
+  benchmarks[name] = { subject = subject, f = f }
+  order[#order + 1] = name
+end
+
+
+-- lexers/csv.lua: quoted and unquoted fields
+add("csv", function ()
+  return fill(function (i)
+    return string.format('%d,%s,"%s, ""%s""",%d.%02d\r\n',
+                         i, word(i), word(i * 7), word(i * 3), i % 1000, i % 100)
+  end)
+end, function (s)
+  local csv = require"lexers.csv"
+  return function () return csv(s) end
+end)
+
+-- the same, read in 64K chunks by a stream
+add("csvstream", benchmarks.csv.subject, function (s)
+  local csv = require"lexers.csv"
+  local reader = {}
+  function reader:read (n)
+    local chunk = s:sub(self.i, self.i + n - 1)
+    self.i = self.i + n
+    return chunk ~= "" and chunk or nil
+  end
+  return function ()
+    reader.i = 1
+    for r in csv.read_records(reader) do end
+  end
+end)
+
+-- lexers/ini.lua
+add("ini", function ()
+  return fill(function (i)
+    if i % 8 == 1 then return "\n[" .. word(i) .. i .. "]\n# comment\n" end
+    return word(i) .. i .. " = " .. word(i * 5) .. " " .. i .. "\n"
+  end)
+end, function (s)
+  local ini = require"lexers.ini"
+  return function () return ini(s) end
+end)
+
+-- lexers/c.lua: tokens of all kinds
+add("c", function ()
+  return fill(function (i)
+    return string.format(
+      "/* %s */\nstatic int %s%d (const char *s, int n) {\n" ..
+      "  if (n >= 0x%x && s[n] != '\\n') return %s(s + 1, n - %d);\n" ..
+      "  else while (n-- > 0) n += %d.5e1; // %s\n  return \"%s\";\n}\n",
+      word(i), word(i), i, i, word(i * 3), i % 10, i % 7, word(i * 5), word(i))
+  end)
+end, function (s)
+  local c = require"lexers.c"
+  return function () return c.tokenize(s) end
+end)
+
+-- keywords: ordered choice of literals
+add("keywords", function ()
+  return fill(function (i)
+    local kw = { "and", "break", "do", "else", "elseif", "end", "false", "for",
+                 "function", "if", "in", "local", "nil", "not", "or",
+                 "repeat", "return", "then", "true", "until", "while" }
+    return (i % 3 == 0 and word(i) or kw[i % #kw + 1]) .. " "
+  end)
+end, function (s)
+  local p = re.compile[[
+    tokens <- (keyword / name / ' ')* -> {}
+    keyword <- ('and' / 'break' / 'do' / 'elseif' / 'else' / 'end' /
+                'false' / 'for' / 'function' / 'if' / 'in' / 'local' /
+                'nil' / 'not' / 'or' / 'repeat' / 'return' / 'then' /
+                'true' / 'until' / 'while') !%w -> 'kw'
+    name <- {%a%w*}
+  ]]
+  return function () return p:match(s) end
+end)
+
+-- log lines: literals, spans and captures
+add("log", function ()
+  return fill(function (i)
+    return string.format(
+      '10.0.%d.%d - - [12/Mar/2011:10:%02d:%02d +0000] "GET /%s/%d HTTP/1.1" %d %d\n',
+      i % 256, i % 200, i % 60, i % 60, word(i), i, i % 7 == 0 and 404 or 200,
+      i * 13 % 5000)
+  end)
+end, function (s)
+  local p = re.compile([=[
+    lines <- (line / (!%nl .)* %nl)*
+    line <- ({:ip: [0-9.]+ :} ' - - [' {:date: [^]]+ :} '] "'
+            {:method: %u+ :} ' ' {:path: [^ ]+ :} ' HTTP/1.1" '
+            {:status: %d+ :} ' ' {:size: %d+ :} %nl) -> {} => count
+  ]=], { nl = m.P"\n", count = function (_, i) return i end })
+  return function () return p:match(s) end
+end)
+
+-- arithmetic expressions
+add("expr", function ()
+  return fill(function (i)
+    return string.format("(%d + %d) * %d - %d / (%d + x%d)\n",
+                         i, i % 17, i % 5, i % 3, i % 11, i % 9)
+  end)
+end, function (s)
+  local p = re.compile[[
+    lines <- (S exp %nl)* !.
+    exp <- term (S [+-] S term)*
+    term <- factor (S [*/] S factor)*
+    factor <- [0-9]+ / [a-z] [a-z0-9]* / '(' S exp S ')'
+    S <- ' '*
+  ]]
+  return function () return p:match(s) end
+end)
+
+-- re.find and re.gsub over plain text
+add("find", function ()
+  return fill(function (i) return word(i) .. " " .. (i % 101 == 0 and "\n" or "") end)
+end, function (s)
+  return function () return re.find(s, "'omega' / 'alphabet'") end
+end)
+
+add("gsub", function ()
+  return fill(function (i) return word(i) .. " " end)
+end, function (s)
+  return function () return re.gsub(s, "'lambda'", "LAMBDA") end
+end)
+
+
+local function run (name)
+  local b = benchmarks[name]
+  local s = b.subject()
+  local f = b.f(s)
+  local best = math.huge
+  local total = 0
+  while total < 2 or best == math.huge do
+    local t = os.clock()
+    f()
+    t = os.clock() - t
+    total = total + t
+    if t < best then best = t end
+    if total > 10 then break end
+  end
+  print(string.format("%-10s %8.1f MB/s", name, #s / (1024 * 1024) / best))
+end
+
+
+local names = arg and #arg > 0 and arg or order
+for _, name in ipairs(names) do
+  if not benchmarks[name] then error("unknown benchmark " .. name) end
+  run(name)
+end
@@ -18,9 +18,22 @@
 #include "lpeg.h"
 
 
+/*
+** spans over simple charsets use SSE2 where available (always on
+** x86-64); define LPEG_NOSIMD to avoid it
+*/
+#if !defined(LPEG_NOSIMD) && \
+    (defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LPEG_SSE2
+#include <emmintrin.h>
+#endif
+
+
 #define VERSION		"0.10"
 #define PATTERN_T	"lpeg-pattern"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define SPECIALIZEDIDX	"lpeg-specialized"
 
 
 /*
@@ -98,7 +111,9 @@ typedef enum Opcode {
   ICommit, IPartialCommit, IBackCommit, IFailTwice, IFail, IGiveup,
   IFunc,
   IFullCapture, IEmptyCapture, IEmptyCaptureIdx,
-  IOpenCapture, ICloseCapture, ICloseRunTime
+  IOpenCapture, ICloseCapture, ICloseRunTime,
+  /* only in specialized code (see 'specialize') */
+  IString, IDispatch, ISpanRanges
 } Opcode;
 
 
@@ -134,7 +149,10 @@ static const int opproperties[] = {
   /* IEmptyCaptureIdx */ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
   /* IOpenCapture */	ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
   /* ICloseCapture */	ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
-  /* ICloseRunTime */	ISCAPTURE | ISFENVOFF
+  /* ICloseRunTime */	ISCAPTURE | ISFENVOFF,
+  /* IString */		0,
+  /* IDispatch */	0,
+  /* ISpanRanges */	ISNOFAIL
 };
 
 
@@ -209,11 +227,27 @@ typedef struct Capture {
 #define setchar(st,c)	((st)[(c) >> 3] |= (1 << ((c) & 7)))
 
 
+/* maximum number of ranges in a 'ISpanRanges' */
+#define MAXSPANRANGES	4
+
+/*
+** a charset as a few ranges of chars, for spans that test 16 chars at
+** a time; with 'negated', the ranges are the chars not in the charset
+*/
+typedef struct SpanRanges {
+  byte n;  /* number of ranges */
+  byte negated;
+  byte low[MAXSPANRANGES];
+  byte width[MAXSPANRANGES];  /* high - low */
+} SpanRanges;
+
+
 
 static int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
-    case ISet: case ISpan: return CHARSETINSTSIZE;
+    case ISet: case ISpan: case ISpanRanges: return CHARSETINSTSIZE;
     case IFunc: return funcinstsize(i);
+    case IString: case IDispatch: return i->i.aux;
     default: return 1;
   }
 }
@@ -290,7 +324,8 @@ static void printinst (const Instruction *op, const Instruction *p) {
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
      "func",
      "fullcapture", "emptycapture", "emptycaptureidx", "opencapture",
-     "closecapture", "closeruntime"
+     "closecapture", "closeruntime",
+     "string", "dispatch", "span_ranges"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
   switch ((Opcode)p->i.code) {
@@ -433,9 +468,71 @@ static void adddyncaptures (const char *s, Capture *base, int n, int fd) {
 
 #define condfailed(p)	{ int f = p->i.offset; if (f) p+=f; else goto fail; }
 
+
+#if defined(LPEG_SSE2)
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int firstbit (unsigned int mask) {
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+}
+#elif defined(__GNUC__)
+#define firstbit(mask)	__builtin_ctz(mask)
+#else
+static int firstbit (unsigned int mask) {
+  int n = 0;
+  for (; !(mask & 1); mask >>= 1) n++;
+  return n;
+}
+#endif
+#endif
+
+
+/*
+** span over the chars of charset 'cs', which is also described by 'sr'
+*/
+static const char *spanranges (const SpanRanges *sr, const Charset cs,
+                               const char *s, const char *e) {
+#if defined(LPEG_SSE2)
+  __m128i low[MAXSPANRANGES], width[MAXSPANRANGES];
+  int i, n = sr->n;
+  int flip = sr->negated ? 0 : 0xFFFF;  /* turns matches into span ends */
+  for (i = 0; i < n; i++) {
+    low[i] = _mm_set1_epi8((char)sr->low[i]);
+    width[i] = _mm_set1_epi8((char)sr->width[i]);
+  }
+  for (; e - s >= 16; s += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)s);
+    __m128i in = _mm_setzero_si128();
+    int mask;
+    for (i = 0; i < n; i++) {  /* (c - low) <= width, unsigned */
+      __m128i d = _mm_sub_epi8(x, low[i]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_max_epu8(d, width[i]),
+                                           width[i]));
+    }
+    mask = _mm_movemask_epi8(in) ^ flip;
+    if (mask != 0) return s + firstbit(mask);
+  }
+#else
+  (void)sr;
+#endif
+  for (; s < e; s++) {
+    int c = (byte)*s;
+    if (!testchar(cs, c)) break;
+  }
+  return s;
+}
+
+
+/*
+** 'atend' is set when the result depended on the subject ending at 'e',
+** that is, when more input could make it different
+*/
 static const char *match (lua_State *L,
                           const char *o, const char *s, const char *e,
-                          Instruction *op, Capture *capture, int ptop) {
+                          Instruction *op, Capture *capture, int ptop,
+                          int *atend) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -469,19 +566,19 @@ static const char *match (lua_State *L,
       case IAny: {
         int n = p->i.aux;
         if (n <= e - s) { p++; s += n; }
-        else condfailed(p);
+        else { *atend = 1; condfailed(p); }
         continue;
       }
       case IChar: {
         if ((byte)*s == p->i.aux && s < e) { p++; s++; }
-        else condfailed(p);
+        else { if (s >= e) *atend = 1; condfailed(p); }
         continue;
       }
       case ISet: {
         int c = (byte)*s;
         if (testchar((p+1)->buff, c) && s < e)
           { p += CHARSETINSTSIZE; s++; }
-        else condfailed(p);
+        else { if (s >= e) *atend = 1; condfailed(p); }
         continue;
       }
       case IBack: {
@@ -495,11 +592,40 @@ static const char *match (lua_State *L,
           int c = (byte)*s;
           if (!testchar((p+1)->buff, c)) break;
         }
+        if (s == e) *atend = 1;
+        p += CHARSETINSTSIZE;
+        continue;
+      }
+      case IString: {
+        int n = p->i.aux;
+        if (n <= e - s && memcmp(s, (p+1)->buff, n) == 0)
+          { p += n; s += n; }
+        else {
+          if (n > e - s && memcmp(s, (p+1)->buff, e - s) == 0) *atend = 1;
+          goto fail;
+        }
+        continue;
+      }
+      case IDispatch: {
+        const short *jmp = (const short *)(p + p->i.offset)->buff;
+        int c = (byte)*s;
+        if (jmp[c] != 0 && s < e) { p += jmp[c]; s++; }
+        else {
+          if (s >= e) *atend = 1;
+          p += jmp[UCHAR_MAX + 1];
+        }
+        continue;
+      }
+      case ISpanRanges: {
+        s = spanranges((const SpanRanges *)(p + p->i.offset)->buff,
+                       (p+1)->buff, s, e);
+        if (s == e) *atend = 1;
         p += CHARSETINSTSIZE;
         continue;
       }
       case IFunc: {
         const char *r = (p+1)->f(s, e, o, (p+2)->buff);
+        if (r == NULL || r == e) *atend = 1;  /* cannot tell what it read */
         if (r != NULL) { s = r; p += funcinstsize(p); }
         else condfailed(p);
         continue;
@@ -576,6 +702,7 @@ static const char *match (lua_State *L,
         }
         if (res < s - o || res > e - o)
           luaL_error(L, "invalid position returned by match-time capture");
+        if (res == e - o) *atend = 1;
         s = o + res;  /* update current position */
         captop -= ncap;  /* remove nested captures */
         lua_remove(L, fr);  /* remove first result (offset) */
@@ -1832,6 +1959,7 @@ typedef struct CapState {
   lua_State *L;
   int ptop;  /* index of last argument to 'match' */
   const char *s;  /* original string */
+  lua_Number base;  /* position of 's' in a stream (0 otherwise) */
   int valuecached;  /* value stored in cache slot */
 } CapState;
 
@@ -2030,7 +2158,7 @@ static int runtimecap (lua_State *L, Capture *close, Capture *ocap,
   close->kind = Cclose;
   close->s = s;
   cs.ocap = ocap; cs.cap = open; cs.L = L;
-  cs.s = o; cs.valuecached = 0; cs.ptop = ptop;
+  cs.s = o; cs.base = 0; cs.valuecached = 0; cs.ptop = ptop;
   luaL_checkstack(L, 4, "too many runtime captures");
   pushluaval(&cs);
   lua_pushvalue(L, SUBJIDX);  /* push original subject */
@@ -2161,7 +2289,7 @@ static int pushcapture (CapState *cs) {
   luaL_checkstack(cs->L, 4, "too many captures");
   switch (captype(cs->cap)) {
     case Cposition: {
-      lua_pushinteger(cs->L, cs->cap->s - cs->s + 1);
+      lua_pushnumber(cs->L, cs->base + (cs->cap->s - cs->s) + 1);
       cs->cap++;
       return 1;
     }
@@ -2224,19 +2352,20 @@ static int pushcapture (CapState *cs) {
 }
 
 
-static int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
+static int getcaptures (lua_State *L, const char *s, const char *r, int ptop,
+                        lua_Number base) {
   Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
   int n = 0;
   if (!isclosecap(capture)) {  /* is there any capture? */
     CapState cs;
     cs.ocap = cs.cap = capture; cs.L = L;
-    cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+    cs.s = s; cs.base = base; cs.valuecached = 0; cs.ptop = ptop;
     do {  /* collect their values */
       n += pushcapture(&cs);
     } while (!isclosecap(cs.cap));
   }
   if (n == 0) {  /* no capture values? */
-    lua_pushinteger(L, r - s + 1);  /* return only end position */
+    lua_pushnumber(L, base + (r - s) + 1);  /* return only end position */
     n = 1;
   }
   return n;
@@ -2322,10 +2451,239 @@ static int printpat_l (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Specialization
+** =======================================================
+*/
+
+/*
+** Patterns are built from their parts and must keep a form that
+** pattern operations can analyse. Before a pattern is first matched,
+** 'specialize' makes a copy of its code with faster, equivalent
+** instructions, which is kept (weakly) for later matches:
+**   - runs of IChar that are not jump targets become one IString;
+**   - chains of char tests, each jumping to the next on failure (as
+**     in choices among literals and charsets), start with an IDispatch
+**     that jumps straight to the test matching the current char;
+**   - spans over charsets made of a few ranges (or their complements)
+**     become ISpanRanges, checking 16 chars at a time with SIMD.
+** The new instructions take the same space as the old ones, so all
+** jumps keep working. Their tables are appended after the final IEnd.
+*/
+
+/* minimum number of tests worth a dispatch table */
+#define MINDISPATCH	4
+
+/* maximum number of tests followed when building a dispatch table */
+#define MAXDISPATCH	64
+
+/* size (in elements) for 'l' bytes of data */
+#define datasize(l)	(((l) + sizeof(Instruction) - 1)/sizeof(Instruction))
+
+#define DISPATCHSIZE	datasize((UCHAR_MAX + 2) * sizeof(short))
+#define SPANRANGESSIZE	datasize(sizeof(SpanRanges))
+
+/* flags for each instruction, while specializing */
+#define SPTARGET	0x1  /* a jump may go there */
+#define SPCOVERED	0x2  /* part of a chain of tests */
+#define SPDISPATCH	0x4  /* starts a dispatch */
+#define SPSPAN		0x8  /* becomes ISpanRanges */
+
+#define isdispatchtest(op) \
+	(istest(op) && ((op)->i.code == IChar || (op)->i.code == ISet))
+
+
+/*
+** collect the chain of tests starting at 'i' into 'chain'; '*fallback'
+** gets where the chain goes when all tests fail
+*/
+static int testchain (Instruction *p, int i, int *chain, int *fallback) {
+  int n = 0;
+  while (n < MAXDISPATCH && isdispatchtest(p + i)) {
+    int next = target(p, dest(p, i));
+    chain[n++] = i;
+    if (next <= i) { i = next; break; }
+    i = next;
+  }
+  *fallback = i;
+  return n;
+}
+
+
+static int testmatches (const Instruction *op, int c) {
+  if (op->i.code == IChar) return op->i.aux == c;
+  else return testchar((op + 1)->buff, c) != 0;
+}
+
+
+#if defined(LPEG_SSE2)
+
+/*
+** describe charset 'cs' (or its complement) with up to MAXSPANRANGES
+** ranges; returns 0 if it needs more
+*/
+static int charsetranges (const Charset cs, int negated, SpanRanges *sr) {
+  int c = 0;
+  sr->n = 0;
+  sr->negated = negated;
+  for (;;) {
+    int first;
+    while (c <= UCHAR_MAX && (testchar(cs, c) != 0) == negated) c++;
+    if (c > UCHAR_MAX) return sr->n > 0;
+    if (sr->n == MAXSPANRANGES) return 0;
+    first = c;
+    while (c <= UCHAR_MAX && (testchar(cs, c) != 0) != negated) c++;
+    sr->low[sr->n] = (byte)first;
+    sr->width[sr->n] = (byte)(c - 1 - first);
+    sr->n++;
+  }
+}
+
+
+static int spanasranges (const Charset cs, SpanRanges *sr) {
+  return charsetranges(cs, 0, sr) || charsetranges(cs, 1, sr);
+}
+
+#else
+
+static int spanasranges (const Charset cs, SpanRanges *sr) {
+  (void)cs; (void)sr;
+  return 0;  /* no gain without SIMD */
+}
+
+#endif
+
+
+/*
+** mark jump targets and choose the instructions to specialize;
+** returns the size of the tables to append
+*/
+static int planspecialize (Instruction *op, int n, byte *flags) {
+  int chain[MAXDISPATCH];
+  int i, k, fallback, extra = 0;
+  SpanRanges sr;
+  for (i = 0; i < n; i += sizei(op + i)) {
+    if (isjmp(op + i))
+      flags[dest(op, i)] |= SPTARGET;
+    if (op[i].i.code == ICall)
+      flags[i + 1] |= SPTARGET;  /* return address */
+  }
+  for (i = 0; i < n; i += sizei(op + i)) {
+    if (n + 1 + extra + (int)DISPATCHSIZE >= MAXPATTSIZE)
+      break;  /* offsets to tables would not fit */
+    if (isdispatchtest(op + i) && !(flags[i] & SPCOVERED)) {
+      int nc = testchain(op, i, chain, &fallback);
+      for (k = 0; k < nc; k++) {
+        flags[chain[k]] |= SPCOVERED;
+        if (nc >= MINDISPATCH)  /* dispatch may jump after each test */
+          flags[chain[k] + sizei(op + chain[k])] |= SPTARGET;
+      }
+      if (nc >= MINDISPATCH) {
+        flags[i] |= SPDISPATCH;
+        extra += DISPATCHSIZE;
+      }
+    }
+    else if (op[i].i.code == ISpan && spanasranges((op + i + 1)->buff, &sr)) {
+      flags[i] |= SPSPAN;
+      extra += SPANRANGESSIZE;
+    }
+  }
+  return extra;
+}
+
+
+static void filldispatch (Instruction *op, int i, short *jmp) {
+  int chain[MAXDISPATCH];
+  int fallback, c, k;
+  int nc = testchain(op, i, chain, &fallback);
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    jmp[c] = 0;  /* no test matches 'c' */
+    for (k = 0; k < nc; k++) {
+      if (testmatches(op + chain[k], c)) {
+        jmp[c] = (short)(chain[k] + sizei(op + chain[k]) - i);
+        break;
+      }
+    }
+  }
+  jmp[UCHAR_MAX + 1] = (short)(fallback - i);
+}
+
+
+/*
+** copy code 'op' (of size 'n') into 'p', specializing it
+*/
+static void dospecialize (Instruction *op, int n, const byte *flags,
+                          Instruction *p) {
+  int i, j, k, step;
+  int pos = n + 1;  /* where next table goes */
+  copypatt(p, op, n + 1);
+  for (i = 0; i < n; i += step) {
+    step = sizei(op + i);
+    if (flags[i] & SPDISPATCH) {
+      setinstaux(p + i, IDispatch, pos - i, sizei(op + i));
+      filldispatch(op, i, (short *)(p + pos)->buff);
+      pos += DISPATCHSIZE;
+    }
+    else if (flags[i] & SPSPAN) {
+      setinst(p + i, ISpanRanges, pos - i);
+      spanasranges((op + i + 1)->buff, (SpanRanges *)(p + pos)->buff);
+      pos += SPANRANGESSIZE;
+    }
+    else if (op[i].i.code == IChar && op[i].i.offset == 0) {
+      for (j = i + 1; j < n && j - i < MAXAUX; j++) {
+        if (op[j].i.code != IChar || op[j].i.offset != 0 ||
+            (flags[j] & SPTARGET))
+          break;
+      }
+      if (j - i >= 2) {  /* chars i..j-1 become a string */
+        setinstaux(p + i, IString, 0, j - i);
+        for (k = 0; k < j - i; k++)
+          (p + i + 1)->buff[k] = op[i + k].i.aux;
+        step = j - i;
+      }
+    }
+  }
+}
+
+
+/*
+** returns the specialized code for pattern 'op' at index 'idx'
+*/
+static Instruction *specialize (lua_State *L, int idx, Instruction *op) {
+  Instruction *p;
+  byte *flags;
+  int n = pattsize(L, idx);
+  int extra;
+  lua_getfield(L, LUA_REGISTRYINDEX, SPECIALIZEDIDX);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  p = (Instruction *)lua_touserdata(L, -1);
+  if (p != NULL) {
+    lua_pop(L, 2);
+    return p;
+  }
+  lua_pop(L, 1);
+  flags = (byte *)lua_newuserdata(L, n + 1);
+  memset(flags, 0, n + 1);
+  extra = planspecialize(op, n, flags);
+  lua_pushvalue(L, idx);
+  p = (Instruction *)lua_newuserdata(L, (n + 1 + extra) * sizeof(Instruction));
+  dospecialize(op, n, flags, p);
+  lua_rawset(L, -4);  /* specialized[pattern] = code */
+  lua_pop(L, 2);  /* remove flags and table */
+  return p;
+}
+
+/* }====================================================== */
+
+
 static int matchl (lua_State *L) {
   Capture capture[INITCAPSIZE];
   const char *r;
   size_t l;
+  int atend = 0;
+  int ispattern = lua_isuserdata(L, 1);  /* not built for this match? */
   Instruction *p = getpatt(L, 1, NULL);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
   int ptop = lua_gettop(L);
@@ -2336,17 +2694,521 @@ static int matchl (lua_State *L) {
   lua_pushnil(L);  /* subscache */
   lua_pushlightuserdata(L, capture);  /* caplistidx */
   lua_getfenv(L, 1);  /* penvidx */
-  r = match(L, s, s + i, s + l, p, capture, ptop);
+  if (ispattern)
+    p = specialize(L, 1, p);
+  r = match(L, s, s + i, s + l, p, capture, ptop, &atend);
   if (r == NULL) {
     lua_pushnil(L);
     return 1;
   }
-  return getcaptures(L, s, r, ptop);
+  return getcaptures(L, s, r, ptop, 0);
 }
 
 
+/*
+** {======================================================
+** Streams
+** =======================================================
+*/
+
+/*
+** A stream matches a pattern repeatedly against input that arrives in
+** chunks. Input is kept in a buffer until matched; only the last
+** 'window' bytes before the current position are kept after that, for
+** look-behind. A match that looks at the end of the buffer is not
+** final while more input may come; it is retried when there is more.
+*/
+
+#define STREAM_T	"lpeg-stream"
+
+typedef struct Stream {
+  char *buff;  /* buffered input, always followed by a '\0' */
+  size_t size;  /* size of 'buff' */
+  size_t n;  /* number of bytes in 'buff' */
+  size_t pos;  /* where next match starts */
+  size_t window;  /* bytes kept before 'pos' */
+  lua_Number base;  /* stream position of 'buff[0]' */
+  Instruction *code;  /* code of the pattern (kept by its environment) */
+  int runtime;  /* pattern has match-time captures? */
+  int finished;  /* no more input? */
+  int busy;  /* being matched? (buffer cannot move) */
+} Stream;
+
+
+#define checkstream(L, idx)	((Stream *)luaL_checkudata(L, idx, STREAM_T))
+
+
+static int hasruntime (const Instruction *p) {
+  for (; (Opcode)p->i.code != IEnd; p += sizei(p)) {
+    if ((Opcode)p->i.code == ICloseRunTime)
+      return 1;
+  }
+  return 0;
+}
+
+
+static void resizestream (lua_State *L, Stream *st, size_t size) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+#if LUAPLUS_EXTENSIONS
+  char *b = (char *)allocf(ud, st->buff, st->size, size, "lpeg.stream", 0);
+#else
+  char *b = (char *)allocf(ud, st->buff, st->size, size);
+#endif
+  if (b == NULL && size > 0)
+    luaL_error(L, "not enough memory");
+  st->buff = b;
+  st->size = size;
+}
+
+
+static int stream_l (lua_State *L) {
+  Instruction *p = getpatt(L, 1, NULL);
+  lua_Integer window = luaL_optinteger(L, 2, MAXAUX);
+  Stream *st;
+  luaL_argcheck(L, window >= 0, 2, "invalid look-behind");
+  p = specialize(L, 1, p);
+  st = (Stream *)lua_newuserdata(L, sizeof(Stream));
+  st->buff = NULL;
+  st->size = st->n = st->pos = 0;
+  st->window = (size_t)window;
+  st->base = 0;
+  st->code = p;
+  st->runtime = hasruntime(p);
+  st->finished = st->busy = 0;
+  luaL_getmetatable(L, STREAM_T);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);  /* environment keeps the pattern */
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  resizestream(L, st, LUAL_BUFFERSIZE);
+  st->buff[0] = '\0';
+  return 1;
+}
+
+
+static int stream_feed (lua_State *L) {
+  Stream *st = checkstream(L, 1);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  if (st->finished)
+    return luaL_error(L, "stream is finished");
+  if (st->busy)
+    return luaL_error(L, "cannot feed a stream while matching it");
+  if (st->pos > st->window) {  /* discard input not needed anymore */
+    size_t d = st->pos - st->window;
+    memmove(st->buff, st->buff + d, st->n - d);
+    st->n -= d; st->pos -= d;
+    st->base += d;
+  }
+  if (l >= st->size - st->n) {
+    size_t newsize = st->size * 2;
+    if (newsize <= st->n + l)
+      newsize = st->n + l + 1;
+    resizestream(L, st, newsize);
+  }
+  memcpy(st->buff + st->n, s, l);
+  st->n += l;
+  st->buff[st->n] = '\0';
+  return 0;
+}
+
+
+static int stream_finish (lua_State *L) {
+  checkstream(L, 1)->finished = 1;
+  return 0;
+}
+
+
+/*
+** Returns the captures (or the end position) of the next match,
+** 'nil' if it needs more input or 'false' if there is no match.
+** Stack for 'match' is [pattern, subject, stream, args...], so that
+** 'Carg' works as with 'lpeg.match'.
+*/
+static int dostreammatch (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  Stream *st = checkstream(L, 1);
+  const char *r;
+  int atend = 0;
+  int ptop, n;
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, 1);  /* pattern */
+  lua_replace(L, -2);
+  lua_insert(L, 1);
+  if (st->runtime)  /* match-time captures get the buffered input */
+    lua_pushlstring(L, st->buff, st->n);
+  else
+    lua_pushnil(L);
+  lua_insert(L, SUBJIDX);
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* subscache */
+  lua_pushlightuserdata(L, capture);  /* caplistidx */
+  lua_getfenv(L, 1);  /* penvidx */
+  r = match(L, st->buff, st->buff + st->pos, st->buff + st->n, st->code,
+            capture, ptop, &atend);
+  if (atend && !st->finished) {  /* must see more input */
+    lua_pushnil(L);
+    return 1;
+  }
+  if (r == NULL) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  n = getcaptures(L, st->buff, r, ptop, st->base);
+  st->pos = r - st->buff;
+  return n;
+}
+
+
+/*
+** The match runs in protected mode so that 'busy' is cleared even
+** when a capture raises an error.
+*/
+static int stream_match (lua_State *L) {
+  Stream *st = checkstream(L, 1);
+  int status;
+  lua_pushcfunction(L, dostreammatch);
+  lua_insert(L, 1);
+  st->busy++;
+  status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+  st->busy--;
+  if (status != 0)
+    return lua_error(L);
+  return lua_gettop(L);
+}
+
+
+static int stream_pos (lua_State *L) {
+  Stream *st = checkstream(L, 1);
+  lua_pushnumber(L, st->base + st->pos + 1);
+  return 1;
+}
+
+
+static int stream_pending (lua_State *L) {
+  Stream *st = checkstream(L, 1);
+  lua_pushnumber(L, (lua_Number)(st->n - st->pos));
+  return 1;
+}
+
+
+static int stream_gc (lua_State *L) {
+  Stream *st = (Stream *)lua_touserdata(L, 1);
+  resizestream(L, st, 0);
+  return 0;
+}
+
+
+static int stream_tostring (lua_State *L) {
+  lua_pushfstring(L, "lpeg stream (%p)", lua_touserdata(L, 1));
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Dump and load
+** =======================================================
+*/
+
+/*
+** A dumped pattern is a header, the instructions as they are in memory
+** and the values of its ktable. So it can only be loaded by the same
+** build of LPeg on the same kind of machine, which the header checks.
+** The header ('DumpHeader') is followed by the number of instructions
+** (including the final IEnd) and the size of the ktable, both as
+** 'size_t'; then come the instructions and the ktable values, each a
+** one-byte tag followed by its data.
+** Values that are not strings, numbers or booleans are dumped by name
+** (given in a table of names) and loaded by name (from a table of
+** values).
+*/
+
+#define DUMPSIGNATURE	"\033LPeg"
+#define DUMPFORMAT	1
+
+typedef struct DumpHeader {
+  char signature[sizeof(DUMPSIGNATURE) - 1];
+  byte format;
+  byte instsize;  /* sizeof(Instruction) */
+  byte numsize;  /* sizeof(lua_Number) */
+  byte sizetsize;  /* sizeof(size_t) */
+  short endian;  /* 1 */
+} DumpHeader;
+
+
+static void dumpheader (DumpHeader *h) {
+  memset(h, 0, sizeof(DumpHeader));
+  memcpy(h->signature, DUMPSIGNATURE, sizeof(h->signature));
+  h->format = DUMPFORMAT;
+  h->instsize = sizeof(Instruction);
+  h->numsize = sizeof(lua_Number);
+  h->sizetsize = sizeof(size_t);
+  h->endian = 1;
+}
+
+
+static void dumpvalue (lua_State *L, luaL_Buffer *b, int idx, int names) {
+  size_t l;
+  const char *s;
+  switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN: {
+      luaL_addchar(b, lua_toboolean(L, idx) ? 't' : 'f');
+      return;
+    }
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber(L, idx);
+      luaL_addchar(b, 'n');
+      luaL_addlstring(b, (const char *)&n, sizeof(n));
+      return;
+    }
+    case LUA_TSTRING: {
+      luaL_addchar(b, 's');
+      break;
+    }
+    default: {
+      const char *tname = luaL_typename(L, idx);
+      if (names != 0) {
+        lua_pushvalue(L, idx);
+        lua_rawget(L, names);
+      }
+      else lua_pushnil(L);
+      lua_replace(L, idx);  /* dump its name instead */
+      if (lua_type(L, idx) != LUA_TSTRING)
+        luaL_error(L, "cannot dump a %s value without a name", tname);
+      luaL_addchar(b, 'r');
+    }
+  }
+  s = lua_tolstring(L, idx, &l);
+  luaL_addlstring(b, (const char *)&l, sizeof(l));
+  luaL_addlstring(b, s, l);
+}
+
+
+static int dump_l (lua_State *L) {
+  luaL_Buffer b;
+  DumpHeader h;
+  int names = lua_isnoneornil(L, 2) ? 0 : 2;
+  Instruction *p = checkpattern(L, 1);
+  size_t n = pattsize(L, 1) + 1;  /* including the final IEnd */
+  size_t k, i;
+  Instruction *pi;
+  if (names != 0) luaL_checktype(L, 2, LUA_TTABLE);
+  for (pi = p; (Opcode)pi->i.code != IEnd; pi += sizei(pi)) {
+    if ((Opcode)pi->i.code == IFunc)
+      luaL_error(L, "cannot dump a pattern with C functions");
+  }
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);
+  k = ktablelen(L, 3);
+  luaL_checkstack(L, 4, "cannot dump pattern");
+  dumpheader(&h);
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, (const char *)&h, sizeof(h));
+  luaL_addlstring(&b, (const char *)&n, sizeof(n));
+  luaL_addlstring(&b, (const char *)&k, sizeof(k));
+  luaL_addlstring(&b, (const char *)p, n * sizeof(Instruction));
+  for (i = 1; i <= k; i++) {
+    lua_rawgeti(L, 3, (int)i);
+    lua_insert(L, 4);  /* below buffer contents */
+    dumpvalue(L, &b, 4, names);
+    lua_remove(L, 4);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/* what 'checkcode' knows about each position in the code */
+typedef struct CodeInfo {
+  int height;  /* choice entries pushed when reached, or -1 */
+  byte start;  /* an instruction starts here */
+  byte inrule;  /* reached inside a called rule */
+} CodeInfo;
+
+
+typedef struct LoadState {
+  lua_State *L;
+  const char *s;  /* next byte to read */
+  size_t l;  /* bytes left */
+} LoadState;
+
+
+static const char *loadbytes (LoadState *ls, size_t n) {
+  const char *s = ls->s;
+  if (n > ls->l)
+    luaL_error(ls->L, "truncated pattern dump");
+  ls->s += n; ls->l -= n;
+  return s;
+}
+
+
+static size_t loadsize (LoadState *ls) {
+  size_t n;
+  memcpy(&n, loadbytes(ls, sizeof(n)), sizeof(n));
+  return n;
+}
+
+
+/*
+** check that code loaded from a dump is well formed: only opcodes of
+** unspecialized patterns, jumps to instructions and valid ktable indices.
+** The backtrack stack must balance along every path: the code of the
+** pattern and of each called rule is walked with the number of choice
+** entries it has pushed, which must be the same whenever an instruction
+** is reached again, may not go negative and must be zero at a return.
+*/
+static int checkcode (lua_State *L, const Instruction *op, int n, size_t k) {
+  CodeInfo *ci = (CodeInfo *)lua_newuserdata(L, (n + 1) * sizeof(CodeInfo));
+  int *work = (int *)lua_newuserdata(L, n * sizeof(int));
+  int i, nwork = 0;
+  memset(ci, 0, (n + 1) * sizeof(CodeInfo));
+  for (i = 0; i < n - 1; i += sizei(op + i)) {
+    Opcode code = (Opcode)op[i].i.code;
+    if (code > ICloseRunTime || code == IFunc || code == IEnd)
+      return 0;
+    ci[i].start = 1;
+    ci[i].height = -1;
+  }
+  if (i != n - 1 || (Opcode)op[i].i.code != IEnd) return 0;
+  ci[i].start = 1;
+  ci[i].height = -1;
+  for (i = 0; i < n - 1; i += sizei(op + i)) {
+    const Instruction *p = op + i;
+    if (isprop(p, ISJMP) && p->i.offset != 0) {
+      int d = i + p->i.offset;
+      if (d < 0 || d >= n || !ci[d].start) return 0;
+    }
+    else if (isfenvoff(p) && (p->i.offset < 0 || (size_t)p->i.offset > k))
+      return 0;
+    if (iscapture(p) && getkind(p) > Cgroup) return 0;
+  }
+#define reach(x,h,r) \
+  { int x_ = (x); \
+    if (ci[x_].height < 0) { \
+      ci[x_].height = (h); ci[x_].inrule = (r); work[nwork++] = x_; } \
+    else if (ci[x_].height != (h) || ci[x_].inrule != (r)) return 0; }
+  reach(0, 0, 0);
+  while (nwork > 0) {
+    const Instruction *p;
+    int h, r, d;
+    i = work[--nwork];
+    p = op + i;
+    h = ci[i].height;
+    r = ci[i].inrule;
+    d = i + p->i.offset;
+    switch ((Opcode)p->i.code) {
+      case IEnd: case IFail: case IGiveup: case IOpenCall: break;
+      case IRet: if (h != 0 || !r) return 0; break;
+      case IFailTwice: if (h < 1) return 0; break;
+      case IJmp: reach(d, h, r); break;
+      case IChoice: reach(d, h, r); reach(i + 1, h + 1, r); break;
+      case ICall: reach(d, 0, 1); reach(i + 1, h, r); break;
+      case ICommit: case IBackCommit:
+        if (h < 1) return 0;
+        reach(d, h - 1, r);
+        break;
+      case IPartialCommit:
+        if (h < 1) return 0;
+        reach(d, h, r);
+        break;
+      default:
+        if (isprop(p, ISCHECK) && p->i.offset != 0)  /* test */
+          reach(d, h, r);
+        reach(i + sizei(p), h, r);
+    }
+  }
+#undef reach
+  lua_pop(L, 2);
+  return 1;
+}
+
+
+static int load_l (lua_State *L) {
+  LoadState ls;
+  DumpHeader h, hl;
+  size_t n, k, i;
+  Instruction *p;
+  int values = lua_isnoneornil(L, 2) ? 0 : 2;
+  ls.L = L;
+  ls.s = luaL_checklstring(L, 1, &ls.l);
+  if (values != 0) luaL_checktype(L, 2, LUA_TTABLE);
+  dumpheader(&h);
+  if (ls.l < sizeof(hl) ||
+      memcmp(ls.s, h.signature, sizeof(h.signature)) != 0)
+    return luaL_error(L, "not a pattern dump");
+  memcpy(&hl, loadbytes(&ls, sizeof(hl)), sizeof(hl));
+  if (memcmp(&hl, &h, sizeof(h)) != 0)
+    return luaL_error(L, "pattern dump from an incompatible build");
+  n = loadsize(&ls);
+  k = loadsize(&ls);
+  if (n < 1 || n >= MAXPATTSIZE || n > ls.l / sizeof(Instruction) ||
+      k > INT_MAX)
+    return luaL_error(L, "invalid pattern dump");
+  lua_settop(L, 2);
+  p = newpatt(L, n - 1);
+  memcpy(p, loadbytes(&ls, n * sizeof(Instruction)), n * sizeof(Instruction));
+  if (!checkcode(L, p, (int)n, k))
+    return luaL_error(L, "invalid pattern dump");
+  lua_createtable(L, (int)k, 0);  /* ktable */
+  for (i = 1; i <= k; i++) {
+    char tag = *loadbytes(&ls, 1);
+    switch (tag) {
+      case 't': case 'f': lua_pushboolean(L, tag == 't'); break;
+      case 'n': {
+        lua_Number v;
+        memcpy(&v, loadbytes(&ls, sizeof(v)), sizeof(v));
+        lua_pushnumber(L, v);
+        break;
+      }
+      case 's': case 'r': {
+        size_t l = loadsize(&ls);
+        lua_pushlstring(L, loadbytes(&ls, l), l);
+        if (tag == 'r') {  /* value given by name */
+          lua_pushvalue(L, -1);
+          if (values != 0) lua_rawget(L, values);
+          else { lua_pop(L, 1); lua_pushnil(L); }
+          if (lua_isnil(L, -1))
+            return luaL_error(L, "no value for '%s' in pattern dump",
+                                 lua_tostring(L, -2));
+          lua_replace(L, -2);
+        }
+        break;
+      }
+      default: return luaL_error(L, "invalid pattern dump");
+    }
+    lua_rawseti(L, -2, (int)i);
+  }
+  if (ls.l != 0)
+    return luaL_error(L, "invalid pattern dump");
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static struct luaL_reg streamreg[] = {
+  {"feed", stream_feed},
+  {"finish", stream_finish},
+  {"match", stream_match},
+  {"pos", stream_pos},
+  {"pending", stream_pending},
+  {"__gc", stream_gc},
+  {"__tostring", stream_tostring},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
 static struct luaL_reg pattreg[] = {
   {"match", matchl},
+  {"stream", stream_l},
+  {"dump", dump_l},
+  {"load", load_l},
   {"print", printpat_l},
   {"locale", locale_l},
   {"setmaxstack", setmax},
@@ -2390,6 +3252,17 @@ int luaopen_lpeg (lua_State *L) {
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  lua_newtable(L);  /* specialized code of patterns, weak keys */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, SPECIALIZEDIDX);
+  luaL_newmetatable(L, STREAM_T);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, streamreg);
+  lua_pop(L, 1);
   luaL_register(L, NULL, metapattreg);
   luaL_register(L, "lpeg", pattreg);
   lua_pushliteral(L, "__index");
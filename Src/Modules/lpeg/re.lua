@@ -2,7 +2,7 @@
 
 -- imported functions and modules
 local tonumber, type, print, error = tonumber, type, print, error
-local setmetatable = setmetatable
+local setmetatable, pairs = setmetatable, pairs
 local m = require"lpeg"
 
 -- 'm' will be used to parse expressions, and 'mm' will be used to
@@ -27,7 +27,9 @@ local any = m.P(1)
 local Predef = { nl = m.P"\n" }
 
 
-local mem
+local mem    -- compiled patterns by source
+local dmem   -- the same for each 'defs' table
+local dumps  -- dumped patterns by source, from 'loadcache'
 local fmem
 local gmem
 
@@ -55,10 +57,13 @@ local function updatelocale ()
   Predef.W = any - Predef.w
   Predef.X = any - Predef.x
   mem = {}    -- restart memoization
+  dmem = {}
+  dumps = {}
   fmem = {}
   gmem = {}
   local mt = {__mode = "v"}
   setmetatable(mem, mt)
+  setmetatable(dmem, {__mode = "k"})
   setmetatable(fmem, mt)
   setmetatable(gmem, mt)
 end
@@ -195,10 +200,28 @@ local exp = m.P{ "Exp",
 local pattern = S * exp / mm.P * (-any + patt_error)
 
 
+-- compiled patterns are cached by source (and 'defs' table, whose
+-- contents should not change after being used)
 local function compile (p, defs)
   if mm.type(p) == "pattern" then return p end   -- already compiled
-  local cp = pattern:match(p, 1, defs)
-  if not cp then error("incorrect pattern", 3) end
+  local cache = mem
+  if defs then
+    cache = dmem[defs]
+    if not cache then
+      cache = setmetatable({}, {__mode = "v"})
+      dmem[defs] = cache
+    end
+  end
+  local cp = cache[p]
+  if not cp then
+    if not defs and dumps[p] then
+      cp = mm.load(dumps[p])
+    else
+      cp = pattern:match(p, 1, defs)
+      if not cp then error("incorrect pattern", 3) end
+    end
+    cache[p] = cp
+  end
   return cp
 end
 
@@ -206,7 +229,6 @@ local function match (s, p, i)
   local cp = mem[p]
   if not cp then
     cp = compile(p)
-    mem[p] = cp
   end
   return cp:match(s, i or 1)
 end
@@ -234,9 +256,27 @@ local function gsub (s, p, rep)
 end
 
 
+-- returns the patterns compiled without 'defs' (and still in use) as a
+-- table of dumps by source, which 'loadcache' accepts in any Lua state
+local function dumpcache ()
+  local t = {}
+  for p, d in pairs(dumps) do t[p] = d end
+  for p, cp in pairs(mem) do t[p] = mm.dump(cp) end
+  return t
+end
+
+-- adds the dumps in table 't' to the cache; they are loaded when
+-- compiled for the first time
+local function loadcache (t)
+  for p, d in pairs(t) do dumps[p] = d end
+end
+
+
 -- exported names
 local re = {
   compile = compile,
+  dumpcache = dumpcache,
+  loadcache = loadcache,
   match = match,
   find = find,
   gsub = gsub,
@@ -1180,6 +1180,151 @@ rev = re.compile[[ R <- (!.) -> '' / ({.} R) -> '%2%1']]
 
 assert(rev:match"0123456789" == "9876543210")
 
+
+-- testing specialized code (strings, dispatch on first char, spans)
+
+do
+  local kw = {"and", "break", "do", "else", "elseif", "end", "false", "for",
+              "function", "if", "in", "local", "nil", "not", "or", "repeat"}
+  local p = m.P(false)
+  for _, w in ipairs(kw) do p = p + m.P(w) * -m.R("az") * m.Cc(w) end
+  for _, w in ipairs(kw) do
+    assert(p:match(w) == w)
+    assert(p:match(w) == w)   -- again, with code already specialized
+    assert(not p:match(w .. "x"))
+    assert(not p:match(w:sub(1, -2) .. "\0"))
+  end
+  assert(p:match"elseif" == "elseif" and not p:match"" and not p:match"z")
+  local set = m.S"aeiou" + m.S"xyz" + "q" + m.R"09" + m.P"\0"
+  for _, c in ipairs{"a", "y", "q", "5", "\0"} do assert(set:match(c) == 2) end
+  assert(not set:match"b" and not set:match"")
+
+  local line = string.rep("abcdefghij", 10)
+  p = m.C((1 - m.S"\n,")^0) * m.S"\n,"
+  assert(p:match(line .. ",") == line and not p:match(line))
+  for i = 0, 40 do
+    local s = string.rep("x", i)
+    assert(p:match(s .. "\n" .. line) == s)
+    assert(m.match(m.R("az", "09", "__")^0 * m.Cp(), s .. "-" .. line) == i + 1)
+    assert(m.match(m.S" \t"^0 * m.Cp(), string.rep(" \t", i) .. "x") == 2*i + 1)
+  end
+  assert(m.match((m.P(1) - "\255")^0 * m.Cp(), line .. "\255") == #line + 1)
+end
+
+-- testing streams
+do
+  -- feeds 's' in chunks of 'k' bytes; returns the results of all matches
+  local function streamall (p, s, k, ...)
+    local st = m.stream(p)
+    local res, i = {}, 1
+    while true do
+      local r = st:match(...)
+      if r == false then return res, st end
+      if r == nil then
+        if i > #s then st:finish() else st:feed(s:sub(i, i + k - 1)) end
+        i = i + k
+      else
+        res[#res + 1] = r
+      end
+    end
+  end
+
+  local csv = m.C((1 - m.S",\n")^0) * (m.S",\n" + -1) * m.Cp()
+  local s = "alpha,beta,,gamma\ndelta"
+  for k = 1, #s do
+    local res, st = streamall(#m.P(1) * csv, s, k)
+    assert(table.concat(res, "|") == "alpha|beta||gamma|delta")
+    assert(st:pos() == #s + 1 and st:pending() == 0)
+  end
+  -- longest alternatives wait for more input
+  local p = m.C(m.P"<=" + "<" + "=") * m.Cp()
+  local st = m.stream(p)
+  assert(st:match() == nil)
+  st:feed"<"
+  assert(st:match() == nil)
+  st:feed"=<"
+  local c, e = st:match()
+  assert(c == "<=" and e == 3 and st:pos() == 3)
+  assert(st:match() == nil and st:pending() == 1)
+  st:finish()
+  assert(st:match() == "<" and st:match() == false)
+  checkerr("finished", st.feed, st, "x")
+  -- a definite failure does not wait
+  st = m.stream(m.P"abc")
+  st:feed"ax"
+  assert(st:match() == false and st:pos() == 1)
+  -- positions, arguments and look-behind
+  st = m.stream(m.Cp() * m.C(m.R"az"^1) * m.Carg(1) * m.P" ", 1)
+  st:feed"ab cd "
+  local t = {st:match(10)}
+  assert(t[1] == 1 and t[2] == "ab" and t[3] == 10)
+  st:feed"ef "
+  t = {st:match(20)}
+  assert(t[1] == 4 and t[2] == "cd" and t[3] == 20)
+  st = m.stream((m.P"b" * m.B"ab" + 1) * m.Cp(), 1)
+  st:feed"a"; assert(st:match() == 2)
+  st:feed"b"; assert(st:match() == 3)
+  -- match-time captures see the buffered input
+  st = m.stream(m.Cmt(m.R"09"^1, function (s, i) return i, s end))
+  st:feed"12"
+  assert(st:match() == nil)
+  st:feed"3x"
+  assert(st:match() == "123x")
+  -- an error in a capture does not leave the stream locked
+  st = m.stream(m.C(1) / function (c) if c == "!" then error"boom" end end)
+  st:feed"!a"
+  checkerr("boom", st.match, st)
+  st:feed"b"
+  assert(st:pending() == 3)
+end
+
+-- testing dump and load
+do
+  local f = function (x) return x .. "!" end
+  local p = m.Ct(m.Cg(m.C(m.R"az"^1) / f, "name") * "=" *
+                 (m.R"09"^1 / tonumber) * m.Cc(1.5, true, false) * m.Carg(1))
+  local d = m.dump(p, {[f] = "f", [tonumber] = "tonumber"})
+  local q = m.load(d, {f = f, tonumber = tonumber})
+  local t = q:match("abc=42", 1, "x")
+  assert(t.name == "abc!" and t[1] == 42 and t[2] == 1.5 and t[3] == true and
+         t[4] == false and t[5] == "x" and not q:match"=42")
+  assert(m.dump(q, {[f] = "f", [tonumber] = "tonumber"}) == d)
+  q = m.load(m.dump(m.P{ "(" * m.V(1) * ")" + "" } * -1))
+  assert(q:match"((()))" and not q:match"(()")
+  checkerr("without a name", m.dump, p)
+  checkerr("no value for 'f'", m.load, d, {tonumber = tonumber})
+  checkerr("truncated", m.load, d:sub(1, -2), {f = f, tonumber = tonumber})
+  checkerr("invalid pattern dump", m.load, d .. "x", {f = f, tonumber = tonumber})
+  checkerr("not a pattern dump", m.load, "x")
+  -- code that would pop the backtrack stack below its base
+  d = m.dump(m.P"a")
+  assert(m.load(d):match"a")
+  -- header: signature, format, instruction/number/size_t sizes, endian
+  local sig = #"\27LPeg"
+  local instsize, sizetsize = d:byte(sig + 2), d:byte(sig + 4)
+  local hsize = sig + 4 + (sig + 4) % 2 + 2  -- 'short' endian is aligned
+  local code = hsize + 2 * sizetsize  -- after the code and ktable sizes
+  assert((#d - code) % instsize == 0)  -- no ktable: only the code follows
+  local last = #d - instsize + 1  -- the final IEnd
+  for _, op in ipairs{"\5", "\14"} do  -- IRet, IFailTwice
+    checkerr("invalid pattern dump", m.load,
+             d:sub(1, last - 1) .. op .. d:sub(last + 1))
+  end
+
+  -- compiled patterns are cached and can be moved to other states
+  local src = "{%a+} '=' {%d+}"
+  assert(re.compile(src) == re.compile(src))
+  local defs = {tonumber = tonumber}
+  assert(re.compile("%d+ -> tonumber", defs) == re.compile("%d+ -> tonumber", defs))
+  local keep = re.compile(src)
+  local cache = re.dumpcache()
+  assert(cache[src] and not cache["%d+ -> tonumber"])
+  re.updatelocale()  -- clears the cache
+  re.loadcache(cache)
+  local a, b = re.match("abc=12", src)
+  assert(a == "abc" and b == "12" and re.compile(src) ~= keep)
+end
+
 print"OK"
 
 
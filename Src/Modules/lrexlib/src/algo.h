@@ -21,6 +21,15 @@ static int generate_error  (lua_State *L, const TUserdata *ud, int errcode);
 #define DO_NAMED_SUBPATTERNS(a,b,c)
 #endif
 
+/* Whether a regex compiled with these arguments may be kept in the cache */
+#ifndef ALG_CACHEABLE
+#  define ALG_CACHEABLE(argC) 1
+#endif
+
+#ifndef ALG_CACHESIZE_DFLT
+#  define ALG_CACHESIZE_DFLT 64
+#endif
+
 /*  When doing an iterative search, there can occur a situation of a zero-length
  *  match at the current position, that prevents further advance on the subject
  *  string.
@@ -103,6 +112,8 @@ static TUserdata* check_ud (lua_State *L)
 
 static void check_pattern (lua_State *L, int pos, TArgComp *argC)
 {
+  argC->locale = NULL;  /* these take part in the cache key */
+  argC->syntax = NULL;
   if (lua_isstring (L, pos)) {
     argC->pattern = lua_tolstring (L, pos, &argC->patlen);
     argC->ud = NULL;
@@ -178,6 +189,117 @@ static int ud_new (lua_State *L) {
   return compile_regex (L, &argC, NULL);
 }
 
+/*  Cache of the regexes compiled from string patterns by the functions
+ *  (match, find, gmatch, gsub, split), so that a pattern used in a loop is
+ *  compiled only once. It is a userdata kept in the function environment;
+ *  its own environment holds the pattern strings and the compiled regexes
+ *  at [2*i+1] and [2*i+2], and as Lua strings are interned while they are
+ *  held there, a pattern is looked up by comparing pointers. The least
+ *  recently used entry is replaced when the cache is full.
+ */
+typedef struct {
+  const char * pattern;
+  int          cflags;
+  const char * locale;
+  void       * syntax;
+  TUserdata  * ud;
+  unsigned     used;
+} TCacheEntry;
+
+typedef struct {
+  int          size;
+  unsigned     clock;
+  TCacheEntry  entry[1];
+} TCache;
+
+static const char cache_key = 'c';
+
+static TCache *new_cache (lua_State *L, int size) {
+  TCache *c = (TCache *)lua_newuserdata (L, sizeof (TCache) +
+                                            size * sizeof (TCacheEntry));
+  memset (c, 0, sizeof (TCache) + size * sizeof (TCacheEntry));
+  c->size = size;
+  lua_createtable (L, 2 * size, 0);
+  lua_setfenv (L, -2);
+  lua_pushlightuserdata (L, (void *)&cache_key);
+  lua_pushvalue (L, -2);
+  lua_rawset (L, LUA_ENVIRONINDEX);
+  return c;
+}
+
+/* the cache is left on the stack top */
+static TCache *get_cache (lua_State *L) {
+  TCache *c;
+  lua_pushlightuserdata (L, (void *)&cache_key);
+  lua_rawget (L, LUA_ENVIRONINDEX);
+  if ((c = (TCache *)lua_touserdata (L, -1)) == NULL) {
+    lua_pop (L, 1);
+    c = new_cache (L, ALG_CACHESIZE_DFLT);
+  }
+  return c;
+}
+
+/* like compile_regex, but looks in the cache first; pos is the pattern */
+static void compile_cached (lua_State *L, int pos, const TArgComp *argC,
+                            TUserdata **pud) {
+  TCache *c;
+  TCacheEntry *e, *victim;
+  int i;
+
+  if (!ALG_CACHEABLE (argC)) {
+    compile_regex (L, argC, pud);
+    return;
+  }
+  c = get_cache (L);
+  if (c->size == 0) {
+    lua_pop (L, 1);
+    compile_regex (L, argC, pud);
+    return;
+  }
+  victim = c->entry;
+  for (i = 0, e = c->entry; i < c->size; i++, e++) {
+    if (e->pattern == argC->pattern && e->cflags == argC->cflags &&
+        e->locale == argC->locale && e->syntax == argC->syntax) {
+      e->used = ++c->clock;
+      *pud = e->ud;
+      lua_getfenv (L, -1);
+      lua_rawgeti (L, -1, 2 * i + 2);
+      lua_replace (L, -3);
+      lua_pop (L, 1);
+      return;
+    }
+    if (e->used < victim->used)
+      victim = e;
+  }
+  compile_regex (L, argC, pud);         /* cache, ud */
+  i = (int)(victim - c->entry);
+  victim->pattern = argC->pattern;
+  victim->cflags = argC->cflags;
+  victim->locale = argC->locale;
+  victim->syntax = argC->syntax;
+  victim->ud = *pud;
+  victim->used = ++c->clock;
+  lua_getfenv (L, -2);
+  lua_pushvalue (L, pos);
+  lua_rawseti (L, -2, 2 * i + 1);
+  lua_pushvalue (L, -2);
+  lua_rawseti (L, -2, 2 * i + 2);
+  lua_pop (L, 1);
+  lua_remove (L, -2);
+}
+
+/* function cachesize ([n]) */
+static int cachesize (lua_State *L) {
+  int size = luaL_optint (L, 1, -1);
+  luaL_argcheck (L, size >= -1, 1, "must be non-negative");
+  lua_pushinteger (L, get_cache (L)->size);
+  if (size >= 0) {
+    new_cache (L, size);
+    lua_pop (L, 1);
+  }
+  return 1;
+}
+
 static void push_substrings (lua_State *L, TUserdata *ud, const char *text,
                              TFreeList *freelist) {
   int i;
@@ -204,7 +326,7 @@ static int gsub (lua_State *L) {
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);
+  else compile_cached (L, 2, &argC, &ud);
   freelist_init (&freelist);
   /*------------------------------------------------------------------*/
   if (argE.reptype == LUA_TSTRING) {
@@ -406,7 +528,7 @@ static int generic_find_func (lua_State *L, int method) {
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);
+  else compile_cached (L, 2, &argC, &ud);
   res = findmatch_exec (ud, &argE);
   return finish_generic_find (L, ud, &argE, method, res);
 }
@@ -541,7 +663,7 @@ static int gmatch (lua_State *L)
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);         /* 1-st upvalue: ud */
+  else compile_cached (L, 2, &argC, &ud);     /* 1-st upvalue: ud */
   gmatch_pushsubject (L, &argE);              /* 2-nd upvalue: s  */
   lua_pushinteger (L, argE.eflags);           /* 3-rd upvalue: ef */
   lua_pushinteger (L, 0);                     /* 4-th upvalue: startoffset */
@@ -564,7 +686,7 @@ static int split (lua_State *L)
     ud = (TUserdata*) argC.ud;
     lua_pushvalue (L, 2);
   }
-  else compile_regex (L, &argC, &ud);         /* 1-st upvalue: ud */
+  else compile_cached (L, 2, &argC, &ud);     /* 1-st upvalue: ud */
   gmatch_pushsubject (L, &argE);              /* 2-nd upvalue: s  */
   lua_pushinteger (L, argE.eflags);           /* 3-rd upvalue: ef */
   lua_pushinteger (L, 0);                     /* 4-th upvalue: startoffset */
@@ -37,6 +37,7 @@
 
 static const unsigned char *gettranslate (lua_State *L, int pos);
 #define ALG_GETCARGS(L,pos,argC)  argC->translate = gettranslate (L, pos)
+#define ALG_CACHEABLE(argC)       ((argC)->translate == NULL)
 
 #define ALG_NOMATCH(res)   ((res) == -1 || (res) == -2)
 #define ALG_ISMATCH(res)   ((res) >= 0)
@@ -301,6 +302,7 @@ static const luaL_reg rexlib[] = {
   { "new",        ud_new },
   { "flags",      Gnu_get_flags },
   { "plainfind",  plainfind_func },
+  { "cachesize",  cachesize },
   { NULL, NULL }
 };
 
@@ -337,6 +337,7 @@ static const luaL_reg rexlib[] = {
   { "split",            split },
   { "new",              ud_new },
   { "plainfind",        plainfind_func },
+  { "cachesize",        cachesize },
   { "flags",            LOnig_get_flags },
   { "version",          LOnig_version },
   { "setdefaultsyntax", LOnig_setdefaultsyntax },
@@ -6,6 +6,9 @@
 #include <locale.h>
 #include <ctype.h>
 #include <pcre.h>
+#ifdef _WIN32
+#  include <windows.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -35,6 +38,7 @@ static int getcflags (lua_State *L, int pos);
 
 static void checkarg_compile (lua_State *L, int pos, TArgComp *argC);
 #define ALG_GETCARGS(a,b,c)  checkarg_compile(a,b,c)
+#define ALG_CACHEABLE(argC)  ((argC)->locale == NULL && (argC)->tables == NULL)
 
 #define ALG_NOMATCH(res)   ((res) == PCRE_ERROR_NOMATCH)
 #define ALG_ISMATCH(res)   ((res) >= 0)
@@ -66,6 +70,7 @@ typedef struct {
   int          ncapt;
   const unsigned char * tables;
   int          freed;
+  int          shared;              /* pr and extra belong to a TShared */
 } TPcre;
 
 #define TUserdata TPcre
@@ -83,6 +88,41 @@ static void do_named_subpatterns (lua_State *L, TPcre *ud, const char *text);
 
 const char chartables_typename[] = "chartables";
 
+/* Use the JIT compiler of PCRE 8.20 and later when it is built in */
+#ifdef PCRE_STUDY_JIT_COMPILE
+#  define STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+#  define free_study(extra) pcre_free_study (extra)
+#else
+#  define STUDY_OPTIONS 0
+#  define free_study(extra) pcre_free (extra)
+#endif
+
+/*  Regexes compiled by precompile() are kept for the life of the process in
+ *  a list shared by all Lua states (e.g. the states of several lanes), and
+ *  are used by every regex later compiled from the same pattern and flags
+ *  without a locale or chartables. Entries are never removed.
+ */
+typedef struct tagShared {
+  struct tagShared * next;
+  pcre             * pr;
+  pcre_extra       * extra;
+  int                cflags;
+  size_t             patlen;
+  char               pattern[1];
+} TShared;
+
+static TShared *shared_list = NULL;
+
+#ifdef _WIN32
+static volatile LONG shared_lock = 0;
+#  define lock_shared()   while (InterlockedExchange (&shared_lock, 1)) Sleep (0)
+#  define unlock_shared() InterlockedExchange (&shared_lock, 0)
+#else
+static volatile int shared_lock = 0;
+#  define lock_shared()   while (__sync_lock_test_and_set (&shared_lock, 1))
+#  define unlock_shared() __sync_lock_release (&shared_lock)
+#endif
+
 /*  Functions
  ******************************************************************************
  */
@@ -182,11 +222,31 @@ static void checkarg_compile (lua_State *L, int pos, TArgComp *argC) {
   }
 }
 
+/* the caller must hold the lock */
+static TShared *lookup_shared (const TArgComp *argC) {
+  TShared *sh;
+  for (sh = shared_list; sh; sh = sh->next) {
+    if (sh->cflags == argC->cflags && sh->patlen == argC->patlen &&
+        memcmp (sh->pattern, argC->pattern, argC->patlen) == 0)
+      break;
+  }
+  return sh;
+}
+
+static TShared *find_shared (const TArgComp *argC) {
+  TShared *sh;
+  lock_shared ();
+  sh = lookup_shared (argC);
+  unlock_shared ();
+  return sh;
+}
+
 static int compile_regex (lua_State *L, const TArgComp *argC, TPcre **pud) {
   const char *error;
   int erroffset;
   TPcre *ud;
   const unsigned char *tables = NULL;
+  TShared *sh;
 
   ud = (TPcre*)lua_newuserdata (L, sizeof (TPcre));
   memset (ud, 0, sizeof (TPcre));           /* initialize all members to 0 */
@@ -210,13 +270,20 @@ static int compile_regex (lua_State *L, const TArgComp *argC, TPcre **pud) {
     lua_rawset (L, -3);
     lua_pop (L, 1);
   }
+  else if ((sh = find_shared (argC)) != NULL) {
+    ud->pr = sh->pr;
+    ud->extra = sh->extra;
+    ud->shared = 1;
+  }
 
-  ud->pr = pcre_compile (argC->pattern, argC->cflags, &error, &erroffset, tables);
-  if (!ud->pr)
-    return luaL_error (L, "%s (pattern offset: %d)", error, erroffset + 1);
+  if (!ud->shared) {
+    ud->pr = pcre_compile (argC->pattern, argC->cflags, &error, &erroffset, tables);
+    if (!ud->pr)
+      return luaL_error (L, "%s (pattern offset: %d)", error, erroffset + 1);
 
-  ud->extra = pcre_study (ud->pr, 0, &error);
-  if (error) return luaL_error (L, "%s", error);
+    ud->extra = pcre_study (ud->pr, STUDY_OPTIONS, &error);
+    if (error) return luaL_error (L, "%s", error);
+  }
 
   pcre_fullinfo (ud->pr, ud->extra, PCRE_INFO_CAPTURECOUNT, &ud->ncapt);
   /* need (2 ints per capture, plus one for substring match) * 3/2 */
@@ -334,8 +401,10 @@ static int Lpcre_gc (lua_State *L) {
   TPcre *ud = check_ud (L);
   if (ud->freed == 0) {           /* precaution against "manual" __gc calling */
     ud->freed = 1;
-    if (ud->pr)      pcre_free (ud->pr);
-    if (ud->extra)   pcre_free (ud->extra);
+    if (!ud->shared) {
+      if (ud->pr)    pcre_free (ud->pr);
+      if (ud->extra) free_study (ud->extra);
+    }
     if (ud->tables)  pcre_free ((void *)ud->tables);
     free (ud->match);
   }
@@ -368,6 +437,38 @@ static const luaL_reg chartables_meta[] = {
   { NULL, NULL }
 };
 
+/* function precompile (patt, [cf]) */
+static int Lpcre_precompile (lua_State *L) {
+  TArgComp argC;
+  TPcre *ud;
+  TShared *sh;
+
+  argC.pattern = luaL_checklstring (L, 1, &argC.patlen);
+  argC.cflags = ALG_GETCFLAGS (L, 2);
+  argC.locale = NULL;
+  argC.tables = NULL;
+  compile_regex (L, &argC, &ud);
+  if (ud->shared)
+    return 1;
+
+  sh = (TShared *) Lmalloc (L, sizeof (TShared) + argC.patlen);
+  sh->cflags = argC.cflags;
+  sh->patlen = argC.patlen;
+  memcpy (sh->pattern, argC.pattern, argC.patlen);
+  lock_shared ();
+  if (lookup_shared (&argC) == NULL) {   /* another state may have won */
+    sh->pr = ud->pr;
+    sh->extra = ud->extra;
+    sh->next = shared_list;
+    shared_list = sh;
+    ud->shared = 1;
+    sh = NULL;
+  }
+  unlock_shared ();
+  free (sh);
+  return 1;
+}
+
 static const luaL_reg regex_meta[] = {
   { "exec",        ud_exec },
   { "tfind",       ud_tfind },    /* old name: match */
@@ -389,6 +490,8 @@ static const luaL_reg rexlib[] = {
   { "split",       split },
   { "new",         ud_new },
   { "plainfind",   plainfind_func },
+  { "cachesize",   cachesize },
+  { "precompile",  Lpcre_precompile },
   { "flags",       Lpcre_get_flags },
   { "version",     Lpcre_version },
   { "maketables",  Lpcre_maketables },
@@ -170,6 +170,9 @@ flag_pair pcre_error_flags[] = {
 #ifdef PCRE_ERROR_SHORTUTF8
   { "ERROR_SHORTUTF8",               PCRE_ERROR_SHORTUTF8 },
 #endif
+#ifdef PCRE_ERROR_JIT_STACKLIMIT
+  { "ERROR_JIT_STACKLIMIT",          PCRE_ERROR_JIT_STACKLIMIT },
+#endif
 /*---------------------------------------------------------------------------*/
   { NULL, 0 }
 };
@@ -191,6 +194,9 @@ static flag_pair pcre_config_flags[] = {
 #if VERSION_PCRE >= 704
   { "CONFIG_BSR",                    PCRE_CONFIG_BSR },
 #endif
+#ifdef PCRE_CONFIG_JIT
+  { "CONFIG_JIT",                    PCRE_CONFIG_JIT },
+#endif
 /*---------------------------------------------------------------------------*/
   { NULL, 0 }
 };
@@ -272,6 +272,7 @@ static const luaL_reg rexlib[] = {
   { "new",        ud_new },
   { "flags",      Posix_get_flags },
   { "plainfind",  plainfind_func },
+  { "cachesize",  cachesize },
   { NULL, NULL }
 };
 
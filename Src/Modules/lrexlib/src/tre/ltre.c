@@ -332,6 +332,7 @@ static const luaL_reg rexlib[] = {
   { "new",        ud_new },
   { "flags",      Ltre_get_flags },
   { "plainfind",  plainfind_func },
+  { "cachesize",  cachesize },
   { "config",     Ltre_config },
   { "version",    Ltre_version },
   { NULL, NULL }
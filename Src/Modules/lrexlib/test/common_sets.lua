@@ -319,6 +319,29 @@ local function set_f_gsub8 (lib, flg)
   }
 end
 
+local function set_f_cachesize (lib, flg)
+  -- cachesize ([n]), with the compiled patterns reused by find
+  local function test_cachesize (size, subj, ...)
+    local old = lib.cachesize (size)
+    local out = {}
+    for k = 1, 3 do
+      for i = 1, select ("#", ...) do
+        table.insert (out, tostring ((lib.find (subj, (select (i, ...))))))
+      end
+    end
+    lib.cachesize (old)
+    return table.concat (out, ",")
+  end
+  return {
+    Name = "Function cachesize",
+    Func = test_cachesize,
+  --{  size  subj    patterns                results }
+    { {64,   "abc",  "b", "c"},             {"2,3,2,3,2,3"} },
+    { {1,    "abc",  "b", "c", "a"},        {"2,3,1,2,3,1,2,3,1"} },
+    { {0,    "abc",  "c", "d"},             {"3,nil,3,nil,3,nil"} },
+  }
+end
+
 return function (libname)
   local lib = require (libname)
   return {
@@ -338,5 +361,6 @@ return function (libname)
     set_f_gsub6     (lib),
     set_f_gsub8     (lib),
     set_f_plainfind (lib),
+    set_f_cachesize (lib),
   }
 end
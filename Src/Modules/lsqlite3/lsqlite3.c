@@ -41,9 +41,14 @@
     #define SQLITE_OMIT_PROGRESS_CALLBACK 0
 #endif
 
+#ifndef LSQLITE_STMT_CACHE
+#define LSQLITE_STMT_CACHE 32   /* default size of the statement cache */
+#endif
+
 typedef struct sdb sdb;
 typedef struct sdb_vm sdb_vm;
 typedef struct sdb_func sdb_func;
+typedef struct sdb_stmt sdb_stmt;
 
 /* to use as C user data so i know what function sqlite is calling */
 struct sdb_func {
@@ -77,6 +82,20 @@ struct sdb {
 
     int trace_cb;       /* trace callback */
     int trace_udata;
+
+    /* statement cache */
+    sdb_stmt *stmts;    /* array of stmts_size entries, allocated on use */
+    int stmts_size;
+    unsigned stmts_clock;
+};
+
+/* a prepared statement not in use, kept to be reused for the same sql text */
+struct sdb_stmt {
+    sqlite3_stmt *stmt;     /* NULL for a free entry */
+    char *sql;              /* copy of the sql text given to prepare */
+    int len;
+    int tail;               /* length of the compiled part of sql */
+    unsigned used;          /* stmts_clock when last put in the cache */
 };
 
 static const char *sqlite_meta      = ":sqlite3";
@@ -84,6 +103,136 @@ static const char *sqlite_vm_meta   = ":sqlite3:vm";
 static const char *sqlite_ctx_meta  = ":sqlite3:ctx";
 static int sqlite_ctx_meta_ref;
 
+/*
+** =======================================================
+** Statement cache
+** =======================================================
+*/
+
+/*
+** takes out of the cache a statement prepared from the same sql text;
+** returns NULL if there is none
+*/
+static sqlite3_stmt *stmt_take(sdb *db, const char *sql, int len, int *tail) {
+    sdb_stmt *s = db->stmts;
+    int i;
+    for (i = 0; s && i < db->stmts_size; ++i, ++s) {
+        if (s->stmt && s->len == len && memcmp(s->sql, sql, len) == 0) {
+            sqlite3_stmt *stmt = s->stmt;
+            *tail = s->tail;
+            free(s->sql);
+            s->stmt = NULL;
+            s->sql = NULL;
+            return stmt;
+        }
+    }
+    return NULL;
+}
+
+/*
+** resets a statement that is no longer used and puts it in the cache,
+** dropping the least recently used entry if the cache is full; returns the
+** result of sqlite3_finalize (the same as that of sqlite3_reset)
+*/
+static int stmt_put(sdb *db, const char *sql, int len, int tail, sqlite3_stmt *stmt) {
+    sdb_stmt *s, *victim;
+    char *copy;
+    int result;
+    int i;
+
+    if (db->stmts_size == 0 || sql == NULL)
+        return sqlite3_finalize(stmt);
+    if (db->stmts == NULL) {
+        db->stmts = (sdb_stmt*)calloc(db->stmts_size, sizeof(sdb_stmt));
+        if (db->stmts == NULL)
+            return sqlite3_finalize(stmt);
+    }
+    if ((copy = (char*)malloc(len + 1)) == NULL)
+        return sqlite3_finalize(stmt);
+    memcpy(copy, sql, len);
+    copy[len] = '\0';
+
+    result = sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    victim = db->stmts;
+    for (i = 0, s = db->stmts; i < db->stmts_size; ++i, ++s) {
+        if (s->stmt == NULL) {
+            victim = s;
+            break;
+        }
+        if (s->used < victim->used)
+            victim = s;
+    }
+    if (victim->stmt) {
+        sqlite3_finalize(victim->stmt);
+        free(victim->sql);
+    }
+    victim->stmt = stmt;
+    victim->sql = copy;
+    victim->len = len;
+    victim->tail = tail;
+    victim->used = ++db->stmts_clock;
+    return result;
+}
+
+/* finalizes all the statements in the cache */
+static void stmt_clear(sdb *db) {
+    sdb_stmt *s = db->stmts;
+    int i;
+    for (i = 0; s && i < db->stmts_size; ++i, ++s) {
+        if (s->stmt) {
+            sqlite3_finalize(s->stmt);
+            free(s->sql);
+        }
+    }
+    free(db->stmts);
+    db->stmts = NULL;
+}
+
+/*
+** prepares the first statement in sql, taking it from the cache when
+** possible; returns the result of sqlite3_prepare
+*/
+static int stmt_prepare(sdb *db, const char *sql, int len, sqlite3_stmt **stmt, int *tail) {
+    const char *sqltail = NULL;
+    int result;
+
+    if ((*stmt = stmt_take(db, sql, len, tail)) != NULL)
+        return SQLITE_OK;
+    result = sqlite3_prepare(db->db, sql, len, stmt, &sqltail);
+    *tail = sqltail ? (int)(sqltail - sql) : len;
+    return result;
+}
+
+/*
+** steps a statement of the cache until it is done; on errors, returns the
+** result of sqlite3_reset, and re-prepares the statement if the schema
+** changed since it was prepared
+*/
+static int stmt_run(sdb *db, const char *sql, int len, sqlite3_stmt **stmt) {
+    int result;
+    int loop_limit = 3;
+    while (loop_limit--) {
+        while ((result = sqlite3_step(*stmt)) == SQLITE_ROW)
+            ;
+        if (result == SQLITE_DONE)
+            return result;
+        if ((result = sqlite3_reset(*stmt)) == SQLITE_SCHEMA) {
+            sqlite3_stmt *vn;
+            if (sqlite3_prepare(db->db, sql, len, &vn, NULL) != SQLITE_OK)
+                break;
+            sqlite3_transfer_bindings(*stmt, vn);
+            sqlite3_finalize(*stmt);
+            *stmt = vn;
+        }
+        else {
+            break;
+        }
+    }
+    return result;
+}
+
 /*
 ** =======================================================
 ** Database Virtual Machine Operations
@@ -130,6 +279,9 @@ struct sdb_vm {
     char has_values;        /* true when step succeeds */
 
     char temp;              /* temporary vm used in db:rows */
+    char has_names;         /* column names are in the vm's environment */
+
+    int sqltail;            /* length of the compiled part of the sql text */
 };
 
 /* called with sql text on the lua stack */
@@ -144,6 +296,8 @@ static sdb_vm *newvm(lua_State *L, sdb *db) {
     svm->has_values = 0;
     svm->vm = NULL;
     svm->temp = 0;
+    svm->has_names = 0;
+    svm->sqltail = 0;
 
     /* add an entry on the database table: svm -> sql text */
     lua_pushlightuserdata(L, db);
@@ -156,7 +310,27 @@ static sdb_vm *newvm(lua_State *L, sdb *db) {
     return svm;
 }
 
+/*
+** puts the statement of the vm back in the statement cache of the database,
+** under the sql text kept in the database table; returns the result of
+** sqlite3_finalize
+*/
+static int releasevm(lua_State *L, sdb_vm *svm) {
+    int result;
+    lua_pushlightuserdata(L, svm->db);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, svm);
+    lua_rawget(L, -2);
+    result = stmt_put(svm->db, lua_tostring(L, -1), lua_strlen(L, -1), svm->sqltail, svm->vm);
+    lua_pop(L, 2);
+    svm->vm = NULL;
+    return result;
+}
+
 static int cleanupvm(lua_State *L, sdb_vm *svm) {
+    int had_vm = svm->vm != NULL;
+    int result = had_vm ? releasevm(L, svm) : SQLITE_OK;
+
     /* remove entry in database table - no harm if not present in the table */
     lua_pushlightuserdata(L, svm->db);
     lua_rawget(L, LUA_REGISTRYINDEX);
@@ -167,11 +341,11 @@ static int cleanupvm(lua_State *L, sdb_vm *svm) {
 
     svm->columns = 0;
     svm->has_values = 0;
+    svm->has_names = 0;
 
-    if (!svm->vm) return 0;
+    if (!had_vm) return 0;
 
-    lua_pushnumber(L, sqlite3_finalize(svm->vm));
-    svm->vm = NULL;
+    lua_pushnumber(L, result);
     return 1;
 }
 
@@ -198,6 +372,7 @@ static int stepvm(lua_State *L, sdb_vm *svm) {
             sqlite3_transfer_bindings(svm->vm, vn);
             sqlite3_finalize(svm->vm);
             svm->vm = vn;
+            svm->has_names = 0; /* the columns may have changed */
             lua_pop(L,2);
         } else {
           break;
@@ -218,6 +393,30 @@ static sdb_vm *lsqlite_checkvm(lua_State *L, int index) {
     return svm;
 }
 
+/*
+** pushes an array with the names of the columns of the vm at (absolute)
+** index; it is built once per statement and kept as the vm's environment,
+** so that rows with named fields do not intern the names again
+*/
+static void vm_push_names(lua_State *L, int index, sdb_vm *svm) {
+    if (!svm->has_names) {
+        int columns = sqlite3_column_count(svm->vm);
+        int n;
+
+        lua_createtable(L, columns, 0);
+        for (n = 0; n < columns;) {
+            lua_pushstring(L, sqlite3_column_name(svm->vm, n++));
+            lua_rawseti(L, -2, n);
+        }
+        lua_pushvalue(L, -1);
+        lua_setfenv(L, index);
+        svm->has_names = 1;
+    }
+    else {
+        lua_getfenv(L, index);
+    }
+}
+
 static int dbvm_isopen(lua_State *L) {
     sdb_vm *svm = lsqlite_getvm(L, 1);
     lua_pushboolean(L, svm->vm != NULL ? 1 : 0);
@@ -413,10 +612,11 @@ static int dbvm_get_named_values(lua_State *L) {
     int n;
     dbvm_check_contents(L, svm);
 
-    lua_newtable(L);
-    for (n = 0; n < columns; ++n) {
-        lua_pushstring(L, sqlite3_column_name(vm, n));
-        vm_push_column(L, vm, n);
+    vm_push_names(L, 1, svm);
+    lua_createtable(L, 0, columns);
+    for (n = 0; n < columns;) {
+        lua_rawgeti(L, -2, ++n);
+        vm_push_column(L, vm, n - 1);
         lua_rawset(L, -3);
     }
     return 1;
@@ -581,6 +781,10 @@ static sdb *newdb (lua_State *L) {
     db->trace_cb =
     db->trace_udata = LUA_NOREF;
 
+    db->stmts = NULL;
+    db->stmts_size = LSQLITE_STMT_CACHE;
+    db->stmts_clock = 0;
+
     luaL_getmetatable(L, sqlite_meta);
     lua_setmetatable(L, -2);        /* set metatable */
 
@@ -615,6 +819,9 @@ static int cleanupdb(lua_State *L, sdb *db) {
 
     lua_pop(L, 1); /* pop vm table */
 
+    /* the vms have put their statements in the cache */
+    stmt_clear(db);
+
     /* remove entry in lua registry table */
     lua_pushlightuserdata(L, db);
     lua_pushnil(L);
@@ -1414,14 +1621,147 @@ static int db_exec(lua_State *L) {
         result = sqlite3_exec(db->db, sql, db_exec_callback, L, NULL);
     }
     else {
-        /* no callbacks */
-        result = sqlite3_exec(db->db, sql, NULL, NULL, NULL);
+        /* no callbacks: run the statements one by one, through the cache */
+        int len = lua_strlen(L, 2);
+        result = SQLITE_OK;
+        while (result == SQLITE_OK && len > 0) {
+            sqlite3_stmt *stmt;
+            int tail;
+            result = stmt_prepare(db, sql, len, &stmt, &tail);
+            if (result == SQLITE_OK && stmt != NULL) {
+                if ((result = stmt_run(db, sql, len, &stmt)) == SQLITE_DONE)
+                    result = SQLITE_OK;
+                stmt_put(db, sql, len, tail, stmt);
+            }
+            if (tail == 0) break;
+            sql += tail;
+            len -= tail;
+        }
     }
 
     lua_pushnumber(L, result);
     return 1;
 }
 
+/*
+** Params: db, sql, rows
+** Binds each row of the array rows to the statement sql and steps it, within
+** a transaction unless one is already open. A row is bound as by
+** stmt:bind_names: :name and $name parameters take the named fields of the
+** row, the others the row's array items.
+** returns: code, number of rows inserted (kept), [error message]
+*/
+static int db_insert_many(lua_State *L) {
+    sdb *db = lsqlite_checkdb(L, 1);
+    const char *sql = luaL_checkstring(L, 2);
+    int len = lua_strlen(L, 2);
+    sqlite3_stmt *stmt;
+    int tail, nrows, nparams, i, n;
+    int inserted = 0;
+    int begun = 0;
+    int badrow = 0;
+    int result;
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    nrows = lua_objlen(L, 3);
+    lua_settop(L, 3);
+
+    if ((result = stmt_prepare(db, sql, len, &stmt, &tail)) != SQLITE_OK) {
+        lua_pushnumber(L, result);
+        lua_pushnumber(L, 0);
+        lua_pushstring(L, sqlite3_errmsg(db->db));
+        return 3;
+    }
+    if (stmt == NULL)
+        luaL_argerror(L, 2, "no SQL statement");
+
+    /* 4: the key of each parameter in the rows */
+    nparams = sqlite3_bind_parameter_count(stmt);
+    lua_createtable(L, nparams, 0);
+    for (n = 1; n <= nparams; ++n) {
+        const char *name = sqlite3_bind_parameter_name(stmt, n);
+        if (name && (name[0] == ':' || name[0] == '$'))
+            lua_pushstring(L, name + 1);
+        else
+            lua_pushnumber(L, n);
+        lua_rawseti(L, 4, n);
+    }
+
+    if (sqlite3_get_autocommit(db->db)) {
+        result = sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL);
+        begun = result == SQLITE_OK;
+    }
+
+    for (i = 1; i <= nrows && result == SQLITE_OK; ++i) {
+        lua_rawgeti(L, 3, i);                   /* 5: row */
+        if (!lua_istable(L, 5)) {
+            badrow = i;
+            break;
+        }
+        for (n = 1; n <= nparams && result == SQLITE_OK; ++n) {
+            lua_rawgeti(L, 4, n);
+            lua_rawget(L, 5);
+            if (lua_type(L, -1) > LUA_TSTRING || lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
+                badrow = i;
+                break;
+            }
+            result = dbvm_bind_index(L, stmt, n, -1);
+            lua_pop(L, 1);
+        }
+        if (badrow)
+            break;
+        if (result == SQLITE_OK) {
+            if ((result = stmt_run(db, sql, len, &stmt)) == SQLITE_DONE)
+                result = sqlite3_reset(stmt);
+            if (result == SQLITE_OK)
+                ++inserted;
+        }
+        lua_settop(L, 4);
+    }
+
+    if (result == SQLITE_OK && !badrow && begun) {
+        result = sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL);
+        begun = result != SQLITE_OK;
+    }
+    lua_settop(L, 4);
+    if (result != SQLITE_OK)
+        lua_pushstring(L, sqlite3_errmsg(db->db));
+    if (begun) {
+        /* the rows inserted so far go with the transaction */
+        sqlite3_exec(db->db, "ROLLBACK", NULL, NULL, NULL);
+        inserted = 0;
+    }
+    stmt_put(db, sql, len, tail, stmt);
+
+    if (badrow)
+        luaL_error(L, "row %d - invalid row or data type for bind", badrow);
+
+    lua_pushnumber(L, result);
+    lua_pushnumber(L, inserted);
+    if (result != SQLITE_OK) {
+        lua_pushvalue(L, 5);
+        return 3;
+    }
+    return 2;
+}
+
+/*
+** Params: db, [n]
+** Sets the number of statements kept in the statement cache (emptying it)
+** returns: the previous size
+*/
+static int db_stmt_cache_size(lua_State *L) {
+    sdb *db = lsqlite_checkdb(L, 1);
+    lua_pushnumber(L, db->stmts_size);
+    if (!lua_isnoneornil(L, 2)) {
+        int size = luaL_checkint(L, 2);
+        luaL_argcheck(L, size >= 0, 2, "must be non-negative");
+        stmt_clear(db);
+        db->stmts_size = size;
+    }
+    return 1;
+}
+
 /*
 ** Params: db, sql
 ** returns: code, compiled length or error message
@@ -1430,12 +1770,11 @@ static int db_prepare(lua_State *L) {
     sdb *db = lsqlite_checkdb(L, 1);
     const char *sql = luaL_checkstring(L, 2);
     int sql_len = lua_strlen(L, 2);
-    const char *sqltail;
     sdb_vm *svm;
     lua_settop(L,2); /* sql is on top of stack for call to newvm */
     svm = newvm(L, db);
 
-    if (sqlite3_prepare(db->db, sql, sql_len, &svm->vm, &sqltail) != SQLITE_OK) {
+    if (stmt_prepare(db, sql, sql_len, &svm->vm, &svm->sqltail) != SQLITE_OK) {
         cleanupvm(L, svm);
 
         lua_pushnil(L);
@@ -1444,17 +1783,50 @@ static int db_prepare(lua_State *L) {
     }
 
     /* vm already in the stack */
-    lua_pushstring(L, sqltail);
+    lua_pushstring(L, sql + svm->sqltail);
     return 2;
 }
 
-static int db_do_next_row(lua_State *L, int packed) {
+/*
+** ends the iteration over the rows of a statement once no more rows are
+** available: temporary vms are finalized, others are reset; raises the
+** error, if any
+*/
+static void db_end_rows(lua_State *L, sdb_vm *svm, int result) {
+    sqlite3_stmt *vm = svm->vm;
+
+    if (svm->temp) {
+        /* finalize (into the statement cache) and check for errors */
+        result = releasevm(L, svm);
+        cleanupvm(L, svm);
+    }
+    else if (result == SQLITE_DONE) {
+        result = sqlite3_reset(vm);
+    }
+
+    if (result != SQLITE_OK) {
+        lua_pushstring(L, sqlite3_errmsg(svm->db->db));
+        lua_error(L);
+    }
+}
+
+/*
+** packed: 0 for unpacked values, 1 for an array, 2 for named fields
+** reuse: the row is stored in the table given as the 2nd argument (the
+** control variable of the generic for) instead of a new table
+*/
+static int db_do_next_row(lua_State *L, int packed, int reuse) {
     int result;
     sdb_vm *svm = lsqlite_checkvm(L, 1);
     sqlite3_stmt *vm;
     int columns;
     int i;
 
+    if (reuse) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
     result = stepvm(L, svm);
     vm = svm->vm; /* stepvm may change svm->vm if re-prepare is needed */
     svm->has_values = result == SQLITE_ROW ? 1 : 0;
@@ -1462,7 +1834,12 @@ static int db_do_next_row(lua_State *L, int packed) {
 
     if (result == SQLITE_ROW) {
         if (packed) {
-            lua_newtable(L);
+            if (reuse)
+                lua_pushvalue(L, 2);
+            else if (packed == 1)
+                lua_createtable(L, columns, 0);
+            else
+                lua_createtable(L, 0, columns);
             if (packed == 1) {
                 for (i = 0; i < columns;) {
                     vm_push_column(L, vm, i);
@@ -1470,11 +1847,13 @@ static int db_do_next_row(lua_State *L, int packed) {
                 }
             }
             else {
-                for (i = 0; i < columns; ++i) {
-                    lua_pushstring(L, sqlite3_column_name(vm, i));
-                    vm_push_column(L, vm, i);
-                    lua_rawset(L, -3);
+                vm_push_names(L, 1, svm);
+                for (i = 0; i < columns;) {
+                    lua_rawgeti(L, -1, ++i);
+                    vm_push_column(L, vm, i - 1);
+                    lua_rawset(L, -4);
                 }
+                lua_pop(L, 1);
             }
             return 1;
         }
@@ -1486,33 +1865,87 @@ static int db_do_next_row(lua_State *L, int packed) {
         }
     }
 
-    if (svm->temp) {
-        /* finalize and check for errors */
-        result = sqlite3_finalize(vm);
-        svm->vm = NULL;
-        cleanupvm(L, svm);
-    }
-    else if (result == SQLITE_DONE) {
-        result = sqlite3_reset(vm);
-    }
-
-    if (result != SQLITE_OK) {
-        lua_pushstring(L, sqlite3_errmsg(svm->db->db));
-        lua_error(L);
-    }
+    db_end_rows(L, svm, result);
     return 0;
 }
 
 static int db_next_row(lua_State *L) {
-    return db_do_next_row(L, 0);
+    return db_do_next_row(L, 0, 0);
 }
 
 static int db_next_packed_row(lua_State *L) {
-    return db_do_next_row(L, 1);
+    return db_do_next_row(L, 1, 0);
 }
 
 static int db_next_named_row(lua_State *L) {
-    return db_do_next_row(L, 2);
+    return db_do_next_row(L, 2, 0);
+}
+
+static int db_reuse_packed_row(lua_State *L) {
+    return db_do_next_row(L, 1, 1);
+}
+
+static int db_reuse_named_row(lua_State *L) {
+    return db_do_next_row(L, 2, 1);
+}
+
+/*
+** Params: vm, n
+** returns: a table with one array of values per column, keyed by column
+** number and by column name, and the number of rows fetched into them;
+** fewer than n rows means the end of the result set was reached
+*/
+static int dbvm_fetchmany(lua_State *L) {
+    sdb_vm *svm = lsqlite_checkvm(L, 1);
+    int n = luaL_checkint(L, 2);
+    int columns = sqlite3_column_count(svm->vm);
+    int result = SQLITE_ROW;
+    int rows = 0;
+    int i;
+
+    luaL_argcheck(L, n > 0, 2, "must be positive");
+    lua_settop(L, 2);
+    luaL_checkstack(L, columns + LUA_MINSTACK, "too many columns");
+    vm_push_names(L, 1, svm);                       /* 3: names */
+    lua_createtable(L, columns, columns);           /* 4: result */
+    for (i = 1; i <= columns; ++i) {                /* 5..: the arrays */
+        lua_createtable(L, n, 0);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 4, i);
+        lua_rawgeti(L, 3, i);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 4);
+    }
+
+    while (rows < n && (result = stepvm(L, svm)) == SQLITE_ROW) {
+        sqlite3_stmt *vm = svm->vm;
+        ++rows;
+        for (i = 0; i < columns; ++i) {
+            vm_push_column(L, vm, i);
+            lua_rawseti(L, 5 + i, rows);
+        }
+    }
+    svm->has_values = result == SQLITE_ROW ? 1 : 0;
+    svm->columns = sqlite3_data_count(svm->vm);
+
+    if (result != SQLITE_ROW)
+        db_end_rows(L, svm, result);
+
+    lua_pushvalue(L, 4);
+    lua_pushnumber(L, rows);
+    return 2;
+}
+
+/*
+** pushes the table to be reused for all the rows of svm, which is the
+** initial control value of the generic for with rows(true) and nrows(true)
+*/
+static void push_row_table(lua_State *L, sdb_vm *svm, int packed) {
+    int columns = sqlite3_column_count(svm->vm);
+    if (packed == 1)
+        lua_createtable(L, columns, 0);
+    else
+        lua_createtable(L, 0, columns);
 }
 
 static int dbvm_do_rows(lua_State *L, int(*f)(lua_State *)) {
@@ -1525,11 +1958,19 @@ static int dbvm_do_rows(lua_State *L, int(*f)(lua_State *)) {
 }
 
 static int dbvm_rows(lua_State *L) {
-    return dbvm_do_rows(L, db_next_packed_row);
+    if (!lua_toboolean(L, 2))
+        return dbvm_do_rows(L, db_next_packed_row);
+    dbvm_do_rows(L, db_reuse_packed_row);
+    push_row_table(L, lsqlite_checkvm(L, 1), 1);
+    return 3;
 }
 
 static int dbvm_nrows(lua_State *L) {
-    return dbvm_do_rows(L, db_next_named_row);
+    if (!lua_toboolean(L, 2))
+        return dbvm_do_rows(L, db_next_named_row);
+    dbvm_do_rows(L, db_reuse_named_row);
+    push_row_table(L, lsqlite_checkvm(L, 1), 2);
+    return 3;
 }
 
 static int dbvm_urows(lua_State *L) {
@@ -1544,7 +1985,7 @@ static int db_do_rows(lua_State *L, int(*f)(lua_State *)) {
     svm = newvm(L, db);
     svm->temp = 1;
 
-    if (sqlite3_prepare(db->db, sql, -1, &svm->vm, NULL) != SQLITE_OK) {
+    if (stmt_prepare(db, sql, lua_strlen(L, 2), &svm->vm, &svm->sqltail) != SQLITE_OK) {
         cleanupvm(L, svm);
 
         lua_pushstring(L, sqlite3_errmsg(svm->db->db));
@@ -1557,11 +1998,19 @@ static int db_do_rows(lua_State *L, int(*f)(lua_State *)) {
 }
 
 static int db_rows(lua_State *L) {
-    return db_do_rows(L, db_next_packed_row);
+    if (!lua_toboolean(L, 3))
+        return db_do_rows(L, db_next_packed_row);
+    db_do_rows(L, db_reuse_packed_row);
+    push_row_table(L, (sdb_vm*)lua_touserdata(L, -1), 1);
+    return 3;
 }
 
 static int db_nrows(lua_State *L) {
-    return db_do_rows(L, db_next_named_row);
+    if (!lua_toboolean(L, 3))
+        return db_do_rows(L, db_next_named_row);
+    db_do_rows(L, db_reuse_named_row);
+    push_row_table(L, (sdb_vm*)lua_touserdata(L, -1), 2);
+    return 3;
 }
 
 /* unpacked version of db:rows */
@@ -1754,6 +2203,8 @@ static const luaL_reg dblib[] = {
 
     {"exec",                db_exec                 },
     {"execute",             db_exec                 },
+    {"insert_many",         db_insert_many          },
+    {"stmt_cache_size",     db_stmt_cache_size      },
     {"close",               db_close                },
     {"close_vm",            db_close_vm             },
 
@@ -1795,6 +2246,7 @@ static const luaL_reg vmlib[] = {
     {"rows",                dbvm_rows               },
     {"urows",               dbvm_urows              },
     {"nrows",               dbvm_nrows              },
+    {"fetchmany",           dbvm_fetchmany          },
 
     /* compatibility names (added by request) */
     {"idata",               dbvm_get_values         },
@@ -419,6 +419,100 @@ function st:test_bind_by_names()
   assert_number( stmt:finalize() )
 end
 
+function st:test_reused_rows()
+  local last, i = nil, 0
+  for row in self.db:nrows("SELECT * FROM test ORDER BY id", true) do
+    i = i + 1
+    assert( last == nil or last == row, "Row table not reused." )
+    last = row
+    assert_equal(i, row.id)
+  end
+  assert_equal(3, i)
+  assert_equal("Hello sqlite3", last.name)
+  local stmt = assert_userdata( self.db:prepare("SELECT id, NULLIF(id, 2) FROM test ORDER BY id") )
+  i = 0
+  for row in stmt:rows(true) do
+    i = i + 1
+    assert_equal(i, row[1])
+    if i == 2 then assert_nil(row[2]) else assert_equal(i, row[2]) end
+  end
+  assert_equal(3, i)
+  assert_number( stmt:finalize() )
+end
+
+function st:test_fetchmany()
+  local stmt = assert_userdata( self.db:prepare("SELECT * FROM test ORDER BY id") )
+  local cols, n = stmt:fetchmany(2)
+  assert_equal(2, n)
+  assert_equal(cols[1], cols.id)
+  assert_equal(cols[2], cols.name)
+  assert_equal(2, cols.id[2])
+  assert_equal("Hello World", cols.name[1])
+  cols, n = stmt:fetchmany(2)
+  assert_equal(1, n)
+  assert_equal("Hello sqlite3", cols.name[1])
+  assert_nil(cols.name[2])
+  assert_error(function() stmt:fetchmany(0) end)
+  assert_number( stmt:finalize() )
+end
+
+function st:test_insert_many()
+  local code, n = self.db:insert_many("INSERT INTO test VALUES (?, ?)", {
+    { 4, "Good morning" }, { 5, "Foo Bar" } })
+  assert_equal(sqlite3.OK, code)
+  assert_equal(2, n)
+  self:check_content{ "Hello World", "Hello Lua", "Hello sqlite3", "Good morning", "Foo Bar" }
+  code, n = self.db:insert_many("INSERT INTO test VALUES (:id, :name)", {
+    { id = 6, name = "Six" }, { id = 7, name = "Seven" } })
+  assert_equal(sqlite3.OK, code)
+  assert_equal(2, n)
+  assert_error(function() self.db:insert_many("INSERT INTO test VALUES (?, ?)", { { 8, {} } }) end)
+  self:check_content{ "Hello World", "Hello Lua", "Hello sqlite3", "Good morning", "Foo Bar", "Six", "Seven" }
+end
+
+function st:test_insert_many_rollback()
+  assert_equal( sqlite3.OK, self.db:exec("CREATE TABLE u (id PRIMARY KEY)") )
+  local code, n, msg = self.db:insert_many("INSERT INTO u VALUES (?)", { { 1 }, { 2 }, { 1 } })
+  assert_equal(sqlite3.CONSTRAINT, code)
+  assert_equal(0, n)
+  assert_string(msg)
+  for count in self.db:urows("SELECT count(*) FROM u") do
+    assert_equal(0, count, "Rows not rolled back.")
+  end
+  -- within the caller's transaction the rows before the failing one stay
+  assert_equal( sqlite3.OK, self.db:exec("BEGIN") )
+  code, n = self.db:insert_many("INSERT INTO u VALUES (?)", { { 1 }, { 2 }, { 1 } })
+  assert_equal(sqlite3.CONSTRAINT, code)
+  assert_equal(2, n)
+  for count in self.db:urows("SELECT count(*) FROM u") do
+    assert_equal(2, count)
+  end
+  assert_equal( sqlite3.OK, self.db:exec("ROLLBACK") )
+end
+
+function st:test_stmt_cache()
+  local stmt = assert_userdata( self.db:prepare("SELECT name FROM test WHERE id = ?") )
+  assert_number( stmt:bind_values(2) )
+  assert_equal( sqlite3.ROW, stmt:step() )
+  assert_number( stmt:finalize() )
+  -- the cached statement comes back without its bindings
+  stmt = assert_userdata( self.db:prepare("SELECT name FROM test WHERE id = ?") )
+  assert_equal( sqlite3.DONE, stmt:step() )
+  assert_number( stmt:finalize() )
+  -- a cached statement is prepared again when the schema changes
+  stmt = assert_userdata( self.db:prepare("SELECT * FROM test WHERE id = 1") )
+  assert_equal( 2, stmt:columns() )
+  assert_number( stmt:finalize() )
+  assert_equal( sqlite3.OK, self.db:exec("ALTER TABLE test ADD COLUMN extra") )
+  stmt = assert_userdata( self.db:prepare("SELECT * FROM test WHERE id = 1") )
+  assert_equal( sqlite3.ROW, stmt:step() )
+  assert_equal( 3, stmt:columns() )
+  assert_number( stmt:finalize() )
+  assert_equal( 32, self.db:stmt_cache_size(0) )
+  assert_equal( 0, self.db:stmt_cache_size() )
+  self:check_content{ "Hello World", "Hello Lua", "Hello sqlite3" }
+end
+
 
 
 --------------------------------
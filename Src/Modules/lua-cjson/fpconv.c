@@ -26,12 +26,17 @@
  * with locale support will break when the decimal separator is a comma.
  *
  * fpconv_* will around these issues with a translation buffer if required.
+ *
+ * When built with USE_INTERNAL_FPCONV, fpconv_g_fmt() and fpconv_strtod()
+ * come from g_fmt.c / dtoa.c instead, and only the fast conversions below
+ * are used from this file.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <float.h>
 
 #include "fpconv.h"
 
@@ -39,6 +44,499 @@
 #define snprintf _snprintf
 #endif
 
+/* ===== FAST CONVERSIONS =====
+ *
+ * Most numbers found in JSON have few significant digits. They are
+ * converted here without the C library (or dtoa.c), which remains in use
+ * for the rest. These routines always use '.' as the decimal point.
+ *
+ * Doubles are formatted with Grisu2 (Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", 2010).
+ * Its digits always read back as the same double. When they are no more
+ * than the requested precision (at most 15), they are also the digits
+ * printf("%.<precision>g") would produce, since a double can be
+ * recovered from any decimal of 15 digits or fewer. */
+
+#ifdef _MSC_VER
+typedef unsigned __int64 fpconv_u64;
+#else
+typedef unsigned long long fpconv_u64;
+#endif
+
+#define FPCONV_U64(hi, lo)      (((fpconv_u64)(hi) << 32) | (fpconv_u64)(lo))
+
+#define DP_SIGNIFICAND_MASK     FPCONV_U64(0x000fffff, 0xffffffff)
+#define DP_HIDDEN_BIT           FPCONV_U64(0x00100000, 0x00000000)
+#define DP_SIGN_BIT             FPCONV_U64(0x80000000, 0x00000000)
+#define DP_EXPONENT_BIAS        (0x3ff + 52)
+
+/* Largest power of 10 that can be used when reading numbers. Values are
+ * exact up to 1e22, but intermediate results of x87 arithmetic would be
+ * rounded twice. */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 2
+#define EXACT_POW10_MAX         0
+#else
+#define EXACT_POW10_MAX         22
+#endif
+
+/* Floating point number f * 2^e with a 64 bit significand */
+typedef struct {
+    fpconv_u64 f;
+    int e;
+} diy_fp_t;
+
+/* Normalised approximations of 10^-348, 10^-340, .., 10^340 */
+static const diy_fp_t cached_powers[] = {
+    { FPCONV_U64(0xfa8fd5a0, 0x081c0288), -1220 },
+    { FPCONV_U64(0xbaaee17f, 0xa23ebf76), -1193 },
+    { FPCONV_U64(0x8b16fb20, 0x3055ac76), -1166 },
+    { FPCONV_U64(0xcf42894a, 0x5dce35ea), -1140 },
+    { FPCONV_U64(0x9a6bb0aa, 0x55653b2d), -1113 },
+    { FPCONV_U64(0xe61acf03, 0x3d1a45df), -1087 },
+    { FPCONV_U64(0xab70fe17, 0xc79ac6ca), -1060 },
+    { FPCONV_U64(0xff77b1fc, 0xbebcdc4f), -1034 },
+    { FPCONV_U64(0xbe5691ef, 0x416bd60c), -1007 },
+    { FPCONV_U64(0x8dd01fad, 0x907ffc3c), -980 },
+    { FPCONV_U64(0xd3515c28, 0x31559a83), -954 },
+    { FPCONV_U64(0x9d71ac8f, 0xada6c9b5), -927 },
+    { FPCONV_U64(0xea9c2277, 0x23ee8bcb), -901 },
+    { FPCONV_U64(0xaecc4991, 0x4078536d), -874 },
+    { FPCONV_U64(0x823c1279, 0x5db6ce57), -847 },
+    { FPCONV_U64(0xc2109436, 0x4dfb5637), -821 },
+    { FPCONV_U64(0x9096ea6f, 0x3848984f), -794 },
+    { FPCONV_U64(0xd77485cb, 0x25823ac7), -768 },
+    { FPCONV_U64(0xa086cfcd, 0x97bf97f4), -741 },
+    { FPCONV_U64(0xef340a98, 0x172aace5), -715 },
+    { FPCONV_U64(0xb23867fb, 0x2a35b28e), -688 },
+    { FPCONV_U64(0x84c8d4df, 0xd2c63f3b), -661 },
+    { FPCONV_U64(0xc5dd4427, 0x1ad3cdba), -635 },
+    { FPCONV_U64(0x936b9fce, 0xbb25c996), -608 },
+    { FPCONV_U64(0xdbac6c24, 0x7d62a584), -582 },
+    { FPCONV_U64(0xa3ab6658, 0x0d5fdaf6), -555 },
+    { FPCONV_U64(0xf3e2f893, 0xdec3f126), -529 },
+    { FPCONV_U64(0xb5b5ada8, 0xaaff80b8), -502 },
+    { FPCONV_U64(0x87625f05, 0x6c7c4a8b), -475 },
+    { FPCONV_U64(0xc9bcff60, 0x34c13053), -449 },
+    { FPCONV_U64(0x964e858c, 0x91ba2655), -422 },
+    { FPCONV_U64(0xdff97724, 0x70297ebd), -396 },
+    { FPCONV_U64(0xa6dfbd9f, 0xb8e5b88f), -369 },
+    { FPCONV_U64(0xf8a95fcf, 0x88747d94), -343 },
+    { FPCONV_U64(0xb9447093, 0x8fa89bcf), -316 },
+    { FPCONV_U64(0x8a08f0f8, 0xbf0f156b), -289 },
+    { FPCONV_U64(0xcdb02555, 0x653131b6), -263 },
+    { FPCONV_U64(0x993fe2c6, 0xd07b7fac), -236 },
+    { FPCONV_U64(0xe45c10c4, 0x2a2b3b06), -210 },
+    { FPCONV_U64(0xaa242499, 0x697392d3), -183 },
+    { FPCONV_U64(0xfd87b5f2, 0x8300ca0e), -157 },
+    { FPCONV_U64(0xbce50864, 0x92111aeb), -130 },
+    { FPCONV_U64(0x8cbccc09, 0x6f5088cc), -103 },
+    { FPCONV_U64(0xd1b71758, 0xe219652c), -77 },
+    { FPCONV_U64(0x9c400000, 0x00000000), -50 },
+    { FPCONV_U64(0xe8d4a510, 0x00000000), -24 },
+    { FPCONV_U64(0xad78ebc5, 0xac620000), 3 },
+    { FPCONV_U64(0x813f3978, 0xf8940984), 30 },
+    { FPCONV_U64(0xc097ce7b, 0xc90715b3), 56 },
+    { FPCONV_U64(0x8f7e32ce, 0x7bea5c70), 83 },
+    { FPCONV_U64(0xd5d238a4, 0xabe98068), 109 },
+    { FPCONV_U64(0x9f4f2726, 0x179a2245), 136 },
+    { FPCONV_U64(0xed63a231, 0xd4c4fb27), 162 },
+    { FPCONV_U64(0xb0de6538, 0x8cc8ada8), 189 },
+    { FPCONV_U64(0x83c7088e, 0x1aab65db), 216 },
+    { FPCONV_U64(0xc45d1df9, 0x42711d9a), 242 },
+    { FPCONV_U64(0x924d692c, 0xa61be758), 269 },
+    { FPCONV_U64(0xda01ee64, 0x1a708dea), 295 },
+    { FPCONV_U64(0xa26da399, 0x9aef774a), 322 },
+    { FPCONV_U64(0xf209787b, 0xb47d6b85), 348 },
+    { FPCONV_U64(0xb454e4a1, 0x79dd1877), 375 },
+    { FPCONV_U64(0x865b8692, 0x5b9bc5c2), 402 },
+    { FPCONV_U64(0xc83553c5, 0xc8965d3d), 428 },
+    { FPCONV_U64(0x952ab45c, 0xfa97a0b3), 455 },
+    { FPCONV_U64(0xde469fbd, 0x99a05fe3), 481 },
+    { FPCONV_U64(0xa59bc234, 0xdb398c25), 508 },
+    { FPCONV_U64(0xf6c69a72, 0xa3989f5c), 534 },
+    { FPCONV_U64(0xb7dcbf53, 0x54e9bece), 561 },
+    { FPCONV_U64(0x88fcf317, 0xf22241e2), 588 },
+    { FPCONV_U64(0xcc20ce9b, 0xd35c78a5), 614 },
+    { FPCONV_U64(0x98165af3, 0x7b2153df), 641 },
+    { FPCONV_U64(0xe2a0b5dc, 0x971f303a), 667 },
+    { FPCONV_U64(0xa8d9d153, 0x5ce3b396), 694 },
+    { FPCONV_U64(0xfb9b7cd9, 0xa4a7443c), 720 },
+    { FPCONV_U64(0xbb764c4c, 0xa7a44410), 747 },
+    { FPCONV_U64(0x8bab8eef, 0xb6409c1a), 774 },
+    { FPCONV_U64(0xd01fef10, 0xa657842c), 800 },
+    { FPCONV_U64(0x9b10a4e5, 0xe9913129), 827 },
+    { FPCONV_U64(0xe7109bfb, 0xa19c0c9d), 853 },
+    { FPCONV_U64(0xac2820d9, 0x623bf429), 880 },
+    { FPCONV_U64(0x80444b5e, 0x7aa7cf85), 907 },
+    { FPCONV_U64(0xbf21e440, 0x03acdd2d), 933 },
+    { FPCONV_U64(0x8e679c2f, 0x5e44ff8f), 960 },
+    { FPCONV_U64(0xd433179d, 0x9c8cb841), 986 },
+    { FPCONV_U64(0x9e19db92, 0xb4e31ba9), 1013 },
+    { FPCONV_U64(0xeb96bf6e, 0xbadf77d9), 1039 },
+    { FPCONV_U64(0xaf87023b, 0x9bf0ee6b), 1066 }
+};
+
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static FPCONV_INLINE fpconv_u64 double_bits(double num)
+{
+    union {
+        double d;
+        fpconv_u64 u;
+    } bits;
+
+    bits.d = num;
+    return bits.u;
+}
+
+static diy_fp_t diy_fp_multiply(diy_fp_t x, diy_fp_t y)
+{
+    const fpconv_u64 m32 = 0xffffffff;
+    fpconv_u64 a = x.f >> 32, b = x.f & m32;
+    fpconv_u64 c = y.f >> 32, d = y.f & m32;
+    fpconv_u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    fpconv_u64 tmp;
+    diy_fp_t r;
+
+    tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    tmp += (fpconv_u64)1 << 31;     /* Round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+
+    return r;
+}
+
+static int count_digits(fpconv_u64 n)
+{
+    int digits = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+
+    return digits;
+}
+
+static void grisu_round(char *digits, int len, fpconv_u64 delta,
+                        fpconv_u64 rest, fpconv_u64 ten_kappa,
+                        fpconv_u64 wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/* Generates the decimal digits of a positive finite double. Returns the
+ * number of digits, the value being digits * 10^K. */
+static int grisu2(double num, char *digits, int *K)
+{
+    static const unsigned int pow10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000
+    };
+    fpconv_u64 bits = double_bits(num);
+    fpconv_u64 delta, wp_w, p2, rest, unit, one;
+    diy_fp_t v, w, wp, wm, c;
+    unsigned int p1, d;
+    int kappa, len, k, index;
+    double dk;
+
+    /* Decompose */
+    v.f = bits & DP_SIGNIFICAND_MASK;
+    index = (int)((bits >> 52) & 0x7ff);
+    if (index) {
+        v.f += DP_HIDDEN_BIT;
+        v.e = index - DP_EXPONENT_BIAS;
+    } else {
+        v.e = 1 - DP_EXPONENT_BIAS;
+    }
+
+    /* Boundaries of the values rounding to num, with equal exponents */
+    wp.f = (v.f << 1) + 1;
+    wp.e = v.e - 1;
+    while (!(wp.f & (DP_HIDDEN_BIT << 1))) {
+        wp.f <<= 1;
+        wp.e--;
+    }
+    wp.f <<= 64 - 52 - 2;
+    wp.e -= 64 - 52 - 2;
+    if (v.f == DP_HIDDEN_BIT) {
+        wm.f = (v.f << 2) - 1;
+        wm.e = v.e - 2;
+    } else {
+        wm.f = (v.f << 1) - 1;
+        wm.e = v.e - 1;
+    }
+    wm.f <<= wm.e - wp.e;
+    wm.e = wp.e;
+
+    w = v;
+    while (!(w.f & DP_SIGN_BIT)) {
+        w.f <<= 1;
+        w.e--;
+    }
+
+    /* Scale by a cached power of ten so the binary exponent falls
+     * within [-60, -32] */
+    dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+    k = (int)dk;
+    if (dk - k > 0.0)
+        k++;
+    index = (k >> 3) + 1;
+    *K = -(-348 + index * 8);
+    c = cached_powers[index];
+
+    w = diy_fp_multiply(w, c);
+    wp = diy_fp_multiply(wp, c);
+    wm = diy_fp_multiply(wm, c);
+    wm.f++;
+    wp.f--;
+
+    /* Generate digits of wp until within the rounding interval */
+    delta = wp.f - wm.f;
+    wp_w = wp.f - w.f;
+    one = (fpconv_u64)1 << -wp.e;
+    p1 = (unsigned int)(wp.f >> -wp.e);
+    p2 = wp.f & (one - 1);
+    kappa = count_digits(p1);
+    len = 0;
+
+    while (kappa > 0) {
+        d = p1 / pow10[kappa - 1];
+        p1 %= pow10[kappa - 1];
+        if (d || len)
+            digits[len++] = '0' + d;
+        kappa--;
+        rest = ((fpconv_u64)p1 << -wp.e) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisu_round(digits, len, delta, rest,
+                        (fpconv_u64)pow10[kappa] << -wp.e, wp_w);
+            return len;
+        }
+    }
+
+    unit = 1;
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        unit *= 10;
+        d = (unsigned int)(p2 >> -wp.e);
+        if (d || len)
+            digits[len++] = '0' + d;
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round(digits, len, delta, p2, one, wp_w * unit);
+            return len;
+        }
+    }
+}
+
+/* Formats digits * 10^K like printf("%.<precision>g") */
+static int format_g(char *str, int negative, const char *digits, int len,
+                    int K, int precision)
+{
+    char *p = str;
+    int exp, i;
+
+    /* printf() drops trailing zeros */
+    while (len > 1 && digits[len - 1] == '0') {
+        len--;
+        K++;
+    }
+    exp = len + K - 1;
+
+    if (negative)
+        *p++ = '-';
+
+    if (exp < -4 || exp >= precision) {
+        /* d.ddde+XX */
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        *p++ = 'e';
+        if (exp < 0) {
+            *p++ = '-';
+            exp = -exp;
+        } else {
+            *p++ = '+';
+        }
+        if (exp >= 100) {
+            *p++ = '0' + exp / 100;
+            exp %= 100;
+        }
+        *p++ = '0' + exp / 10;
+        *p++ = '0' + exp % 10;
+    } else if (exp < 0) {
+        /* 0.000ddd */
+        *p++ = '0';
+        *p++ = '.';
+        for (i = exp + 1; i < 0; i++)
+            *p++ = '0';
+        memcpy(p, digits, len);
+        p += len;
+    } else if (len <= exp + 1) {
+        /* ddd000 */
+        memcpy(p, digits, len);
+        p += len;
+        for (i = len; i <= exp; i++)
+            *p++ = '0';
+    } else {
+        /* ddd.ddd */
+        memcpy(p, digits, exp + 1);
+        p += exp + 1;
+        *p++ = '.';
+        memcpy(p, digits + exp + 1, len - exp - 1);
+        p += len - exp - 1;
+    }
+    *p = 0;
+
+    return p - str;
+}
+
+/* Formats a number as fpconv_g_fmt() would when it needs no more than
+ * "precision" significant digits. Returns the length of the string, or
+ * 0 when fpconv_g_fmt() is required (including NaN and Inf). */
+int fpconv_fast_g_fmt(char *str, double num, int precision)
+{
+    char digits[24];
+    fpconv_u64 bits = double_bits(num);
+    fpconv_u64 integer;
+    int negative = (bits & DP_SIGN_BIT) != 0;
+    int len, K;
+
+    if (negative)
+        num = -num;
+
+    if (num == 0) {
+        digits[0] = '0';
+        return format_g(str, negative, digits, 1, 0, precision);
+    }
+
+    /* Subnormals have fewer than 15 significant digits, so their shortest
+     * representation may differ from printf() output */
+    if (((bits >> 52) & 0x7ff) == 0x7ff || ((bits >> 52) & 0x7ff) == 0)
+        return 0;
+
+    /* Integers */
+    if (num < 1e15) {
+        integer = (fpconv_u64)num;
+        if ((double)integer == num) {
+            len = count_digits(integer);
+            if (len > precision)
+                return 0;
+            for (K = len - 1; K >= 0; K--) {
+                digits[K] = '0' + (int)(integer % 10);
+                integer /= 10;
+            }
+            return format_g(str, negative, digits, len, 0, precision);
+        }
+    }
+
+    len = grisu2(num, digits, &K);
+    if (len > precision)
+        return 0;
+
+    return format_g(str, negative, digits, len, K, precision);
+}
+
+/* Converts a number strictly following the JSON grammar with up to 19
+ * significant digits and a small exponent, where the result can be
+ * computed exactly. Otherwise returns with *endptr set to nptr, and
+ * fpconv_strtod() must be used. */
+double fpconv_fast_strtod(const char *nptr, char **endptr)
+{
+    const char *p = nptr;
+    fpconv_u64 significand = 0;
+    int negative = 0, digits = 0, exp10 = 0, exp = 0, exp_negative = 0;
+    double value;
+
+    *endptr = (char *)nptr;
+
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+
+    /* Integer part: leading zeros and hex are left to strtod() */
+    if (*p == '0') {
+        p++;
+        if (('0' <= *p && *p <= '9') || (*p | 0x20) == 'x')
+            return 0;
+    } else if ('1' <= *p && *p <= '9') {
+        do {
+            significand = significand * 10 + (*p++ - '0');
+            digits++;
+        } while ('0' <= *p && *p <= '9');
+    } else {
+        return 0;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p < '0' || '9' < *p)
+            return 0;
+        do {
+            if (significand || *p != '0') {
+                significand = significand * 10 + (*p - '0');
+                digits++;
+            }
+            exp10--;
+            p++;
+        } while ('0' <= *p && *p <= '9');
+    }
+
+    if (digits > 19)
+        return 0;
+
+    if ((*p | 0x20) == 'e') {
+        p++;
+        if (*p == '-' || *p == '+')
+            exp_negative = (*p++ == '-');
+        if (*p < '0' || '9' < *p)
+            return 0;
+        do {
+            if (exp < 10000)
+                exp = exp * 10 + (*p - '0');
+            p++;
+        } while ('0' <= *p && *p <= '9');
+        exp10 += exp_negative ? -exp : exp;
+    }
+
+    if (!significand) {
+        value = 0;
+    } else {
+        if (significand > ((fpconv_u64)1 << 53))
+            return 0;
+        if (0 <= exp10 && exp10 <= EXACT_POW10_MAX)
+            value = (double)significand * exact_pow10[exp10];
+        else if (exp10 < 0 && -exp10 <= EXACT_POW10_MAX)
+            value = (double)significand / exact_pow10[-exp10];
+        else
+            return 0;
+    }
+
+    *endptr = (char *)p;
+
+    return negative ? -value : value;
+}
+
+/* ===== C LIBRARY CONVERSIONS ===== */
+
+#ifndef USE_INTERNAL_FPCONV
+
 /* Lua CJSON assumes the locale is the same for all threads within a
  * process and doesn't change after initialisation.
  *
@@ -205,5 +703,7 @@ void fpconv_init()
     fpconv_update_locale();
 }
 
+#endif
+
 /* vi:ai et sw=4 ts=4:
  */
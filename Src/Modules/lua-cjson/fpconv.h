@@ -24,5 +24,11 @@ extern FPCONV_INLINE void fpconv_init();
 extern int fpconv_g_fmt(char*, double, int);
 extern double fpconv_strtod(const char*, char**);
 
+/* Fast paths for common numbers. fpconv_fast_g_fmt() returns 0 and
+ * fpconv_fast_strtod() sets *endptr to its argument when the general
+ * conversion above must be used instead. */
+extern int fpconv_fast_g_fmt(char*, double, int);
+extern double fpconv_fast_strtod(const char*, char**);
+
 /* vi:ai et sw=4 ts=4:
  */
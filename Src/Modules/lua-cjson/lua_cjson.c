@@ -45,6 +45,7 @@
 
 #include "strbuf.h"
 #include "fpconv.h"
+#include "scan.h"
 
 #ifndef CJSON_MODNAME
 #define CJSON_MODNAME   "cjson"
@@ -86,6 +87,16 @@
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
 #define DEFAULT_ENCODE_NUMBER_PRECISION 14
 
+/* Decoded object keys are cached by nesting depth and position, so
+ * arrays of similar objects can reuse the key strings of the previous
+ * object. Must be a power of 2. */
+#define KEY_CACHE_SIZE 128
+
+/* Tables are preallocated with the size of the previous array/object at
+ * the same depth, up to SHAPE_MAX_DEPTH and SHAPE_MAX_SIZE */
+#define SHAPE_MAX_DEPTH 32
+#define SHAPE_MAX_SIZE 4096
+
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
 #define DEFAULT_DECODE_INVALID_NUMBERS 0
@@ -126,6 +137,14 @@ static const char *json_token_type_name[] = {
     NULL
 };
 
+/* Sizes and keys of recently decoded arrays/objects */
+typedef struct {
+    const char *key[KEY_CACHE_SIZE];    /* Strings anchored in a table */
+    int key_len[KEY_CACHE_SIZE];        /* -1 when unused */
+    int array_size[SHAPE_MAX_DEPTH];
+    int object_size[SHAPE_MAX_DEPTH];
+} json_shape_t;
+
 typedef struct {
     json_token_type_t ch2token[256];
     char escape2char[256];  /* Decoding */
@@ -144,14 +163,22 @@ typedef struct {
 
     int decode_invalid_numbers;
     int decode_max_depth;
+
+    /* Keys are anchored in the environment table of the configuration
+     * and reused by later calls to decode */
+    json_shape_t decode_shape;
 } json_config_t;
 
 typedef struct {
     const char *data;
     const char *ptr;
+    const char *end;  /* Terminating NUL of data */
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
     int current_depth;
+    json_shape_t *shape;
+    int keys;         /* Stack index of the table anchoring shape keys */
+    lua_Number offset; /* Input preceding data, for error positions */
 } json_parse_t;
 
 typedef struct {
@@ -206,6 +233,24 @@ static const char *char2escape[256] = {
 
 /* ===== CONFIGURATION ===== */
 
+/* Forget the sizes of previous arrays/objects */
+static void json_shape_reset(json_shape_t *shape)
+{
+    int i;
+
+    for (i = 0; i < SHAPE_MAX_DEPTH; i++)
+        shape->array_size[i] = shape->object_size[i] = 0;
+}
+
+static void json_shape_init(json_shape_t *shape)
+{
+    int i;
+
+    for (i = 0; i < KEY_CACHE_SIZE; i++)
+        shape->key_len[i] = -1;
+    json_shape_reset(shape);
+}
+
 static json_config_t *json_fetch_config(lua_State *l)
 {
     json_config_t *cfg;
@@ -398,6 +443,11 @@ static void json_create_config(lua_State *l)
     lua_setfield(l, -2, "__gc");
     lua_setmetatable(l, -2);
 
+    /* Anchor for the key cache */
+    lua_createtable(l, KEY_CACHE_SIZE, 0);
+    lua_setfenv(l, -2);
+    json_shape_init(&cfg->decode_shape);
+
     cfg->encode_sparse_convert = DEFAULT_SPARSE_CONVERT;
     cfg->encode_sparse_ratio = DEFAULT_SPARSE_RATIO;
     cfg->encode_sparse_safe = DEFAULT_SPARSE_SAFE;
@@ -478,11 +528,11 @@ static void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *js
 static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
 {
     const char *escstr;
-    int i;
-    const char *str;
+    const char *str, *end, *run;
     size_t len;
 
     str = lua_tolstring(l, lindex, &len);
+    end = str + len;
 
     /* Worst case is len * 6 (all unicode escapes).
      * This buffer is reused constantly for small strings
@@ -491,12 +541,15 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
     strbuf_ensure_empty_length(json, len * 6 + 2);
 
     strbuf_append_char_unsafe(json, '\"');
-    for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(json, escstr);
-        else
-            strbuf_append_char_unsafe(json, str[i]);
+    while (str < end) {
+        /* Copy the run of characters which need no escaping in one go */
+        run = scan_escape(str, end);
+        strbuf_append_mem_unsafe(json, str, run - str);
+        if (run == end)
+            break;
+        escstr = char2escape[(unsigned char)*run];
+        strbuf_append_mem_unsafe(json, escstr, strlen(escstr));
+        str = run + 1;
     }
     strbuf_append_char_unsafe(json, '\"');
 }
@@ -626,7 +679,9 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
     }
 
     strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
-    len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
+    len = fpconv_fast_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
+    if (!len)
+        len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
     strbuf_extend_length(json, len);
 }
 
@@ -900,6 +955,7 @@ static void json_set_token_error(json_token_t *token, json_parse_t *json,
 static void json_next_string_token(json_parse_t *json, json_token_t *token)
 {
     char *escape2char = json->cfg->escape2char;
+    const char *run;
     char ch;
 
     /* Caller must ensure a string is next */
@@ -914,7 +970,15 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
      */
     strbuf_reset(json->tmp);
 
-    while ((ch = *json->ptr) != '"') {
+    while (1) {
+        /* Copy the run of plain characters in one go */
+        run = scan_string(json->ptr, json->end);
+        strbuf_append_mem_unsafe(json->tmp, json->ptr, run - json->ptr);
+        json->ptr = run;
+
+        if ((ch = *json->ptr) == '"')
+            break;
+
         if (!ch) {
             /* Premature end of the string */
             json_set_token_error(token, json, "unexpected end of string");
@@ -944,7 +1008,7 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
             /* Skip '\' */
             json->ptr++;
         }
-        /* Append normal character or translated single character
+        /* Append translated single character escape
          * Unicode escapes are handled above */
         strbuf_append_char_unsafe(json->tmp, ch);
         json->ptr++;
@@ -1013,7 +1077,9 @@ static void json_next_number_token(json_parse_t *json, json_token_t *token)
     char *endptr;
 
     token->type = T_NUMBER;
-    token->value.number = fpconv_strtod(json->ptr, &endptr);
+    token->value.number = fpconv_fast_strtod(json->ptr, &endptr);
+    if (json->ptr == endptr)
+        token->value.number = fpconv_strtod(json->ptr, &endptr);
     if (json->ptr == endptr)
         json_set_token_error(token, json, "invalid number");
     else
@@ -1032,12 +1098,12 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
     int ch;
 
     /* Eat whitespace. */
-    while (1) {
+    ch = (unsigned char)*(json->ptr);
+    token->type = ch2token[ch];
+    if (token->type == T_WHITESPACE) {
+        json->ptr = scan_whitespace(json->ptr + 1, json->end);
         ch = (unsigned char)*(json->ptr);
         token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-            break;
-        json->ptr++;
     }
 
     /* Store location of new token. Required when throwing errors
@@ -1124,8 +1190,8 @@ static void json_throw_parse_error(lua_State *l, json_parse_t *json,
         found = json_token_type_name[token->type];
 
     /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+    luaL_error(l, "Expected %s but found %s at character %f",
+               exp, found, json->offset + token->index + 1);
 }
 
 static CJSON_INLINE void json_decode_ascend(json_parse_t *json)
@@ -1143,34 +1209,69 @@ static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
     }
 
     strbuf_free(json->tmp);
-    luaL_error(l, "Found too many nested data structures (%d) at character %d",
-        json->current_depth, json->ptr - json->data);
+    luaL_error(l, "Found too many nested data structures (%d) at character %f",
+        json->current_depth, json->offset + (json->ptr - json->data));
+}
+
+static CJSON_INLINE int json_shape_size(int *sizes, int depth)
+{
+    return depth < SHAPE_MAX_DEPTH ? sizes[depth] : 0;
+}
+
+static CJSON_INLINE void json_shape_set_size(int *sizes, int depth, int size)
+{
+    if (depth < SHAPE_MAX_DEPTH)
+        sizes[depth] = size < SHAPE_MAX_SIZE ? size : SHAPE_MAX_SIZE;
+}
+
+/* Push an object key. The string is reused from the key cache when the
+ * previous object at this depth had the same key in the same position */
+static void json_push_key(lua_State *l, json_parse_t *json,
+                          json_token_t *token, int field)
+{
+    json_shape_t *shape = json->shape;
+    int slot = (json->current_depth * 16 + field) & (KEY_CACHE_SIZE - 1);
+
+    if (shape->key_len[slot] == token->string_len &&
+        !memcmp(shape->key[slot], token->value.string, token->string_len)) {
+        lua_rawgeti(l, json->keys, slot + 1);
+        return;
+    }
+
+    lua_pushlstring(l, token->value.string, token->string_len);
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, json->keys, slot + 1);
+    shape->key[slot] = lua_tostring(l, -1);
+    shape->key_len[slot] = token->string_len;
 }
 
 static void json_parse_object_context(lua_State *l, json_parse_t *json)
 {
     json_token_t token;
+    int i;
 
     /* 3 slots required:
      * .., table, key, value */
     json_decode_descend(l, json, 3);
 
-    lua_newtable(l);
+    lua_createtable(l, 0, json_shape_size(json->shape->object_size,
+                                          json->current_depth));
 
     json_next_token(json, &token);
 
     /* Handle empty objects */
     if (token.type == T_OBJ_END) {
+        json_shape_set_size(json->shape->object_size, json->current_depth, 0);
         json_decode_ascend(json);
         return;
     }
 
-    while (1) {
+    for (i = 0; ; i++) {
         if (token.type != T_STRING)
             json_throw_parse_error(l, json, "object key string", &token);
 
         /* Push key */
-        lua_pushlstring(l, token.value.string, token.string_len);
+        json_push_key(l, json, &token, i);
 
         json_next_token(json, &token);
         if (token.type != T_COLON)
@@ -1186,6 +1287,8 @@ static void json_parse_object_context(lua_State *l, json_parse_t *json)
         json_next_token(json, &token);
 
         if (token.type == T_OBJ_END) {
+            json_shape_set_size(json->shape->object_size,
+                                json->current_depth, i + 1);
             json_decode_ascend(json);
             return;
         }
@@ -1207,12 +1310,14 @@ static void json_parse_array_context(lua_State *l, json_parse_t *json)
      * .., table, value */
     json_decode_descend(l, json, 2);
 
-    lua_newtable(l);
+    lua_createtable(l, json_shape_size(json->shape->array_size,
+                                       json->current_depth), 0);
 
     json_next_token(json, &token);
 
     /* Handle empty arrays */
     if (token.type == T_ARR_END) {
+        json_shape_set_size(json->shape->array_size, json->current_depth, 0);
         json_decode_ascend(json);
         return;
     }
@@ -1224,6 +1329,8 @@ static void json_parse_array_context(lua_State *l, json_parse_t *json)
         json_next_token(json, &token);
 
         if (token.type == T_ARR_END) {
+            json_shape_set_size(json->shape->array_size,
+                                json->current_depth, i);
             json_decode_ascend(json);
             return;
         }
@@ -1277,6 +1384,13 @@ static int json_decode(lua_State *l)
     json.data = luaL_checklstring(l, 1, &json_len);
     json.current_depth = 0;
     json.ptr = json.data;
+    json.end = json.data + json_len;
+    json.offset = 0;
+
+    json.shape = &json.cfg->decode_shape;
+    json_shape_reset(json.shape);
+    lua_getfenv(l, lua_upvalueindex(1));
+    json.keys = lua_gettop(l);
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
@@ -1305,6 +1419,424 @@ static int json_decode(lua_State *l)
     return 1;
 }
 
+/* ===== STREAM DECODING ===== */
+
+/* The stream decoder buffers input until a complete value is available,
+ * then decodes it with the parser above. Only the value being received is
+ * kept in memory. Values are either a sequence separated by whitespace
+ * (eg, newline delimited JSON), or the elements of a single array. */
+
+typedef enum {
+    DECODER_VALUES,         /* Expecting values */
+    DECODER_ARRAY_START,    /* Expecting '[' */
+    DECODER_ARRAY_FIRST,    /* Expecting an element or ']' */
+    DECODER_ARRAY_ELEMENT,  /* Expecting an element after ',' */
+    DECODER_ARRAY_NEXT,     /* Expecting ',' or ']' */
+    DECODER_ARRAY_END,      /* Expecting nothing after ']' */
+    DECODER_FINISHED,
+    DECODER_FAILED
+} json_decoder_state_t;
+
+typedef struct {
+    json_config_t *cfg;
+    strbuf_t buf;           /* Input not decoded yet */
+    strbuf_t tmp;           /* Temporary storage for strings */
+    json_decoder_state_t state;
+    int pos;                /* Next byte of buf to scan */
+    int start;              /* Start of the value being scanned, or -1 */
+    int depth;              /* Open arrays/objects in the value */
+    int in_string;
+    lua_Number offset;      /* Bytes discarded from the front of buf */
+    int head, tail;         /* Queued values in the environment table */
+    json_shape_t shape;     /* Shared by all values decoded */
+} json_decoder_t;
+
+#define JSON_DECODER_META       "cjson.decoder"
+
+/* Larger buffers are released once empty */
+#define JSON_DECODER_KEEP_SIZE  65536
+
+static json_decoder_t *json_check_decoder(lua_State *l)
+{
+    return luaL_checkudata(l, 1, JSON_DECODER_META);
+}
+
+/* Name of the token starting with ch, for error messages */
+static const char *json_decoder_token_name(json_config_t *cfg, int ch)
+{
+    json_token_type_t type = cfg->ch2token[ch];
+
+    if (type == T_UNKNOWN) {
+        if (ch == '"')
+            type = T_STRING;
+        else if (ch == 't' || ch == 'f')
+            type = T_BOOLEAN;
+        else if (ch == 'n')
+            type = T_NULL;
+        else
+            type = T_NUMBER;
+    }
+
+    return json_token_type_name[type];
+}
+
+static void json_decoder_error(lua_State *l, json_decoder_t *dec,
+                               const char *exp, const char *found)
+{
+    dec->state = DECODER_FAILED;
+    luaL_error(l, "Expected %s but found %s at character %f",
+               exp, found, dec->offset + dec->pos + 1);
+}
+
+/* Scans from dec->pos for the end of the value starting at dec->start.
+ * Returns the offset following the value, or -1 if more input is
+ * required. */
+static int json_decoder_scan(json_decoder_t *dec)
+{
+    const json_token_type_t *ch2token = dec->cfg->ch2token;
+    const char *data = dec->buf.buf;
+    const char *end = data + dec->buf.length;
+    const char *p = data + dec->pos;
+    json_token_type_t type;
+    int ch;
+
+    while (p < end) {
+        if (dec->in_string) {
+            p = scan_string(p, end);
+            if (p == end)
+                break;
+            if (*p == '\\') {
+                /* Wait for the escaped character */
+                if (end - p < 2)
+                    break;
+                p += 2;
+                continue;
+            }
+            /* NUL is left for the parser to reject */
+            if (*p++ == '"') {
+                dec->in_string = 0;
+                if (!dec->depth)
+                    return p - data;
+            }
+            continue;
+        }
+
+        ch = (unsigned char)*p;
+        if (!dec->depth) {
+            /* Numbers and literals end at the next token or whitespace */
+            type = ch2token[ch];
+            if ((type != T_ERROR && type != T_UNKNOWN) || ch == '"')
+                return p - data;
+            p++;
+            continue;
+        }
+
+        p++;
+        if (ch == '"') {
+            dec->in_string = 1;
+        } else if (ch == '{' || ch == '[') {
+            dec->depth++;
+        } else if (ch == '}' || ch == ']') {
+            if (!--dec->depth)
+                return p - data;
+        }
+    }
+
+    dec->pos = p - data;
+
+    return -1;
+}
+
+/* Decodes buf[start, stop) and appends the value to the queue. The
+ * environment table of the decoder and its key cache table must be on the
+ * top of the stack. */
+static void json_decoder_parse(lua_State *l, json_decoder_t *dec,
+                               int start, int stop)
+{
+    json_parse_t json;
+    json_token_t token;
+    json_decoder_state_t state;
+    char saved;
+
+    strbuf_reset(&dec->tmp);
+    strbuf_ensure_empty_length(&dec->tmp, stop - start);
+
+    json.cfg = dec->cfg;
+    json.data = dec->buf.buf + start;
+    json.ptr = json.data;
+    json.end = dec->buf.buf + stop;
+    json.tmp = &dec->tmp;
+    json.current_depth = 0;
+    json.shape = &dec->shape;
+    json.keys = lua_gettop(l);
+    json.offset = dec->offset + start;
+
+    /* The parser requires a terminating NUL. Parse errors leave the
+     * decoder failed. */
+    saved = dec->buf.buf[stop];
+    dec->buf.buf[stop] = '\0';
+    state = dec->state;
+    dec->state = DECODER_FAILED;
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    json_next_token(&json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    dec->buf.buf[stop] = saved;
+    dec->state = state;
+
+    lua_rawseti(l, -3, ++dec->tail);
+}
+
+/* Decodes all complete values in the buffer. When finishing, a number or
+ * literal may end with the input. */
+static void json_decoder_process(lua_State *l, json_decoder_t *dec, int finish)
+{
+    const char *data;
+    int stop, discard, ch;
+
+    lua_getfenv(l, 1);
+    lua_getfield(l, -1, "keys");
+
+    while (1) {
+        data = dec->buf.buf;
+
+        if (dec->start < 0) {
+            dec->pos = scan_whitespace(data + dec->pos,
+                                       data + dec->buf.length) - data;
+            if (dec->pos == dec->buf.length)
+                break;
+
+            ch = (unsigned char)data[dec->pos];
+            switch (dec->state) {
+            case DECODER_ARRAY_START:
+                if (ch != '[')
+                    json_decoder_error(l, dec, "array begin",
+                                       json_decoder_token_name(dec->cfg, ch));
+                dec->state = DECODER_ARRAY_FIRST;
+                dec->pos++;
+                continue;
+            case DECODER_ARRAY_FIRST:
+                if (ch == ']') {
+                    dec->state = DECODER_ARRAY_END;
+                    dec->pos++;
+                    continue;
+                }
+                break;
+            case DECODER_ARRAY_ELEMENT:
+                if (ch == ']')
+                    json_decoder_error(l, dec, "value", "T_ARR_END");
+                break;
+            case DECODER_ARRAY_NEXT:
+                if (ch == ',') {
+                    dec->state = DECODER_ARRAY_ELEMENT;
+                } else if (ch == ']') {
+                    dec->state = DECODER_ARRAY_END;
+                } else {
+                    json_decoder_error(l, dec, "comma or array end",
+                                       json_decoder_token_name(dec->cfg, ch));
+                }
+                dec->pos++;
+                continue;
+            case DECODER_ARRAY_END:
+                json_decoder_error(l, dec, "the end",
+                                   json_decoder_token_name(dec->cfg, ch));
+            default:
+                break;
+            }
+
+            /* Start a new value */
+            dec->start = dec->pos++;
+            dec->depth = (ch == '{' || ch == '[');
+            dec->in_string = (ch == '"');
+        }
+
+        stop = json_decoder_scan(dec);
+        if (stop < 0) {
+            if (!finish || dec->depth || dec->in_string)
+                break;
+            stop = dec->buf.length;
+        }
+
+        json_decoder_parse(l, dec, dec->start, stop);
+        dec->start = -1;
+        dec->pos = stop;
+        if (dec->state == DECODER_ARRAY_FIRST ||
+            dec->state == DECODER_ARRAY_ELEMENT)
+            dec->state = DECODER_ARRAY_NEXT;
+    }
+
+    lua_pop(l, 2);
+
+    /* Discard the decoded input */
+    discard = dec->start < 0 ? dec->pos : dec->start;
+    if (discard > 0) {
+        memmove(dec->buf.buf, dec->buf.buf + discard,
+                dec->buf.length - discard);
+        dec->buf.length -= discard;
+        dec->pos -= discard;
+        if (dec->start >= 0)
+            dec->start -= discard;
+        dec->offset += discard;
+    }
+    if (!dec->buf.length && dec->buf.size > JSON_DECODER_KEEP_SIZE) {
+        strbuf_free(&dec->buf);
+        strbuf_init(&dec->buf, 0);
+    }
+    if (dec->tmp.size > JSON_DECODER_KEEP_SIZE) {
+        strbuf_free(&dec->tmp);
+        strbuf_init(&dec->tmp, 0);
+    }
+}
+
+/* Passes queued values to the callback, if any. Returns the number of
+ * values decoded by this call. */
+static int json_decoder_deliver(lua_State *l, json_decoder_t *dec, int tail)
+{
+    int count = dec->tail - tail;
+
+    lua_getfenv(l, 1);
+    lua_getfield(l, -1, "callback");
+    if (!lua_isnil(l, -1)) {
+        while (dec->head < dec->tail) {
+            lua_pushvalue(l, -1);
+            lua_rawgeti(l, -3, ++dec->head);
+            lua_pushnil(l);
+            lua_rawseti(l, -5, dec->head);
+            lua_call(l, 1, 0);
+        }
+        dec->head = dec->tail = 0;
+    }
+    lua_pop(l, 2);
+
+    lua_pushinteger(l, count);
+
+    return 1;
+}
+
+static void json_decoder_check_state(lua_State *l, json_decoder_t *dec)
+{
+    if (dec->state == DECODER_FAILED)
+        luaL_error(l, "JSON decoder failed on previous input");
+    if (dec->state == DECODER_FINISHED)
+        luaL_error(l, "JSON decoder has already finished");
+}
+
+/* decoder:feed(chunk)
+ * Appends chunk to the input and decodes every value completed by it */
+static int json_decoder_feed(lua_State *l)
+{
+    json_decoder_t *dec = json_check_decoder(l);
+    const char *chunk;
+    size_t len;
+    int tail = dec->tail;
+
+    chunk = luaL_checklstring(l, 2, &len);
+    json_decoder_check_state(l, dec);
+
+    strbuf_append_mem(&dec->buf, chunk, len);
+    json_decoder_process(l, dec, 0);
+
+    return json_decoder_deliver(l, dec, tail);
+}
+
+/* decoder:finish()
+ * Decodes the remaining input, which must end with a complete value */
+static int json_decoder_finish(lua_State *l)
+{
+    json_decoder_t *dec = json_check_decoder(l);
+    int tail = dec->tail;
+
+    json_decoder_check_state(l, dec);
+    json_decoder_process(l, dec, 1);
+
+    if (dec->start >= 0)
+        json_decoder_error(l, dec, "the end of the value", "T_END");
+    if (dec->state == DECODER_ARRAY_START)
+        json_decoder_error(l, dec, "array begin", "T_END");
+    if (dec->state != DECODER_VALUES && dec->state != DECODER_ARRAY_END)
+        json_decoder_error(l, dec, "array end", "T_END");
+
+    dec->state = DECODER_FINISHED;
+
+    return json_decoder_deliver(l, dec, tail);
+}
+
+/* decoder:next()
+ * Returns the next queued value, or nothing */
+static int json_decoder_next(lua_State *l)
+{
+    json_decoder_t *dec = json_check_decoder(l);
+
+    if (dec->head == dec->tail)
+        return 0;
+
+    lua_getfenv(l, 1);
+    lua_rawgeti(l, -1, ++dec->head);
+    lua_pushnil(l);
+    lua_rawseti(l, -3, dec->head);
+    if (dec->head == dec->tail)
+        dec->head = dec->tail = 0;
+
+    return 1;
+}
+
+static int json_decoder_gc(lua_State *l)
+{
+    json_decoder_t *dec = json_check_decoder(l);
+
+    strbuf_free(&dec->buf);
+    strbuf_free(&dec->tmp);
+
+    return 0;
+}
+
+/* cjson.decoder([mode[, callback]])
+ * mode: "values" (default) or "array" */
+static int json_decoder_new(lua_State *l)
+{
+    static const char *modes[] = { "values", "array", NULL };
+    json_config_t *cfg = json_arg_init(l, 2);
+    json_decoder_t *dec;
+    int mode;
+
+    mode = luaL_checkoption(l, 1, "values", modes);
+    if (!lua_isnil(l, 2))
+        luaL_checktype(l, 2, LUA_TFUNCTION);
+
+    dec = lua_newuserdata(l, sizeof(*dec));
+    dec->cfg = cfg;
+    dec->state = mode ? DECODER_ARRAY_START : DECODER_VALUES;
+    dec->pos = 0;
+    dec->start = -1;
+    dec->depth = 0;
+    dec->in_string = 0;
+    dec->offset = 0;
+    dec->head = dec->tail = 0;
+    json_shape_init(&dec->shape);
+    strbuf_init(&dec->buf, 0);
+    strbuf_init(&dec->tmp, 0);
+
+    luaL_getmetatable(l, JSON_DECODER_META);
+    lua_setmetatable(l, -2);
+
+    /* The environment holds the queue, the callback, the key cache and
+     * the configuration used */
+    lua_newtable(l);
+    lua_createtable(l, KEY_CACHE_SIZE, 0);
+    lua_setfield(l, -2, "keys");
+    lua_pushvalue(l, 2);
+    lua_setfield(l, -2, "callback");
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_setfield(l, -2, "config");
+    lua_setfenv(l, -2);
+
+    return 1;
+}
+
 /* ===== INITIALISATION ===== */
 
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
@@ -1327,11 +1859,34 @@ static void luaL_setfuncs (lua_State *l, const luaL_Reg *reg, int nup)
 }
 #endif
 
+static void json_create_decoder_meta(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "feed", json_decoder_feed },
+        { "finish", json_decoder_finish },
+        { "next", json_decoder_next },
+        { NULL, NULL }
+    };
+
+    if (!luaL_newmetatable(l, JSON_DECODER_META)) {
+        lua_pop(l, 1);
+        return;
+    }
+
+    lua_newtable(l);
+    luaL_setfuncs(l, reg, 0);
+    lua_setfield(l, -2, "__index");
+    lua_pushcfunction(l, json_decoder_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_pop(l, 1);
+}
+
 static int lua_cjson_new(lua_State *l)
 {
     luaL_Reg reg[] = {
         { "encode", json_encode },
         { "decode", json_decode },
+        { "decoder", json_decoder_new },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
         { "encode_max_depth", json_cfg_encode_max_depth },
         { "decode_max_depth", json_cfg_decode_max_depth },
@@ -1346,6 +1901,12 @@ static int lua_cjson_new(lua_State *l)
     /* Initialise number conversions */
     fpconv_init();
 
+    /* Select the string scanners for this CPU */
+    scan_init();
+
+    /* Methods shared by all stream decoders */
+    json_create_decoder_meta(l);
+
     /* cjson module table */
     lua_newtable(l);
 
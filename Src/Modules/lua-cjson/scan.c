@@ -0,0 +1,294 @@
+/* scan - Vectorised scanning routines for Lua CJSON
+ *
+ * Copyright (c) 2010-2012  Mark Pulford <mark@kyne.com.au>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Strings and whitespace are scanned 16 (SSE2) or 32 (AVX2) bytes at a
+ * time on x86. SSE2 is always available on x86-64 and is used when the
+ * compiler enables it on 32 bit x86. AVX2 is detected at runtime with
+ * GCC/Clang. Define DISABLE_SIMD to always use the plain C scanners. */
+
+#include "scan.h"
+
+#if !defined(DISABLE_SIMD) && \
+    (defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define SCAN_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static __inline int scan_ctz(unsigned int mask)
+{
+    unsigned long index;
+
+    _BitScanForward(&index, mask);
+    return (int)index;
+}
+#elif defined(__GNUC__)
+#define scan_ctz(mask) __builtin_ctz(mask)
+#else
+static int scan_ctz(unsigned int mask)
+{
+    int n = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
+/* Byte classes used by the plain C scanners */
+#define SC_STRING       1   /* '"', '\\', NUL */
+#define SC_ESCAPE       2   /* Needs escaping when encoding */
+#define SC_WHITESPACE   4
+
+static unsigned char scan_class[256];
+
+/* ===== PLAIN C ===== */
+
+static const char *scan_string_c(const char *p, const char *end)
+{
+    while (p < end && !(scan_class[(unsigned char)*p] & SC_STRING))
+        p++;
+    return p;
+}
+
+static const char *scan_escape_c(const char *p, const char *end)
+{
+    while (p < end && !(scan_class[(unsigned char)*p] & SC_ESCAPE))
+        p++;
+    return p;
+}
+
+static const char *scan_whitespace_c(const char *p, const char *end)
+{
+    while (p < end && (scan_class[(unsigned char)*p] & SC_WHITESPACE))
+        p++;
+    return p;
+}
+
+/* ===== SSE2 ===== */
+
+#ifdef SCAN_SSE2
+
+static const char *scan_string_sse2(const char *p, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote),
+                                              _mm_cmpeq_epi8(x, bslash)),
+                                 _mm_cmpeq_epi8(x, zero));
+        int mask = _mm_movemask_epi8(m);
+
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 16;
+    }
+    return scan_string_c(p, end);
+}
+
+static const char *scan_escape_sse2(const char *p, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        /* Unsigned x <= 0x1f: max(x, 0x1f) == 0x1f */
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl);
+        int mask;
+
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, bslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, slash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, del));
+        mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 16;
+    }
+    return scan_escape_c(p, end);
+}
+
+static const char *scan_whitespace_sse2(const char *p, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    /* Most whitespace runs between tokens are short */
+    if (p < end && !(scan_class[(unsigned char)*p] & SC_WHITESPACE))
+        return p;
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, space),
+                                              _mm_cmpeq_epi8(x, tab)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(x, lf),
+                                              _mm_cmpeq_epi8(x, cr)));
+        int mask = ~_mm_movemask_epi8(m) & 0xffff;
+
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 16;
+    }
+    return scan_whitespace_c(p, end);
+}
+
+#endif
+
+/* ===== AVX2 ===== */
+
+#ifdef SCAN_AVX2
+
+__attribute__((target("avx2")))
+static const char *scan_string_avx2(const char *p, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, quote),
+                                                    _mm256_cmpeq_epi8(x, bslash)),
+                                    _mm256_cmpeq_epi8(x, zero));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 32;
+    }
+    return scan_string_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_escape_avx2(const char *p, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(x, ctrl), ctrl);
+        unsigned int mask;
+
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, quote));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, bslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, slash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, del));
+        mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 32;
+    }
+    return scan_escape_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_whitespace_avx2(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+
+    if (p < end && !(scan_class[(unsigned char)*p] & SC_WHITESPACE))
+        return p;
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, space),
+                                                    _mm256_cmpeq_epi8(x, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(x, lf),
+                                                    _mm256_cmpeq_epi8(x, cr)));
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(m);
+
+        if (mask)
+            return p + scan_ctz(mask);
+        p += 32;
+    }
+    return scan_whitespace_sse2(p, end);
+}
+
+#endif
+
+/* ===== INITIALISATION ===== */
+
+const char *(*scan_string)(const char *p, const char *end) = scan_string_c;
+const char *(*scan_escape)(const char *p, const char *end) = scan_escape_c;
+const char *(*scan_whitespace)(const char *p, const char *end) = scan_whitespace_c;
+
+/* Safe to call more than once, the result is always the same */
+void scan_init()
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (i < 0x20 || i == '"' || i == '\\' || i == '/' || i == 0x7f)
+            scan_class[i] |= SC_ESCAPE;
+    }
+    scan_class['"'] |= SC_STRING;
+    scan_class['\\'] |= SC_STRING;
+    scan_class[0] |= SC_STRING;
+    scan_class[' '] |= SC_WHITESPACE;
+    scan_class['\t'] |= SC_WHITESPACE;
+    scan_class['\n'] |= SC_WHITESPACE;
+    scan_class['\r'] |= SC_WHITESPACE;
+
+#ifdef SCAN_SSE2
+    scan_string = scan_string_sse2;
+    scan_escape = scan_escape_sse2;
+    scan_whitespace = scan_whitespace_sse2;
+#endif
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_string = scan_string_avx2;
+        scan_escape = scan_escape_avx2;
+        scan_whitespace = scan_whitespace_avx2;
+    }
+#endif
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
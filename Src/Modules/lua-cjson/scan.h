@@ -0,0 +1,23 @@
+/* Lua CJSON vectorised scanning routines
+ *
+ * Each scanner returns a pointer to the first byte in [p, end) it stops
+ * at, or end when there is none. The best implementation for the running
+ * CPU (AVX2, SSE2 or plain C) is selected by scan_init().
+ *
+ * Scanners may read up to end, never past it. */
+
+/* First '"', '\\' or NUL: the end of a run of plain string characters
+ * when decoding. */
+extern const char *(*scan_string)(const char *p, const char *end);
+
+/* First byte requiring an escape sequence when encoding a string: control
+ * characters, '"', '\\', '/' and DEL. */
+extern const char *(*scan_escape)(const char *p, const char *end);
+
+/* First byte that is not JSON whitespace (space, tab, CR or LF). */
+extern const char *(*scan_whitespace)(const char *p, const char *end);
+
+extern void scan_init();
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -9,6 +9,10 @@
 
 local json_module = os.getenv("JSON_MODULE") or "cjson"
 
+-- When set, each file is repeated into a JSON array of roughly this many
+-- megabytes to measure large documents (eg, JSON_SIZE=4).
+local json_size = tonumber(os.getenv("JSON_SIZE"))
+
 require "socket"
 local json = require(json_module)
 local util = require "cjson.util"
@@ -98,6 +102,14 @@ end
 
 function bench_file(filename)
     local data_json = util.file_load(filename)
+    if json_size then
+        local count = math.ceil(json_size * 1024 * 1024 / #data_json)
+        local items = {}
+        for i = 1, count do
+            items[i] = data_json
+        end
+        data_json = "[" .. table.concat(items, ",") .. "]"
+    end
     local data_obj = json_decode(data_json)
 
     local function test_encode()
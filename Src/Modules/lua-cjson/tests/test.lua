@@ -73,6 +73,13 @@ function load_testdata()
     end
     data.deeply_nested_data = big
 
+    -- Stream decoders for error tests
+    data.array_decoder = json.decoder("array")
+    data.unterminated_decoder = json.decoder("array")
+    data.unterminated_decoder:feed("[ 1, 2 ")
+    data.values_decoder = json.decoder()
+    data.values_decoder:feed("[1] ")
+
     return data
 end
 
@@ -82,6 +89,19 @@ function test_decode_cycle(filename)
     return util.compare_values(obj1, obj2)
 end
 
+-- Feeds text to a stream decoder in chunks of the given size
+function test_stream_decode(mode, text, size)
+    local values = {}
+    local decoder = json.decoder(mode, function (value)
+        values[#values + 1] = value
+    end)
+    for i = 1, #text, size do
+        decoder:feed(text:sub(i, i + size - 1))
+    end
+    decoder:finish()
+    return values
+end
+
 -- Set up data used in tests
 local Inf = math.huge;
 local NaN = math.huge * 0;
@@ -100,6 +120,9 @@ local cjson_tests = {
     { "Decode numbers",
       json.decode, { '[ 0.0, -5e3, -1, 0.3e-3, 1023.2, 0e10 ]' },
       true, { { 0.0, -5000, -1, 0.0003, 1023.2, 0 } } },
+    { "Decode numbers requiring strtod()",
+      json.decode, { '[ 1e23, 12345678901234567890, 1.5e-22, 2.2250738585072014e-308 ]' },
+      true, { { 1e23, 12345678901234567890, 1.5e-22, 2.2250738585072014e-308 } } },
     { "Decode null",
       json.decode, { 'null' }, true, { json.null } },
     { "Decode true",
@@ -115,6 +138,9 @@ local cjson_tests = {
     { "Decode array",
       json.decode, { '[ "one", null, "three" ]' },
       true, { { "one", json.null, "three" } } },
+    { "Decode array of objects with changing keys",
+      json.decode, { '[ { "a": 1, "b": 2 }, { "a": 3, "bb": 4 }, { "": 5, "b": [ 6, 7, 8 ] }, { "b": [] } ]' },
+      true, { { { a = 1, b = 2 }, { a = 3, bb = 4 }, { [""] = 5, b = { 6, 7, 8 } }, { b = {} } } } },
 
     -- Test decoding errors
     { "Decode UTF-16BE [throw error]",
@@ -349,8 +375,14 @@ local cjson_tests = {
       json.encode_number_precision, { 3 }, true, { 3 } },
     { "Encode number with precision 3",
       json.encode, { 1/3 }, true, { "0.333" } },
+    { "Encode numbers with precision 3",
+      json.encode, { { 1234, 0.5, 100, -0.0125 } },
+      true, { "[1.23e+03,0.5,100,-0.0125]" } },
     { "Set encode_number_precision(14)",
       json.encode_number_precision, { 14 }, true, { 14 } },
+    { "Encode numbers with precision 14",
+      json.encode, { { 0.1, -2.5, 1e-05, 1e+15, 123456789012345, 1e300, 1/3, 5e-324 } },
+      true, { "[0.1,-2.5,1e-05,1e+15,1.2345678901234e+14,1e+300,0.33333333333333,4.9406564584125e-324]" } },
     { "Set encode_keep_buffer(true)",
       json.encode_keep_buffer, { true }, true, { true } },
 
@@ -381,6 +413,32 @@ local cjson_tests = {
       json.encode_sparse_array, { "not quite on" },
       false, { "bad argument #1 to '?' (invalid option 'not quite on')" } },
 
+    -- Test stream decoding
+    { "Stream decode array elements",
+      test_stream_decode, { "array", '[ 1, "a\\"b", { "c": [ true ] }, null ]', 1 },
+      true, { { 1, 'a"b', { c = { true } }, json.null } } },
+    { "Stream decode values",
+      test_stream_decode, { nil, '{ "a": 1 }\n[ 2 ]\n"x" 3\n', 3 },
+      true, { { { a = 1 }, { 2 }, "x", 3 } } },
+    { "Stream decode queued values",
+      function ()
+          local decoder = json.decoder()
+          local count = decoder:feed('[1] [2')
+          return count, decoder:next()[1], decoder:next()
+      end, { }, true, { 1, 1 } },
+    { "Stream decode missing comma [throw error]",
+      testdata.array_decoder.feed, { testdata.array_decoder, '[ 1 2 ]' },
+      false, { "Expected comma or array end but found T_NUMBER at character 5" } },
+    { "Stream decode error position in a later value [throw error]",
+      testdata.values_decoder.feed, { testdata.values_decoder, '{"a" 1}' },
+      false, { "Expected colon but found T_NUMBER at character 10" } },
+    { "Stream decode after error [throw error]",
+      testdata.array_decoder.feed, { testdata.array_decoder, ']' },
+      false, { "JSON decoder failed on previous input" } },
+    { "Stream decode unterminated array [throw error]",
+      testdata.unterminated_decoder.finish, { testdata.unterminated_decoder },
+      false, { "Expected array end but found T_END at character 8" } },
+
     { "Reset Lua CJSON configuration", function () json = json.new() end },
     -- Wrap in a function to ensure the table returned by json.new() is used
     { "Check encode_sparse_array()",
@@ -144,6 +144,18 @@ check_MediaContent(msg1)
 bench.memtest("decode Media", 100, decode_new_msg, MediaContent, bin)
 bench.speedtest("decode Media", loop, decode_new_msg, MediaContent, bin)
 
+print("Memory usage:", collectgarbage"count")
+
+-- sub-messages may be decoded on first use, so also time reading them.
+print("------------ decode and check benchmark.")
+local function decode_check_msg(create, data)
+	local msg = create()
+	msg:Parse(data)
+	check_MediaContent(msg)
+end
+bench.memtest("decode and check Media", 100, decode_check_msg, MediaContent, bin)
+bench.speedtest("decode and check Media", loop, decode_check_msg, MediaContent, bin)
+
 print("Memory usage:", collectgarbage"count")
 --]]
 
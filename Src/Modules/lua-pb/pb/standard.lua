@@ -24,6 +24,7 @@ local type = type
 local sformat = string.format
 local tsort = table.sort
 local setmetatable = setmetatable
+local pcall = pcall
 
 local mod_name = ...
 local mod_path = string.match(mod_name,".*%.") or ''
@@ -33,6 +34,9 @@ local funpack = require(mod_name .. ".unpack")
 
 local fdump = require(mod_name .. ".dump")
 
+-- optional C codec for the binary format.
+local has_codec, fcodec = pcall(require, mod_name .. ".codec")
+
 local message = require(mod_name .. ".message")
 local def_message, new_message, compile_message = message.def, message.new, message.compile
 
@@ -42,13 +46,22 @@ local copy = utils.copy
 local handlers = require(mod_path .. "handlers")
 local new_handlers = handlers.new
 
+local unknown = require(mod_name .. ".unknown")
+
+local encode_binary, decode_binary = fpack.register_msg, funpack.register_msg
+if has_codec then
+	-- the codec leaves unknown fields to the Lua code.
+	fcodec.unknown(funpack.unpack_unknown_field, fpack.encode_unknown_fields, unknown.new)
+	encode_binary, decode_binary = fcodec.encoder, fcodec.decoder
+end
+
 local default_handler_list = {
 encode = {
-binary = fpack.register_msg,
+binary = encode_binary,
 text = fdump.register_msg,
 },
 decode = {
-binary = funpack.register_msg,
+binary = decode_binary,
 },
 }
 
@@ -0,0 +1,1099 @@
+/*
+** C codec for the binary format of the standard backend
+**
+** The fields of a message type (as set up by pb/standard/message.lua) are
+** compiled once into a table of fields, with their wire types and
+** encoded tags, and messages are encoded and decoded by walking that
+** table. Lua values the fields need (names, defaults, enum values,
+** metatables and the tables of sub-messages) are kept in the environment
+** of the compiled type.
+**
+** Sub-messages are decoded lazily: the decoder keeps their bytes in the
+** '.raw' field of a message without '.data', which message.lua decodes
+** on first access, and the encoder copies those bytes back as they are
+** while the message is unchanged. Packed repeated fields are decoded
+** straight into their arrays. Unknown fields are handed to the Lua code
+** in unpack.lua and pack.lua.
+**
+** Copyright (c) 2011, Robert G. Jakabosky <bobby@sharedrealm.com> All rights reserved.
+*/
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#if defined(_MSC_VER)
+typedef __int32 pb_int32;
+typedef unsigned __int32 pb_uint32;
+typedef __int64 pb_int64;
+typedef unsigned __int64 pb_uint64;
+#else
+#include <stdint.h>
+typedef int32_t pb_int32;
+typedef uint32_t pb_uint32;
+typedef int64_t pb_int64;
+typedef uint64_t pb_uint64;
+#endif
+
+/* wire types */
+#define WIRE_VARINT  0
+#define WIRE_64BIT   1
+#define WIRE_LEN     2
+#define WIRE_START   3
+#define WIRE_END     4
+#define WIRE_32BIT   5
+
+/* field types */
+enum {
+  FT_DOUBLE, FT_FLOAT, FT_INT64, FT_UINT64, FT_INT32, FT_UINT32,
+  FT_SINT32, FT_SINT64, FT_FIXED64, FT_FIXED32, FT_SFIXED64, FT_SFIXED32,
+  FT_BOOL, FT_STRING, FT_ENUM, FT_MESSAGE, FT_GROUP
+};
+
+static const struct {
+  const char *name;
+  int type;
+  int wire;
+} basictypes[] = {
+  {"double", FT_DOUBLE, WIRE_64BIT},
+  {"float", FT_FLOAT, WIRE_32BIT},
+  {"int64", FT_INT64, WIRE_VARINT},
+  {"uint64", FT_UINT64, WIRE_VARINT},
+  {"int32", FT_INT32, WIRE_VARINT},
+  {"uint32", FT_UINT32, WIRE_VARINT},
+  {"sint32", FT_SINT32, WIRE_VARINT},
+  {"sint64", FT_SINT64, WIRE_VARINT},
+  {"fixed64", FT_FIXED64, WIRE_64BIT},
+  {"fixed32", FT_FIXED32, WIRE_32BIT},
+  {"sfixed64", FT_SFIXED64, WIRE_64BIT},
+  {"sfixed32", FT_SFIXED32, WIRE_32BIT},
+  {"bool", FT_BOOL, WIRE_VARINT},
+  {"string", FT_STRING, WIRE_LEN},
+  {"bytes", FT_STRING, WIRE_LEN},
+  {NULL, 0, 0}
+};
+
+/* Lua values of field 'i', in the environment of its message type */
+#define NSLOTS      5
+#define S_NAME      1
+#define S_DEFAULT   2
+#define S_TYPE      3  /* values of an enum, compiled type of a message */
+#define S_MT        4  /* metatable of a message or group */
+#define S_ARRAY     5  /* metatable of the array of a repeated field */
+#define SLOT(i,s)   ((i) * NSLOTS + (s))
+
+/* message type name, for errors */
+#define S_TYPENAME  0
+
+/* entries of the table shared by the library functions */
+#define SH_BUFFER          0
+#define SH_DECODE_UNKNOWN  1
+#define SH_ENCODE_UNKNOWN  2
+#define SH_NEW_UNKNOWN     3
+
+/* fields with tags up to this are found by indexing */
+#define DIRECTMAX   1023
+
+/* nesting of groups and merged messages, and of messages being encoded */
+#define MAXDEPTH    100
+
+#define BUFFER_META "pb.standard.codec buffer"
+#define BUFFER_MIN  256
+#define BUFFER_KEEP (64 * 1024)  /* larger buffers are freed after use */
+
+typedef struct Field {
+  int tag;
+  unsigned char type;
+  unsigned char wire;  /* wire type of one value */
+  unsigned char repeated;
+  unsigned char packed;
+  unsigned char hasdefault;
+  unsigned char keylen;
+  char key[6];  /* tag and wire type, as encoded */
+} Field;
+
+typedef struct Desc {
+  int nfields;
+  int maxtag;  /* last tag in 'bytag' */
+  unsigned short *bytag;  /* index + 1 of the field of each tag, or 0 */
+  Field fields[1];
+} Desc;
+
+typedef struct Buffer {
+  char *b;
+  size_t n;
+  size_t size;
+} Buffer;
+
+typedef struct Encoder {
+  lua_State *L;
+  Buffer *b;
+  int shared;
+  int depth;
+} Encoder;
+
+typedef struct Decoder {
+  lua_State *L;
+  const char *s;  /* the string being decoded */
+  size_t len;
+  int str;  /* its stack index */
+  int shared;
+  int depth;
+} Decoder;
+
+
+/*
+** {======================================================
+** Compiling message types
+** =======================================================
+*/
+
+static int putvarint (char *p, pb_uint64 v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (char)((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+
+static const Desc *getdesc (lua_State *L, int shared, int mt);
+
+
+static void compilefield (lua_State *L, int shared, int fields, int i,
+                          Desc *d, int env) {
+  Field *f = &d->fields[i];
+  int fld, wire;
+  lua_rawgeti(L, fields, i + 1);
+  fld = lua_gettop(L);
+  lua_getfield(L, fld, "name");
+  lua_rawseti(L, env, SLOT(i, S_NAME));
+  lua_getfield(L, fld, "tag");
+  f->tag = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (f->tag <= 0 || f->tag >= (1 << 29))
+    luaL_error(L, "invalid tag for field %d of message type", i + 1);
+  lua_getfield(L, fld, "default");
+  f->hasdefault = !lua_isnil(L, -1);
+  lua_rawseti(L, env, SLOT(i, S_DEFAULT));
+  lua_getfield(L, fld, "is_repeated");
+  f->repeated = (unsigned char)lua_toboolean(L, -1);
+  lua_getfield(L, fld, "is_packed");
+  f->packed = (unsigned char)lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  lua_getfield(L, fld, "user_type_mt");
+  if (lua_istable(L, -1)) {
+    int umt = lua_gettop(L);
+    lua_getfield(L, umt, "is_enum");
+    if (lua_toboolean(L, -1)) {
+      f->type = FT_ENUM;
+      f->wire = WIRE_VARINT;
+      lua_getfield(L, umt, "values");
+      lua_rawseti(L, env, SLOT(i, S_TYPE));
+    }
+    else {
+      lua_getfield(L, fld, "is_group");
+      if (lua_toboolean(L, -1)) {
+        f->type = FT_GROUP;
+        f->wire = WIRE_START;
+      }
+      else {
+        f->type = FT_MESSAGE;
+        f->wire = WIRE_LEN;
+      }
+      lua_pop(L, 1);
+      getdesc(L, shared, umt);
+      lua_rawseti(L, env, SLOT(i, S_TYPE));
+      lua_pushvalue(L, umt);
+      lua_rawseti(L, env, SLOT(i, S_MT));
+    }
+    lua_pop(L, 1);
+  }
+  else {
+    const char *ftype;
+    int t;
+    lua_getfield(L, fld, "ftype");
+    ftype = lua_tostring(L, -1);
+    for (t = 0; basictypes[t].name != NULL; t++)
+      if (ftype != NULL && strcmp(ftype, basictypes[t].name) == 0) break;
+    if (basictypes[t].name == NULL) {
+      lua_rawgeti(L, env, SLOT(i, S_NAME));
+      luaL_error(L, "unresolved type '%s' of field '%s'",
+                 ftype ? ftype : "?", lua_tostring(L, -1));
+    }
+    f->type = (unsigned char)basictypes[t].type;
+    f->wire = (unsigned char)basictypes[t].wire;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);  /* user_type_mt */
+  if (f->repeated) {
+    lua_getfield(L, fld, "new");
+    if (!lua_istable(L, -1))
+      luaL_error(L, "message type was not compiled");
+    lua_rawseti(L, env, SLOT(i, S_ARRAY));
+  }
+  /* only numbers can be packed */
+  if (f->wire == WIRE_LEN || f->wire == WIRE_START) f->packed = 0;
+  wire = f->packed ? WIRE_LEN : f->wire;
+  f->keylen = (unsigned char)putvarint(f->key,
+                                       ((pb_uint64)f->tag << 3) | wire);
+  if (f->tag <= d->maxtag && d->bytag[f->tag] == 0)
+    d->bytag[f->tag] = (unsigned short)(i + 1);
+  lua_pop(L, 1);  /* field */
+}
+
+
+/*
+** Pushes the compiled type of the message or group with metatable 'mt',
+** compiling it the first time. Types are registered before their fields
+** are compiled, so recursive types find themselves.
+*/
+static const Desc *getdesc (lua_State *L, int shared, int mt) {
+  Desc *d;
+  int fields, env, n, i, maxtag = 0;
+  lua_pushvalue(L, mt);
+  lua_rawget(L, shared);
+  if (lua_isuserdata(L, -1))
+    return (const Desc *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, 10, "message types nested too deep");
+  lua_getfield(L, mt, "fields");
+  if (!lua_istable(L, -1))
+    luaL_error(L, "message type expected");
+  fields = lua_gettop(L);
+  n = (int)lua_objlen(L, fields);
+  if (n >= USHRT_MAX)
+    luaL_error(L, "too many fields in message type");
+  for (i = 1; i <= n; i++) {
+    int tag;
+    lua_rawgeti(L, fields, i);
+    lua_getfield(L, -1, "tag");
+    tag = (int)lua_tointeger(L, -1);
+    if (tag > maxtag) maxtag = tag;
+    lua_pop(L, 2);
+  }
+  if (maxtag > DIRECTMAX) maxtag = DIRECTMAX;
+  d = (Desc *)lua_newuserdata(L, sizeof(Desc) + n * sizeof(Field) +
+                                 (maxtag + 1) * sizeof(unsigned short));
+  d->nfields = 0;
+  d->maxtag = maxtag;
+  d->bytag = (unsigned short *)&d->fields[n];
+  memset(d->bytag, 0, (maxtag + 1) * sizeof(unsigned short));
+  lua_createtable(L, n * NSLOTS + 1, 0);
+  env = lua_gettop(L);
+  lua_getfield(L, mt, "name");
+  lua_rawseti(L, env, S_TYPENAME);
+  lua_pushvalue(L, env);
+  lua_setfenv(L, env - 1);
+  lua_pushvalue(L, mt);
+  lua_pushvalue(L, env - 1);
+  lua_rawset(L, shared);
+  for (i = 0; i < n; i++) {
+    compilefield(L, shared, fields, i, d, env);
+    d->nfields = i + 1;
+  }
+  lua_pop(L, 1);  /* env */
+  lua_replace(L, fields);
+  return d;
+}
+
+
+/* pushes the compiled type of field 'i' and its environment */
+static const Desc *getsub (lua_State *L, int env, int i) {
+  const Desc *d;
+  lua_rawgeti(L, env, SLOT(i, S_TYPE));
+  d = (const Desc *)lua_touserdata(L, -1);
+  lua_getfenv(L, -1);
+  return d;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Encoding
+** =======================================================
+*/
+
+static void growbuffer (lua_State *L, Buffer *b, size_t n) {
+  size_t size = (b->size > 0) ? b->size : BUFFER_MIN;
+  char *nb;
+  while (size < b->n + n) size *= 2;
+  nb = (char *)realloc(b->b, size);
+  if (nb == NULL)
+    luaL_error(L, "not enough memory");
+  b->b = nb;
+  b->size = size;
+}
+
+#define reserve(E,sz) \
+  ((E)->b->n + (sz) <= (E)->b->size ? (void)0 : \
+                                      growbuffer((E)->L, (E)->b, sz))
+
+
+static void addbytes (Encoder *E, const char *s, size_t l) {
+  reserve(E, l);
+  memcpy(E->b->b + E->b->n, s, l);
+  E->b->n += l;
+}
+
+
+static void addvarint (Encoder *E, pb_uint64 v) {
+  reserve(E, 10);
+  E->b->n += putvarint(E->b->b + E->b->n, v);
+}
+
+
+static void addfixed (Encoder *E, pb_uint64 v, int size) {
+  char *p;
+  int i;
+  reserve(E, size);
+  p = E->b->b + E->b->n;
+  for (i = 0; i < size; i++) {  /* little endian */
+    p[i] = (char)(v & 0xFF);
+    v >>= 8;
+  }
+  E->b->n += size;
+}
+
+
+/* reserves a byte for a length and returns where the data starts */
+static size_t beginlen (Encoder *E) {
+  reserve(E, 1);
+  return ++E->b->n;
+}
+
+
+/* writes the length of the data from 'start' on, moving it if needed */
+static void endlen (Encoder *E, size_t start) {
+  size_t len = E->b->n - start;
+  char tmp[10];
+  int n = putvarint(tmp, len);
+  if (n > 1) {
+    reserve(E, n - 1);
+    memmove(E->b->b + start + n - 1, E->b->b + start, len);
+    E->b->n += n - 1;
+  }
+  memcpy(E->b->b + start - 1, tmp, n);
+}
+
+
+static void fielderror (lua_State *L, int env, int i, const char *expected,
+                        int idx) {
+  const char *got = luaL_typename(L, idx);
+  lua_rawgeti(L, env, SLOT(i, S_NAME));
+  luaL_error(L, "bad value for field '%s' (%s expected, got %s)",
+             lua_tostring(L, -1), expected, got);
+}
+
+
+static lua_Number checknumber (lua_State *L, int env, int i, int idx) {
+  lua_Number n = lua_tonumber(L, idx);
+  if (n == 0 && !lua_isnumber(L, idx))
+    fielderror(L, env, i, "number", idx);
+  return n;
+}
+
+
+static pb_uint64 tobits (lua_Number n) {
+  return (n < 0) ? (pb_uint64)(pb_int64)n : (pb_uint64)n;
+}
+
+
+/* encodes the value at 'idx' of field 'i', without its tag */
+static void encodevalue (Encoder *E, const Field *f, int env, int i, int idx) {
+  lua_State *L = E->L;
+  switch (f->type) {
+    case FT_DOUBLE: {
+      union { double d; pb_uint64 u; } v;
+      v.d = (double)checknumber(L, env, i, idx);
+      addfixed(E, v.u, 8);
+      break;
+    }
+    case FT_FLOAT: {
+      union { float f; pb_uint32 u; } v;
+      v.f = (float)checknumber(L, env, i, idx);
+      addfixed(E, v.u, 4);
+      break;
+    }
+    case FT_INT64: case FT_UINT64: case FT_INT32: case FT_UINT32: {
+      addvarint(E, tobits(checknumber(L, env, i, idx)));
+      break;
+    }
+    case FT_SINT32: {
+      pb_int32 n = (pb_int32)(pb_int64)checknumber(L, env, i, idx);
+      addvarint(E, ((pb_uint32)n << 1) ^ (pb_uint32)(n >> 31));
+      break;
+    }
+    case FT_SINT64: {
+      pb_int64 n = (pb_int64)checknumber(L, env, i, idx);
+      addvarint(E, ((pb_uint64)n << 1) ^ (pb_uint64)(n >> 63));
+      break;
+    }
+    case FT_FIXED64: case FT_SFIXED64: {
+      addfixed(E, tobits(checknumber(L, env, i, idx)), 8);
+      break;
+    }
+    case FT_FIXED32: case FT_SFIXED32: {
+      addfixed(E, tobits(checknumber(L, env, i, idx)), 4);
+      break;
+    }
+    case FT_BOOL: {
+      if (lua_isboolean(L, idx))
+        addvarint(E, lua_toboolean(L, idx));
+      else
+        addvarint(E, checknumber(L, env, i, idx) != 0);
+      break;
+    }
+    case FT_STRING: {
+      size_t l;
+      const char *s;
+      if (lua_type(L, idx) != LUA_TSTRING)
+        fielderror(L, env, i, "string", idx);
+      s = lua_tolstring(L, idx, &l);
+      addvarint(E, l);
+      addbytes(E, s, l);
+      break;
+    }
+    case FT_ENUM: {
+      if (lua_type(L, idx) == LUA_TNUMBER)
+        addvarint(E, tobits(lua_tonumber(L, idx)));
+      else {
+        lua_rawgeti(L, env, SLOT(i, S_TYPE));
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        if (lua_type(L, -1) != LUA_TNUMBER)
+          fielderror(L, env, i, "enum value", idx);
+        addvarint(E, tobits(lua_tonumber(L, -1)));
+        lua_pop(L, 2);
+      }
+      break;
+    }
+  }
+}
+
+
+static void encodemessage (Encoder *E, const Desc *d, int env, int msg);
+
+
+/* encodes tag and value of field 'i' (one element if repeated) */
+static void encodeone (Encoder *E, const Field *f, int env, int i, int idx) {
+  lua_State *L = E->L;
+  addbytes(E, f->key, f->keylen);
+  if (f->type == FT_MESSAGE || f->type == FT_GROUP) {
+    const Desc *sub;
+    if (!lua_istable(L, idx))
+      fielderror(L, env, i, "message", idx);
+    sub = getsub(L, env, i);
+    if (f->type == FT_MESSAGE) {
+      size_t start = beginlen(E);
+      encodemessage(E, sub, lua_gettop(L), idx);
+      endlen(E, start);
+    }
+    else {
+      encodemessage(E, sub, lua_gettop(L), idx);
+      addvarint(E, ((pb_uint64)f->tag << 3) | WIRE_END);
+    }
+    lua_pop(L, 2);
+  }
+  else
+    encodevalue(E, f, env, i, idx);
+}
+
+
+static void encodefield (Encoder *E, const Field *f, int env, int i, int idx) {
+  lua_State *L = E->L;
+  if (f->repeated) {
+    int j, n;
+    if (!lua_istable(L, idx))
+      fielderror(L, env, i, "array", idx);
+    n = (int)lua_objlen(L, idx);
+    if (f->packed) {
+      size_t start;
+      if (n == 0) return;
+      addbytes(E, f->key, f->keylen);
+      start = beginlen(E);
+      for (j = 1; j <= n; j++) {
+        lua_rawgeti(L, idx, j);
+        encodevalue(E, f, env, i, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+      endlen(E, start);
+    }
+    else {
+      for (j = 1; j <= n; j++) {
+        lua_rawgeti(L, idx, j);
+        encodeone(E, f, env, i, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+    }
+  }
+  else
+    encodeone(E, f, env, i, idx);
+}
+
+
+static void encodeunknown (Encoder *E, int data) {
+  lua_State *L = E->L;
+  lua_getfield(L, data, "unknown_fields");
+  if (lua_istable(L, -1)) {
+    size_t l;
+    const char *s;
+    lua_rawgeti(L, E->shared, SH_ENCODE_UNKNOWN);
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);
+    s = lua_tolstring(L, -1, &l);
+    if (s != NULL) addbytes(E, s, l);
+  }
+  lua_pop(L, 1);
+}
+
+
+/* encodes the fields of message 'msg', of type 'd' */
+static void encodemessage (Encoder *E, const Desc *d, int env, int msg) {
+  lua_State *L = E->L;
+  int i, data;
+  if (++E->depth > MAXDEPTH)
+    luaL_error(L, "messages nested too deep");
+  luaL_checkstack(L, 10, "messages nested too deep");
+  lua_pushliteral(L, ".data");
+  lua_rawget(L, msg);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushliteral(L, ".raw");  /* not decoded yet? */
+    lua_rawget(L, msg);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "message expected");
+    addbytes(E, lua_tostring(L, -1), lua_objlen(L, -1));
+    lua_pop(L, 1);
+    E->depth--;
+    return;
+  }
+  data = lua_gettop(L);
+  for (i = 0; i < d->nfields; i++) {
+    const Field *f = &d->fields[i];
+    lua_rawgeti(L, env, SLOT(i, S_NAME));
+    lua_rawget(L, data);
+    if (lua_toboolean(L, -1)) {
+      int isdefault = 0;
+      if (f->hasdefault) {
+        lua_rawgeti(L, env, SLOT(i, S_DEFAULT));
+        isdefault = lua_rawequal(L, -1, -2);
+        lua_pop(L, 1);
+      }
+      if (!isdefault)
+        encodefield(E, f, env, i, data + 1);
+    }
+    lua_pop(L, 1);
+  }
+  encodeunknown(E, data);
+  lua_pop(L, 1);  /* data */
+  E->depth--;
+}
+
+
+static int codec_encode (lua_State *L) {
+  const Desc *d = (const Desc *)lua_touserdata(L, lua_upvalueindex(1));
+  Encoder E;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfenv(L, lua_upvalueindex(1));  /* 2 */
+  lua_rawgeti(L, lua_upvalueindex(2), SH_BUFFER);  /* 3 */
+  E.b = (Buffer *)lua_touserdata(L, 3);
+  if (E.b == NULL) {  /* in use by an encode below us (a finalizer) */
+    E.b = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+    memset(E.b, 0, sizeof(Buffer));
+    luaL_getmetatable(L, BUFFER_META);
+    lua_setmetatable(L, -2);
+    lua_replace(L, 3);
+  }
+  else {  /* take it while encoding; an error drops it for a new one */
+    lua_pushnil(L);
+    lua_rawseti(L, lua_upvalueindex(2), SH_BUFFER);
+  }
+  E.b->n = 0;
+  E.L = L;
+  E.shared = lua_upvalueindex(2);
+  E.depth = 0;
+  encodemessage(&E, d, 2, 1);
+  lua_pushlstring(L, E.b->b, E.b->n);
+  if (E.b->size > BUFFER_KEEP) {
+    free(E.b->b);
+    E.b->b = NULL;
+    E.b->size = 0;
+  }
+  lua_pushvalue(L, 3);  /* give the buffer back */
+  lua_rawseti(L, lua_upvalueindex(2), SH_BUFFER);
+  return 1;
+}
+
+
+static int buffer_gc (lua_State *L) {
+  Buffer *b = (Buffer *)luaL_checkudata(L, 1, BUFFER_META);
+  free(b->b);
+  b->b = NULL;
+  return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Decoding
+** =======================================================
+*/
+
+static void malformed (lua_State *L) {
+  luaL_error(L, "Malformed Message, truncated");
+}
+
+
+static const char *getvarint (lua_State *L, const char *p, const char *e,
+                              pb_uint64 *v) {
+  pb_uint64 r = 0;
+  int shift = 0;
+  while (p < e && shift < 64) {
+    unsigned char c = (unsigned char)*p++;
+    r |= (pb_uint64)(c & 0x7F) << shift;
+    if (c < 0x80) {
+      *v = r;
+      return p;
+    }
+    shift += 7;
+  }
+  *v = 0;
+  malformed(L);
+  return NULL;
+}
+
+
+static pb_uint64 getfixed (const char *p, int size) {
+  pb_uint64 v = 0;
+  int i;
+  for (i = size - 1; i >= 0; i--)  /* little endian */
+    v = (v << 8) | (unsigned char)p[i];
+  return v;
+}
+
+
+static const char *getlen (lua_State *L, const char *p, const char *e,
+                           size_t *len) {
+  pb_uint64 v;
+  p = getvarint(L, p, e, &v);
+  if (v > (pb_uint64)(e - p))
+    malformed(L);
+  *len = (size_t)v;
+  return p;
+}
+
+
+/*
+** Pushes the data table of message 'msg', of type 'd'. A message not
+** decoded yet is decoded first.
+*/
+static int getdata (Decoder *D, const Desc *d, int env, int msg);
+
+static const char *decodemessage (Decoder *D, const Desc *d, int env,
+                                  int data, const char *p, const char *e,
+                                  int endtag);
+
+
+/* pushes a new message with metatable 'mt' and returns its data table */
+static int newmessage (lua_State *L, int mt) {
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, ".data");
+  lua_newtable(L);
+  lua_rawset(L, -3);
+  lua_pushvalue(L, mt);
+  lua_setmetatable(L, -2);
+  lua_pushliteral(L, ".data");
+  lua_rawget(L, -2);
+  return lua_gettop(L);
+}
+
+
+/* decodes one value of field 'i' and pushes it */
+static const char *decodevalue (Decoder *D, const Field *f, int env, int i,
+                                const char *p, const char *e) {
+  lua_State *L = D->L;
+  pb_uint64 v;
+  switch (f->wire) {
+    case WIRE_VARINT:
+      p = getvarint(L, p, e, &v);
+      break;
+    case WIRE_64BIT:
+      if (e - p < 8) malformed(L);
+      v = getfixed(p, 8);
+      p += 8;
+      break;
+    case WIRE_32BIT:
+      if (e - p < 4) malformed(L);
+      v = getfixed(p, 4);
+      p += 4;
+      break;
+    case WIRE_LEN: {
+      size_t len;
+      p = getlen(L, p, e, &len);
+      if (f->type == FT_STRING)
+        lua_pushlstring(L, p, len);
+      else {  /* message: keep its bytes until it is used */
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, ".raw");
+        lua_pushlstring(L, p, len);
+        lua_rawset(L, -3);
+        lua_rawgeti(L, env, SLOT(i, S_MT));
+        lua_setmetatable(L, -2);
+      }
+      return p + len;
+    }
+    default: {  /* group: decoded now, up to its end tag */
+      const Desc *sub;
+      int data;
+      if (++D->depth > MAXDEPTH)
+        luaL_error(L, "groups nested too deep");
+      sub = getsub(L, env, i);
+      lua_rawgeti(L, env, SLOT(i, S_MT));
+      data = newmessage(L, lua_gettop(L));
+      p = decodemessage(D, sub, data - 3, data, p, e, f->tag);
+      lua_pop(L, 1);
+      lua_replace(L, -4);
+      lua_pop(L, 2);
+      D->depth--;
+      return p;
+    }
+  }
+  switch (f->type) {
+    case FT_DOUBLE: {
+      union { double d; pb_uint64 u; } u;
+      u.u = v;
+      lua_pushnumber(L, (lua_Number)u.d);
+      break;
+    }
+    case FT_FLOAT: {
+      union { float f; pb_uint32 u; } u;
+      u.u = (pb_uint32)v;
+      lua_pushnumber(L, (lua_Number)u.f);
+      break;
+    }
+    case FT_INT64: case FT_SFIXED64:
+      lua_pushnumber(L, (lua_Number)(pb_int64)v);
+      break;
+    case FT_UINT64: case FT_FIXED64:
+      lua_pushnumber(L, (lua_Number)v);
+      break;
+    case FT_INT32: case FT_SFIXED32:
+      lua_pushnumber(L, (lua_Number)(pb_int32)(pb_uint32)v);
+      break;
+    case FT_UINT32: case FT_FIXED32:
+      lua_pushnumber(L, (lua_Number)(pb_uint32)v);
+      break;
+    case FT_SINT32: {
+      pb_uint32 u = (pb_uint32)v;
+      lua_pushnumber(L, (lua_Number)(pb_int32)((u >> 1) ^ (0 - (u & 1))));
+      break;
+    }
+    case FT_SINT64:
+      lua_pushnumber(L, (lua_Number)(pb_int64)((v >> 1) ^ (0 - (v & 1))));
+      break;
+    case FT_BOOL:  /* as numbers, like unpack.lua */
+      lua_pushnumber(L, (lua_Number)(v != 0));
+      break;
+    case FT_ENUM:
+      lua_rawgeti(L, env, SLOT(i, S_TYPE));
+      lua_rawgeti(L, -1, (int)(pb_int32)(pb_uint32)v);
+      lua_remove(L, -2);
+      break;
+  }
+  return p;
+}
+
+
+static int getarray (lua_State *L, int env, int i, int data) {
+  lua_rawgeti(L, env, SLOT(i, S_NAME));
+  lua_pushvalue(L, -1);
+  lua_rawget(L, data);
+  if (lua_istable(L, -1)) {
+    lua_remove(L, -2);
+    return lua_gettop(L);
+  }
+  lua_pop(L, 1);
+  lua_newtable(L);
+  lua_rawgeti(L, env, SLOT(i, S_ARRAY));
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_insert(L, -3);
+  lua_rawset(L, data);
+  return lua_gettop(L);
+}
+
+
+static const char *decodefield (Decoder *D, const Field *f, int env, int i,
+                                int data, const char *p, const char *e) {
+  lua_State *L = D->L;
+  if (f->repeated) {
+    int arr = getarray(L, env, i, data);
+    int n = (int)lua_objlen(L, arr);
+    p = decodevalue(D, f, env, i, p, e);
+    lua_rawseti(L, arr, n + 1);
+    lua_pop(L, 1);
+    return p;
+  }
+  lua_rawgeti(L, env, SLOT(i, S_NAME));
+  if (f->type == FT_MESSAGE) {
+    lua_pushvalue(L, -1);
+    lua_rawget(L, data);
+    if (lua_istable(L, -1)) {  /* merge into the message already there */
+      const Desc *sub;
+      int msg = lua_gettop(L);
+      size_t len;
+      if (++D->depth > MAXDEPTH)
+        luaL_error(L, "messages nested too deep");
+      p = getlen(L, p, e, &len);
+      sub = getsub(L, env, i);
+      getdata(D, sub, msg + 2, msg);
+      p = decodemessage(D, sub, msg + 2, msg + 3, p, p + len, 0);
+      lua_pop(L, 5);
+      D->depth--;
+      return p;
+    }
+    lua_pop(L, 1);
+  }
+  p = decodevalue(D, f, env, i, p, e);
+  lua_rawset(L, data);
+  return p;
+}
+
+
+/* decodes the values of a packed repeated field */
+static const char *decodepacked (Decoder *D, const Field *f, int env, int i,
+                                 int data, const char *p, const char *e) {
+  lua_State *L = D->L;
+  int arr = getarray(L, env, i, data);
+  int n = (int)lua_objlen(L, arr);
+  size_t len;
+  p = getlen(L, p, e, &len);
+  e = p + len;
+  while (p < e) {
+    p = decodevalue(D, f, env, i, p, e);
+    lua_rawseti(L, arr, ++n);
+  }
+  lua_pop(L, 1);
+  return p;
+}
+
+
+/* decodes an unknown field with the Lua code, into data.unknown_fields */
+static const char *decodeunknown (Decoder *D, int data, int tag, int wire,
+                                  const char *p, const char *e) {
+  lua_State *L = D->L;
+  lua_Integer off;
+  lua_getfield(L, data, "unknown_fields");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_rawgeti(L, D->shared, SH_NEW_UNKNOWN);
+    lua_call(L, 0, 1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, data, "unknown_fields");
+  }
+  lua_rawgeti(L, D->shared, SH_DECODE_UNKNOWN);
+  lua_pushvalue(L, D->str);
+  lua_pushinteger(L, (p - D->s) + 1);
+  lua_pushinteger(L, e - D->s);
+  lua_pushinteger(L, tag);
+  lua_pushinteger(L, wire);
+  lua_pushvalue(L, -7);
+  lua_call(L, 6, 2);
+  off = lua_tointeger(L, -1);
+  lua_pop(L, 3);
+  if (off - 1 < p - D->s || off - 1 > e - D->s)
+    malformed(L);
+  return D->s + (off - 1);
+}
+
+
+static const char *decodemessage (Decoder *D, const Desc *d, int env,
+                                  int data, const char *p, const char *e,
+                                  int endtag) {
+  lua_State *L = D->L;
+  luaL_checkstack(L, 20, "messages nested too deep");
+  while (p < e) {
+    pb_uint64 key;
+    int tag, wire;
+    const Field *f = NULL;
+    p = getvarint(L, p, e, &key);
+    if ((key >> 3) > INT_MAX)
+      luaL_error(L, "Malformed Message, invalid field tag");
+    tag = (int)(key >> 3);
+    wire = (int)(key & 7);
+    if (wire == WIRE_END) {
+      if (endtag == 0)
+        luaL_error(L, "Malformed Message, found extra 'End group' tag");
+      if (tag != endtag)
+        luaL_error(L, "Malformed Group, invalid 'End group' tag");
+      return p;
+    }
+    if (tag <= d->maxtag) {
+      if (d->bytag[tag] != 0) f = &d->fields[d->bytag[tag] - 1];
+    }
+    else {
+      int i;
+      for (i = 0; i < d->nfields; i++)
+        if (d->fields[i].tag == tag) {
+          f = &d->fields[i];
+          break;
+        }
+    }
+    if (f == NULL)
+      p = decodeunknown(D, data, tag, wire, p, e);
+    else if (wire == f->wire)
+      p = decodefield(D, f, env, (int)(f - d->fields), data, p, e);
+    else if (wire == WIRE_LEN && f->repeated &&
+             f->wire != WIRE_LEN && f->wire != WIRE_START)
+      p = decodepacked(D, f, env, (int)(f - d->fields), data, p, e);
+    else
+      luaL_error(L,
+          "Malformed Message, wire_type of field doesn't match (%d ~= %d)!",
+          f->wire, wire);
+  }
+  if (endtag != 0)
+    luaL_error(L, "Malformed Group, truncated, missing 'End group' tag");
+  return p;
+}
+
+
+static int getdata (Decoder *D, const Desc *d, int env, int msg) {
+  lua_State *L = D->L;
+  int data;
+  lua_pushliteral(L, ".data");
+  lua_rawget(L, msg);
+  if (lua_istable(L, -1))
+    return lua_gettop(L);
+  lua_pop(L, 1);
+  lua_newtable(L);
+  data = lua_gettop(L);
+  lua_pushliteral(L, ".raw");
+  lua_rawget(L, msg);
+  if (lua_type(L, -1) == LUA_TSTRING) {  /* decode it now */
+    Decoder raw;
+    size_t len;
+    raw.L = L;
+    raw.s = lua_tolstring(L, -1, &len);
+    raw.len = len;
+    raw.str = lua_gettop(L);
+    raw.shared = D->shared;
+    raw.depth = D->depth;
+    decodemessage(&raw, d, env, data, raw.s, raw.s + len, 0);
+    /* only now, so that a failed decode fails again on the next access */
+    lua_pushliteral(L, ".raw");
+    lua_pushnil(L);
+    lua_rawset(L, msg);
+  }
+  lua_pop(L, 1);
+  lua_pushliteral(L, ".data");
+  lua_pushvalue(L, data);
+  lua_rawset(L, msg);
+  return data;
+}
+
+
+static int codec_decode (lua_State *L) {
+  const Desc *d = (const Desc *)lua_touserdata(L, lua_upvalueindex(1));
+  Decoder D;
+  size_t off = (size_t)luaL_optinteger(L, 3, 1) - 1;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  D.s = luaL_checklstring(L, 2, &D.len);
+  luaL_argcheck(L, off <= D.len, 3, "offset out of data");
+  lua_settop(L, 2);
+  lua_getfenv(L, lua_upvalueindex(1));  /* 3 */
+  D.L = L;
+  D.str = 2;
+  D.shared = lua_upvalueindex(2);
+  D.depth = 0;
+  getdata(&D, d, 3, 1);  /* 4 */
+  decodemessage(&D, d, 3, 4, D.s + off, D.s + D.len, 0);
+  lua_settop(L, 1);
+  lua_pushinteger(L, (lua_Integer)D.len + 1);
+  return 2;
+}
+
+/* }====================================================== */
+
+
+/* encoder(mt): returns a function(msg) that encodes messages of type 'mt' */
+static int codec_encoder (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  getdesc(L, lua_upvalueindex(1), 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, codec_encode, 2);
+  return 1;
+}
+
+
+/*
+** decoder(mt): returns a function(msg, data, off) that decodes 'data'
+** into message 'msg', of type 'mt'
+*/
+static int codec_decoder (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  getdesc(L, lua_upvalueindex(1), 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, codec_decode, 2);
+  return 1;
+}
+
+
+/*
+** unknown(decode, encode, new): sets the Lua functions used for unknown
+** fields: decode(data, off, len, tag, wire_type, unknowns) returns the
+** value and the offset after it, encode(unknowns) returns a string and
+** new() returns an empty list of unknown fields.
+*/
+static int codec_unknown (lua_State *L) {
+  int i;
+  for (i = 1; i <= 3; i++) {
+    luaL_checktype(L, i, LUA_TFUNCTION);
+    lua_pushvalue(L, i);
+    lua_rawseti(L, lua_upvalueindex(1), i);
+  }
+  return 0;
+}
+
+
+static const luaL_Reg codec_funcs[] = {
+  {"encoder", codec_encoder},
+  {"decoder", codec_decoder},
+  {"unknown", codec_unknown},
+  {NULL, NULL}
+};
+
+
+LUALIB_API int luaopen_pb_standard_codec (lua_State *L) {
+  Buffer *b;
+  luaL_newmetatable(L, BUFFER_META);
+  lua_pushcfunction(L, buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  /* shared by all functions: compiled types by metatable, the encoding
+     buffer and the functions for unknown fields */
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  b = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+  memset(b, 0, sizeof(Buffer));
+  luaL_getmetatable(L, BUFFER_META);
+  lua_setmetatable(L, -2);
+  lua_rawseti(L, -2, SH_BUFFER);
+  luaI_openlib(L, "pb.standard.codec", codec_funcs, 1);
+  return 1;
+}
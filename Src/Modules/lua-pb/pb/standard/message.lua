@@ -5,6 +5,7 @@ local assert = assert
 local tostring = tostring
 local setmetatable = setmetatable
 local rawget = rawget
+local rawset = rawset
 
 local mod_path = string.match(...,".*%.") or ''
 
@@ -79,8 +80,27 @@ function _M.def(parent, name, ast)
 	__metatable = false,
 	}
 
+	-- get a message's field data.  Sub-messages decoded by the C codec keep
+	-- their encoded bytes in '.raw' until they are first used.
+	local function get_data(msg)
+		local data = rawget(msg, '.data')
+		if data then return data end
+		data = {}
+		local raw = rawget(msg, '.raw')
+		if raw then
+			-- decode through a stand-in, so that a failed decode leaves 'msg'
+			-- as it was and fails again on the next access.
+			mt.decode.binary(setmetatable({ ['.data'] = data }, mt), raw, 1)
+			rawset(msg, '.raw', nil)
+		end
+		rawset(msg, '.data', data)
+		return data
+	end
+
 	function mt.__index(msg, name)
-		local data = rawget(msg, '.data') -- field data.
+		local data = get_data(msg) -- field data.
+		-- raw access to the field data of a message not decoded yet.
+		if name == '.data' then return data end
 		-- get field value.
 		local value = data[name]
 		-- field is already set, just return the value
@@ -106,7 +126,7 @@ function _M.def(parent, name, ast)
 		error("Invalid field:" .. name)
 	end
 	function mt.__newindex(msg, name, value)
-		local data = rawget(msg, '.data') -- field data.
+		local data = get_data(msg) -- field data.
 		-- get field info.
 		local field = fields[name]
 		if not field then error("Invalid field:" .. name) end
@@ -118,7 +138,7 @@ function _M.def(parent, name, ast)
 		data[name] = value
 	end
 	function mt.__tostring(msg)
-		local data = rawget(msg, '.data') -- field data.
+		local data = get_data(msg) -- field data.
 		local str = tostring(data)
 		return str:gsub('table', name)
 	end
@@ -184,7 +204,7 @@ function _M.def(parent, name, ast)
 	-- common methods.
 		-- Clear()
 	function methods:Clear()
-		local data = rawget(self, '.data') -- field data.
+		local data = get_data(self) -- field data.
 		for i=1,#fields do
 			local field = fields[i]
 			data[field.name] = nil
@@ -192,7 +212,7 @@ function _M.def(parent, name, ast)
 	end
 		-- IsInitialized()
 	function methods:IsInitialized()
-		local data = rawget(self, '.data') -- field data.
+		local data = get_data(self) -- field data.
 		for i=1,#fields do
 			local field = fields[i]
 			local name = field.name
@@ -212,7 +232,7 @@ function _M.def(parent, name, ast)
 	end
 		-- MergeFrom()
 	function methods:MergeFrom(msg2)
-		local data = rawget(self, '.data') -- field data.  This is for raw field access.
+		local data = get_data(self) -- field data.  This is for raw field access.
 		for i=1,#fields do
 			local field = fields[i]
 			local name = field.name
@@ -267,6 +267,15 @@ function pack_unknown_fields(buf, off, len, unknowns)
 	return off, len
 end
 
+-- used by the C codec for unknown fields.
+function encode_unknown_fields(unknowns)
+	local buf = new_buffer()
+	local off = pack_unknown_fields(buf, 0, 0, unknowns)
+	local data = buf:pack(1, off, true)
+	buf:release()
+	return data
+end
+
 local function pack_fields(buf, off, len, msg, fields)
 	local data = msg['.data']
 	for i=1,#fields do
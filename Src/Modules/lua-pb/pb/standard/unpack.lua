@@ -159,8 +159,6 @@ end
 --
 -- WireType unpack functions for unknown fields.
 --
-local unpack_unknown_field
-
 local function try_unpack_unknown_message(data, off, len)
 	local tag, wire_type, val
 	-- create new list of unknown fields.
@@ -0,0 +1,108 @@
+
+local pb = require"pb"
+
+-- the same types, once through the C codec and once through pack.lua/unpack.lua.
+local proto_text = [[
+message Inner {
+	optional int32 id = 1;
+	optional string name = 2;
+}
+message Outer {
+	optional string title = 1;
+	optional Inner inner = 2;
+	repeated Inner items = 3;
+	repeated uint32 values = 4;
+	optional double ratio = 5;
+}
+]]
+
+assert(pcall(require, "pb.standard.codec"), "pb.standard.codec not installed")
+
+-- load a second copy of the standard backend with the codec hidden.
+for name in pairs(package.loaded) do
+	if name:match("^pb%.standard") or name == "pb.handlers" then
+		package.loaded[name] = nil
+	end
+end
+package.preload["pb.standard.codec"] = function() error("codec disabled") end
+local lua_std = require"pb.standard"
+package.preload["pb.standard.codec"] = nil
+pb.new_backend('lua', lua_std.compile, lua_std.encode, lua_std.decode)
+
+local C = pb.load_proto(proto_text)
+local L = pb.load_proto(proto_text, nil, 'lua')
+
+local data = {
+	title = "outer",
+	inner = { id = 150, name = "first" },
+	items = {
+		{ id = 1, name = "a" },
+		{ id = 300000, name = string.rep("b", 200) },
+		{},
+	},
+	values = { 0, 1, 127, 128, 2147483647 },
+	ratio = 0.25,
+}
+
+local function check_Outer(msg)
+	assert(msg.title == "outer")
+	assert(msg.inner.id == 150)
+	assert(msg.inner.name == "first")
+	assert(#msg.items == 3)
+	assert(msg.items[2].id == 300000)
+	assert(msg.items[2].name == string.rep("b", 200))
+	assert(msg.items[3].id == nil)
+	assert(#msg.values == 5)
+	assert(msg.values[5] == 2147483647)
+	assert(msg.ratio == 0.25)
+end
+
+--
+-- Round trip between the two encoders
+--
+local cbin = assert(C.Outer(data):Serialize())
+local lbin = assert(L.Outer(data):Serialize())
+assert(cbin == lbin, "codec and Lua encodings differ")
+
+local cmsg = C.Outer()
+cmsg:Parse(lbin)
+check_Outer(cmsg)
+local lmsg = L.Outer()
+lmsg:Parse(cbin)
+check_Outer(lmsg)
+-- decoded sub-messages encode back to the same bytes, touched or not.
+assert(cmsg:Serialize() == lbin)
+assert(lmsg:Serialize() == cbin)
+cmsg = C.Outer()
+cmsg:Parse(lbin)
+assert(cmsg:Serialize() == lbin)
+
+--
+-- Corrupt sub-message: the codec decodes it on first use, and keeps failing
+--
+local bad_inner = "\8\128"  -- field 'id', truncated varint
+local bad = "\10\3abc" .. "\18" .. string.char(#bad_inner) .. bad_inner
+
+local ok, err = pcall(function() local m = L.Outer(); m:Parse(bad) end)
+assert(not ok)
+
+cmsg = C.Outer()
+cmsg:Parse(bad)
+assert(cmsg.title == "abc")
+for i = 1, 2 do
+	ok, err = pcall(function() return cmsg.inner.id end)
+	assert(not ok and err:match("Malformed"), err)
+end
+-- untouched by the failed decodes, so it still encodes back as it came.
+assert(cmsg:SerializePartial() == bad)
+
+--
+-- Encoding errors
+--
+for i = 1, 2 do
+	ok, err = pcall(function() return C.Outer({ inner = { id = "x" } }):Serialize() end)
+	assert(not ok)
+end
+assert(C.Outer(data):Serialize() == cbin)
+
+print("Codec tests passed")
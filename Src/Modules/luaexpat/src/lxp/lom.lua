@@ -35,13 +35,19 @@ local function text (p, txt)
 end
 
 function  parse (o)
-  local c = { StartElement = starttag,
-              EndElement = endtag,
-              CharacterData = text,
-              _nonstrict = true,
-              stack = {{}}
-            }
-  local p = lxp.new(c)
+  local c, p
+  if lxp.newdom then
+    -- the element tables are built by the parser itself
+    p = lxp.newdom()
+  else
+    c = { StartElement = starttag,
+          EndElement = endtag,
+          CharacterData = text,
+          _nonstrict = true,
+          stack = {{}}
+        }
+    p = lxp.new(c)
+  end
   local status, err
   if type(o) == "string" then
     status, err = p:parse(o)
@@ -54,7 +60,8 @@ function  parse (o)
   end
   status, err = p:parse()
   if not status then return nil, err end
+  local dom = c and c.stack[1][1] or p:getdom()
   p:close()
-  return c.stack[1][1]
+  return dom
 end
 
@@ -30,6 +30,12 @@ enum XPState {
   XPSstring  /* state while reading a string */
 };
 
+enum XPMode {
+  XPMcallbacks,  /* one call to a Lua handle for each event */
+  XPMbatch,  /* events collected in an array, given to `Events' */
+  XPMdom  /* element tables built in C, as lxp.lom does */
+};
+
 struct lxp_userdata {
   lua_State *L;
   XML_Parser parser;  /* associated expat parser */
@@ -37,6 +43,10 @@ struct lxp_userdata {
   int tableref;  /* table with callbacks for this parser */
   enum XPState state;
   luaL_Buffer *b;  /* to concatenate sequences of cdata pieces */
+  enum XPMode mode;
+  int auxref;  /* array of events (batch) or stack of open elements (dom) */
+  int nevents;  /* events in the array, not given to `Events' yet */
+  int depth;  /* open elements, plus the root list (dom) */
 };
 
 typedef struct lxp_userdata lxp_userdata;
@@ -58,6 +68,7 @@ static lxp_userdata *createlxp (lua_State *L) {
   lxp_userdata *xpu = (lxp_userdata *)lua_newuserdata(L, sizeof(lxp_userdata));
   memset(xpu, 0, sizeof(*xpu));
   xpu->tableref = LUA_REFNIL;  /* in case of errors... */
+  xpu->auxref = LUA_REFNIL;
   xpu->state = XPSpre;
   luaL_getmetatable(L, ParserType);
   lua_setmetatable(L, -2);
@@ -68,6 +79,8 @@ static lxp_userdata *createlxp (lua_State *L) {
 static void lxpclose (lua_State *L, lxp_userdata *xpu) {
   lua_unref(L, xpu->tableref);
   xpu->tableref = LUA_REFNIL;
+  lua_unref(L, xpu->auxref);
+  xpu->auxref = LUA_REFNIL;
   if (xpu->parser)
     XML_ParserFree(xpu->parser);
   xpu->parser = NULL;
@@ -90,6 +103,81 @@ static void docall (lxp_userdata *xpu, int nargs, int nres) {
 }
 
 
+/*
+** {======================================================
+** Batched events and DOM building
+** The array of events (or the stack of open elements) is at
+** stack index 4 while parsing, and the names of the events
+** at indices 5 to 7
+** =======================================================
+*/
+
+#define EV_START	5
+#define EV_END		6
+#define EV_CHARDATA	7
+
+
+/*
+** Give the collected events to the `Events' handle:
+** Events(parser, events, n), with three entries per event in `events'
+*/
+static void flushevents (lxp_userdata *xpu) {
+  lua_State *L = xpu->L;
+  int n = xpu->nevents;
+  xpu->nevents = 0;
+  if (n == 0 || xpu->state == XPSerror) return;
+  lua_pushliteral(L, EventsKey);
+  lua_gettable(L, 3);
+  if (!lua_isfunction(L, -1))
+    luaL_error(L, "lxp `%s' callback is not a function", EventsKey);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 4);
+  lua_pushnumber(L, n);
+  docall(xpu, 2, 0);
+}
+
+
+/*
+** Add an event with the two values on top of the stack (popping them)
+*/
+static void addevent (lxp_userdata *xpu, int event) {
+  lua_State *L = xpu->L;
+  int i = xpu->nevents++ * 3;
+  lua_pushvalue(L, event);
+  lua_rawseti(L, 4, i + 1);
+  lua_rawseti(L, 4, i + 3);
+  lua_rawseti(L, 4, i + 2);
+  if (xpu->nevents >= LXP_BATCHSIZE)
+    flushevents(xpu);
+}
+
+
+/*
+** Add the string on top of the stack (popping it) to the open element,
+** joining it to the text before it
+*/
+static void addtext (lxp_userdata *xpu) {
+  lua_State *L = xpu->L;
+  int n;
+  lua_rawgeti(L, 4, xpu->depth);
+  lua_insert(L, -2);
+  n = lua_objlen(L, -2);
+  lua_rawgeti(L, -2, n);
+  if (lua_isstring(L, -1)) {
+    lua_insert(L, -2);
+    lua_concat(L, 2);
+  }
+  else {
+    lua_pop(L, 1);
+    n++;
+  }
+  lua_rawseti(L, -2, n);
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
 /*
 ** Check whether there is pending Cdata, and call its handle if necessary
 */
@@ -97,7 +185,17 @@ static void dischargestring (lxp_userdata *xpu) {
   assert(xpu->state == XPSstring);
   xpu->state = XPSok;
   luaL_pushresult(xpu->b);
-  docall(xpu, 1, 0);
+  switch (xpu->mode) {
+    case XPMbatch:
+      lua_pushboolean(xpu->L, 0);
+      addevent(xpu, EV_CHARDATA);
+      break;
+    case XPMdom:
+      addtext(xpu);
+      break;
+    default:
+      docall(xpu, 1, 0);
+  }
 }
 
 
@@ -108,6 +206,7 @@ static void dischargestring (lxp_userdata *xpu) {
 static int getHandle (lxp_userdata *xpu, const char *handle) {
   lua_State *L = xpu->L;
   if (xpu->state == XPSstring) dischargestring(xpu);
+  if (xpu->nevents > 0) flushevents(xpu);  /* keep events in order */
   if (xpu->state == XPSerror)
     return 0;  /* some error happened before; skip all handles */
   lua_pushstring(L, handle);
@@ -182,24 +281,30 @@ static void f_DefaultExpand (void *ud, const char *data, int len) {
 }
 
 
-static void f_StartElement (void *ud, const char *name, const char **attrs) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
+static void pushattrs (lxp_userdata *xpu, const char **attrs) {
   lua_State *L = xpu->L;
   int lastspec = XML_GetSpecifiedAttributeCount(xpu->parser) / 2;
   int i = 1;
-  if (getHandle(xpu, StartElementKey) == 0) return;  /* no handle */
-  lua_pushstring(L, name);
-  lua_newtable(L);
+  int n = 0;
+  while (attrs[2 * n]) n++;
+  lua_createtable(L, lastspec, n);
   while (*attrs) {
     if (i <= lastspec) {
-      lua_pushnumber(L, i++);
       lua_pushstring(L, *attrs);
-      lua_settable(L, -3);
+      lua_rawseti(L, -2, i++);
     }
     lua_pushstring(L, *attrs++);
     lua_pushstring(L, *attrs++);
-    lua_settable(L, -3);
+    lua_rawset(L, -3);
   }
+}
+
+
+static void f_StartElement (void *ud, const char *name, const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, StartElementKey) == 0) return;  /* no handle */
+  lua_pushstring(xpu->L, name);
+  pushattrs(xpu, attrs);
   docall(xpu, 2, 0);  /* call function with self, name, and attributes */
 }
 
@@ -212,6 +317,66 @@ static void f_EndElement (void *ud, const char *name) {
 }
 
 
+static void f_BatchCharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->state == XPSok) {
+    xpu->state = XPSstring;
+    luaL_buffinit(xpu->L, xpu->b);
+  }
+  if (xpu->state == XPSstring)
+    luaL_addlstring(xpu->b, s, len);
+}
+
+
+static void f_BatchStartElement (void *ud, const char *name,
+                                           const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  if (xpu->state == XPSerror) return;
+  lua_pushstring(xpu->L, name);
+  pushattrs(xpu, attrs);
+  addevent(xpu, EV_START);
+}
+
+
+static void f_BatchEndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  if (xpu->state == XPSerror) return;
+  lua_pushstring(xpu->L, name);
+  lua_pushboolean(xpu->L, 0);
+  addevent(xpu, EV_END);
+}
+
+
+static void f_DomStartElement (void *ud, const char *name,
+                                         const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  lua_createtable(L, 1, 2);
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "tag");
+  pushattrs(xpu, attrs);
+  lua_setfield(L, -2, "attr");
+  lua_rawseti(L, 4, ++xpu->depth);
+}
+
+
+static void f_DomEndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  (void)name;  /* expat checks it matches the start tag */
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  lua_rawgeti(L, 4, xpu->depth - 1);  /* parent */
+  lua_rawgeti(L, 4, xpu->depth);
+  lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, 4, xpu->depth--);
+}
+
+
 static int f_ExternaEntity (XML_Parser p, const char *context,
                                           const char *base,
                                           const char *systemId,
@@ -331,7 +496,7 @@ static void checkcallbacks (lua_State *L) {
     "Default", "DefaultExpand", "StartElement", "EndElement",
     "ExternalEntityRef", "StartNamespaceDecl", "EndNamespaceDecl",
     "NotationDecl", "NotStandalone", "ProcessingInstruction",
-    "UnparsedEntityDecl", NULL};
+    "UnparsedEntityDecl", "Events", NULL};
   if (hasfield(L, "_nonstrict")) return;
   lua_pushnil(L);
   while (lua_next(L, 1)) {
@@ -360,9 +525,16 @@ static int lxp_make_parser (lua_State *L) {
   lua_pushvalue(L, 1);
   xpu->tableref = luaL_ref(L, LUA_REGISTRYINDEX);
   XML_SetUserData(p, xpu);
+  if (hasfield(L, EventsKey)) {  /* batch mode */
+    lua_createtable(L, 3 * LXP_BATCHMIN, 0);
+    xpu->auxref = luaL_ref(L, LUA_REGISTRYINDEX);
+    xpu->mode = XPMbatch;
+    XML_SetCharacterDataHandler(p, f_BatchCharData);
+    XML_SetElementHandler(p, f_BatchStartElement, f_BatchEndElement);
+  }
   if (hasfield(L, StartCdataKey) || hasfield(L, EndCdataKey))
     XML_SetCdataSectionHandler(p, f_StartCdata, f_EndCdataKey);
-  if (hasfield(L, CharDataKey))
+  if (hasfield(L, CharDataKey) && xpu->mode != XPMbatch)
     XML_SetCharacterDataHandler(p, f_CharData);
   if (hasfield(L, CommentKey))
     XML_SetCommentHandler(p, f_Comment);
@@ -370,7 +542,8 @@ static int lxp_make_parser (lua_State *L) {
     XML_SetDefaultHandler(p, f_Default);
   if (hasfield(L, DefaultExpandKey))
     XML_SetDefaultHandlerExpand(p, f_DefaultExpand);
-  if (hasfield(L, StartElementKey) || hasfield(L, EndElementKey))
+  if ((hasfield(L, StartElementKey) || hasfield(L, EndElementKey)) &&
+      xpu->mode != XPMbatch)
     XML_SetElementHandler(p, f_StartElement, f_EndElement);
   if (hasfield(L, ExternalEntityKey))
     XML_SetExternalEntityRefHandler(p, f_ExternaEntity);
@@ -388,6 +561,33 @@ static int lxp_make_parser (lua_State *L) {
 }
 
 
+/*
+** A parser without handles that builds element tables, in the format of
+** lxp.lom, for `getdom'
+*/
+static int lxp_make_domparser (lua_State *L) {
+  XML_Parser p;
+  char sep = *luaL_optstring(L, 1, "");
+  lxp_userdata *xpu = createlxp(L);
+  p = xpu->parser = (sep == '\0') ? XML_ParserCreate(NULL) :
+                                    XML_ParserCreateNS(NULL, sep);
+  if (!p)
+    luaL_error(L, "XML_ParserCreate failed");
+  lua_newtable(L);
+  xpu->tableref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);  /* stack of open elements */
+  lua_newtable(L);  /* the document list, holding the document element */
+  lua_rawseti(L, -2, 1);
+  xpu->auxref = luaL_ref(L, LUA_REGISTRYINDEX);
+  xpu->depth = 1;
+  xpu->mode = XPMdom;
+  XML_SetUserData(p, xpu);
+  XML_SetCharacterDataHandler(p, f_BatchCharData);
+  XML_SetElementHandler(p, f_DomStartElement, f_DomEndElement);
+  return 1;
+}
+
+
 static lxp_userdata *checkparser (lua_State *L, int idx) {
   lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, idx, ParserType);
   luaL_argcheck(L, xpu, idx, "expat parser expected");
@@ -419,6 +619,16 @@ static int getbase (lua_State *L) {
 }
 
 
+static int getdom (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  luaL_argcheck(L, xpu->mode == XPMdom, 1, "not a DOM parser");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->auxref);
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+
 static int getcallbacks (lua_State *L) {
   lxp_userdata *xpu = checkparser(L, 1);
   lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->tableref);
@@ -435,10 +645,17 @@ static int parse_aux (lua_State *L, lxp_userdata *xpu, const char *s,
   xpu->b = &b;
   lua_settop(L, 2);
   lua_getref(L, xpu->tableref);  /* to be used by handlers */
+  lua_getref(L, xpu->auxref);  /* events or open elements */
+  if (xpu->mode == XPMbatch) {
+    lua_pushliteral(L, StartElementKey);
+    lua_pushliteral(L, EndElementKey);
+    lua_pushliteral(L, CharDataKey);
+  }
   xpu->busy = 1;
   status = XML_Parse(xpu->parser, s, (int)len, s == NULL);
   xpu->busy = 0;
   if (xpu->state == XPSstring) dischargestring(xpu);
+  if (xpu->nevents > 0) flushevents(xpu);
   if (xpu->state == XPSerror) {  /* callback error? */
     lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->tableref);  /* get original msg. */
     lua_error(L);
@@ -508,6 +725,7 @@ static const struct luaL_reg lxp_meths[] = {
   {"pos", lxp_pos},
   {"setencoding", lxp_setencoding},
   {"getcallbacks", getcallbacks},
+  {"getdom", getdom},
   {"getbase", getbase},
   {"setbase", setbase},
   {NULL, NULL}
@@ -515,6 +733,7 @@ static const struct luaL_reg lxp_meths[] = {
 
 static const struct luaL_reg lxp_funcs[] = {
   {"new", lxp_make_parser},
+  {"newdom", lxp_make_domparser},
   {NULL, NULL}
 };
 
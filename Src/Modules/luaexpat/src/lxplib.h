@@ -19,5 +19,10 @@
 #define NotStandaloneKey		"NotStandalone"
 #define ProcessingInstructionKey	"ProcessingInstruction"
 #define UnparsedEntityDeclKey		"UnparsedEntityDecl"
+#define EventsKey			"Events"
+
+/* events given to `Events' at most at once, and initially allocated */
+#define LXP_BATCHSIZE			4096
+#define LXP_BATCHMIN			256
 
 int luaopen_lxp (lua_State *L);
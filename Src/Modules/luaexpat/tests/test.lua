@@ -230,6 +230,51 @@ assert(x[1] == "en" and x[3] == "space" and table.getn(x) == 3)
 
 
 
+----------------------------
+print("testing batched events")
+X = {}
+callbacks = {
+  Events = function (p, events, n)
+    table.insert(X, n)
+    for i = 1, 3 * n, 3 do
+      table.insert(X, {events[i], events[i + 1], events[i + 2]})
+    end
+  end,
+  Comment = xgetargs"c",
+}
+p = lxp.new(callbacks)
+assert(p:parse[[<to a="1">hi ]])
+assert(p:parse[[there<!--x--><b/></to>]])
+p:close()
+assert(X[1] == 2)  -- one call for each parse
+assert(X[2][1] == "StartElement" and X[2][2] == "to" and X[2][3].a == "1")
+assert(X[3][1] == "CharacterData" and X[3][2] == "hi " and X[3][3] == false)
+assert(X[4] == 1 and X[5][2] == "there")  -- flushed before the comment
+assert(X[6][1] == "c" and X[6][3] == "x")
+assert(X[7] == 3 and X[8][1] == "StartElement" and X[8][2] == "b")
+assert(X[9][1] == "EndElement" and X[10][2] == "to" and table.getn(X) == 10)
+
+-- errors in the handle stop the parse
+p = lxp.new{Events = function () error"stop" end}
+local status, err = pcall(p.parse, p, "<to/>")
+assert(not status and string.find(err, "stop"))
+
+
+----------------------------
+print("testing DOM parser")
+p = lxp.newdom()
+assert(p:parse[[<to a="1">hi <b>x</b>]])
+assert(p:parse[[the]])
+assert(p:parse[[re</to>]])
+assert(p:parse())
+x = p:getdom()
+p:close()
+assert(x.tag == "to" and x.attr.a == "1" and x.attr[1] == "a")
+assert(x[1] == "hi " and x[2].tag == "b" and x[2][1] == "x")
+assert(x[3] == "there" and table.getn(x) == 3)
+
+
+
 -- Error reporting
 p = lxp.new{}
 data = [[
@@ -30,6 +30,8 @@
 #define LUASQL_ENVIRONMENT_MYSQL "MySQL environment"
 #define LUASQL_CONNECTION_MYSQL "MySQL connection"
 #define LUASQL_CURSOR_MYSQL "MySQL cursor"
+#define LUASQL_POOL_MYSQL "MySQL pool"
+#define LUASQL_QUERY_MYSQL "MySQL query"
 
 /* For compat with old version 4.0 */
 #if (MYSQL_VERSION_ID < 40100) 
@@ -490,6 +492,70 @@ static int env_connect (lua_State *L) {
 }
 
 
+/*
+** Pool support: the workers run the query and store the whole result.
+*/
+static void *pool_handle (lua_State *L, int o) {
+	conn_data *conn = (conn_data *)luaL_checkudata (L, o, LUASQL_CONNECTION_MYSQL);
+	return conn->my_conn;
+}
+
+
+static void pool_run (void *handle, luasql_job *job) {
+	MYSQL *my_conn = (MYSQL *)handle;
+	if (mysql_real_query(my_conn, job->statement, job->len))
+		luasql_joberror (job, LUASQL_PREFIX"error executing query. MySQL: ", mysql_error(my_conn));
+	else {
+		MYSQL_RES *res = mysql_store_result(my_conn);
+		unsigned int num_cols = mysql_field_count(my_conn);
+		if (res) {
+			job->res = res;
+			job->numcols = num_cols;
+		}
+		else if (num_cols == 0)
+			job->count = (double)mysql_affected_rows(my_conn);
+		else
+			luasql_joberror (job, LUASQL_PREFIX"error retrieving result. MySQL: ", mysql_error(my_conn));
+	}
+}
+
+
+static int pool_cursor (lua_State *L, int o, luasql_job *job) {
+	return create_cursor (L, o, (MYSQL_RES *)job->res, job->numcols);
+}
+
+
+static void pool_discard (luasql_job *job) {
+	mysql_free_result ((MYSQL_RES *)job->res);
+}
+
+
+/*
+** The client library keeps per-thread state for the workers.
+*/
+static void pool_thread (int start) {
+	if (start)
+		mysql_thread_init ();
+	else
+		mysql_thread_end ();
+}
+
+
+static const luasql_driver pool_driver = {
+	LUASQL_POOL_MYSQL, LUASQL_QUERY_MYSQL,
+	pool_handle, pool_run, pool_cursor, pool_discard, pool_thread
+};
+
+
+/*
+** Creates a pool of connections to a data source.
+*/
+static int env_pool (lua_State *L) {
+	getenvironment (L); /* validate environment */
+	return luasql_createpool (L, &pool_driver);
+}
+
+
 /*
 ** Close environment object.
 */
@@ -515,6 +581,7 @@ static void create_metatables (lua_State *L) {
         {"__gc", env_close},
         {"close", env_close},
         {"connect", env_connect},
+        {"pool", env_pool},
 		{NULL, NULL},
 	};
     struct luaL_reg connection_methods[] = {
@@ -541,6 +608,7 @@ static void create_metatables (lua_State *L) {
 	luasql_createmeta (L, LUASQL_CONNECTION_MYSQL, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_MYSQL, cursor_methods);
 	lua_pop (L, 3);
+	luasql_createpoolmeta (L, &pool_driver);
 }
 
 
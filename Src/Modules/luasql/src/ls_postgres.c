@@ -26,6 +26,8 @@
 #define LUASQL_ENVIRONMENT_PG "PostgreSQL environment"
 #define LUASQL_CONNECTION_PG "PostgreSQL connection"
 #define LUASQL_CURSOR_PG "PostgreSQL cursor"
+#define LUASQL_POOL_PG "PostgreSQL pool"
+#define LUASQL_QUERY_PG "PostgreSQL query"
 
 typedef struct {
 	short      closed;
@@ -47,9 +49,24 @@ typedef struct {
 	int        colnames, coltypes; /* reference to column information tables */
 	int        curr_tuple;         /* next tuple to be read */
 	PGresult  *pg_res;
+	char      *typenames;          /* column types looked up by a pool worker */
 } cur_data;
 
 
+/* room for each column type name in typenames */
+#define PG_TYPESIZE 40
+
+
+/*
+** Result of a pool statement: the rows and their column types, which
+** are looked up on the worker since the connection belongs to it.
+*/
+typedef struct {
+	PGresult  *res;
+	char      *typenames;
+} pool_result;
+
+
 typedef void (*creator) (lua_State *L, cur_data *cur);
 
 
@@ -107,6 +124,8 @@ static void cur_nullify (lua_State *L, cur_data *cur) {
 	/* Nullify structure fields. */
 	cur->closed = 1;
 	PQclear(cur->pg_res);
+	free(cur->typenames);
+	cur->typenames = NULL;
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->coltypes);
@@ -206,8 +225,10 @@ static char *getcolumntype (PGconn *conn, PGresult *result, int i, char *buff) {
 				int modifier = PQfmod (result, i) - 4;
 				sprintf (buff, "%.20s (%d)", name, modifier);
 			}
-			else
+			else {
 				strncpy (buff, name, 20);
+				buff[20] = '\0';
+			}
 		}
 	}
 	PQclear(res);
@@ -237,6 +258,14 @@ static void create_coltypes (lua_State *L, cur_data *cur) {
 	conn_data *conn;
 	char typename[100];
 	int i;
+	if (cur->typenames) {
+		lua_newtable (L);
+		for (i = 1; i <= cur->numcols; i++) {
+			lua_pushstring (L, cur->typenames + (i-1) * PG_TYPESIZE);
+			lua_rawseti (L, -2, i);
+		}
+		return;
+	}
 	lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
 	if (!lua_isuserdata (L, -1))
 		luaL_error (L, LUASQL_PREFIX"invalid connection");
@@ -310,6 +339,7 @@ static int create_cursor (lua_State *L, int conn, PGresult *result) {
 	cur->coltypes = LUA_NOREF;
 	cur->curr_tuple = 0;
 	cur->pg_res = result;
+	cur->typenames = NULL;
 	lua_pushvalue (L, conn);
 	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
 
@@ -516,6 +546,83 @@ static int env_connect (lua_State *L) {
 }
 
 
+/*
+** Pool support: the workers run PQexec, which buffers the whole result,
+** and look up the column types while they still own the connection.
+*/
+static void *pool_handle (lua_State *L, int o) {
+	conn_data *conn = (conn_data *)luaL_checkudata (L, o, LUASQL_CONNECTION_PG);
+	return conn->pg_conn;
+}
+
+
+static void pool_run (void *handle, luasql_job *job) {
+	PGconn *pg_conn = (PGconn *)handle;
+	PGresult *res = PQexec(pg_conn, job->statement);
+	if (res && PQresultStatus(res)==PGRES_COMMAND_OK) {
+		job->count = atof(PQcmdTuples(res));
+		PQclear (res);
+	}
+	else if (res && PQresultStatus(res)==PGRES_TUPLES_OK) {
+		int i, n = PQnfields(res);
+		char typename[100];
+		pool_result *pr = (pool_result *)malloc(sizeof(pool_result));
+		char *names = (char *)malloc(n > 0 ? n * PG_TYPESIZE : 1);
+		if (pr == NULL || names == NULL) {
+			free (pr);
+			free (names);
+			PQclear (res);
+			luasql_joberror (job, LUASQL_PREFIX, "not enough memory");
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			getcolumntype (pg_conn, res, i, typename);
+			strncpy (names + i * PG_TYPESIZE, typename, PG_TYPESIZE - 1);
+			names[i * PG_TYPESIZE + PG_TYPESIZE - 1] = '\0';
+		}
+		pr->res = res;
+		pr->typenames = names;
+		job->res = pr;
+	}
+	else {
+		PQclear (res);
+		luasql_joberror (job, LUASQL_PREFIX"error executing statement. PostgreSQL: ", PQerrorMessage(pg_conn));
+	}
+}
+
+
+static int pool_cursor (lua_State *L, int o, luasql_job *job) {
+	pool_result *pr = (pool_result *)job->res;
+	int n = create_cursor (L, o, pr->res);
+	((cur_data *)lua_touserdata (L, -1))->typenames = pr->typenames;
+	free (pr);
+	return n;
+}
+
+
+static void pool_discard (luasql_job *job) {
+	pool_result *pr = (pool_result *)job->res;
+	PQclear (pr->res);
+	free (pr->typenames);
+	free (pr);
+}
+
+
+static const luasql_driver pool_driver = {
+	LUASQL_POOL_PG, LUASQL_QUERY_PG,
+	pool_handle, pool_run, pool_cursor, pool_discard, NULL
+};
+
+
+/*
+** Creates a pool of connections to a data source.
+*/
+static int env_pool (lua_State *L) {
+	getenvironment (L);	/* validate environment */
+	return luasql_createpool (L, &pool_driver);
+}
+
+
 /*
 ** Environment object collector function.
 */
@@ -555,6 +662,7 @@ static void create_metatables (lua_State *L) {
 		{"__gc",    env_gc},
 		{"close",   env_close},
 		{"connect", env_connect},
+		{"pool",    env_pool},
 		{NULL, NULL},
 	};
 	struct luaL_reg connection_methods[] = {
@@ -580,6 +688,7 @@ static void create_metatables (lua_State *L) {
 	luasql_createmeta (L, LUASQL_CONNECTION_PG, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_PG, cursor_methods);
 	lua_pop (L, 3);
+	luasql_createpoolmeta (L, &pool_driver);
 }
 
 /*
@@ -25,6 +25,8 @@
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_POOL_SQLITE "SQLite3 pool"
+#define LUASQL_QUERY_SQLITE "SQLite3 query"
 
 typedef struct
 {
@@ -50,6 +52,7 @@ typedef struct
   int         colnames, coltypes; /* reference to column information tables */
   conn_data   *conn_data;         /* reference to connection for cursor */
   sqlite3_stmt  *sql_vm;
+  int         pending;            /* result of a step already taken, or 0 */
 } cur_data;
 
 LUASQL_API int luaopen_luasql_sqlite3(lua_State *L);
@@ -141,7 +144,14 @@ static int cur_fetch (lua_State *L) {
   if (vm == NULL)
     return 0;
 
-  res = sqlite3_step(vm);
+  if (cur->pending != 0)
+    {
+      /* a pool worker already stepped to the first row */
+      res = cur->pending;
+      cur->pending = 0;
+    }
+  else
+    res = sqlite3_step(vm);
 
   /* no more results? */
   if (res == SQLITE_DONE)
@@ -266,6 +276,7 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
   cur->coltypes = LUA_NOREF;
   cur->sql_vm = sql_vm;
   cur->conn_data = conn;
+  cur->pending = 0;
 
   lua_pushvalue(L, o);
   cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -526,6 +537,87 @@ static int env_connect(lua_State *L)
 }
 
 
+/*
+** Pool support: the workers run the first step of the statement, and
+** the cursor returns that row before stepping again.  Cursors step the
+** connection from the Lua thread while its worker may run another
+** statement, so the connection must be in serialized mode (it has a
+** mutex); the mutex also keeps the error message from being replaced.
+*/
+static void *pool_handle(lua_State *L, int o)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, o, LUASQL_CONNECTION_SQLITE);
+  if (sqlite3_db_mutex(conn->sql_conn) == NULL)
+    return NULL;
+  return conn->sql_conn;
+}
+
+static void pool_run(void *handle, luasql_job *job)
+{
+  sqlite3 *db = (sqlite3 *)handle;
+  sqlite3_stmt *vm;
+  const char *tail;
+  int res, numcols;
+
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+  res = sqlite3_prepare(db, job->statement, (int)job->len, &vm, &tail);
+  if (res != SQLITE_OK)
+    {
+      luasql_joberror(job, LUASQL_PREFIX, sqlite3_errmsg(db));
+      sqlite3_mutex_leave(sqlite3_db_mutex(db));
+      return;
+    }
+
+  res = sqlite3_step(vm);
+  numcols = sqlite3_column_count(vm);
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    {
+      job->res = vm;
+      job->resstate = res;
+      job->numcols = numcols;
+    }
+  else if (res == SQLITE_DONE)
+    {
+      sqlite3_finalize(vm);
+      job->count = sqlite3_changes(db);
+    }
+  else
+    {
+      luasql_joberror(job, LUASQL_PREFIX, sqlite3_errmsg(db));
+      sqlite3_finalize(vm);
+    }
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+}
+
+static int pool_cursor(lua_State *L, int o, luasql_job *job)
+{
+  conn_data *conn = (conn_data *)lua_touserdata(L, o);
+  int n = create_cursor(L, o, conn, (sqlite3_stmt *)job->res, job->numcols);
+  ((cur_data *)lua_touserdata(L, -1))->pending = job->resstate;
+  return n;
+}
+
+static void pool_discard(luasql_job *job)
+{
+  sqlite3_finalize((sqlite3_stmt *)job->res);
+}
+
+static const luasql_driver pool_driver = {
+  LUASQL_POOL_SQLITE, LUASQL_QUERY_SQLITE,
+  pool_handle, pool_run, pool_cursor, pool_discard, NULL
+};
+
+
+/*
+** Creates a pool of connections to a data source.
+*/
+static int env_pool(lua_State *L)
+{
+  getenvironment(L);  /* validate environment */
+  return luasql_createpool(L, &pool_driver);
+}
+
+
 /*
 ** Close environment object.
 */
@@ -564,6 +656,7 @@ static void create_metatables (lua_State *L)
     {"__gc", env_close},
     {"close", env_close},
     {"connect", env_connect},
+    {"pool", env_pool},
     {NULL, NULL},
   };
   struct luaL_reg connection_methods[] = {
@@ -589,6 +682,7 @@ static void create_metatables (lua_State *L)
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
   lua_pop (L, 3);
+  luasql_createpoolmeta(L, &pool_driver);
 }
 
 /*
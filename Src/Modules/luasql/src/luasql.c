@@ -3,8 +3,12 @@
 ** See Copyright Notice in license.html
 */
 
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "mthread.h"
+
 #include "lua.h"
 #include "lauxlib.h"
 #if ! defined (LUA_VERSION_NUM) || LUA_VERSION_NUM < 501
@@ -108,3 +112,506 @@ LUASQL_API void luasql_set_info (lua_State *L) {
 	lua_pushliteral (L, "LuaSQL 2.1.2");
 	lua_settable (L, -3);
 }
+
+
+/*
+** Connection pools.
+** A pool owns a set of connections, each one served by a worker thread
+** which takes statements from the pool queue and runs them through the
+** driver.  pool:execute returns a query object at once; query:ready
+** never blocks, so a coroutine scheduler (copas) can yield until it is
+** true, and query:result then returns what conn:execute would have.
+*/
+
+typedef struct pool_state pool_state;
+
+typedef struct {
+	pool_state *pool;
+	int         n;                  /* index of the connection */
+	void       *handle;             /* native connection */
+	mt_thread   thread;
+} pool_worker;
+
+struct pool_state {
+	int         refs;               /* pool object, its queries and workers */
+	int         closing;
+	int         size;               /* number of connections */
+	int         started;            /* number of running workers */
+	const luasql_driver *drv;
+	mt_mutex    lock;
+	mt_cond     work;               /* a statement was queued */
+	mt_cond     done;               /* a statement was run */
+	luasql_job *head, *tail;        /* statements waiting for a worker */
+	pool_worker workers[1];
+};
+
+typedef struct {
+	short       closed;
+	pool_state *pool;
+	int         conns;              /* reference to connection list */
+} pool_data;
+
+typedef struct {
+	short       closed;
+	pool_state *pool;
+	int         conns;              /* reference to connection list */
+	luasql_job  job;
+} query_data;
+
+
+static char *copy_string (const char *s, size_t len) {
+	char *c = (char *)malloc (len + 1);
+	if (c != NULL) {
+		memcpy (c, s, len);
+		c[len] = '\0';
+	}
+	return c;
+}
+
+
+/*
+** Sets the error message of a job; may be called from a worker thread.
+** @param err LuaSQL error message.
+** @param m Driver error message.
+*/
+LUASQL_API void luasql_joberror (luasql_job *job, const char *err, const char *m) {
+	size_t l1 = strlen (err), l2 = strlen (m);
+	free (job->errmsg);
+	job->errmsg = (char *)malloc (l1 + l2 + 1);
+	if (job->errmsg != NULL) {
+		memcpy (job->errmsg, err, l1);
+		memcpy (job->errmsg + l1, m, l2 + 1);
+	}
+}
+
+
+/*
+** Drops a reference to the pool state; the pool object, its queries and
+** its workers each hold one.
+*/
+static void pool_release (pool_state *pool) {
+	int refs;
+	mt_mutex_lock (&pool->lock);
+	refs = --pool->refs;
+	mt_mutex_unlock (&pool->lock);
+	if (refs > 0)
+		return;
+	mt_mutex_free (&pool->lock);
+	mt_cond_free (&pool->work);
+	mt_cond_free (&pool->done);
+	free (pool);
+}
+
+
+static MT_THREAD_RETURN pool_work (void *arg) {
+	pool_worker *w = (pool_worker *)arg;
+	pool_state *pool = w->pool;
+	luasql_job *job;
+	if (pool->drv->thread)
+		pool->drv->thread (1);
+	mt_mutex_lock (&pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->closing)
+			mt_cond_wait (&pool->work, &pool->lock);
+		if ((job = pool->head) == NULL)
+			break;
+		if ((pool->head = job->next) == NULL)
+			pool->tail = NULL;
+		job->state = LUASQL_RUNNING;
+		job->conn = w->n;
+		mt_mutex_unlock (&pool->lock);
+		pool->drv->run (w->handle, job);
+		mt_mutex_lock (&pool->lock);
+		job->state = LUASQL_DONE;
+		mt_cond_broadcast (&pool->done);
+	}
+	mt_mutex_unlock (&pool->lock);
+	if (pool->drv->thread)
+		pool->drv->thread (0);
+	pool_release (pool);
+	return 0;
+}
+
+
+static int start_worker (pool_worker *w) {
+	return mt_thread_start (&w->thread, pool_work, w);
+}
+
+
+static void join_worker (pool_worker *w) {
+	mt_thread_join (w->thread);
+}
+
+
+static void detach_worker (pool_worker *w) {
+	mt_thread_detach (w->thread);
+}
+
+
+/*
+** Stops the workers once they are done with the statement they are
+** running; statements still in the queue fail.  Unless `wait' is set,
+** the workers are left to exit on their own.
+*/
+static void pool_stop (pool_state *pool, int wait) {
+	luasql_job *job;
+	int i;
+	mt_mutex_lock (&pool->lock);
+	pool->closing = 1;
+	for (job = pool->head; job != NULL; job = job->next) {
+		job->state = LUASQL_DONE;
+		luasql_joberror (job, LUASQL_PREFIX, "pool is closed");
+	}
+	pool->head = pool->tail = NULL;
+	mt_cond_broadcast (&pool->work);
+	mt_cond_broadcast (&pool->done);
+	mt_mutex_unlock (&pool->lock);
+	for (i = 0; i < pool->started; i++) {
+		if (wait)
+			join_worker (&pool->workers[i]);
+		else
+			detach_worker (&pool->workers[i]);
+	}
+	pool->started = 0;
+}
+
+
+/*
+** Check for valid pool.
+*/
+static pool_data *getpool (lua_State *L) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	pool_data *p = (pool_data *)luaL_checkudata (L, 1, drv->pool);
+	luaL_argcheck (L, p != NULL, 1, LUASQL_PREFIX"pool expected");
+	luaL_argcheck (L, !p->closed, 1, LUASQL_PREFIX"pool is closed");
+	return p;
+}
+
+
+/*
+** Check for valid query.
+*/
+static query_data *getquery (lua_State *L) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	query_data *q = (query_data *)luaL_checkudata (L, 1, drv->query);
+	luaL_argcheck (L, q != NULL, 1, LUASQL_PREFIX"query expected");
+	return q;
+}
+
+
+/*
+** Removes a job from the queue; the pool must be locked.
+*/
+static int unqueue (pool_state *pool, luasql_job *job) {
+	luasql_job *prev = NULL, *j;
+	for (j = pool->head; j != NULL; prev = j, j = j->next) {
+		if (j == job) {
+			if (prev == NULL)
+				pool->head = j->next;
+			else
+				prev->next = j->next;
+			if (pool->tail == j)
+				pool->tail = prev;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int closepool (lua_State *L, int wait) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	pool_data *p = (pool_data *)luaL_checkudata (L, 1, drv->pool);
+	luaL_argcheck (L, p != NULL, 1, LUASQL_PREFIX"pool expected");
+	if (p->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	p->closed = 1;
+	pool_stop (p->pool, wait);
+	pool_release (p->pool);
+	luaL_unref (L, LUA_REGISTRYINDEX, p->conns);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Close a Pool object.
+** Statements being run are waited for; queued ones fail.  Cursors and
+** queries created by the pool keep working after it is closed.
+*/
+static int pool_close (lua_State *L) {
+	return closepool (L, 1);
+}
+
+
+/*
+** Collect a Pool object.
+** The workers are not waited for: they exit once done with the statement
+** they are running, whose query keeps its connection alive.
+*/
+static int pool_gc (lua_State *L) {
+	return closepool (L, 0);
+}
+
+
+/*
+** Queue an SQL statement to be run by one of the pool connections.
+** Return a Query object.
+*/
+static int pool_execute (lua_State *L) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	pool_data *p = getpool (L);
+	size_t len;
+	const char *statement = luaL_checklstring (L, 2, &len);
+	query_data *q = (query_data *)lua_newuserdata (L, sizeof (query_data));
+	luasql_job *job = &q->job;
+	memset (q, 0, sizeof (query_data));
+	q->closed = 1;  /* until it is queued */
+	q->conns = LUA_NOREF;
+	luasql_setmeta (L, drv->query);
+	job->statement = copy_string (statement, len);
+	if (job->statement == NULL)
+		return luaL_error (L, LUASQL_PREFIX"not enough memory");
+	job->len = len;
+	job->state = LUASQL_QUEUED;
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, p->conns);
+	q->conns = luaL_ref (L, LUA_REGISTRYINDEX);
+	q->pool = p->pool;
+	q->closed = 0;
+
+	mt_mutex_lock (&p->pool->lock);
+	q->pool->refs++;
+	if (p->pool->tail == NULL)
+		p->pool->head = job;
+	else
+		p->pool->tail->next = job;
+	p->pool->tail = job;
+	mt_cond_signal (&p->pool->work);
+	mt_mutex_unlock (&p->pool->lock);
+	return 1;
+}
+
+
+/*
+** Return the number of connections of the pool.
+*/
+static int pool_size (lua_State *L) {
+	pool_data *p = getpool (L);
+	lua_pushnumber (L, p->pool->size);
+	return 1;
+}
+
+
+/*
+** Return true if the statement was run, without blocking.
+*/
+static int query_ready (lua_State *L) {
+	query_data *q = getquery (L);
+	int state;
+	if (q->closed) {
+		lua_pushboolean (L, 1);
+		return 1;
+	}
+	mt_mutex_lock (&q->pool->lock);
+	state = q->job.state;
+	mt_mutex_unlock (&q->pool->lock);
+	lua_pushboolean (L, state >= LUASQL_DONE);
+	return 1;
+}
+
+
+/*
+** Wait for the statement to be run and return its results, as
+** conn:execute does: a Cursor object, the number of rows affected or
+** nil plus an error message.  The results are returned only once.
+*/
+static int query_result (lua_State *L) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	query_data *q = getquery (L);
+	luasql_job *job = &q->job;
+	int state, n;
+	if (q->closed)
+		return luasql_faildirect (L, "query results already retrieved");
+	mt_mutex_lock (&q->pool->lock);
+	while (job->state < LUASQL_DONE)
+		mt_cond_wait (&q->pool->done, &q->pool->lock);
+	state = job->state;
+	job->state = LUASQL_TAKEN;
+	mt_mutex_unlock (&q->pool->lock);
+	if (state == LUASQL_TAKEN)
+		return luasql_faildirect (L, "query results already retrieved");
+	if (job->errmsg) {
+		lua_pushnil (L);
+		lua_pushstring (L, job->errmsg);
+		return 2;
+	}
+	if (job->res == NULL) {
+		lua_pushnumber (L, job->count);
+		return 1;
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, q->conns);
+	lua_rawgeti (L, -1, job->conn);
+	n = drv->cursor (L, lua_gettop (L), job);
+	job->res = NULL;  /* the cursor owns it now */
+	return n;
+}
+
+
+/*
+** Take a statement out of the queue if no worker started it yet.
+** Return true if the statement was cancelled; its result will be
+** nil plus an error message.
+*/
+static int query_cancel (lua_State *L) {
+	query_data *q = getquery (L);
+	int cancelled = 0;
+	if (!q->closed) {
+		mt_mutex_lock (&q->pool->lock);
+		if (q->job.state == LUASQL_QUEUED && unqueue (q->pool, &q->job)) {
+			q->job.state = LUASQL_DONE;
+			luasql_joberror (&q->job, LUASQL_PREFIX, "query cancelled");
+			cancelled = 1;
+		}
+		mt_mutex_unlock (&q->pool->lock);
+	}
+	lua_pushboolean (L, cancelled);
+	return 1;
+}
+
+
+/*
+** Collect a Query object, waiting for its statement if it is running.
+*/
+static int query_gc (lua_State *L) {
+	const luasql_driver *drv = (const luasql_driver *)lua_touserdata (L, lua_upvalueindex (1));
+	query_data *q = (query_data *)luaL_checkudata (L, 1, drv->query);
+	luasql_job *job = &q->job;
+	if (q != NULL && !q->closed) {
+		q->closed = 1;
+		mt_mutex_lock (&q->pool->lock);
+		if (job->state == LUASQL_QUEUED)
+			unqueue (q->pool, job);
+		while (job->state == LUASQL_RUNNING)
+			mt_cond_wait (&q->pool->done, &q->pool->lock);
+		mt_mutex_unlock (&q->pool->lock);
+		if (job->res != NULL)
+			drv->discard (job);
+		pool_release (q->pool);
+		luaL_unref (L, LUA_REGISTRYINDEX, q->conns);
+	}
+	if (q != NULL) {
+		free (job->statement);
+		free (job->errmsg);
+		job->statement = job->errmsg = NULL;
+	}
+	return 0;
+}
+
+
+/*
+** Create the pool and query metatables of a driver.
+*/
+LUASQL_API void luasql_createpoolmeta (lua_State *L, const luasql_driver *drv) {
+	struct luaL_reg pool_methods[] = {
+		{"__gc", pool_gc},
+		{"close", pool_close},
+		{"execute", pool_execute},
+		{"size", pool_size},
+		{NULL, NULL},
+	};
+	struct luaL_reg query_methods[] = {
+		{"__gc", query_gc},
+		{"ready", query_ready},
+		{"result", query_result},
+		{"cancel", query_cancel},
+		{NULL, NULL},
+	};
+	struct luaL_reg none[] = {
+		{NULL, NULL},
+	};
+	luasql_createmeta (L, drv->pool, none);
+	lua_pushlightuserdata (L, (void *)drv);
+	luaL_openlib (L, NULL, pool_methods, 1);
+	lua_pop (L, 1);
+	luasql_createmeta (L, drv->query, none);
+	lua_pushlightuserdata (L, (void *)drv);
+	luaL_openlib (L, NULL, query_methods, 1);
+	lua_pop (L, 1);
+}
+
+
+/*
+** Implements env:pool(n, ...): opens n connections with env:connect(...)
+** and starts a worker for each one.
+** Return a Pool object, or the error of env:connect.
+*/
+LUASQL_API int luasql_createpool (lua_State *L, const luasql_driver *drv) {
+	int n = luaL_checkint (L, 2);
+	int top = lua_gettop (L);
+	int conns, i;
+	pool_state *pool;
+	pool_data *p;
+	luaL_argcheck (L, n > 0, 2, LUASQL_PREFIX"invalid pool size");
+
+	lua_newtable (L);
+	conns = lua_gettop (L);
+	for (i = 1; i <= n; i++) {
+		int a;
+		lua_getfield (L, 1, "connect");
+		lua_pushvalue (L, 1);
+		for (a = 3; a <= top; a++)
+			lua_pushvalue (L, a);
+		lua_call (L, top - 1, 2);
+		if (lua_isnil (L, -2))
+			return 2;  /* connection error */
+		lua_pop (L, 1);
+		lua_rawseti (L, conns, i);
+	}
+
+	p = (pool_data *)lua_newuserdata (L, sizeof (pool_data));
+	p->closed = 1;  /* until the workers are started */
+	p->pool = NULL;
+	p->conns = LUA_NOREF;
+	luasql_setmeta (L, drv->pool);
+	pool = (pool_state *)malloc (sizeof (pool_state) + (n - 1) * sizeof (pool_worker));
+	if (pool == NULL)
+		return luaL_error (L, LUASQL_PREFIX"not enough memory");
+	memset (pool, 0, sizeof (pool_state));
+	pool->refs = 1;
+	pool->size = n;
+	pool->drv = drv;
+	mt_mutex_init (&pool->lock);
+	mt_cond_init (&pool->work);
+	mt_cond_init (&pool->done);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti (L, conns, i + 1);
+		pool->workers[i].pool = pool;
+		pool->workers[i].n = i + 1;
+		pool->workers[i].handle = drv->handle (L, lua_gettop (L));
+		if (pool->workers[i].handle == NULL) {
+			pool_release (pool);
+			return luaL_error (L, LUASQL_PREFIX"connection cannot be used by a pool thread");
+		}
+		lua_pop (L, 1);
+	}
+	for (i = 0; i < n; i++) {
+		mt_mutex_lock (&pool->lock);
+		pool->refs++;  /* released by the worker when it exits */
+		mt_mutex_unlock (&pool->lock);
+		if (!start_worker (&pool->workers[i])) {
+			pool_release (pool);
+			pool_stop (pool, 1);
+			pool_release (pool);
+			return luaL_error (L, LUASQL_PREFIX"could not start pool thread");
+		}
+		pool->started++;
+	}
+	p->pool = pool;
+	lua_pushvalue (L, conns);
+	p->conns = luaL_ref (L, LUA_REGISTRYINDEX);
+	p->closed = 0;
+	return 1;
+}
@@ -20,10 +20,48 @@ typedef struct {
 	short  closed;
 } pseudo_data;
 
+/* States of a statement sent to a pool */
+#define LUASQL_QUEUED   0
+#define LUASQL_RUNNING  1
+#define LUASQL_DONE     2
+#define LUASQL_TAKEN    3   /* results already returned or discarded */
+
+typedef struct luasql_job {
+	struct luasql_job *next;    /* next job in the pool queue */
+	int        state;
+	int        conn;            /* pool connection which ran the statement */
+	char      *statement;
+	size_t     len;
+	void      *res;             /* driver result, turned into a cursor */
+	int        resstate;        /* driver state of res */
+	int        numcols;
+	double     count;           /* rows affected when there is no result */
+	char      *errmsg;          /* error message (malloc'ed) or NULL */
+} luasql_job;
+
+/*
+** What a driver provides to support pools.
+** `run' and `thread' are called from the worker threads and must not
+** touch the Lua state.  `handle' returns NULL if the connection cannot
+** be used from another thread.
+*/
+typedef struct {
+	const char *pool;           /* name of the pool metatable */
+	const char *query;          /* name of the query metatable */
+	void *(*handle) (lua_State *L, int conn);     /* native connection */
+	void (*run) (void *handle, luasql_job *job);  /* executes the statement */
+	int (*cursor) (lua_State *L, int conn, luasql_job *job);  /* pushes res */
+	void (*discard) (luasql_job *job);            /* frees an unused res */
+	void (*thread) (int start);                   /* per-thread setup or NULL */
+} luasql_driver;
+
 LUASQL_API int luasql_faildirect (lua_State *L, const char *err);
 LUASQL_API int luasql_failmsg (lua_State *L, const char *err, const char *m);
 LUASQL_API int luasql_createmeta (lua_State *L, const char *name, const luaL_reg *methods);
 LUASQL_API void luasql_setmeta (lua_State *L, const char *name);
 LUASQL_API void luasql_set_info (lua_State *L);
+LUASQL_API void luasql_joberror (luasql_job *job, const char *err, const char *m);
+LUASQL_API void luasql_createpoolmeta (lua_State *L, const luasql_driver *drv);
+LUASQL_API int luasql_createpool (lua_State *L, const luasql_driver *drv);
 
 #endif
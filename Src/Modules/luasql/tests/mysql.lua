@@ -7,6 +7,8 @@ QUERYING_STRING_TYPE_NAME = "binary(65535)"
 
 table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
+table.insert (ENV_METHODS, "pool")
+table.insert (EXTENSIONS, pool)
 
 ---------------------------------------------------------------------
 -- Build SQL command to create the test table.
@@ -5,3 +5,5 @@
 
 table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
+table.insert (ENV_METHODS, "pool")
+table.insert (EXTENSIONS, pool)
@@ -5,6 +5,9 @@
 
 DROP_TABLE_RETURN_VALUE = 1
 
+table.insert (ENV_METHODS, "pool")
+table.insert (EXTENSIONS, pool)
+
 ---------------------------------------------------------------------
 -- Produces a SQL statement which completely erases a table.
 -- @param table_name String with the name of the table.
@@ -598,6 +598,65 @@ function numrows()
 	io.write (" numrows")
 end
 
+---------------------------------------------------------------------
+-- Testing connection pools.
+-- This is not a default test, it must be added to the extensions
+-- table to be executed.
+---------------------------------------------------------------------
+POOL_METHODS = { "close", "execute", "size", }
+QUERY_METHODS = { "cancel", "ready", "result", }
+function pool ()
+	for i = 1, 10 do
+		assert2 (1, CONN:execute ("insert into t (f1) values ('"..i.."')"),
+			"could not insert a new record")
+	end
+	local pool = test_object (ENV:pool (2, datasource, username, password), POOL_METHODS)
+	assert2 (2, pool:size ())
+	assert2 (false, pcall (ENV.pool, ENV, 0, datasource), "empty pool accepted")
+
+	-- Queries are run in the background; ready never blocks.
+	local queries = {}
+	for i = 1, 10 do
+		queries[i] = test_object (pool:execute ("select f1 from t where f1 = '"..i.."'"), QUERY_METHODS)
+	end
+	for i = 1, 10 do
+		local q = queries[i]
+		while not q:ready () do end
+		local cur = CUR_OK (q:result ())
+		assert2 (tostring (i), cur:fetch ())
+		assert2 (nil, cur:fetch ())
+		cur:close ()
+		-- results are returned only once.
+		assert2 (nil, q:result ())
+	end
+
+	-- Statements without results return the number of rows affected.
+	assert2 (10, pool:execute (sql_erase_table"t"):result ())
+	local res, err = pool:execute ("select * from luasql_unknown_table"):result ()
+	assert2 (nil, res, "error not reported")
+	assert2 ("string", type (err))
+
+	-- Queued queries may be cancelled; closing the pool fails the others.
+	for i = 1, 20 do
+		queries[i] = pool:execute ("select * from t")
+	end
+	if queries[20]:cancel () then
+		assert2 (nil, queries[20]:result ())
+	end
+	assert2 (true, pool:close ())
+	assert2 (false, pool:close ())
+	for i = 1, 20 do
+		local res = queries[i]:result ()
+		if res then res:close () end
+	end
+	assert2 (false, pcall (pool.execute, pool, "select * from t"),
+		"executing through a closed pool")
+	queries = nil
+	collectgarbage ()
+
+	io.write (" pool")
+end
+
 
 ---------------------------------------------------------------------
 -- Main
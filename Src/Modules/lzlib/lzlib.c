@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mthread.h"
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -83,11 +88,446 @@ typedef struct {
     size_t o_buffer_len;
     size_t o_buffer_max;
     char o_buffer[LZ_BUFFER_SIZE];
+    /* parallel deflate engine, NULL for plain streams */
+    struct lz_pdeflate *par;
 } lz_stream;
 
 
 /* forward declarations */
 static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int flush);
+static int lzstream_pardeflate(lua_State *L, lz_stream *s, int from, int to, int flush);
+
+
+/*
+** =========================================================================
+** parallel deflate
+**
+** The input is cut in blocks which worker threads compress as raw deflate
+** data, each primed with the 32K of input before it as dictionary, and
+** ended with a sync flush so they can be concatenated. The calling thread
+** writes the blocks in order between the zlib or gzip header and trailer,
+** combining the checksums of the blocks.
+** =========================================================================
+*/
+#define LZ_PAR_BLOCK    (128*1024)      /* default block size */
+#define LZ_PAR_AHEAD    2               /* blocks in flight per thread */
+
+#define LZ_WRAP_RAW     0
+#define LZ_WRAP_ZLIB    1
+#define LZ_WRAP_GZIP    2
+
+typedef struct lz_block {
+    struct lz_block *next_work;     /* queue of blocks waiting for a worker */
+    struct lz_block *next;          /* blocks in stream order */
+    unsigned char *in;              /* dictionary followed by data */
+    size_t dict_len;
+    size_t len;
+    size_t max;                     /* room for data */
+    int flush;
+    int done;
+    int error;
+    unsigned char *out;
+    size_t out_len;
+    uLong check;                    /* checksum of the data */
+} lz_block;
+
+typedef struct lz_pdeflate {
+    int level, memLevel, strategy;
+    int windowBits;                 /* raw window bits */
+    int wrap;                       /* LZ_WRAP_* */
+    size_t block_size;
+    int closing;
+    int header;                     /* header already written? */
+    int error;
+    uLong check;                    /* checksum of the data written */
+    uLong total;                    /* data length modulo 2^32 */
+    mt_mutex lock;
+    mt_cond work;                   /* a block was queued */
+    mt_cond done;                   /* a block was compressed */
+    lz_block *work_head, *work_tail;
+    lz_block *head, *tail;          /* blocks not written yet */
+    int pending;                    /* number of blocks not written yet */
+    lz_block *cur;                  /* block being filled */
+    int threads, started;
+    mt_thread thread[1];
+} lz_pdeflate;
+
+
+/*
+** Return the number of processors, the default number of threads.
+*/
+static int lz_par_cpus(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+static uLong lz_par_checksum(int wrap, uLong check, const unsigned char *buf, size_t len) {
+    if (wrap == LZ_WRAP_GZIP) return crc32(check, buf, len);
+    if (wrap == LZ_WRAP_ZLIB) return adler32(check, buf, len);
+    return 0;
+}
+
+static void lz_par_compress(lz_pdeflate *p, z_stream *zs, lz_block *b) {
+    size_t size;
+    int r;
+
+    b->check = lz_par_checksum(p->wrap, lz_par_checksum(p->wrap, 0L, Z_NULL, 0), b->in + b->dict_len, b->len);
+
+    deflateReset(zs);
+    if (b->dict_len > 0 && deflateSetDictionary(zs, b->in, b->dict_len) != Z_OK) {
+        b->error = Z_STREAM_ERROR;
+        return;
+    }
+
+    size = deflateBound(zs, b->len) + 16;
+    b->out = (unsigned char*)malloc(size);
+    if (b->out == NULL) {
+        b->error = Z_MEM_ERROR;
+        return;
+    }
+    zs->next_in = b->in + b->dict_len;
+    zs->avail_in = b->len;
+    zs->next_out = b->out;
+    zs->avail_out = size;
+
+    for (;;) {
+        r = deflate(zs, b->flush);
+        if (r == Z_STREAM_ERROR) {
+            b->error = r;
+            return;
+        }
+        if (r == Z_STREAM_END || zs->avail_out != 0) {
+            break;
+        }
+        /* out of room: grow the output */
+        {
+            unsigned char *out = (unsigned char*)realloc(b->out, size * 2);
+            if (out == NULL) {
+                b->error = Z_MEM_ERROR;
+                return;
+            }
+            b->out = out;
+            zs->next_out = out + size;
+            zs->avail_out = size;
+            size *= 2;
+        }
+    }
+    b->out_len = size - zs->avail_out;
+}
+
+static MT_THREAD_RETURN lz_par_work(void *arg) {
+    lz_pdeflate *p = (lz_pdeflate*)arg;
+    lz_block *b;
+    z_stream zs;
+    int ok;
+
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    ok = deflateInit2(&zs, p->level, Z_DEFLATED, -p->windowBits, p->memLevel, p->strategy) == Z_OK;
+
+    mt_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->work_head == NULL && !p->closing) {
+            mt_cond_wait(&p->work, &p->lock);
+        }
+        if ((b = p->work_head) == NULL) {
+            break;
+        }
+        if ((p->work_head = b->next_work) == NULL) {
+            p->work_tail = NULL;
+        }
+        mt_mutex_unlock(&p->lock);
+
+        if (ok) {
+            lz_par_compress(p, &zs, b);
+        } else {
+            b->error = Z_MEM_ERROR;
+        }
+
+        mt_mutex_lock(&p->lock);
+        b->done = 1;
+        mt_cond_broadcast(&p->done);
+    }
+    mt_mutex_unlock(&p->lock);
+
+    if (ok) {
+        deflateEnd(&zs);
+    }
+    return 0;
+}
+
+static void lz_par_free_block(lz_block *b) {
+    if (b) {
+        free(b->in);
+        free(b->out);
+        free(b);
+    }
+}
+
+static void lz_par_free(lz_pdeflate *p) {
+    lz_block *b;
+    int i;
+
+    mt_mutex_lock(&p->lock);
+    p->closing = 1;
+    p->work_head = p->work_tail = NULL;     /* drop queued blocks */
+    mt_cond_broadcast(&p->work);
+    mt_mutex_unlock(&p->lock);
+    for (i = 0; i < p->started; i++) {
+        mt_thread_join(p->thread[i]);
+    }
+
+    while ((b = p->head) != NULL) {
+        p->head = b->next;
+        lz_par_free_block(b);
+    }
+    lz_par_free_block(p->cur);
+    mt_mutex_free(&p->lock);
+    mt_cond_free(&p->work);
+    mt_cond_free(&p->done);
+    free(p);
+}
+
+/*
+** Start a block, with the end of the previous one as dictionary
+** (unless a full flush happened).
+*/
+static int lz_par_start_block(lz_pdeflate *p, lz_block *prev) {
+    size_t window = (size_t)1 << p->windowBits;
+    size_t dict_len = 0;
+    lz_block *b = (lz_block*)calloc(1, sizeof(lz_block));
+
+    if (b == NULL) {
+        return Z_MEM_ERROR;
+    }
+    if (prev && prev->flush != Z_FULL_FLUSH) {
+        dict_len = prev->dict_len + prev->len;
+        if (dict_len > window) dict_len = window;
+    }
+    b->in = (unsigned char*)malloc(dict_len + p->block_size);
+    if (b->in == NULL) {
+        free(b);
+        return Z_MEM_ERROR;
+    }
+    if (dict_len > 0) {
+        memcpy(b->in, prev->in + prev->dict_len + prev->len - dict_len, dict_len);
+    }
+    b->dict_len = dict_len;
+    b->max = p->block_size;
+    p->cur = b;
+    return Z_OK;
+}
+
+static lz_pdeflate *lz_par_new(int level, int windowBits, int memLevel, int strategy, int threads, size_t block_size) {
+    lz_pdeflate *p;
+    int i;
+
+    if (threads < 1) threads = lz_par_cpus();
+    p = (lz_pdeflate*)calloc(1, sizeof(lz_pdeflate) + (threads - 1) * sizeof(mt_thread));
+    if (p == NULL) {
+        return NULL;
+    }
+    if (windowBits < 0) {
+        p->wrap = LZ_WRAP_RAW;
+        p->windowBits = -windowBits;
+    } else if (windowBits > 15) {
+        p->wrap = LZ_WRAP_GZIP;
+        p->windowBits = windowBits - 16;
+    } else {
+        p->wrap = LZ_WRAP_ZLIB;
+        p->windowBits = windowBits;
+    }
+    if (p->windowBits == 8) p->windowBits = 9;  /* as deflateInit2 does */
+    p->level = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+    p->memLevel = memLevel;
+    p->strategy = strategy;
+    p->block_size = block_size;
+    p->threads = threads;
+    p->check = lz_par_checksum(p->wrap, 0L, Z_NULL, 0);
+    mt_mutex_init(&p->lock);
+    mt_cond_init(&p->work);
+    mt_cond_init(&p->done);
+
+    if (lz_par_start_block(p, NULL) != Z_OK) {
+        lz_par_free(p);
+        return NULL;
+    }
+    for (i = 0; i < threads; i++) {
+        if (!mt_thread_start(&p->thread[i], lz_par_work, p)) break;
+        p->started++;
+    }
+    if (p->started == 0) {
+        lz_par_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/*
+** Hand the current block to the workers and start the next one.
+*/
+static int lz_par_submit(lz_pdeflate *p, int flush) {
+    lz_block *b = p->cur;
+
+    b->flush = flush;
+    mt_mutex_lock(&p->lock);
+    if (p->work_tail) p->work_tail->next_work = b;
+    else p->work_head = b;
+    p->work_tail = b;
+    if (p->tail) p->tail->next = b;
+    else p->head = b;
+    p->tail = b;
+    p->pending++;
+    mt_cond_signal(&p->work);
+    mt_mutex_unlock(&p->lock);
+
+    p->cur = NULL;
+    if (flush == Z_FINISH) {
+        return Z_OK;
+    }
+    return lz_par_start_block(p, b);
+}
+
+/*
+** Push the zlib or gzip header.
+*/
+static void lz_par_push_header(lua_State *L, lz_pdeflate *p) {
+    unsigned char h[10];
+
+    if (p->wrap == LZ_WRAP_ZLIB) {
+        unsigned int header = (Z_DEFLATED + ((p->windowBits - 8) << 4)) << 8;
+        unsigned int flags;
+        if (p->strategy >= Z_HUFFMAN_ONLY || p->level < 2) flags = 0;
+        else if (p->level < 6) flags = 1;
+        else if (p->level == 6) flags = 2;
+        else flags = 3;
+        header |= flags << 6;
+        header += 31 - (header % 31);
+        h[0] = (unsigned char)(header >> 8);
+        h[1] = (unsigned char)(header & 0xff);
+        lua_pushlstring(L, (char*)h, 2);
+    } else {
+        memset(h, 0, sizeof(h));
+        h[0] = 0x1f;
+        h[1] = 0x8b;
+        h[2] = Z_DEFLATED;
+        h[8] = p->level == 9 ? 2 : (p->strategy >= Z_HUFFMAN_ONLY || p->level < 2 ? 4 : 0);
+        h[9] = 3;   /* OS: unix, as most gzip writers say */
+        lua_pushlstring(L, (char*)h, 10);
+    }
+}
+
+/*
+** Push the zlib or gzip trailer.
+*/
+static void lz_par_push_trailer(lua_State *L, lz_pdeflate *p) {
+    unsigned char t[8];
+    int i;
+
+    if (p->wrap == LZ_WRAP_ZLIB) {
+        for (i = 0; i < 4; i++) t[i] = (unsigned char)(p->check >> (24 - 8 * i));
+        lua_pushlstring(L, (char*)t, 4);
+    } else {
+        for (i = 0; i < 4; i++) t[i] = (unsigned char)(p->check >> (8 * i));
+        for (i = 0; i < 4; i++) t[4 + i] = (unsigned char)(p->total >> (8 * i));
+        lua_pushlstring(L, (char*)t, 8);
+    }
+}
+
+typedef void (*lz_par_emit)(lua_State *L, void *ud);
+
+/*
+** Hand the string on top of the stack to emit. Should the sink raise an
+** error, the stream stays failed instead of going on without that data.
+*/
+static void lz_par_emit_top(lua_State *L, lz_pdeflate *p, lz_par_emit emit, void *ud) {
+    p->error = Z_ERRNO;
+    emit(L, ud);
+    p->error = Z_OK;
+}
+
+/*
+** Write compressed blocks in order, each pushed as a string and handed
+** to emit. Blocks are waited for until at most `keep' are pending.
+** Returns Z_OK or the error of the first failed block.
+*/
+static int lz_par_write(lua_State *L, lz_pdeflate *p, int keep, lz_par_emit emit, void *ud) {
+    lz_block *b;
+    int done, finish;
+
+    if (!p->header && p->wrap != LZ_WRAP_RAW) {
+        lz_par_push_header(L, p);
+        p->header = 1;
+        lz_par_emit_top(L, p, emit, ud);
+    }
+    while ((b = p->head) != NULL && p->error == Z_OK) {
+        mt_mutex_lock(&p->lock);
+        while (!(done = b->done) && p->pending > keep) {
+            mt_cond_wait(&p->done, &p->lock);
+        }
+        mt_mutex_unlock(&p->lock);
+        if (!done) {
+            break;
+        }
+
+        if (b->error != Z_OK) {
+            p->error = b->error;
+            break;      /* the block goes with the stream */
+        }
+        /* push while the block is still listed, so it is freed with the
+           stream should this raise a memory error */
+        lua_pushlstring(L, (char*)b->out, b->out_len);
+        p->head = b->next;
+        if (p->head == NULL) p->tail = NULL;
+        p->pending--;
+        if (p->wrap == LZ_WRAP_ZLIB) {
+            p->check = adler32_combine(p->check, b->check, b->len);
+        } else if (p->wrap == LZ_WRAP_GZIP) {
+            p->check = crc32_combine(p->check, b->check, b->len);
+        }
+        p->total += b->len;
+        finish = b->flush == Z_FINISH;
+        lz_par_free_block(b);
+        lz_par_emit_top(L, p, emit, ud);
+        if (finish && p->wrap != LZ_WRAP_RAW) {
+            lz_par_push_trailer(L, p);
+            lz_par_emit_top(L, p, emit, ud);
+        }
+    }
+    return p->error;
+}
+
+/*
+** Append data, handing each full block to the workers and writing what
+** is ready, waiting when too many blocks are in flight.
+*/
+static int lz_par_append(lua_State *L, lz_pdeflate *p, const char *data, size_t len, lz_par_emit emit, void *ud) {
+    while (len > 0 && p->error == Z_OK) {
+        lz_block *b = p->cur;
+        size_t n = b->max - b->len;
+        if (n > len) n = len;
+        memcpy(b->in + b->dict_len + b->len, data, n);
+        b->len += n;
+        data += n;
+        len -= n;
+        if (b->len == b->max) {
+            if ((p->error = lz_par_submit(p, Z_SYNC_FLUSH)) != Z_OK) {
+                break;
+            }
+            lz_par_write(L, p, LZ_PAR_AHEAD * p->threads, emit, ud);
+        }
+    }
+    return p->error;
+}
 
 
 static lz_stream *lzstream_new(lua_State *L, int src) {
@@ -100,6 +540,7 @@ static lz_stream *lzstream_new(lua_State *L, int src) {
     s->error = Z_OK;
     s->eos = 0;
     s->io_cb = LUA_REFNIL;
+    s->par = NULL;
 
     s->i_buffer = NULL;
     s->i_buffer_ref = LUA_REFNIL;
@@ -132,7 +573,12 @@ static void lzstream_cleanup(lua_State *L, lz_stream *s) {
             inflateEnd(&s->zstream);
         }
         if (s->state == LZ_DEFLATE) {
-            deflateEnd(&s->zstream);
+            if (s->par) {
+                lz_par_free(s->par);
+                s->par = NULL;
+            } else {
+                deflateEnd(&s->zstream);
+            }
         }
 
         luaL_unref(L, LUA_REGISTRYINDEX, s->io_cb);
@@ -218,10 +664,13 @@ static int lzstream_adler(lua_State *L) {
         windowBits, [15]
         memLevel, [8]
         strategy, [Z_DEFAULT_STRATEGY]
+        threads, [none: compress on the calling thread; 0: one per processor]
+        block size, [128K]
     )
 */
 static int lzlib_deflate(lua_State *L) {
-    int level, method, windowBits, memLevel, strategy;
+    int level, method, windowBits, memLevel, strategy, threads;
+    lua_Number block;
     lz_stream *s;
 
     if (lua_istable(L, 1) || lua_isuserdata(L, 1)) {
@@ -241,6 +690,9 @@ static int lzlib_deflate(lua_State *L) {
     windowBits = luaL_optint(L, 4, 15);
     memLevel = luaL_optint(L, 5, 8);
     strategy = luaL_optint(L, 6, Z_DEFAULT_STRATEGY);
+    threads = lua_isnoneornil(L, 7) ? -1 : luaL_checkint(L, 7);
+    block = luaL_optnumber(L, 8, LZ_PAR_BLOCK);
+    luaL_argcheck(L, block >= 1, 8, "invalid block size");
 
     s = lzstream_new(L, 1);
 
@@ -249,6 +701,16 @@ static int lzlib_deflate(lua_State *L) {
         lua_error(L);
     }
 
+    if (threads >= 0) {
+        deflateEnd(&s->zstream);
+        s->par = lz_par_new(level, windowBits, memLevel, strategy, threads, (size_t)block);
+        if (s->par == NULL) {
+            lua_pushliteral(L, "failed to start parallel deflate");
+            lua_error(L);
+        }
+        s->zstream.adler = s->par->check;
+    }
+
     s->state = LZ_DEFLATE;
     return 1;
 }
@@ -589,6 +1051,10 @@ static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int
     size_t b_size = s->o_buffer_max;
     unsigned char *b = (unsigned char *)s->o_buffer;
 
+    if (s->par) {
+        return lzstream_pardeflate(L, s, from, to, flush);
+    }
+
     /* number of processed bytes */
     lua_rawgeti(L, LUA_REGISTRYINDEX, s->io_cb);
     if (!lua_isfunction(L, -1)) {
@@ -638,6 +1104,66 @@ static int lzstream_compress(lua_State *L) {
     return lzstream_docompress(L, s, 2, lua_gettop(L), Z_NO_FLUSH);
 }
 
+/* ====================================================================== */
+
+typedef struct {
+    int func;   /* stack index of the write function */
+    int self;   /* stack index of the sink object, 0 for functions */
+} lz_sink;
+
+static void lzstream_emit(lua_State *L, void *ud) {
+    lz_sink *k = (lz_sink*)ud;
+    lua_pushvalue(L, k->func);
+    lua_insert(L, -2);
+    if (k->self) {
+        lua_pushvalue(L, k->self);
+        lua_insert(L, -2);
+    }
+    lua_call(L, (k->self ? 2 : 1), 0);
+}
+
+static int lzstream_pardeflate(lua_State *L, lz_stream *s, int from, int to, int flush) {
+    lz_pdeflate *p = s->par;
+    lz_sink k;
+    int r = Z_OK, arg;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->io_cb);
+    k.self = 0;
+    if (!lua_isfunction(L, -1)) {
+        k.self = lua_gettop(L);
+        lua_getfield(L, -1, "write");
+    }
+    k.func = lua_gettop(L);
+
+    for (arg = from; arg <= to && r == Z_OK; arg++) {
+        size_t len;
+        const char *data = luaL_checklstring(L, arg, &len);
+        r = lz_par_append(L, p, data, len, lzstream_emit, &k);
+    }
+
+    if (r == Z_OK && flush != Z_NO_FLUSH) {
+        /* the current block ends with the requested flush */
+        r = lz_par_submit(p, flush);
+        if (r == Z_OK) {
+            r = lz_par_write(L, p, 0, lzstream_emit, &k);
+        }
+    }
+    s->zstream.adler = p->check;
+
+    if (r != Z_OK) {
+        lzstream_cleanup(L, s);
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "failed to compress [%d]", r);
+        return 2;
+    }
+    if (flush == Z_FINISH) {
+        lzstream_cleanup(L, s);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 
 /* ====================================================================== */
 
@@ -773,6 +1299,79 @@ static int lzlib_compress(lua_State *L) {
 
 /* ====================================================================== */
 
+static void lzlib_emit_buffer(lua_State *L, void *ud) {
+    (void)L;
+    luaL_addvalue((luaL_Buffer*)ud);
+}
+
+static int lzlib_compress_parallel(lua_State *L) {
+    size_t avail_in;
+    const char *next_in = luaL_checklstring(L, 1, &avail_in);
+    int level = luaL_optint(L, 2, Z_DEFAULT_COMPRESSION);
+    int method = luaL_optint(L, 3, Z_DEFLATED);
+    int windowBits = luaL_optint(L, 4, 15);
+    int memLevel = luaL_optint(L, 5, 8);
+    int strategy = luaL_optint(L, 6, Z_DEFAULT_STRATEGY);
+    int threads = luaL_optint(L, 7, 0);
+    lua_Number block = luaL_optnumber(L, 8, LZ_PAR_BLOCK);
+
+    int ret;
+    luaL_Buffer b;
+    z_stream zs;
+    lz_pdeflate *p;
+    lz_stream *s;
+
+    luaL_argcheck(L, block >= 1, 8, "invalid block size");
+
+    /* check the parameters */
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    ret = deflateInit2(&zs, level, method, windowBits, memLevel, strategy);
+    if (ret != Z_OK)
+    {
+        lua_pushnil(L);
+        lua_pushnumber(L, ret);
+        return 2;
+    }
+    deflateEnd(&zs);
+
+    p = lz_par_new(level, windowBits, memLevel, strategy, threads, (size_t)block);
+    if (p == NULL)
+    {
+        lua_pushnil(L);
+        lua_pushnumber(L, Z_MEM_ERROR);
+        return 2;
+    }
+
+    /* the stream object stops the workers should an error be raised */
+    s = lzstream_new(L, 1);
+    s->par = p;
+    s->state = LZ_DEFLATE;
+
+    luaL_buffinit(L, &b);
+    ret = lz_par_append(L, p, next_in, avail_in, lzlib_emit_buffer, &b);
+    if (ret == Z_OK)
+        ret = lz_par_submit(p, Z_FINISH);
+    if (ret == Z_OK)
+        ret = lz_par_write(L, p, 0, lzlib_emit_buffer, &b);
+    luaL_pushresult(&b);
+
+    /* cleanup */
+    lzstream_cleanup(L, s);
+
+    if (ret != Z_OK)
+    {
+        lua_pushnil(L);
+        lua_pushnumber(L, ret);
+        return 2;
+    }
+    lua_pushnumber(L, Z_STREAM_END);
+    return 2;
+}
+
+/* ====================================================================== */
+
 static int lzlib_decompress(lua_State *L)
 {
     size_t avail_in;
@@ -867,6 +1466,7 @@ LUALIB_API int luaopen_zlib(lua_State *L)
         {"inflate",         lzlib_inflate       },
 
         {"compress",        lzlib_compress      },
+        {"compress_parallel", lzlib_compress_parallel },
         {"decompress",      lzlib_decompress    },
 
         {NULL, NULL}
@@ -0,0 +1,72 @@
+local zlib = require"zlib"
+
+print("Generating test data...")
+local text, noise = {}, {}
+for i = 0, 20000 do
+    table.insert(text, tostring(math.random(1, 1000)) .. (i % 7 == 0 and "\n" or " "))
+end
+for i = 1, 100000 do
+    table.insert(noise, string.char(math.random(0, 255)))
+end
+text = table.concat(text)
+noise = table.concat(noise)
+
+-- zlib, gzip and raw streams, with blocks smaller and larger than the
+-- dictionary, on one and several threads
+for _, data in ipairs{ "", "a", text, noise, text .. noise .. text } do
+    for _, windowBits in ipairs{ 15, 31, -15, 10 } do
+        for _, blocksize in ipairs{ 1000, 32768, 131072 } do
+            for _, threads in ipairs{ 1, 3 } do
+                local c, r = zlib.compress_parallel(data, 6, 8, windowBits, 8, 0, threads, blocksize)
+                assert(c, r)
+                local d = zlib.decompress(c, windowBits > 15 and 47 or windowBits)
+                assert(d == data, string.format("windowBits %d, block size %d, threads %d",
+                    windowBits, blocksize, threads))
+            end
+        end
+    end
+end
+
+-- same header and checksum as zlib.compress
+local c1, c2 = zlib.compress(text), zlib.compress_parallel(text)
+assert(string.sub(c1, 1, 2) == string.sub(c2, 1, 2))
+assert(string.sub(c1, -4) == string.sub(c2, -4))
+print("compress", #c1, "compress_parallel", #c2)
+
+-- streams
+local buffer = {}
+local stream = zlib.deflate(function(data) table.insert(buffer, data) end, 6, 8, 15, 8, 0, 2, 10000)
+for i = 1, #text, 777 do
+    stream:write(string.sub(text, i, i + 776))
+end
+stream:flush("sync")
+-- all data written so far can be decoded
+assert(zlib.inflate(table.concat(buffer)):read("*a") == text)
+stream:write(noise)
+stream:flush("full")
+stream:write(text)
+stream:close()
+assert(zlib.decompress(table.concat(buffer)) == text .. noise .. text)
+
+local sink = { parts = {} }
+function sink:write(data) table.insert(self.parts, data) end
+stream = zlib.deflate(sink, 9, 8, 31, 8, 0, 0)
+stream:write(text, noise)
+stream:close()
+assert(zlib.decompress(table.concat(sink.parts), 47) == text .. noise)
+
+-- errors raised by the sink reach the caller
+stream = zlib.deflate(function() error("sink failed") end, 6, 8, 15, 8, 0, 2, 1000)
+assert(not pcall(stream.write, stream, text))
+-- and the stream stays failed rather than going on without that data
+local fail = true
+buffer = {}
+stream = zlib.deflate(function(data)
+    if fail and #buffer > 0 then fail = false; error("sink failed") end
+    table.insert(buffer, data)
+end, 6, 8, 15, 8, 0, 2, 1000)
+assert(not pcall(stream.write, stream, text))
+local ok, r = pcall(stream.write, stream, text)
+assert(not (ok and r))
+
+print("parallel deflate ok")
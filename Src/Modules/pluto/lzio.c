@@ -45,6 +45,9 @@ void pdep_init (lua_State *L, ZIO *z, lua_Reader reader, void *data) {
   z->data = data;
   z->n = 0;
   z->p = NULL;
+#if LUA_WIDESTRING
+  z->isWide = 0;
+#endif /* LUA_WIDESTRING */
 }
 
 
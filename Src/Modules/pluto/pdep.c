@@ -14,7 +14,15 @@ void pdep_pushobject (lua_State *L, const TValue *o) {
 void *pdep_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
 	global_State *g = G(L);
 	lua_assert((osize == 0) == (block == NULL));
+#if LUAPLUS_EXTENSIONS
+#ifdef _DEBUG
+	block = (*g->frealloc)(g->ud, block, osize, nsize, L->allocName, 0);
+#else
+	block = (*g->frealloc)(g->ud, block, osize, nsize, "", 0);
+#endif /* _DEBUG */
+#else
 	block = (*g->frealloc)(g->ud, block, osize, nsize);
+#endif /* LUAPLUS_EXTENSIONS */
 	lua_assert((nsize == 0) == (block == NULL));
 	g->totalbytes = (g->totalbytes - osize) + nsize;
 	return block;
@@ -5,26 +5,12 @@
 */
 
 
-#ifndef lzio_h
-#define lzio_h
+#ifndef pdep_lzio_h
+#define pdep_lzio_h
 
-#include "lua.h"
+/* ZIO, Mbuffer and EOZ come from the Lua lzio.h, through lstate.h */
 
 
-#define EOZ	(-1)			/* end of stream */
-
-typedef struct Zio ZIO;
-
-#define char2int(c)	cast(int, cast(unsigned char, (c)))
-
-#define zgetc(z)  (((z)->n--)>0 ?  char2int(*(z)->p++) : pdep_fill(z))
-
-typedef struct Mbuffer {
-  char *buffer;
-  size_t n;
-  size_t buffsize;
-} Mbuffer;
-
 #define pdep_initbuffer(L, buff) ((buff)->buffer = NULL, (buff)->buffsize = 0)
 
 #define pdep_buffer(buff)	((buff)->buffer)
@@ -47,19 +33,6 @@ LUAI_FUNC void pdep_init (lua_State *L, ZIO *z, lua_Reader reader,
 LUAI_FUNC size_t pdep_read (ZIO* z, void* b, size_t n);	/* read next n bytes */
 LUAI_FUNC int pdep_lookahead (ZIO *z);
 
-
-
-/* --------- Private Part ------------------ */
-
-struct Zio {
-  size_t n;			/* bytes still unread */
-  const char *p;		/* current position in buffer */
-  lua_Reader reader;
-  void* data;			/* additional data */
-  lua_State *L;			/* Lua state (for reader) */
-};
-
-
 LUAI_FUNC int pdep_fill (ZIO *z);
 
 #endif
@@ -11,6 +11,7 @@
 #include "lstate.h"
 #include "lstring.h"
 #include "lauxlib.h"
+#include "lzio.h"  /* the pdep_ one next to this file */
 
 
 #define pdep_reallocv(L,b,on,n,e) \
@@ -22,4 +22,8 @@ void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud);
 
 void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud);
 
+void pluto_persistsnapshot(lua_State *L, lua_Chunkwriter writer, void *ud);
+
+void pluto_unpersistsnapshot(lua_State *L, lua_Chunkreader reader, void *ud);
+
 LUALIB_API int luaopen_pluto(lua_State *L);
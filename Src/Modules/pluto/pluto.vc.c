@@ -53,14 +53,42 @@
 #endif
 
 #define PLUTO_TPERMANENT 101
+#define PLUTO_TSNAPSHOT 102
+
+/* Bits of Table.snapflags. Lua clears them whenever the table is modified,
+ * so they survive only in the tables that have not changed since they were
+ * last written to or read from a snapshot. They only hold for that
+ * snapshot, which the table of owners in the registry gives. */
+#define PLUTO_CLEAN 0x01	/* need not be written again */
+#define PLUTO_LEAF 0x02		/* refers to no other snapshot table */
+#define PLUTO_SKIP (PLUTO_CLEAN | PLUTO_LEAF)
+
+#define PLUTO_OWNERS "pluto.owners"
+
+/* Stack positions of the snapshot, of the table of owners and of the tables
+ * pending to be written or searched, when persisting to a snapshot */
+#define SNAPIDX 3
+#define OWNERSIDX 4
+#define PENDINGIDX 5
 
 #define verify(x) { int v = (int)((x)); v=v; lua_assert(v); }
 
+/* Size of the buffer where output is staged before it goes to the writer */
+#define PLUTO_BUFSIZE 16384
+
+typedef struct RefMap_t RefMap;
+
 typedef struct PersistInfo_t {
 	lua_State *L;
 	int counter;
 	lua_Chunkwriter writer;
 	void *ud;
+	RefMap *refs;
+	int snapshot;		/* whether persisting to a snapshot */
+	int lastid;		/* last id given to a table of the snapshot */
+	int npending;
+	size_t buflen;
+	char buf[PLUTO_BUFSIZE];
 #ifdef PLUTO_DEBUG
 	int level;
 #endif
@@ -78,6 +106,30 @@ void printindent(int indent)
 
 /* Mutual recursion requires prototype */
 static void persist(PersistInfo *pi);
+static void anchorobject(PersistInfo *pi);
+
+/* Most writes are a few bytes long, so output is staged in pi->buf and
+ * handed to the writer in large blocks. */
+static void flushbuffer(PersistInfo *pi)
+{
+	if(pi->buflen > 0) {
+		pi->writer(pi->L, pi->buf, pi->buflen, pi->ud);
+		pi->buflen = 0;
+	}
+}
+
+static void pwrite(PersistInfo *pi, const void *p, size_t sz)
+{
+	if(sz > PLUTO_BUFSIZE - pi->buflen) {
+		flushbuffer(pi);
+		if(sz >= PLUTO_BUFSIZE) {
+			pi->writer(pi->L, p, sz, pi->ud);
+			return;
+		}
+	}
+	memcpy(pi->buf + pi->buflen, p, sz);
+	pi->buflen += sz;
+}
 
 /* A simple reimplementation of the unfortunately static function luaA_index.
  * Does not support the global table, registry, or upvalues. */
@@ -92,6 +144,85 @@ static StkId getobject(lua_State *L, int stackpos)
 	}
 }
 
+/* The reference map of persist is a hash table from objects to their
+ * references, in a userdata that takes the place of the reference table.
+ * Collectable objects are keyed on their GCObject pointer; numbers,
+ * booleans and light userdata on their value, so equal values still share
+ * a reference. The environment of the userdata anchors the objects
+ * returned by __persist functions, so that their addresses cannot be
+ * reused by new objects while persisting. */
+typedef union RefKey_t {
+	const void *p;
+	lua_Number n;
+} RefKey;
+
+typedef struct RefEntry_t {
+	RefKey key;
+	int tt;
+	int ref;		/* 0 if the entry is free */
+} RefEntry;
+
+struct RefMap_t {
+	size_t size;		/* number of entries, a power of 2 */
+	size_t count;		/* number of used entries */
+	int anchored;		/* number of anchored objects */
+	RefEntry entries[1];
+};
+
+#define REFMAP_MINSIZE 1024
+
+static RefMap *newrefmap(lua_State *L, size_t size)
+{
+	RefMap *rm = (RefMap *)lua_newuserdata(L,
+		sizeof(RefMap) + (size - 1) * sizeof(RefEntry));
+	memset(rm->entries, 0, size * sizeof(RefEntry));
+	rm->size = size;
+	rm->count = 0;
+	rm->anchored = 0;
+	return rm;
+}
+
+/* Fills in the key of the object on top of the stack; returns its type */
+static int getrefkey(lua_State *L, RefKey *k)
+{
+	const TValue *o = getobject(L, -1);
+	memset(k, 0, sizeof(RefKey));
+	switch(ttype(o)) {
+		case LUA_TNIL:
+			break;
+		case LUA_TNUMBER:
+			k->n = nvalue(o);
+			break;
+		case LUA_TBOOLEAN:
+			k->p = (const void *)(size_t)bvalue(o);
+			break;
+		case LUA_TLIGHTUSERDATA:
+			k->p = pvalue(o);
+			break;
+		default:
+			k->p = gcvalue(o);
+	}
+	return ttype(o);
+}
+
+static RefEntry *findref(RefMap *rm, const RefKey *k, int tt)
+{
+	const unsigned char *b = (const unsigned char *)k;
+	size_t i, h = (size_t)tt;
+	for(i = 0; i < sizeof(RefKey); i++) {
+		h = h * 31 + b[i];
+	}
+	i = (h ^ (h >> 16)) & (rm->size - 1);
+	for(;;) {
+		RefEntry *e = &rm->entries[i];
+		if(e->ref == 0 ||
+		   (e->tt == tt && memcmp(&e->key, k, sizeof(RefKey)) == 0)) {
+			return e;
+		}
+		i = (i + 1) & (rm->size - 1);
+	}
+}
+
 /* Choose whether to do a regular or special persistence based on an object's
  * metatable. "default" is whether the object, if it doesn't have a __persist
  * entry, is literally persistable or not.
@@ -107,7 +238,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		if(defaction) {
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -127,7 +258,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		if(defaction) {
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -143,7 +274,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 					/* perms reftbl sptbl ... obj */
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -159,6 +290,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 	lua_pushvalue(pi->L, -3);
 					/* perms reftbl ... obj mt __persist obj */
 #ifdef PLUTO_PASS_USERDATA_TO_PERSIST
+	flushbuffer(pi);
 	lua_pushlightuserdata(pi->L, (void*)pi->writer);
 	lua_pushlightuserdata(pi->L, pi->ud);
 					/* perms reftbl ... obj mt __persist obj ud */
@@ -173,10 +305,11 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		lua_pushstring(pi->L, "__persist function did not return a function");
 		lua_error(pi->L);
 	}
+	anchorobject(pi);
 					/* perms reftbl ... obj mt func */
 	{
 		int one = 1;
-		pi->writer(pi->L, &one, sizeof(int), pi->ud);
+		pwrite(pi, &one, sizeof(int));
 	}
 	persist(pi);
 					/* perms reftbl ... obj mt func */
@@ -185,21 +318,160 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 	return 1;
 }
 
-static void persisttable(PersistInfo *pi)
+/* Gives the next id to the table on top of the stack. Both persisting and
+ * unpersisting give ids to literal tables in the order they appear in the
+ * hunk, so that later hunks can refer to the tables by id. */
+static void setsnapshotid(lua_State *L, int id)
 {
-					/* perms reftbl ... tbl */
-	lua_checkstack(pi->L, 3);
-	if(persistspecialobject(pi, 1)) {
-					/* perms reftbl ... tbl */
+					/* perms reftbl snap ... tbl */
+	lua_checkstack(L, 2);
+	lua_pushvalue(L, -1);
+	lua_pushinteger(L, id);
+					/* perms reftbl snap ... tbl tbl id */
+	lua_rawset(L, SNAPIDX);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, SNAPIDX, id);
+					/* perms reftbl snap ... tbl */
+}
+
+static int getsnapshotid(lua_State *L)
+{
+	int id;
+					/* perms reftbl snap ... tbl */
+	lua_checkstack(L, 1);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, SNAPIDX);
+	id = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return id;
+}
+
+/* Pushes the table of owners, which maps each table with snapshot flags
+ * to the snapshot they hold for. It is weak, so it keeps neither alive. */
+static void pushowners(lua_State *L)
+{
+	lua_checkstack(L, 3);
+	lua_getfield(L, LUA_REGISTRYINDEX, PLUTO_OWNERS);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "kv");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PLUTO_OWNERS);
+	}
+}
+
+/* Returns the snapshot flags of the table on top of the stack, or 0 if
+ * another snapshot set them */
+static int getsnapflags(lua_State *L)
+{
+	int flags = hvalue(getobject(L, -1))->snapflags;
+					/* perms reftbl snap owners ... tbl */
+	if(flags != 0) {
+		lua_checkstack(L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, OWNERSIDX);
+		if(!lua_rawequal(L, -1, SNAPIDX)) {
+			flags = 0;
+		}
+		lua_pop(L, 1);
+	}
+	return flags;
+}
+
+static void setsnapflags(lua_State *L, int flags)
+{
+					/* perms reftbl snap owners ... tbl */
+	lua_checkstack(L, 2);
+	lua_pushvalue(L, -1);
+	lua_pushvalue(L, SNAPIDX);
+	lua_rawset(L, OWNERSIDX);
+	hvalue(getobject(L, -1))->snapflags = (lu_byte)flags;
+}
+
+/* Clears the bits in *flags that the object on top of the stack, a key,
+ * value or the metatable of a table being written, does not allow */
+static void snapshotref(PersistInfo *pi, int *flags)
+{
+					/* perms reftbl snap owners pending ... obj */
+	switch(lua_type(pi->L, -1)) {
+		case LUA_TNIL:
+		case LUA_TBOOLEAN:
+		case LUA_TLIGHTUSERDATA:
+		case LUA_TNUMBER:
+		case LUA_TSTRING:
+			return;
+		case LUA_TTABLE:
+			if(getsnapshotid(pi->L) != 0) {
+				*flags &= ~PLUTO_LEAF;
+				return;
+			}
+			break;
+	}
+	/* Permanents do not change. Other objects may change without the
+	 * table changing, so the table is written every time. */
+	lua_checkstack(pi->L, 1);
+	lua_pushvalue(pi->L, -1);
+	lua_gettable(pi->L, 1);
+	if(lua_isnil(pi->L, -1)) {
+		*flags = 0;
+	}
+	lua_pop(pi->L, 1);
+}
+
+/* Queues the snapshot table on top of the stack, unless it is queued
+ * already or there is nothing to write or search in it */
+static void pendtable(PersistInfo *pi)
+{
+	int pending;
+					/* perms reftbl snap owners pending ... tbl */
+	if((getsnapflags(pi->L) & PLUTO_SKIP) == PLUTO_SKIP) {
 		return;
 	}
+	lua_checkstack(pi->L, 2);
+	lua_pushvalue(pi->L, -1);
+	lua_rawget(pi->L, PENDINGIDX);
+	pending = !lua_isnil(pi->L, -1);
+	lua_pop(pi->L, 1);
+	if(!pending) {
+		lua_pushvalue(pi->L, -1);
+		lua_pushboolean(pi->L, 1);
+		lua_rawset(pi->L, PENDINGIDX);
+		lua_pushvalue(pi->L, -1);
+		lua_rawseti(pi->L, PENDINGIDX, ++(pi->npending));
+	}
+}
+
+/* Writes the metatable and the contents of the table on top of the stack */
+static void persistliteraltable(PersistInfo *pi)
+{
+	Table *t = hvalue(getobject(pi->L, -1));
+	int flags = PLUTO_SKIP;
 					/* perms reftbl ... tbl */
+	lua_checkstack(pi->L, 3);
+	if(pi->snapshot) {
+		/* Lua clears the bit if the table is modified meanwhile */
+		t->snapflags |= PLUTO_CLEAN;
+	}
 	/* First, persist the metatable (if any) */
 	if(!lua_getmetatable(pi->L, -1)) {
 		lua_pushnil(pi->L);
 	}
 					/* perms reftbl ... tbl mt/nil */
 	persist(pi);
+	if(pi->snapshot && !lua_isnil(pi->L, -1)) {
+		snapshotref(pi, &flags);
+		/* The GC changes weak tables behind our back */
+		lua_pushstring(pi->L, "__mode");
+		lua_rawget(pi->L, -2);
+		if(!lua_isnil(pi->L, -1)) {
+			flags = 0;
+		}
+		lua_pop(pi->L, 1);
+	}
 	lua_pop(pi->L, 1);
 					/* perms reftbl ... tbl */
 
@@ -211,9 +483,15 @@ static void persisttable(PersistInfo *pi)
 		lua_pushvalue(pi->L, -2);
 					/* perms reftbl ... tbl k v k */
 		persist(pi);
+		if(pi->snapshot) {
+			snapshotref(pi, &flags);
+		}
 		lua_pop(pi->L, 1);
 					/* perms reftbl ... tbl k v */
 		persist(pi);
+		if(pi->snapshot) {
+			snapshotref(pi, &flags);
+		}
 		lua_pop(pi->L, 1);
 					/* perms reftbl ... tbl k */
 	}
@@ -224,6 +502,28 @@ static void persisttable(PersistInfo *pi)
 	persist(pi);
 	lua_pop(pi->L, 1);
 					/* perms reftbl ... tbl */
+	if(pi->snapshot) {
+		if(!(t->snapflags & PLUTO_CLEAN)) {
+			flags = 0;
+		}
+		setsnapflags(pi->L, flags);
+		pwrite(pi, &flags, sizeof(int));
+	}
+}
+
+static void persisttable(PersistInfo *pi)
+{
+					/* perms reftbl ... tbl */
+	lua_checkstack(pi->L, 3);
+	if(persistspecialobject(pi, 1)) {
+					/* perms reftbl ... tbl */
+		return;
+	}
+					/* perms reftbl ... tbl */
+	if(pi->snapshot) {
+		setsnapshotid(pi->L, ++(pi->lastid));
+	}
+	persistliteraltable(pi);
 }
 
 static void persistuserdata(PersistInfo *pi) {
@@ -235,8 +535,8 @@ static void persistuserdata(PersistInfo *pi) {
 	} else {
 	/* Use literal persistence */
 		size_t length = uvalue(getobject(pi->L, -1))->len;
-		pi->writer(pi->L, &length, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, lua_touserdata(pi->L, -1), length, pi->ud);
+		pwrite(pi, &length, sizeof(size_t));
+		pwrite(pi, lua_touserdata(pi->L, -1), length);
 		if(!lua_getmetatable(pi->L, -1)) {
 					/* perms reftbl ... udata */
 			lua_pushnil(pi->L);
@@ -302,7 +602,7 @@ static void persistfunction(PersistInfo *pi)
 		{
 			/* We don't really _NEED_ the number of upvals,
 			 * but it'll simplify things a bit */
-			pi->writer(pi->L, &cl->l.p->nups, sizeof(lu_byte), pi->ud);
+			pwrite(pi, &cl->l.p->nups, sizeof(lu_byte));
 		}
 		/* Persist prototype */
 		{
@@ -394,7 +694,7 @@ static void persistproto(PersistInfo *pi)
 	/* Persist constant refs */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizek, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizek, sizeof(int));
 		for(i=0; i<p->sizek; i++) {
 			LIF(A,pushobject)(pi->L, &p->k[i]);
 					/* perms reftbl ... proto const */
@@ -408,7 +708,7 @@ static void persistproto(PersistInfo *pi)
 	/* serialize inner Proto refs */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizep, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizep, sizeof(int));
 		for(i=0; i<p->sizep; i++)
 		{
 			pushproto(pi->L, p->p[i]);
@@ -421,15 +721,15 @@ static void persistproto(PersistInfo *pi)
 					/* perms reftbl ... proto */
 	/* Serialize code */
 	{
-		pi->writer(pi->L, &p->sizecode, sizeof(int), pi->ud);
-		pi->writer(pi->L, p->code, sizeof(Instruction) * p->sizecode, pi->ud);
+		pwrite(pi, &p->sizecode, sizeof(int));
+		pwrite(pi, p->code, sizeof(Instruction) * p->sizecode);
 	}
 	/* Serialize misc values */
 	{
-		pi->writer(pi->L, &p->nups, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->numparams, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->is_vararg, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->maxstacksize, sizeof(lu_byte), pi->ud);
+		pwrite(pi, &p->nups, sizeof(lu_byte));
+		pwrite(pi, &p->numparams, sizeof(lu_byte));
+		pwrite(pi, &p->is_vararg, sizeof(lu_byte));
+		pwrite(pi, &p->maxstacksize, sizeof(lu_byte));
 	}
 	/* We do not currently persist upvalue names, local variable names,
 	 * variable lifetimes, line info, or source code. */
@@ -465,7 +765,7 @@ static void persistthread(PersistInfo *pi)
 	/* Persist the stack */
 	posremaining = revappendstack(L2, pi->L);
 					/* perms reftbl ... thr (rev'ed contents of L2) */
-	pi->writer(pi->L, &posremaining, sizeof(size_t), pi->ud);
+	pwrite(pi, &posremaining, sizeof(size_t));
 	for(; posremaining > 0; posremaining--) {
 		persist(pi);
 		lua_pop(pi->L, 1);
@@ -474,7 +774,7 @@ static void persistthread(PersistInfo *pi)
 	/* Now, persist the CallInfo stack. */
 	{
 		size_t i, numframes = (L2->ci - L2->base_ci) + 1;
-		pi->writer(pi->L, &numframes, sizeof(size_t), pi->ud);
+		pwrite(pi, &numframes, sizeof(size_t));
 		for(i=0; i<numframes; i++) {
 			CallInfo *ci = L2->base_ci + i;
 			size_t stackbase = ci->base - L2->stack;
@@ -483,11 +783,11 @@ static void persistthread(PersistInfo *pi)
 			size_t savedpc = (ci != L2->base_ci) ?
 				ci->savedpc - ci_func(ci)->l.p->code :
 				0;
-			pi->writer(pi->L, &stackbase, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &stackfunc, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &stacktop, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &ci->nresults, sizeof(int), pi->ud);
-			pi->writer(pi->L, &savedpc, sizeof(size_t), pi->ud);
+			pwrite(pi, &stackbase, sizeof(size_t));
+			pwrite(pi, &stackfunc, sizeof(size_t));
+			pwrite(pi, &stacktop, sizeof(size_t));
+			pwrite(pi, &ci->nresults, sizeof(int));
+			pwrite(pi, &savedpc, sizeof(size_t));
 		}
 	}
 
@@ -496,10 +796,10 @@ static void persistthread(PersistInfo *pi)
 		size_t stackbase = L2->base - L2->stack;
 		size_t stacktop = L2->top - L2->stack;
 		lua_assert(L2->nCcalls <= 1);
-		pi->writer(pi->L, &L2->status, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &stackbase, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, &stacktop, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, &L2->errfunc, sizeof(ptrdiff_t), pi->ud);
+		pwrite(pi, &L2->status, sizeof(lu_byte));
+		pwrite(pi, &stackbase, sizeof(size_t));
+		pwrite(pi, &stacktop, sizeof(size_t));
+		pwrite(pi, &L2->errfunc, sizeof(ptrdiff_t));
 	}
 
 	/* Finally, record upvalues which need to be reopened */
@@ -520,7 +820,7 @@ static void persistthread(PersistInfo *pi)
 			lua_pop(pi->L, 1);
 					/* perms reftbl ... thr */
 			stackpos = uv->v - L2->stack;
-			pi->writer(pi->L, &stackpos, sizeof(size_t), pi->ud);
+			pwrite(pi, &stackpos, sizeof(size_t));
 		}
 					/* perms reftbl ... thr */
 		lua_pushnil(pi->L);
@@ -535,63 +835,103 @@ static void persistthread(PersistInfo *pi)
 static void persistboolean(PersistInfo *pi)
 {
 	int b = lua_toboolean(pi->L, -1);
-	pi->writer(pi->L, &b, sizeof(int), pi->ud);
+	pwrite(pi, &b, sizeof(int));
 }
 
 static void persistlightuserdata(PersistInfo *pi)
 {
 	void *p = lua_touserdata(pi->L, -1);
-	pi->writer(pi->L, &p, sizeof(void *), pi->ud);
+	pwrite(pi, &p, sizeof(void *));
 }
 
 static void persistnumber(PersistInfo *pi)
 {
 	lua_Number n = lua_tonumber(pi->L, -1);
-	pi->writer(pi->L, &n, sizeof(lua_Number), pi->ud);
+	pwrite(pi, &n, sizeof(lua_Number));
 }
 
 static void persiststring(PersistInfo *pi)
 {
 	size_t length = lua_strlen(pi->L, -1);
-	pi->writer(pi->L, &length, sizeof(size_t), pi->ud);
-	pi->writer(pi->L, lua_tostring(pi->L, -1), length, pi->ud);
+	pwrite(pi, &length, sizeof(size_t));
+	pwrite(pi, lua_tostring(pi->L, -1), length);
+}
+
+/* Records that the object on top of the stack has reference 'ref' */
+static void addref(PersistInfo *pi, const RefKey *k, int tt, int ref)
+{
+	RefMap *rm = pi->refs;
+	RefEntry *e;
+	if((rm->count + 1) * 4 > rm->size * 3) {
+		/* Rehash into a map twice as large, which replaces the old one */
+		size_t i;
+		RefMap *nrm = newrefmap(pi->L, rm->size * 2);
+					/* perms reftbl ... obj reftbl' */
+		for(i = 0; i < rm->size; i++) {
+			if(rm->entries[i].ref != 0) {
+				*findref(nrm, &rm->entries[i].key, rm->entries[i].tt) =
+					rm->entries[i];
+			}
+		}
+		nrm->count = rm->count;
+		nrm->anchored = rm->anchored;
+		lua_getfenv(pi->L, 2);
+		lua_setfenv(pi->L, -2);
+		lua_replace(pi->L, 2);
+					/* perms reftbl' ... obj */
+		pi->refs = rm = nrm;
+	}
+	e = findref(rm, k, tt);
+	e->key = *k;
+	e->tt = tt;
+	e->ref = ref;
+	rm->count++;
+}
+
+/* Keeps the object on top of the stack alive until persisting is done */
+static void anchorobject(PersistInfo *pi)
+{
+					/* perms reftbl ... obj */
+	lua_checkstack(pi->L, 2);
+	lua_getfenv(pi->L, 2);
+					/* perms reftbl ... obj anchors */
+	lua_pushvalue(pi->L, -2);
+	lua_rawseti(pi->L, -2, ++pi->refs->anchored);
+	lua_pop(pi->L, 1);
+					/* perms reftbl ... obj */
 }
 
 /* Top-level delegating persist function
  */
 static void persist(PersistInfo *pi)
 {
+	RefKey key;
+	int tt;
 					/* perms reftbl ... obj */
 	lua_checkstack(pi->L, 2);
 	/* If the object has already been written, write a reference to it */
-	lua_pushvalue(pi->L, -1);
-					/* perms reftbl ... obj obj */
-	lua_rawget(pi->L, 2);
-					/* perms reftbl ... obj ref? */
-	if(!lua_isnil(pi->L, -1)) {
-					/* perms reftbl ... obj ref */
-		int zero = 0;
-		int ref = (int)lua_touserdata(pi->L, -1);
-		pi->writer(pi->L, &zero, sizeof(int), pi->ud);
-		pi->writer(pi->L, &ref, sizeof(int), pi->ud);
-		lua_pop(pi->L, 1);
-					/* perms reftbl ... obj ref */
+	tt = getrefkey(pi->L, &key);
+	{
+		int ref = findref(pi->refs, &key, tt)->ref;
+		if(ref != 0) {
+			int zero = 0;
+			pwrite(pi, &zero, sizeof(int));
+			pwrite(pi, &ref, sizeof(int));
 #ifdef PLUTO_DEBUG
-		printindent(pi->level);
-		printf("0 %d\n", ref);
+			printindent(pi->level);
+			printf("0 %d\n", ref);
 #endif
-		return;
+			return;
+		}
 	}
-					/* perms reftbl ... obj nil */
-	lua_pop(pi->L, 1);
 					/* perms reftbl ... obj */
 	/* If the object is nil, write the pseudoreference 0 */
 	if(lua_isnil(pi->L, -1)) {
 		int zero = 0;
 		/* firsttime */
-		pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+		pwrite(pi, &zero, sizeof(int));
 		/* ref */
-		pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+		pwrite(pi, &zero, sizeof(int));
 #ifdef PLUTO_DEBUG
 		printindent(pi->level);
 		printf("0 0\n");
@@ -601,16 +941,11 @@ static void persist(PersistInfo *pi)
 	{
 		/* indicate that it's the first time */
 		int one = 1;
-		pi->writer(pi->L, &one, sizeof(int), pi->ud);
+		pwrite(pi, &one, sizeof(int));
 	}
-	lua_pushvalue(pi->L, -1);
-					/* perms reftbl ... obj obj */
-	lua_pushlightuserdata(pi->L, (void*)(++(pi->counter)));
-					/* perms reftbl ... obj obj ref */
-	lua_rawset(pi->L, 2);
-					/* perms reftbl ... obj */
+	addref(pi, &key, tt, ++(pi->counter));
 
-	pi->writer(pi->L, &pi->counter, sizeof(int), pi->ud);
+	pwrite(pi, &pi->counter, sizeof(int));
 
 
 	/* At this point, we'll give the permanents table a chance to play. */
@@ -627,7 +962,7 @@ static void persist(PersistInfo *pi)
 			printf("1 %d PERM\n", pi->counter);
 			pi->level++;
 #endif
-			pi->writer(pi->L, &type, sizeof(int), pi->ud);
+			pwrite(pi, &type, sizeof(int));
 			persist(pi);
 			lua_pop(pi->L, 1);
 					/* perms reftbl ... obj */
@@ -642,9 +977,21 @@ static void persist(PersistInfo *pi)
 		}
 					/* perms reftbl ... obj */
 	}
+	/* Tables of the snapshot are written as their id. Their contents
+	 * are written later if they have changed. */
+	if(pi->snapshot && lua_istable(pi->L, -1)) {
+		int id = getsnapshotid(pi->L);
+		if(id != 0) {
+			int type = PLUTO_TSNAPSHOT;
+			pwrite(pi, &type, sizeof(int));
+			pwrite(pi, &id, sizeof(int));
+			pendtable(pi);
+			return;
+		}
+	}
 	{
 		int type = lua_type(pi->L, -1);
-		pi->writer(pi->L, &type, sizeof(int), pi->ud);
+		pwrite(pi, &type, sizeof(int));
 
 #ifdef PLUTO_DEBUG
 		printindent(pi->level);
@@ -692,7 +1039,62 @@ static void persist(PersistInfo *pi)
 #endif
 }
 
-void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
+/* Queues the object on top of the stack if it is a table of the snapshot
+ * that needs to be written or searched */
+static void searchref(PersistInfo *pi)
+{
+	if(lua_istable(pi->L, -1) &&
+	   (getsnapflags(pi->L) & PLUTO_SKIP) != PLUTO_SKIP &&
+	   getsnapshotid(pi->L) != 0) {
+		pendtable(pi);
+	}
+}
+
+/* Queues the tables of the snapshot that a clean table refers to */
+static void searchtable(PersistInfo *pi)
+{
+					/* perms reftbl snap owners pending ... tbl */
+	lua_checkstack(pi->L, 3);
+	if(lua_getmetatable(pi->L, -1)) {
+		searchref(pi);
+		lua_pop(pi->L, 1);
+	}
+	lua_pushnil(pi->L);
+	while(lua_next(pi->L, -2)) {
+					/* perms reftbl snap owners pending ... tbl k v */
+		searchref(pi);
+		lua_pop(pi->L, 1);
+		searchref(pi);
+					/* perms reftbl snap owners pending ... tbl k */
+	}
+}
+
+/* Writes the tables of the snapshot that have changed, as their id
+ * followed by their contents, and searches the unchanged ones that were
+ * queued for more. The list ends with id 0. */
+static void persistpending(PersistInfo *pi)
+{
+	int i;
+	int zero = 0;
+	lua_checkstack(pi->L, 1);
+	for(i = 1; i <= pi->npending; i++) {
+		lua_rawgeti(pi->L, PENDINGIDX, i);
+					/* perms reftbl snap owners pending ... tbl */
+		if(getsnapflags(pi->L) & PLUTO_CLEAN) {
+			searchtable(pi);
+		} else {
+			int id = getsnapshotid(pi->L);
+			pwrite(pi, &id, sizeof(int));
+			persistliteraltable(pi);
+		}
+		lua_pop(pi->L, 1);
+					/* perms reftbl snap owners pending ... */
+	}
+	pwrite(pi, &zero, sizeof(int));
+}
+
+static void persistobjects(lua_State *L, lua_Chunkwriter writer, void *ud,
+	int snapshot)
 {
 	PersistInfo pi;
 
@@ -700,57 +1102,85 @@ void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
 	pi.L = L;
 	pi.writer = writer;
 	pi.ud = ud;
+	pi.snapshot = snapshot;
+	pi.lastid = 0;
+	pi.npending = 0;
+	pi.buflen = 0;
 #ifdef PLUTO_DEBUG
 	pi.level = 0;
 #endif
 
-	lua_checkstack(L, 4);
-					/* perms? rootobj? ...? */
-	lua_assert(lua_gettop(L) == 2);
-					/* perms rootobj */
-	lua_assert(!lua_isnil(L, 2));
-					/* perms rootobj */
+	lua_checkstack(L, 5);
+					/* perms? [snap?] rootobj? ...? */
+	lua_assert(lua_gettop(L) == 2 + snapshot);
+					/* perms [snap] rootobj */
+	lua_assert(!lua_isnil(L, -1));
+					/* perms [snap] rootobj */
+	/* The reference map is not a table, so the GC never sees the
+	 * upvalues and prototypes in it. */
+	pi.refs = newrefmap(L, REFMAP_MINSIZE);
+					/* perms [snap] rootobj reftbl */
 	lua_newtable(L);
-					/* perms rootobj reftbl */
-
-	/* Now we're going to make the table weakly keyed. This prevents the
-	 * GC from visiting it and trying to mark things it doesn't want to
-	 * mark in tables, e.g. upvalues. All objects in the table are
-	 * a priori reachable, so it doesn't matter that we do this. */
-	lua_newtable(L);
-					/* perms rootobj reftbl mt */
-	lua_pushstring(L, "__mode");
-					/* perms rootobj reftbl mt "__mode" */
-	lua_pushstring(L, "k");
-					/* perms rootobj reftbl mt "__mode" "k" */
-	lua_settable(L, 4);
-					/* perms rootobj reftbl mt */
-	lua_setmetatable(L, 3);
-					/* perms rootobj reftbl */
+	lua_setfenv(L, -2);
 	lua_insert(L, 2);
-					/* perms reftbl rootobj */
+					/* perms reftbl [snap] rootobj */
+	if(snapshot) {
+		/* The hunk starts with the last id it knows of, which must
+		 * match when it is unpersisted */
+		lua_rawgeti(L, SNAPIDX, 0);
+		pi.lastid = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		pwrite(&pi, &pi.lastid, sizeof(int));
+		pushowners(L);
+		lua_insert(L, OWNERSIDX);
+		lua_newtable(L);
+		lua_insert(L, PENDINGIDX);
+					/* perms reftbl snap owners pending rootobj */
+	}
 	persist(&pi);
-					/* perms reftbl rootobj */
+	if(snapshot) {
+		persistpending(&pi);
+		lua_remove(L, PENDINGIDX);
+		lua_remove(L, OWNERSIDX);
+		lua_pushinteger(L, pi.lastid);
+		lua_rawseti(L, SNAPIDX, 0);
+					/* perms reftbl snap rootobj */
+	}
+	flushbuffer(&pi);
+					/* perms reftbl [snap] rootobj */
 	lua_remove(L, 2);
-					/* perms rootobj */
+					/* perms [snap] rootobj */
+}
+
+void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
+{
+	persistobjects(L, writer, ud, 0);
+}
+
+void pluto_persistsnapshot(lua_State *L, lua_Chunkwriter writer, void *ud)
+{
+	persistobjects(L, writer, ud, 1);
 }
 
 typedef struct WriterInfo_t {
 	char* buf;
 	size_t buflen;
+	size_t bufsize;
 } WriterInfo;
 
 static int bufwriter (lua_State *L, const void* p, size_t sz, void* ud) {
-	const char* cp = (const char*)p;
 	WriterInfo *wi = (WriterInfo *)ud;
 
-	LIF(M,reallocvector)(L, wi->buf, wi->buflen, wi->buflen+sz, char);
-	while(sz)
-	{
-		/* how dearly I love ugly C pointer twiddling */
-		wi->buf[wi->buflen++] = *cp++;
-		sz--;
+	if(sz > wi->bufsize - wi->buflen) {
+		size_t newsize = wi->bufsize ? wi->bufsize * 2 : PLUTO_BUFSIZE * 4;
+		while(newsize - wi->buflen < sz) {
+			newsize *= 2;
+		}
+		LIF(M,reallocvector)(L, wi->buf, wi->bufsize, newsize, char);
+		wi->bufsize = newsize;
 	}
+	memcpy(wi->buf + wi->buflen, p, sz);
+	wi->buflen += sz;
 	return 0;
 }
 
@@ -761,27 +1191,42 @@ int persist_l(lua_State *L)
 
 	wi.buf = NULL;
 	wi.buflen = 0;
+	wi.bufsize = 0;
 
-	lua_settop(L, 2);
-					/* perms? rootobj? */
+	lua_settop(L, 3);
+					/* perms? rootobj? snap? */
 	luaL_checktype(L, 1, LUA_TTABLE);
-					/* perms rootobj? */
+					/* perms rootobj? snap? */
 	luaL_checktype(L, 1, LUA_TTABLE);
-					/* perms rootobj */
+					/* perms rootobj snap? */
 
-	pluto_persist(L, bufwriter, &wi);
+	if(lua_isnil(L, 3)) {
+		lua_pop(L, 1);
+					/* perms rootobj */
+		pluto_persist(L, bufwriter, &wi);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_insert(L, 2);
+					/* perms snap rootobj */
+		pluto_persistsnapshot(L, bufwriter, &wi);
+	}
 
 	lua_settop(L, 0);
 					/* (empty) */
 	lua_pushlstring(L, wi.buf, wi.buflen);
 					/* str */
-	pdep_freearray(L, wi.buf, wi.buflen, char);
+	pdep_freearray(L, wi.buf, wi.bufsize, char);
 	return 1;
 }
 
+typedef struct RefArray_t RefArray;
+
 typedef struct UnpersistInfo_t {
 	lua_State *L;
 	ZIO zio;
+	RefArray *refs;
+	int snapshot;		/* whether unpersisting to a snapshot */
+	int lastid;
 #ifdef PLUTO_DEBUG
 	int level;
 #endif
@@ -792,15 +1237,46 @@ static void unpersist(UnpersistInfo *upi);
 /* The object is left on the stack. This is primarily used by unpersist, but
  * may be used by GCed objects that may incur cycles in order to preregister
  * the object. */
+/* Unpersisted objects are found by reference in an array of values, in a
+ * userdata that takes the place of the reference table. The GC does not
+ * see the array, which is safe since it is stopped while unpersisting. */
+struct RefArray_t {
+	int size;
+	TValue objs[1];
+};
+
+#define REFARRAY_MINSIZE 1024
+
+static RefArray *newrefarray(lua_State *L, int size)
+{
+	int i;
+	RefArray *ra = (RefArray *)lua_newuserdata(L,
+		sizeof(RefArray) + (size - 1) * sizeof(TValue));
+	ra->size = size;
+	for(i = 0; i < size; i++) {
+		setnilvalue(&ra->objs[i]);
+	}
+	return ra;
+}
+
 static void registerobject(int ref, UnpersistInfo *upi)
 {
 					/* perms reftbl ... obj */
-	lua_checkstack(upi->L, 2);
-	lua_pushlightuserdata(upi->L, (void*)ref);
-					/* perms reftbl ... obj ref */
-	lua_pushvalue(upi->L, -2);
-					/* perms reftbl ... obj ref obj */
-	lua_settable(upi->L, 2);
+	RefArray *ra = upi->refs;
+	lua_assert(ref > 0);
+	if(ref >= ra->size) {
+		/* Move to an array large enough, which replaces the old one */
+		int size = ra->size * 2;
+		while(size <= ref) {
+			size *= 2;
+		}
+		lua_checkstack(upi->L, 1);
+		upi->refs = newrefarray(upi->L, size);
+		memcpy(upi->refs->objs, ra->objs, ra->size * sizeof(TValue));
+		lua_replace(upi->L, 2);
+		ra = upi->refs;
+	}
+	setobj(upi->L, &ra->objs[ref], getobject(upi->L, -1));
 					/* perms reftbl ... obj */
 }
 
@@ -837,15 +1313,21 @@ static void unpersistnumber(UnpersistInfo *upi)
 static void unpersiststring(UnpersistInfo *upi)
 {
 					/* perms reftbl sptbl ref */
-	int length;
-	char* string;
+	size_t length;
 	lua_checkstack(upi->L, 1);
-	verify(LIF(Z,read)(&upi->zio, &length, sizeof(int)) == 0);
-	string = pdep_newvector(upi->L, length, char);
-	verify(LIF(Z,read)(&upi->zio, string, length) == 0);
-	lua_pushlstring(upi->L, string, length);
+	verify(LIF(Z,read)(&upi->zio, &length, sizeof(size_t)) == 0);
+	if(upi->zio.n >= length) {
+		/* Whole string in the current block: no need to copy it twice */
+		lua_pushlstring(upi->L, upi->zio.p, length);
+		upi->zio.p += length;
+		upi->zio.n -= length;
+	} else {
+		char* string = pdep_newvector(upi->L, length, char);
+		verify(LIF(Z,read)(&upi->zio, string, length) == 0);
+		lua_pushlstring(upi->L, string, length);
+		pdep_freearray(upi->L, string, length, char);
+	}
 					/* perms reftbl sptbl ref str */
-	pdep_freearray(upi->L, string, length, char);
 }
 
 static void unpersistspecialtable(int ref, UnpersistInfo *upi)
@@ -862,15 +1344,11 @@ static void unpersistspecialtable(int ref, UnpersistInfo *upi)
 					/* perms reftbl ... tbl */
 }
 
-static void unpersistliteraltable(int ref, UnpersistInfo *upi)
+/* Reads the metatable and the contents of the table on top of the stack */
+static void unpersisttablecontents(UnpersistInfo *upi)
 {
-					/* perms reftbl ... */
-	lua_checkstack(upi->L, 3);
-	/* Preregister table for handling of cycles */
-	lua_newtable(upi->L);
-					/* perms reftbl ... tbl */
-	registerobject(ref, upi);
 					/* perms reftbl ... tbl */
+	lua_checkstack(upi->L, 3);
 	/* Unpersist metatable */
 	{
 		unpersist(upi);
@@ -908,6 +1386,27 @@ static void unpersistliteraltable(int ref, UnpersistInfo *upi)
 		lua_rawset(upi->L, -3);
 					/* perms reftbl ... tbl */
 	}
+	if(upi->snapshot) {
+		int flags;
+		verify(LIF(Z,read)(&upi->zio, &flags, sizeof(int)) == 0);
+		setsnapflags(upi->L, flags);
+	}
+}
+
+static void unpersistliteraltable(int ref, UnpersistInfo *upi)
+{
+					/* perms reftbl ... */
+	lua_checkstack(upi->L, 1);
+	/* Preregister table for handling of cycles */
+	lua_newtable(upi->L);
+					/* perms reftbl ... tbl */
+	registerobject(ref, upi);
+					/* perms reftbl ... tbl */
+	if(upi->snapshot) {
+		setsnapshotid(upi->L, ++(upi->lastid));
+	}
+	unpersisttablecontents(upi);
+					/* perms reftbl ... tbl */
 }
 
 static void unpersisttable(int ref, UnpersistInfo *upi)
@@ -1367,20 +1866,67 @@ static void unpersistpermanent(int ref, UnpersistInfo *upi)
 					/* perms reftbl perm */
 }
 
+static void snapshoterror(UnpersistInfo *upi, const char *msg)
+{
+	lua_gc(upi->L, LUA_GCRESTART, 0);
+	lua_pushstring(upi->L, msg);
+	lua_error(upi->L);
+}
+
+static void pushsnapshottable(UnpersistInfo *upi, int id)
+{
+					/* perms reftbl snap ... */
+	lua_checkstack(upi->L, 1);
+	lua_rawgeti(upi->L, SNAPIDX, id);
+	if(!lua_istable(upi->L, -1)) {
+		snapshoterror(upi, "Table not found in snapshot");
+	}
+					/* perms reftbl snap ... tbl */
+}
+
+static void unpersistsnapshot(UnpersistInfo *upi)
+{
+	int id;
+					/* perms reftbl snap ... */
+	verify(LIF(Z,read)(&upi->zio, &id, sizeof(int)) == 0);
+	pushsnapshottable(upi, id);
+					/* perms reftbl snap ... tbl */
+}
+
+/* Replaces the contents of the tables of the snapshot that have changed */
+static void unpersistpending(UnpersistInfo *upi)
+{
+	int id;
+					/* perms reftbl snap owners rootobj */
+	lua_checkstack(upi->L, 3);
+	for(;;) {
+		verify(LIF(Z,read)(&upi->zio, &id, sizeof(int)) == 0);
+		if(id == 0) {
+			break;
+		}
+		pushsnapshottable(upi, id);
+					/* perms reftbl snap owners rootobj tbl */
+		lua_pushnil(upi->L);
+		lua_setmetatable(upi->L, -2);
+		lua_pushnil(upi->L);
+		while(lua_next(upi->L, -2)) {
+					/* perms reftbl snap owners rootobj tbl k v */
+			lua_pop(upi->L, 1);
+			lua_pushvalue(upi->L, -1);
+			lua_pushnil(upi->L);
+			lua_rawset(upi->L, -4);
+					/* perms reftbl snap owners rootobj tbl k */
+		}
+		unpersisttablecontents(upi);
+		lua_pop(upi->L, 1);
+					/* perms reftbl snap owners rootobj */
+	}
+}
+
 /* For debugging only; not called when lua_assert is empty */
-static int inreftable(lua_State *L, int ref)
+static int inreftable(UnpersistInfo *upi, int ref)
 {
-	int res;
-	lua_checkstack(L, 1);
-					/* perms reftbl ... */
-	lua_pushlightuserdata(L, (void*)ref);
-					/* perms reftbl ... ref */
-	lua_gettable(L, 2);
-					/* perms reftbl ... obj? */
-	res = !lua_isnil(L, -1);
-	lua_pop(L, 1);
-					/* perms reftbl ... */
-	return res;
+	return ref < upi->refs->size && !ttisnil(&upi->refs->objs[ref]);
 }
 
 static void unpersist(UnpersistInfo *upi)
@@ -1394,7 +1940,7 @@ static void unpersist(UnpersistInfo *upi)
 		int ref;
 		int type;
 		LIF(Z,read)(&upi->zio, &ref, sizeof(int));
-		lua_assert(!inreftable(upi->L, ref));
+		lua_assert(!inreftable(upi, ref));
 		LIF(Z,read)(&upi->zio, &type, sizeof(int));
 #ifdef PLUTO_DEBUG
 		printindent(upi->level);
@@ -1435,12 +1981,16 @@ static void unpersist(UnpersistInfo *upi)
 		case PLUTO_TPERMANENT:
 			unpersistpermanent(ref, upi);
 			break;
+		case PLUTO_TSNAPSHOT:
+			unpersistsnapshot(upi);
+			break;
 		default:
 			lua_assert(0);
 		}
 					/* perms reftbl ... obj */
 		lua_assert(lua_type(upi->L, -1) == type ||
 			type == PLUTO_TPERMANENT ||
+			(type == PLUTO_TSNAPSHOT && lua_istable(upi->L, -1)) ||
 			/* Remember, upvalues get a special dispensation, as
 			 * described in boxupval */
 			(lua_type(upi->L, -1) == LUA_TFUNCTION &&
@@ -1461,11 +2011,12 @@ static void unpersist(UnpersistInfo *upi)
 			lua_pushnil(upi->L);
 					/* perms reftbl ... nil */
 		} else {
-			lua_pushlightuserdata(upi->L, (void*)ref);
-					/* perms reftbl ... ref */
-			lua_gettable(upi->L, 2);
-					/* perms reftbl ... obj? */
-			lua_assert(!lua_isnil(upi->L, -1));
+			lua_assert(inreftable(upi, ref));
+			if(ref < upi->refs->size) {
+				LIF(A,pushobject)(upi->L, &upi->refs->objs[ref]);
+			} else {
+				lua_pushnil(upi->L);
+			}
 		}
 					/* perms reftbl ... obj/nil */
 	}
@@ -1473,7 +2024,8 @@ static void unpersist(UnpersistInfo *upi)
 	lua_assert(lua_gettop(upi->L) == stacksize + 1);
 }
 
-void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
+static void unpersistobjects(lua_State *L, lua_Chunkreader reader,
+	void *ud, int snapshot)
 {
 	/* We use the graciously provided ZIO (what the heck does the Z stand
 	 * for?) library so that we don't have to deal with the reader directly.
@@ -1482,6 +2034,8 @@ void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
 	 */
 	UnpersistInfo upi;
 	upi.L = L;
+	upi.snapshot = snapshot;
+	upi.lastid = 0;
 #ifdef PLUTO_DEBUG
 	upi.level = 0;
 #endif
@@ -1489,19 +2043,49 @@ void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
 	lua_checkstack(L, 3);
 	LIF(Z,init)(L, &upi.zio, reader, ud);
 
-					/* perms */
-	lua_newtable(L);
-					/* perms reftbl */
+					/* perms [snap] */
 	lua_gc(L, LUA_GCSTOP, 0);
+	upi.refs = newrefarray(L, REFARRAY_MINSIZE);
+	lua_insert(L, 2);
+					/* perms reftbl [snap] */
+	if(snapshot) {
+		int lastid;
+		lua_rawgeti(L, SNAPIDX, 0);
+		upi.lastid = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		verify(LIF(Z,read)(&upi.zio, &lastid, sizeof(int)) == 0);
+		if(lastid != upi.lastid) {
+			snapshoterror(&upi, "Hunk does not follow the snapshot");
+		}
+		pushowners(L);
+					/* perms reftbl snap owners */
+	}
 	unpersist(&upi);
+					/* perms reftbl [snap owners] rootobj */
+	if(snapshot) {
+		unpersistpending(&upi);
+		lua_remove(L, OWNERSIDX);
+		lua_pushinteger(L, upi.lastid);
+		lua_rawseti(L, SNAPIDX, 0);
+	}
 	lua_gc(L, LUA_GCRESTART, 0);
-					/* perms reftbl rootobj */
-	lua_replace(L, 2);
-					/* perms rootobj  */
+					/* perms reftbl [snap] rootobj */
+	lua_remove(L, 2);
+					/* perms [snap] rootobj  */
+}
+
+void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
+{
+	unpersistobjects(L, reader, ud, 0);
+}
+
+void pluto_unpersistsnapshot(lua_State *L, lua_Chunkreader reader, void *ud)
+{
+	unpersistobjects(L, reader, ud, 1);
 }
 
 typedef struct LoadInfo_t {
-  char *buf;
+  const char *buf;
   size_t size;
 } LoadInfo;
 
@@ -1519,33 +2103,47 @@ static const char *bufreader(lua_State *L, void *ud, size_t *sz) {
 int unpersist_l(lua_State *L)
 {
 	LoadInfo li;
-	char const *origbuf;
-	char *tempbuf;
-	size_t bufsize;
-					/* perms? str? ...? */
-	lua_settop(L, 2);
-					/* perms? str? */
-	origbuf = luaL_checklstring(L, 2, &bufsize);
-	tempbuf = LIF(M,newvector)(L, bufsize, char);
-	memcpy(tempbuf, origbuf, bufsize);
-
-	li.buf = tempbuf;
-	li.size = bufsize;
-
-					/* perms? str */
-	lua_pop(L, 1);
-					/* perms? */
+					/* perms? str? snap? ...? */
+	lua_settop(L, 3);
+					/* perms? str? snap? */
+	li.buf = luaL_checklstring(L, 2, &li.size);
 	luaL_checktype(L, 1, LUA_TTABLE);
+	if(!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+					/* perms str snap/nil */
+	/* The string is read in place. Once off the stack only the stopped
+	 * GC keeps it alive, and pluto_unpersist restarts the GC when done. */
+	lua_gc(L, LUA_GCSTOP, 0);
+	lua_remove(L, 2);
+					/* perms snap/nil */
+	if(lua_isnil(L, 2)) {
+		lua_pop(L, 1);
 					/* perms */
-	pluto_unpersist(L, bufreader, &li);
+		pluto_unpersist(L, bufreader, &li);
 					/* perms rootobj */
-	LIF(M,freearray)(L, tempbuf, bufsize, char);
+	} else {
+		pluto_unpersistsnapshot(L, bufreader, &li);
+					/* perms snap rootobj */
+	}
+	return 1;
+}
+
+/* A snapshot maps the tables written to it to their ids and back; [0]
+ * holds the last id given. It keeps the tables alive, so that later hunks
+ * can always refer to them. */
+int snapshot_l(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, -2, 0);
 	return 1;
 }
 
 static luaL_reg pluto_reg[] = {
 	{ "persist", persist_l },
 	{ "unpersist", unpersist_l },
+	{ "snapshot", snapshot_l },
 	{ NULL, NULL }
 };
 
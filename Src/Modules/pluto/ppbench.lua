@@ -0,0 +1,93 @@
+-- $Id$
+
+-- Benchmark for pluto.persist and pluto.unpersist
+--
+-- Builds a heap of records (tables with numbers, strings, shared
+-- subtables and closures) of about the given size in megabytes, then
+-- persists and unpersists it and prints the throughput of each. Then
+-- does the same with snapshots: a full one, and one after changing 1% of
+-- the records.
+--
+-- usage: lua ppbench.lua [megabytes]    (default 64; 1024 for 1 GB)
+
+require "pluto"
+
+local mb = tonumber(arg and arg[1]) or 64
+
+local shared = { kind = "shared", 1, 2, 3 }
+
+local function record(i)
+	local name = "record" .. i
+	return {
+		id = i,
+		name = name,
+		score = i * 0.5,
+		active = i % 2 == 0,
+		tags = { "a" .. i % 100, "b" .. i % 7, shared },
+		pos = { x = i, y = -i, z = i / 3 },
+		get = function() return name end,
+	}
+end
+
+collectgarbage()
+local base = collectgarbage("count")
+local root = {}
+local i = 0
+while (collectgarbage("count") - base) < mb * 1024 do
+	for j = 1, 1000 do
+		i = i + 1
+		root[i] = record(i)
+	end
+end
+local heap = (collectgarbage("count") - base) / 1024
+print(string.format("heap: %.0f MB, %d records", heap, i))
+
+local perms = { [_G] = "_G" }
+local uperms = { _G = _G }
+
+local t = os.clock()
+local s = pluto.persist(perms, root)
+t = os.clock() - t
+print(string.format("persist:   %6.2f s  %7.1f MB/s of heap  (%.0f MB written)",
+	t, heap / t, #s / 1048576))
+
+t = os.clock()
+local copy = pluto.unpersist(uperms, s)
+t = os.clock() - t
+print(string.format("unpersist: %6.2f s  %7.1f MB/s of heap", t, heap / t))
+
+assert(#copy == #root)
+assert(copy[1].get() == "record1" and copy[i].pos.x == i)
+assert(copy[1].tags[3] == copy[2].tags[3])
+
+-- Tables that hold functions are written to every snapshot, since the
+-- functions may change without the table changing
+copy = nil
+s = nil
+for j = 1, i do
+	root[j].get = nil
+end
+collectgarbage()
+
+local wsnap, rsnap = pluto.snapshot(), pluto.snapshot()
+t = os.clock()
+s = pluto.persist(perms, root, wsnap)
+t = os.clock() - t
+print(string.format("snapshot:  %6.2f s  %7.1f MB/s of heap  (%.0f MB written)",
+	t, heap / t, #s / 1048576))
+copy = pluto.unpersist(uperms, s, rsnap)
+s = nil
+
+for j = 1, i, 100 do
+	root[j].pos.x = -j
+end
+t = os.clock()
+s = pluto.persist(perms, root, wsnap)
+t = os.clock() - t
+print(string.format("delta:     %6.2f s  %7.1f MB/s of heap  (%.2f MB written)",
+	t, heap / t, #s / 1048576))
+t = os.clock()
+assert(pluto.unpersist(uperms, s, rsnap) == copy)
+t = os.clock() - t
+print(string.format("apply:     %6.2f s", t))
+assert(copy[1].pos.x == -1 and copy[2].pos.x == 2)
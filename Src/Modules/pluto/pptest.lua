@@ -166,3 +166,27 @@ onerror()
 outfile = io.open("test.plh", "wb")
 outfile:write(buf)
 outfile:close()
+
+-- Snapshots: a full hunk, one with the changes only, and one with none
+world = { name = "world", list = {}, getid = funcreturningclosure(7) }
+for i = 1, 200 do
+	world.list[i] = { id = i, pos = { x = i, y = -i } }
+end
+world.list[1].self = world.list[1]
+world.weak = setmetatable({}, { __mode = "k" })
+
+snap = pluto.snapshot()
+snapbufs = { pluto.persist(perms, world, snap) }
+world.list[50].pos.x = 500
+world.list[201] = { id = 201, pos = world.list[1].pos }
+world.name = nil
+setmetatable(world.list[2], { __index = { hit = 1 } })
+table.remove(world.list, 3)
+snapbufs[2] = pluto.persist(perms, world, snap)
+snapbufs[3] = pluto.persist(perms, world, snap)
+
+outfile = io.open("testsnap.plh", "wb")
+for _, b in ipairs(snapbufs) do
+	outfile:write(#b, "\n", b)
+end
+outfile:close()
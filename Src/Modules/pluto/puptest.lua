@@ -18,6 +18,80 @@ function testuvinthread(func)
 end
 
 
+function readsnapshots()
+	local infile = assert(io.open("testsnap.plh", "rb"))
+	local bufs = {}
+	while true do
+		local len = infile:read("*n")
+		if not len then break end
+		infile:read(1)
+		bufs[#bufs+1] = infile:read(len)
+	end
+	infile:close()
+	return bufs
+end
+
+function checkworld(world)
+	local list = world.list
+	return world.name == nil and world.getid() == 7 and
+		#list == 200 and list[1].self == list[1] and
+		list[49].pos.x == 500 and list[3].id == 4 and
+		list[200].id == 201 and list[200].pos == list[1].pos and
+		list[2].hit == 1 and getmetatable(world.weak).__mode == "k"
+end
+
+function testsnapshots()
+	local bufs = readsnapshots()
+	local snap = pluto.snapshot()
+	local world = pluto.unpersist(perms, bufs[1], snap)
+	local base = world.list[10]
+	if world.name ~= "world" or #world.list ~= 200 or
+	   pluto.unpersist(perms, bufs[2], snap) ~= world or
+	   pluto.unpersist(perms, bufs[3], snap) ~= world or
+	   not checkworld(world) or world.list[9] ~= base or
+	   #bufs[2] * 4 > #bufs[1] or #bufs[3] * 4 > #bufs[2] then
+		return false
+	end
+	-- Hunks must be applied in order
+	if pcall(pluto.unpersist, perms, bufs[2], pluto.snapshot()) then
+		return false
+	end
+	-- Unpersisted tables can be persisted to the same snapshot
+	local copysnap = pluto.snapshot()
+	local copy = pluto.unpersist(perms, bufs[1], copysnap)
+	pluto.unpersist(perms, bufs[2], copysnap)
+	pluto.unpersist(perms, bufs[3], copysnap)
+	world.list[100].pos.y = 1
+	world.extra = world.list[1]
+	local buf = pluto.persist({ [coroutine.yield] = 1, [permtable] = 2 },
+		world, snap)
+	return #buf < #bufs[3] * 2 and
+		pluto.unpersist(perms, buf, copysnap) == copy and
+		checkworld(copy) and copy.list[100].pos.y == 1 and
+		copy.extra == copy.list[1]
+end
+
+-- Two snapshots of the same tables each see every change
+function testsharedsnapshots()
+	local p = {}
+	local t = { v = 5, sub = { w = 1 } }
+	local a, b = pluto.snapshot(), pluto.snapshot()
+	local ra, rb = pluto.snapshot(), pluto.snapshot()
+	local ca = pluto.unpersist(p, pluto.persist(p, t, a), ra)
+	local cb = pluto.unpersist(p, pluto.persist(p, t, b), rb)
+	t.v = 999
+	t.sub.w = 2
+	pluto.unpersist(p, pluto.persist(p, t, a), ra)
+	pluto.unpersist(p, pluto.persist(p, t, b), rb)
+	if ca.v ~= 999 or cb.v ~= 999 or ca.sub.w ~= 2 or cb.sub.w ~= 2 then
+		return false
+	end
+	t.v = 7
+	pluto.unpersist(p, pluto.persist(p, t, b), rb)
+	pluto.unpersist(p, pluto.persist(p, t, a), ra)
+	return ca.v == 7 and cb.v == 7
+end
+
 function test(rootobj)
 	local passed = 0
 	local total = 0
@@ -68,6 +142,8 @@ function test(rootobj)
 		rootobj.testuvcycle()[1] == rootobj.testuvcycle()[2])
 	dotest("__newindex metamethod", rootobj.testniinmt.a == 3)
 	dotest("Debug info           ", (rootobj.testdebuginfo(2)) == "foo")
+	dotest("Snapshots            ", testsnapshots())
+	dotest("Shared snapshots     ", testsharedsnapshots())
 	print()
 	if passed == total then
 		print("All tests passed.")
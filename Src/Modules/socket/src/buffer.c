@@ -4,20 +4,44 @@
 *
 * RCS ID: $Id: buffer.c,v 1.28 2007/06/11 23:44:54 diego Exp $
 \*=========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+
 #include "lua.h"
 #include "lauxlib.h"
 
 #include "buffer.h"
 
+#ifdef LUASOCKET_LBUFFER
+#include "lbuffer.h"
+#endif
+
+/* destination of received data */
+typedef struct t_sink_ {
+    luaL_Buffer *b;         /* string being built, or NULL */
+#ifdef LUASOCKET_LBUFFER
+    lua_State *L;           /* state owning the lbuffer */
+    buffer *lb;             /* mutable buffer being appended to, or NULL */
+#endif
+} t_sink;
+typedef t_sink *p_sink;
+
 /*=========================================================================*\
 * Internal function prototypes
 \*=========================================================================*/
-static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b);
-static int recvline(p_buffer buf, luaL_Buffer *b);
-static int recvall(p_buffer buf, luaL_Buffer *b);
+static int recvraw(p_buffer buf, size_t wanted, p_sink s);
+static int recvline(p_buffer buf, p_sink s);
+static int recvall(p_buffer buf, p_sink s);
 static int buffer_get(p_buffer buf, const char **data, size_t *count);
 static void buffer_skip(p_buffer buf, size_t count);
 static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent);
+static int sendgather(lua_State *L, p_buffer buf, int tab, size_t skip,
+        size_t count, size_t *sent);
+static const char *getpiece(lua_State *L, int idx, size_t *len);
+static void sink_add(p_sink s, const char *data, size_t count);
+#ifdef LUASOCKET_LBUFFER
+static int recvdirect(p_buffer buf, size_t wanted, p_sink s, size_t *got);
+#endif
 
 /* min and max macros */
 #ifndef MIN
@@ -27,6 +51,9 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent);
 #define MAX(x, y) ((x) > (y) ? x : y)
 #endif
 
+/* largest chunk handed to the transport in a single call */
+#define STEPSIZE (64*1024)
+
 /*=========================================================================*\
 * Exported functions
 \*=========================================================================*/
@@ -43,12 +70,53 @@ int buffer_open(lua_State *L) {
 \*-------------------------------------------------------------------------*/
 void buffer_init(p_buffer buf, p_io io, p_timeout tm) {
 	buf->first = buf->last = 0;
+    buf->data = buf->init;
+    buf->size = BUF_SIZE;
     buf->io = io;
     buf->tm = tm;
     buf->received = buf->sent = 0;
     buf->birthday = timeout_gettime();
 }
 
+/*-------------------------------------------------------------------------*\
+* Releases storage allocated by setbuffersize 
+\*-------------------------------------------------------------------------*/
+void buffer_destroy(p_buffer buf) {
+    if (buf->data != buf->init) free(buf->data);
+    buf->data = buf->init;
+    buf->size = BUF_SIZE;
+    buf->first = buf->last = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:setbuffersize() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf) {
+    lua_Number n = luaL_checknumber(L, 2);
+    size_t size, used = buf->last - buf->first;
+    char *data = buf->init;
+    luaL_argcheck(L, n >= 1, 2, "must be positive");
+    size = (size_t) n;
+    luaL_argcheck(L, size >= used, 2, "smaller than buffered data");
+    if (size > BUF_SIZE) {
+        data = (char *) malloc(size);
+        if (!data) {
+            lua_pushnil(L);
+            lua_pushstring(L, "not enough memory");
+            return 2;
+        }
+    }
+    /* keep any buffered data */
+    memmove(data, buf->data + buf->first, used);
+    if (buf->data != buf->init && buf->data != data) free(buf->data);
+    buf->data = data;
+    buf->size = size;
+    buf->first = 0;
+    buf->last = used;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * object:getstats() interface
 \*-------------------------------------------------------------------------*/
@@ -77,15 +145,33 @@ int buffer_meth_send(lua_State *L, p_buffer buf) {
     int top = lua_gettop(L);
     int err = IO_DONE;
     size_t size = 0, sent = 0;
-    const char *data = luaL_checklstring(L, 2, &size);
-    long start = (long) luaL_optnumber(L, 3, 1);
-    long end = (long) luaL_optnumber(L, 4, -1);
-    p_timeout tm = timeout_markstart(buf->tm);
+    const char *data = NULL;
+    long start, end;
+    p_timeout tm;
+    /* a table of strings is sent as if it had been concatenated */
+    if (lua_istable(L, 2)) {
+        int i, n = (int) lua_objlen(L, 2);
+        for (i = 1; i <= n; i++) {
+            size_t len;
+            lua_rawgeti(L, 2, i);
+            if (!getpiece(L, -1, &len)) 
+                luaL_argerror(L, 2, "table of strings expected");
+            size += len;
+            lua_pop(L, 1);
+        }
+    } else if (!(data = getpiece(L, 2, &size))) 
+        data = luaL_checklstring(L, 2, &size);
+    start = (long) luaL_optnumber(L, 3, 1);
+    end = (long) luaL_optnumber(L, 4, -1);
+    tm = timeout_markstart(buf->tm);
     if (start < 0) start = (long) (size+start+1);
     if (end < 0) end = (long) (size+end+1);
     if (start < 1) start = (long) 1;
     if (end > (long) size) end = (long) size;
-    if (start <= end) err = sendraw(buf, data+start-1, end-start+1, &sent);
+    if (start <= end) {
+        if (data) err = sendraw(buf, data+start-1, end-start+1, &sent);
+        else err = sendgather(L, buf, 2, start-1, end-start+1, &sent);
+    }
     /* check if there was an error */
     if (err != IO_DONE) {
         lua_pushnil(L);
@@ -109,33 +195,50 @@ int buffer_meth_send(lua_State *L, p_buffer buf) {
 int buffer_meth_receive(lua_State *L, p_buffer buf) {
     int err = IO_DONE, top = lua_gettop(L);
     luaL_Buffer b;
+    t_sink s;
     size_t size;
-    const char *part = luaL_optlstring(L, 3, "", &size);
-    p_timeout tm = timeout_markstart(buf->tm);
-    /* initialize buffer with optional extra prefix 
-     * (useful for concatenating previous partial results) */
-    luaL_buffinit(L, &b);
-    luaL_addlstring(&b, part, size);
-    /* receive new patterns */
+    const char *p = NULL;
+    p_timeout tm;
     if (!lua_isnumber(L, 2)) {
-        const char *p= luaL_optstring(L, 2, "*l");
-        if (p[0] == '*' && p[1] == 'l') err = recvline(buf, &b);
-        else if (p[0] == '*' && p[1] == 'a') err = recvall(buf, &b); 
-        else luaL_argcheck(L, 0, 2, "invalid receive pattern");
+        p = luaL_optstring(L, 2, "*l");
+        if (!(p[0] == '*' && (p[1] == 'l' || p[1] == 'a')))
+            luaL_argcheck(L, 0, 2, "invalid receive pattern");
+    }
+    s.b = NULL;
+#ifdef LUASOCKET_LBUFFER
+    /* an lbuffer prefix is appended to in place */
+    s.L = L;
+    s.lb = lb_testbuffer(L, 3);
+    if (s.lb) size = s.lb->len;
+    else
+#endif
+    {
+        const char *part = luaL_optlstring(L, 3, "", &size);
+        /* initialize buffer with optional extra prefix 
+         * (useful for concatenating previous partial results) */
+        luaL_buffinit(L, &b);
+        luaL_addlstring(&b, part, size);
+        s.b = &b;
+    }
+    tm = timeout_markstart(buf->tm);
+    /* receive new patterns */
+    if (p) {
+        if (p[1] == 'l') err = recvline(buf, &s);
+        else err = recvall(buf, &s); 
         /* get a fixed number of bytes (minus what was already partially 
          * received) */
-    } else err = recvraw(buf, (size_t) lua_tonumber(L, 2)-size, &b);
+    } else err = recvraw(buf, (size_t) lua_tonumber(L, 2)-size, &s);
+    /* we can't push anyting in the stack before pushing the
+     * contents of the buffer. this is the reason for the complication */
+    if (s.b) luaL_pushresult(&b);
+    else lua_pushvalue(L, 3);
     /* check if there was an error */
     if (err != IO_DONE) {
-        /* we can't push anyting in the stack before pushing the
-         * contents of the buffer. this is the reason for the complication */
-        luaL_pushresult(&b);
         lua_pushstring(L, buf->io->error(buf->io->ctx, err)); 
         lua_pushvalue(L, -2); 
         lua_pushnil(L);
         lua_replace(L, -4);
     } else {
-        luaL_pushresult(&b);
         lua_pushnil(L);
         lua_pushnil(L);
     }
@@ -159,7 +262,6 @@ int buffer_isempty(p_buffer buf) {
 /*-------------------------------------------------------------------------*\
 * Sends a block of data (unbuffered)
 \*-------------------------------------------------------------------------*/
-#define STEPSIZE (64*1024)
 static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
     p_io io = buf->io;
     p_timeout tm = buf->tm;
@@ -176,17 +278,126 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sends the bytes [skip, skip+count) of the concatenation of the strings in
+* a table, handing up to IO_MAXIOV of them to the transport at once. The
+* strings stay anchored by the table while their data is in use.
+\*-------------------------------------------------------------------------*/
+static int sendgather(lua_State *L, p_buffer buf, int tab, size_t skip,
+        size_t count, size_t *sent) {
+    p_io io = buf->io;
+    p_timeout tm = buf->tm;
+    t_iovec iov[IO_MAXIOV];
+    int i = 1, n = (int) lua_objlen(L, tab), err = IO_DONE;
+    size_t total = 0, offset = skip, len;
+    for ( ;; ) {
+        int j, k = 0;
+        size_t done, batch = 0, o;
+        /* move to the piece holding the next byte to send */
+        while (i <= n) {
+            lua_rawgeti(L, tab, i);
+            getpiece(L, -1, &len);
+            lua_pop(L, 1);
+            if (offset < len) break;
+            offset -= len;
+            i++;
+        }
+        if (total >= count || err != IO_DONE) break;
+        for (j = i, o = offset; j <= n && k < IO_MAXIOV && 
+                total + batch < count; j++, o = 0) {
+            const char *data;
+            lua_rawgeti(L, tab, j);
+            data = getpiece(L, -1, &len);
+            lua_pop(L, 1);
+            len = MIN(len - o, count - total - batch);
+            if (len > 0) {
+                iov[k].data = data + o;
+                iov[k].count = len;
+                batch += len;
+                k++;
+            }
+        }
+        if (k == 0) break;
+        if (io->sendv) err = io->sendv(io->ctx, iov, k, &done, tm);
+        else err = io->send(io->ctx, iov[0].data, iov[0].count, &done, tm);
+        total += done;
+        offset += done;
+    }
+    *sent = total;
+    buf->sent += total;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the contents of a string (or lbuffer) piece, or NULL
+\*-------------------------------------------------------------------------*/
+static const char *getpiece(lua_State *L, int idx, size_t *len) {
+#ifdef LUASOCKET_LBUFFER
+    buffer *lb = lb_testbuffer(L, idx);
+    if (lb) {
+        *len = lb->len;
+        return lb->str;
+    }
+#endif
+    if (lua_type(L, idx) != LUA_TSTRING) return NULL;
+    return lua_tolstring(L, idx, len);
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends received data to its destination
+\*-------------------------------------------------------------------------*/
+static void sink_add(p_sink s, const char *data, size_t count) {
+#ifdef LUASOCKET_LBUFFER
+    if (s->lb) {
+        size_t len = s->lb->len;
+        if (count == 0) return;
+        if (!lb_realloc(s->L, s->lb, len + count))
+            luaL_error(s->L, "not enough memory");
+        memcpy(s->lb->str + len, data, count);
+        return;
+    }
+#endif
+    luaL_addlstring(s->b, data, count);
+}
+
+#ifdef LUASOCKET_LBUFFER
+/*-------------------------------------------------------------------------*\
+* Reads from the transport straight into the lbuffer storage. Only used
+* when the read buffer is empty, so no data is reordered.
+\*-------------------------------------------------------------------------*/
+static int recvdirect(p_buffer buf, size_t wanted, p_sink s, size_t *got) {
+    p_io io = buf->io;
+    size_t len = s->lb->len;
+    int err;
+    if (!lb_realloc(s->L, s->lb, len + wanted))
+        luaL_error(s->L, "not enough memory");
+    err = io->recv(io->ctx, s->lb->str + len, wanted, got, buf->tm);
+    lb_realloc(s->L, s->lb, len + *got);
+    buf->received += *got;
+    return err;
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Reads a fixed number of bytes (buffered)
 \*-------------------------------------------------------------------------*/
-static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
+static int recvraw(p_buffer buf, size_t wanted, p_sink s) {
     int err = IO_DONE;
     size_t total = 0;
     while (err == IO_DONE) {
         size_t count; const char *data;
+#ifdef LUASOCKET_LBUFFER
+        /* large reads bypass the read buffer */
+        if (s->lb && buffer_isempty(buf) && wanted - total >= buf->size) {
+            err = recvdirect(buf, MIN(wanted - total, STEPSIZE), s, &count);
+            total += count;
+            if (total >= wanted) break;
+            continue;
+        }
+#endif
         err = buffer_get(buf, &data, &count);
         count = MIN(count, wanted - total);
-        luaL_addlstring(b, data, count);
+        sink_add(s, data, count);
         buffer_skip(buf, count);
         total += count;
         if (total >= wanted) break;
@@ -197,14 +408,21 @@ static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
 /*-------------------------------------------------------------------------*\
 * Reads everything until the connection is closed (buffered)
 \*-------------------------------------------------------------------------*/
-static int recvall(p_buffer buf, luaL_Buffer *b) {
+static int recvall(p_buffer buf, p_sink s) {
     int err = IO_DONE;
     size_t total = 0;
     while (err == IO_DONE) {
         const char *data; size_t count;
+#ifdef LUASOCKET_LBUFFER
+        if (s->lb && buffer_isempty(buf)) {
+            err = recvdirect(buf, MAX(buf->size, STEPSIZE), s, &count);
+            total += count;
+            continue;
+        }
+#endif
         err = buffer_get(buf, &data, &count);
         total += count;
-        luaL_addlstring(b, data, count);
+        sink_add(s, data, count);
         buffer_skip(buf, count);
     }
     if (err == IO_CLOSED) {
@@ -217,16 +435,19 @@ static int recvall(p_buffer buf, luaL_Buffer *b) {
 * Reads a line terminated by a CR LF pair or just by a LF. The CR and LF 
 * are not returned by the function and are discarded from the buffer
 \*-------------------------------------------------------------------------*/
-static int recvline(p_buffer buf, luaL_Buffer *b) {
+static int recvline(p_buffer buf, p_sink s) {
     int err = IO_DONE;
     while (err == IO_DONE) {
         size_t count, pos; const char *data;
         err = buffer_get(buf, &data, &count);
         pos = 0;
         while (pos < count && data[pos] != '\n') {
-            /* we ignore all \r's */
-            if (data[pos] != '\r') luaL_putchar(b, data[pos]);
-            pos++;
+            /* copy runs of data at once, ignoring all \r's */
+            size_t run = pos;
+            while (pos < count && data[pos] != '\n' && data[pos] != '\r')
+                pos++;
+            sink_add(s, data + run, pos - run);
+            if (pos < count && data[pos] == '\r') pos++;
         }
         if (pos < count) { /* found '\n' */
             buffer_skip(buf, pos+1); /* skip '\n' too */
@@ -258,7 +479,7 @@ static int buffer_get(p_buffer buf, const char **data, size_t *count) {
     p_timeout tm = buf->tm;
     if (buffer_isempty(buf)) {
         size_t got;
-        err = io->recv(io->ctx, buf->data, BUF_SIZE, &got, tm);
+        err = io->recv(io->ctx, buf->data, buf->size, &got, tm);
         buf->first = 0;
         buf->last = got;
     }
@@ -10,7 +10,14 @@
 * Lua programs. 
 *
 * Input is buffered. Output is *not* buffered because there was no simple
-* way of making sure the buffered output data would ever be sent.
+* way of making sure the buffered output data would ever be sent. Output
+* can be a table of strings, which is sent with gathering writes instead
+* of being concatenated first.
+*
+* When compiled with LUASOCKET_LBUFFER (and linked against the lbuffer
+* module), input can be appended to a mutable lbuffer object instead of
+* being returned as a new string; large reads then go straight from the
+* transport into the lbuffer storage.
 *
 * The module is built on top of the I/O abstraction defined in io.h and the
 * timeout management is done with the timeout.h interface.
@@ -22,8 +29,11 @@
 #include "io.h"
 #include "timeout.h"
 
-/* buffer size in bytes */
+/* default buffer size in bytes. larger buffers can be requested per 
+ * object with setbuffersize() and are allocated on the heap */
+#ifndef BUF_SIZE
 #define BUF_SIZE 8192
+#endif
 
 /* buffer control structure */
 typedef struct t_buffer_ {
@@ -32,16 +42,20 @@ typedef struct t_buffer_ {
     p_io io;                /* IO driver used for this buffer */
     p_timeout tm;           /* timeout management for this buffer */
 	size_t first, last;     /* index of first and last bytes of stored data */
-	char data[BUF_SIZE];    /* storage space for buffer data */
+    size_t size;            /* size of storage space pointed to by data */
+    char *data;             /* storage space for buffer data */
+	char init[BUF_SIZE];    /* default storage space */
 } t_buffer;
 typedef t_buffer *p_buffer;
 
 int buffer_open(lua_State *L);
 void buffer_init(p_buffer buf, p_io io, p_timeout tm);
+void buffer_destroy(p_buffer buf);
 int buffer_meth_send(lua_State *L, p_buffer buf);
 int buffer_meth_receive(lua_State *L, p_buffer buf);
 int buffer_meth_getstats(lua_State *L, p_buffer buf);
 int buffer_meth_setstats(lua_State *L, p_buffer buf);
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf);
 int buffer_isempty(p_buffer buf);
 
 #endif /* BUF_H */
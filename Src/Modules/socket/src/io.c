@@ -15,6 +15,7 @@
 void io_init(p_io io, p_send send, p_recv recv, p_error error, void *ctx) {
     io->send = send;
     io->recv = recv;
+    io->sendv = NULL;
     io->error = error;
     io->ctx = ctx;
 }
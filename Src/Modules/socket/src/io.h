@@ -42,6 +42,24 @@ typedef int (*p_send) (
     p_timeout tm        /* timeout control */
 );
 
+/* a piece of data for scatter/gather output */
+typedef struct t_iovec_ {
+    const char *data;   /* pointer to piece data */
+    size_t count;       /* number of bytes in piece */
+} t_iovec;
+
+/* maximum number of pieces handed to a single sendv call */
+#define IO_MAXIOV 64
+
+/* interface to gather send function */
+typedef int (*p_sendv) (
+    void *ctx,          /* context needed by send */
+    const t_iovec *iov, /* pieces to send, in order */
+    int n,              /* number of pieces (at most IO_MAXIOV) */
+    size_t *sent,       /* number of bytes sent uppon return */
+    p_timeout tm        /* timeout control */
+);
+
 /* interface to recv function */
 typedef int (*p_recv) (
     void *ctx,          /* context needed by recv */
@@ -56,6 +74,7 @@ typedef struct t_io_ {
     void *ctx;          /* context needed by send/recv */
     p_send send;        /* send function pointer */
     p_recv recv;        /* receive function pointer */
+    p_sendv sendv;      /* gather send function pointer, or NULL */
     p_error error;      /* strerror function */
 } t_io;
 typedef t_io *p_io;
@@ -36,6 +36,7 @@
 #include "tcp.h"
 #include "udp.h"
 #include "select.h"
+#include "poller.h"
 
 /*-------------------------------------------------------------------------*\
 * Internal function prototypes
@@ -56,6 +57,7 @@ static const luaL_reg mod[] = {
     {"tcp", tcp_open},
     {"udp", udp_open},
     {"select", select_open},
+    {"poller", poller_open},
     {NULL, NULL}
 };
 
@@ -46,6 +46,19 @@ int opt_reuseaddr(lua_State *L, p_socket ps)
     return opt_setboolean(L, ps, SOL_SOCKET, SO_REUSEADDR); 
 }
 
+/* lets several sockets bind the same address and port, where supported */
+int opt_reuseport(lua_State *L, p_socket ps)
+{
+#ifdef SO_REUSEPORT
+    return opt_setboolean(L, ps, SOL_SOCKET, SO_REUSEPORT); 
+#else
+    (void) ps;
+    lua_pushnil(L);
+    lua_pushstring(L, "reuseport not supported");
+    return 2;
+#endif
+}
+
 /* disables the Naggle algorithm */
 int opt_tcp_nodelay(lua_State *L, p_socket ps)
 {
@@ -24,6 +24,7 @@ typedef t_opt *p_opt;
 int opt_dontroute(lua_State *L, p_socket ps);
 int opt_broadcast(lua_State *L, p_socket ps);
 int opt_reuseaddr(lua_State *L, p_socket ps);
+int opt_reuseport(lua_State *L, p_socket ps);
 int opt_tcp_nodelay(lua_State *L, p_socket ps);
 int opt_keepalive(lua_State *L, p_socket ps);
 int opt_linger(lua_State *L, p_socket ps);
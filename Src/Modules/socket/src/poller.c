@@ -0,0 +1,453 @@
+/*=========================================================================*\
+* Scalable readiness notification (epoll)
+* LuaSocket toolkit
+*
+* RCS ID: $Id$
+\*=========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "auxiliar.h"
+#include "socket.h"
+#include "timeout.h"
+#include "poller.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+/* interest mask bits kept for each registered descriptor */
+#define POLLER_READ  0x01
+#define POLLER_WRITE 0x02
+#define POLLER_EDGE  0x04
+#define POLLER_RW    (POLLER_READ | POLLER_WRITE)
+
+/* default number of events returned by a single wait */
+#define POLLER_MAXEVENTS 1024
+
+/* poller control structure */
+typedef struct t_poller_ {
+    int epfd;                   /* epoll descriptor */
+    unsigned char *mask;        /* interest mask, indexed by descriptor */
+    int nmask;                  /* number of entries in mask */
+    t_socket *pending;          /* descriptors holding buffered input */
+    int npending, maxpending;   /* used and allocated entries in pending */
+    int maxevents;              /* number of entries in events */
+    struct epoll_event events[1];
+} t_poller;
+typedef t_poller *p_poller;
+
+/*=========================================================================*\
+* Internal function prototypes.
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_add(lua_State *L);
+static int meth_modify(lua_State *L);
+static int meth_remove(lua_State *L);
+static int meth_wait(lua_State *L);
+static int meth_getfd(lua_State *L);
+static int meth_close(lua_State *L);
+static t_socket getfd(lua_State *L, int idx);
+static int dirty(lua_State *L, int idx);
+static int getmode(lua_State *L, int idx, const char *def);
+static int update(lua_State *L, p_poller p, int objidx, int mode, int merge);
+static int control(p_poller p, t_socket fd, int oldmask, int newmask);
+static int growmask(p_poller p, t_socket fd);
+static int addpending(p_poller p, t_socket fd);
+static void addready(lua_State *L, int tab, int obj);
+
+/* poller object methods */
+static luaL_reg poller[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"add",         meth_add},
+    {"close",       meth_close},
+    {"getfd",       meth_getfd},
+    {"modify",      meth_modify},
+    {"remove",      meth_remove},
+    {"wait",        meth_wait},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_reg func[] = {
+    {"poller", global_create},
+    {NULL,     NULL}
+};
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int poller_open(lua_State *L) {
+    auxiliar_newclass(L, "poller{}", poller);
+    luaL_openlib(L, NULL, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a poller object. The object environment maps descriptors to
+* registered objects and registered objects back to their descriptors.
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    int maxevents = luaL_optint(L, 1, POLLER_MAXEVENTS);
+    p_poller p;
+    luaL_argcheck(L, maxevents > 0, 1, "must be positive");
+    p = (p_poller) lua_newuserdata(L, sizeof(t_poller) +
+            (maxevents - 1) * sizeof(struct epoll_event));
+    memset(p, 0, sizeof(t_poller));
+    p->epfd = -1;
+    p->maxevents = maxevents;
+    auxiliar_setclass(L, "poller{}", -1);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    p->epfd = epoll_create(maxevents);
+    if (p->epfd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(errno));
+        return 2;
+    }
+    fcntl(p->epfd, F_SETFD, FD_CLOEXEC);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Adds interest in an object, merged with any interest already registered
+\*-------------------------------------------------------------------------*/
+static int meth_add(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    return update(L, p, 2, getmode(L, 3, "r"), 1);
+}
+
+/*-------------------------------------------------------------------------*\
+* Replaces the interest registered for an object
+\*-------------------------------------------------------------------------*/
+static int meth_modify(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    return update(L, p, 2, getmode(L, 3, "r"), 0);
+}
+
+/*-------------------------------------------------------------------------*\
+* Removes interest in an object. Objects are looked up by identity, so
+* sockets that were closed after being added can still be removed.
+\*-------------------------------------------------------------------------*/
+static int meth_remove(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    int mode = getmode(L, 3, "rw");
+    int env, oldmask, newmask, err;
+    t_socket fd;
+    luaL_checkany(L, 2);
+    lua_getfenv(L, 1); env = lua_gettop(L);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, env);
+    if (!lua_isnumber(L, -1)) {
+        lua_pushnumber(L, 1);
+        return 1;
+    }
+    fd = (t_socket) lua_tonumber(L, -1);
+    oldmask = fd < p->nmask ? p->mask[fd] : 0;
+    newmask = oldmask & ~(mode & POLLER_RW);
+    err = control(p, fd, oldmask, newmask);
+    if (!(newmask & POLLER_RW)) {
+        lua_pushvalue(L, 2); lua_pushnil(L); lua_rawset(L, env);
+        lua_pushnumber(L, fd); lua_pushnil(L); lua_rawset(L, env);
+        newmask = 0;
+    }
+    if (fd < p->nmask) p->mask[fd] = (unsigned char) newmask;
+    if (err != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits until registered objects are ready or the timeout expires.
+* Returns the same doubly keyed tables as socket.select.
+\*-------------------------------------------------------------------------*/
+static int meth_wait(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    double t = luaL_optnumber(L, 2, -1);
+    int env, rtab, wtab, i, n, ret, nready = 0;
+    t_timeout tm;
+    lua_settop(L, 2);
+    lua_getfenv(L, 1); env = lua_gettop(L);
+    lua_newtable(L); rtab = lua_gettop(L);
+    lua_newtable(L); wtab = lua_gettop(L);
+    if (p->epfd < 0) {
+        lua_pushstring(L, "closed");
+        return 3;
+    }
+    /* objects holding buffered input are ready without asking the kernel,
+    * and stay pending for as long as they remain dirty */
+    for (i = n = 0; i < p->npending; i++) {
+        t_socket fd = p->pending[i];
+        if (fd >= p->nmask || !(p->mask[fd] & POLLER_READ)) continue;
+        lua_pushnumber(L, fd);
+        lua_rawget(L, env);
+        if (!lua_isnil(L, -1) && dirty(L, lua_gettop(L))) {
+            addready(L, rtab, lua_gettop(L));
+            nready++;
+            p->pending[n++] = fd;
+        }
+        lua_pop(L, 1);
+    }
+    p->npending = n;
+    timeout_init(&tm, nready > 0 ? 0.0 : t, -1);
+    timeout_markstart(&tm);
+    do {
+        double left = timeout_getretry(&tm);
+        int ms = left >= 0.0 ? (int) (left * 1000.0 + 0.999) : -1;
+        ret = epoll_wait(p->epfd, p->events, p->maxevents, ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        lua_pushstring(L, socket_strerror(errno));
+        return 3;
+    }
+    for (i = 0; i < ret; i++) {
+        t_socket fd = (t_socket) p->events[i].data.fd;
+        unsigned int ev = p->events[i].events;
+        int mask = fd < p->nmask ? p->mask[fd] : 0;
+        lua_pushnumber(L, fd);
+        lua_rawget(L, env);
+        if (!lua_isnil(L, -1)) {
+            if ((mask & POLLER_READ) &&
+                    (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                addready(L, rtab, lua_gettop(L));
+                nready++;
+            }
+            if ((mask & POLLER_WRITE) &&
+                    (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+                addready(L, wtab, lua_gettop(L));
+                nready++;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    if (nready > 0) return 2;
+    lua_pushstring(L, "timeout");
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the epoll descriptor, so pollers can be nested in select
+\*-------------------------------------------------------------------------*/
+static int meth_getfd(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    lua_pushnumber(L, p->epfd);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the epoll descriptor and the bookkeeping arrays
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, "poller{}", 1);
+    if (p->epfd >= 0) {
+        close(p->epfd);
+        p->epfd = -1;
+    }
+    free(p->mask); p->mask = NULL; p->nmask = 0;
+    free(p->pending); p->pending = NULL;
+    p->npending = p->maxpending = 0;
+    lua_newtable(L);
+    lua_setfenv(L, 1);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static t_socket getfd(lua_State *L, int idx) {
+    t_socket fd = SOCKET_INVALID;
+    lua_pushstring(L, "getfd");
+    lua_gettable(L, idx);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 1);
+        if (lua_isnumber(L, -1))
+            fd = (t_socket) lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+static int dirty(lua_State *L, int idx) {
+    int is = 0;
+    lua_pushstring(L, "dirty");
+    lua_gettable(L, idx);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 1);
+        is = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+    return is;
+}
+
+/*-------------------------------------------------------------------------*\
+* Parses a mode string made of 'r' (read), 'w' (write), 'e' (edge-triggered)
+\*-------------------------------------------------------------------------*/
+static int getmode(lua_State *L, int idx, const char *def) {
+    const char *s = luaL_optstring(L, idx, def);
+    int mode = 0;
+    for ( ; *s; s++) {
+        switch (*s) {
+            case 'r': mode |= POLLER_READ; break;
+            case 'w': mode |= POLLER_WRITE; break;
+            case 'e': mode |= POLLER_EDGE; break;
+            default: luaL_argerror(L, idx, "invalid mode"); break;
+        }
+    }
+    return mode;
+}
+
+/*-------------------------------------------------------------------------*\
+* Registers or updates an object's interest mask
+\*-------------------------------------------------------------------------*/
+static int update(lua_State *L, p_poller p, int objidx, int mode, int merge) {
+    int env, oldmask, newmask, err;
+    t_socket fd;
+    luaL_checkany(L, objidx);
+    if (p->epfd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "closed");
+        return 2;
+    }
+    fd = getfd(L, objidx);
+    if (fd == SOCKET_INVALID) {
+        lua_pushnil(L);
+        lua_pushstring(L, "invalid descriptor");
+        return 2;
+    }
+    if (!growmask(p, fd)) luaL_error(L, "not enough memory");
+    lua_getfenv(L, 1); env = lua_gettop(L);
+    oldmask = p->mask[fd];
+    /* a descriptor reused by a different object invalidates the old entry */
+    lua_pushnumber(L, fd);
+    lua_rawget(L, env);
+    if (!lua_rawequal(L, -1, objidx)) {
+        if (!lua_isnil(L, -1)) {
+            lua_pushnil(L);
+            lua_rawset(L, env);
+        } else lua_pop(L, 1);
+        oldmask = 0;
+    } else lua_pop(L, 1);
+    newmask = merge ? (oldmask | mode) : mode;
+    if (merge && !(mode & POLLER_EDGE)) newmask &= ~POLLER_EDGE;
+    if (!(newmask & POLLER_RW)) newmask = 0;
+    err = control(p, fd, oldmask, newmask);
+    if (err != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    p->mask[fd] = (unsigned char) newmask;
+    lua_pushnumber(L, fd);
+    if (newmask) lua_pushvalue(L, objidx); else lua_pushnil(L);
+    lua_rawset(L, env);
+    lua_pushvalue(L, objidx);
+    if (newmask) lua_pushnumber(L, fd); else lua_pushnil(L);
+    lua_rawset(L, env);
+    if ((mode & POLLER_READ) && dirty(L, objidx) && !addpending(p, fd))
+        luaL_error(L, "not enough memory");
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Applies a mask change to the kernel interest set. The kernel silently
+* drops closed descriptors, so stale state is recovered from here.
+\*-------------------------------------------------------------------------*/
+static int control(p_poller p, t_socket fd, int oldmask, int newmask) {
+    struct epoll_event ev;
+    int op;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (newmask & POLLER_READ) ev.events |= EPOLLIN;
+    if (newmask & POLLER_WRITE) ev.events |= EPOLLOUT;
+    if (newmask & POLLER_EDGE) ev.events |= EPOLLET;
+    if (!(newmask & POLLER_RW)) {
+        if (!(oldmask & POLLER_RW)) return 0;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, &ev) == 0) return 0;
+        return (errno == ENOENT || errno == EBADF) ? 0 : errno;
+    }
+    op = (oldmask & POLLER_RW) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(p->epfd, op, fd, &ev) == 0) return 0;
+    if (op == EPOLL_CTL_ADD && errno == EEXIST) op = EPOLL_CTL_MOD;
+    else if (op == EPOLL_CTL_MOD && errno == ENOENT) op = EPOLL_CTL_ADD;
+    else return errno;
+    return epoll_ctl(p->epfd, op, fd, &ev) == 0 ? 0 : errno;
+}
+
+static int growmask(p_poller p, t_socket fd) {
+    if (fd >= p->nmask) {
+        int n = p->nmask > 0 ? p->nmask : 64;
+        unsigned char *mask;
+        while (n <= fd) n *= 2;
+        mask = (unsigned char *) realloc(p->mask, n);
+        if (!mask) return 0;
+        memset(mask + p->nmask, 0, n - p->nmask);
+        p->mask = mask;
+        p->nmask = n;
+    }
+    return 1;
+}
+
+static int addpending(p_poller p, t_socket fd) {
+    int i;
+    for (i = 0; i < p->npending; i++)
+        if (p->pending[i] == fd) return 1;
+    if (p->npending >= p->maxpending) {
+        int n = p->maxpending > 0 ? 2 * p->maxpending : 16;
+        t_socket *pending = (t_socket *) realloc(p->pending,
+                n * sizeof(t_socket));
+        if (!pending) return 0;
+        p->pending = pending;
+        p->maxpending = n;
+    }
+    p->pending[p->npending++] = fd;
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends an object to a result table, keyed both ways as select does
+\*-------------------------------------------------------------------------*/
+static void addready(lua_State *L, int tab, int obj) {
+    int n;
+    lua_pushvalue(L, obj);
+    lua_rawget(L, tab);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    n = lua_objlen(L, tab) + 1;
+    lua_pushvalue(L, obj);
+    lua_rawseti(L, tab, n);
+    lua_pushvalue(L, obj);
+    lua_pushnumber(L, n);
+    lua_rawset(L, tab);
+}
+
+#else
+
+/*-------------------------------------------------------------------------*\
+* Without epoll there is no poller; scripts fall back to socket.select
+\*-------------------------------------------------------------------------*/
+int poller_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef POLLER_H
+#define POLLER_H
+/*=========================================================================*\
+* Scalable readiness notification (epoll)
+* LuaSocket toolkit
+*
+* A poller object keeps a persistent interest set in the kernel, so the
+* cost of waiting is proportional to the number of ready sockets instead
+* of the number of watched ones, and there is no FD_SETSIZE limit. Objects
+* are registered once with add() and updated incrementally with modify()
+* and remove(). As with select, objects must export a getfd() method, and
+* objects exporting dirty() are reported readable right away if they
+* already hold buffered input when read interest is requested.
+*
+* The socket.poller function is only exported on platforms with epoll.
+* Scripts should test for its presence and fall back to socket.select.
+\*=========================================================================*/
+
+int poller_open(lua_State *L);
+
+#endif /* POLLER_H */
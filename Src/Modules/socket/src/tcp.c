@@ -31,6 +31,8 @@ static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
 static int meth_accept(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_settimeout(lua_State *L);
 static int meth_getfd(lua_State *L);
@@ -39,7 +41,7 @@ static int meth_dirty(lua_State *L);
 
 /* tcp object methods */
 static luaL_reg tcp[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
     {"bind",        meth_bind},
@@ -58,6 +60,7 @@ static luaL_reg tcp[] = {
     {"setoption",   meth_setoption},
     {"setpeername", meth_connect},
     {"setsockname", meth_bind},
+    {"setbuffersize", meth_setbuffersize},
     {"settimeout",  meth_settimeout},
     {"shutdown",    meth_shutdown},
     {NULL,          NULL}
@@ -67,6 +70,7 @@ static luaL_reg tcp[] = {
 static t_opt opt[] = {
     {"keepalive",   opt_keepalive},
     {"reuseaddr",   opt_reuseaddr},
+    {"reuseport",   opt_reuseport},
     {"tcp-nodelay", opt_tcp_nodelay},
     {"linger",      opt_linger},
     {NULL,          NULL}
@@ -175,6 +179,7 @@ static int meth_accept(lua_State *L)
         clnt->sock = sock;
         io_init(&clnt->io, (p_send) socket_send, (p_recv) socket_recv, 
                 (p_error) socket_ioerror, &clnt->sock);
+        clnt->io.sendv = (p_sendv) socket_sendv;
         timeout_init(&clnt->tm, -1, -1);
         buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
         return 1;
@@ -236,6 +241,26 @@ static int meth_close(lua_State *L)
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes socket and releases read buffer storage on collection
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    socket_destroy(&tcp->sock);
+    buffer_destroy(&tcp->buf);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Changes the size of the read buffer
+\*-------------------------------------------------------------------------*/
+static int meth_setbuffersize(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_setbuffersize(L, &tcp->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Puts the sockt in listen mode
 \*-------------------------------------------------------------------------*/
@@ -328,6 +353,7 @@ static int global_create(lua_State *L)
         tcp->sock = sock;
         io_init(&tcp->io, (p_send) socket_send, (p_recv) socket_recv, 
                 (p_error) socket_ioerror, &tcp->sock);
+        tcp->io.sendv = (p_sendv) socket_sendv;
         timeout_init(&tcp->tm, -1, -1);
         buffer_init(&tcp->buf, &tcp->io, &tcp->tm);
         return 1;
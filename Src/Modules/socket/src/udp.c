@@ -68,6 +68,7 @@ static t_opt opt[] = {
     {"dontroute",          opt_dontroute},
     {"broadcast",          opt_broadcast},
     {"reuseaddr",          opt_reuseaddr},
+    {"reuseport",          opt_reuseport},
     {"ip-multicast-ttl",   opt_ip_multicast_ttl},
     {"ip-multicast-loop",  opt_ip_multicast_loop},
     {"ip-add-membership",  opt_ip_add_membership},
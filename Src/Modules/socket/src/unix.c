@@ -27,6 +27,8 @@ static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
 static int meth_accept(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_settimeout(lua_State *L);
 static int meth_getfd(lua_State *L);
@@ -40,7 +42,7 @@ static const char *unix_trybind(p_unix un, const char *path);
 
 /* unix object methods */
 static luaL_reg un[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
     {"bind",        meth_bind},
@@ -57,6 +59,7 @@ static luaL_reg un[] = {
     {"setoption",   meth_setoption},
     {"setpeername", meth_connect},
     {"setsockname", meth_bind},
+    {"setbuffersize", meth_setbuffersize},
     {"settimeout",  meth_settimeout},
     {"shutdown",    meth_shutdown},
     {NULL,          NULL}
@@ -171,6 +174,7 @@ static int meth_accept(lua_State *L) {
         clnt->sock = sock;
         io_init(&clnt->io, (p_send)socket_send, (p_recv)socket_recv, 
                 (p_error) socket_ioerror, &clnt->sock);
+        clnt->io.sendv = (p_sendv) socket_sendv;
         timeout_init(&clnt->tm, -1, -1);
         buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
         return 1;
@@ -270,6 +274,26 @@ static int meth_close(lua_State *L)
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes socket and releases read buffer storage on collection
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L)
+{
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unix{any}", 1);
+    socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Changes the size of the read buffer
+\*-------------------------------------------------------------------------*/
+static int meth_setbuffersize(lua_State *L)
+{
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unix{any}", 1);
+    return buffer_meth_setbuffersize(L, &un->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Puts the sockt in listen mode
 \*-------------------------------------------------------------------------*/
@@ -345,6 +369,7 @@ static int global_create(lua_State *L) {
         un->sock = sock;
         io_init(&un->io, (p_send) socket_send, (p_recv) socket_recv, 
                 (p_error) socket_ioerror, &un->sock);
+        un->io.sendv = (p_sendv) socket_sendv;
         timeout_init(&un->tm, -1, -1);
         buffer_init(&un->buf, &un->io, &un->tm);
         return 1;
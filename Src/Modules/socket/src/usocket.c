@@ -256,6 +256,39 @@ int socket_sendto(p_socket ps, const char *data, size_t count, size_t *sent,
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Gather send with timeout
+\*-------------------------------------------------------------------------*/
+int socket_sendv(p_socket ps, const t_iovec *iov, int n, size_t *sent,
+        p_timeout tm)
+{
+    struct iovec v[IO_MAXIOV];
+    int i, err;
+    *sent = 0;
+    /* avoid making system calls on closed sockets */
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (n > IO_MAXIOV) n = IO_MAXIOV;
+    for (i = 0; i < n; i++) {
+        v[i].iov_base = (void *) iov[i].data;
+        v[i].iov_len = iov[i].count;
+    }
+    /* same loop as socket_send */
+    for ( ;; ) {
+        long put = (long) writev(*ps, v, n);
+        if (put > 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        err = errno;
+        if (put == 0 || err == EPIPE) return IO_CLOSED;
+        if (err == EINTR) continue;
+        if (err != EAGAIN) return err;
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+    /* can't reach here */
+    return IO_UNKNOWN;
+}
+
 /*-------------------------------------------------------------------------*\
 * Receive with timeout
 \*-------------------------------------------------------------------------*/
@@ -20,6 +20,8 @@
 #include <sys/types.h>
 /* socket function */
 #include <sys/socket.h>
+/* writev function */
+#include <sys/uio.h>
 /* struct timeval */
 #include <sys/time.h>
 /* gethostbyname and gethostbyaddr functions */
@@ -224,6 +224,19 @@ int socket_send(p_socket ps, const char *data, size_t count,
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Gather send with timeout
+* winsock.h has no WSASend, so pieces go out one send at a time; callers
+* already cope with partial sends.
+\*-------------------------------------------------------------------------*/
+int socket_sendv(p_socket ps, const t_iovec *iov, int n, size_t *sent,
+        p_timeout tm)
+{
+    *sent = 0;
+    if (n <= 0) return IO_DONE;
+    return socket_send(ps, iov[0].data, iov[0].count, sent, tm);
+}
+
 /*-------------------------------------------------------------------------*\
 * Sendto with timeout
 \*-------------------------------------------------------------------------*/
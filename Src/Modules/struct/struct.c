@@ -7,6 +7,10 @@
 #include "lua.h"
 #include "lauxlib.h"
 
+#ifdef STRUCT_LBUFFER
+#include "lbuffer.h"
+#endif
+
 
 /*
 ** {======================================================
@@ -31,6 +35,33 @@
 ** f - float
 ** d - doulbe
 ** ' ' - ignored
+**
+** struct.pack(fmt, d1, d2, ...) and struct.unpack(fmt, s [, i [, t]])
+** work as usual; with a table 't', unpack stores the values in it and
+** returns it instead of the values.
+**
+** struct.compile(fmt) returns the format compiled (and cached while in
+** use), which can be passed in place of the string and has methods:
+** fmt:pack(...), fmt:unpack(s [, i [, t]])
+** fmt:size() - size of the packed data, or nil when it depends on the
+**   values (s, c0)
+** fmt:packmany(list [, n]) - packs the records list[1] .. list[n] (n
+**   defaults to #list), each an array of values, into one string.
+**   Raises "record %d is not a table" when the list is short, and the
+**   usual argument errors when a record lacks values.
+** fmt:unpackmany(s [, i [, n [, list]]]) - unpacks n records (default:
+**   up to the end of s) starting at i into the tables list[1] ..
+**   list[n], reusing those already there. Returns the list, the
+**   position after the last record and the number of records. Raises
+**   "data string too short" when s ends inside a record, and "empty
+**   format" when reading to the end with a format of size 0.
+** fmt:packinto(b, i, ...) - only when built with STRUCT_LBUFFER: packs
+**   the values into lbuffer b at position i (#b + 1 appends), growing b
+**   and zero-filling as needed. Returns the position after the packed
+**   data; raises "position out of buffer" when i > #b + 1, leaving b
+**   untouched on errors.
+**
+** teststruct.lua exercises all of the above.
 */
 
 
@@ -106,13 +137,6 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
 }
 
 
-static int gettoalign (size_t len, Header *h, int opt, size_t size) {
-  if (size == 0 || opt == 'c') return 0;
-  if (size > (size_t)h->align) size = h->align;  /* respect max. alignment */
-  return  (size - (len & (size - 1))) & (size - 1);
-}
-
-
 static void commoncases (lua_State *L, int opt, const char **fmt, Header *h) {
   switch (opt) {
     case  ' ': return;  /* ignore white spaces */
@@ -130,7 +154,7 @@ static void commoncases (lua_State *L, int opt, const char **fmt, Header *h) {
 }
 
 
-static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
+static void putinteger (lua_State *L, char *b, int arg, int endian,
                         int size) {
   lua_Number n = luaL_checknumber(L, arg);
   unsigned long value;
@@ -141,12 +165,12 @@ static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
   if (endian == LITTLE) {
     int i;
     for (i = 0; i < size; i++)
-      luaL_addchar(b, (value >> 8*i) & 0xff);
+      *b++ = (value >> 8*i) & 0xff;
   }
   else {
     int i;
     for (i = size - 1; i >= 0; i--)
-      luaL_addchar(b, (value >> 8*i) & 0xff);
+      *b++ = (value >> 8*i) & 0xff;
   }
 }
 
@@ -163,41 +187,193 @@ static void correctbytes (char *b, int size, int endian) {
 }
 
 
-static int b_pack (lua_State *L) {
-  luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
+static lua_Number getinteger (const char *buff, int endian,
+                        int issigned, int size) {
+  unsigned long l = 0;
+  if (endian == BIG) {
+    int i;
+    for (i = 0; i < size; i++)
+      l |= (unsigned long)(unsigned char)buff[size - i - 1] << (i*8);
+  }
+  else {
+    int i;
+    for (i = 0; i < size; i++)
+      l |= (unsigned long)(unsigned char)buff[i] << (i*8);
+  }
+  if (!issigned)
+    return (lua_Number)l;
+  else {  /* signed format */
+    unsigned long mask = ~(0UL) << (size*8 - 1);
+    if (l & mask)  /* negative value? */
+      l |= mask;  /* signal extension */
+    return (lua_Number)(long)l;
+  }
+}
+
+
+/*
+** Compiled formats. A format string is parsed once into a list of
+** items, each with its own size, alignment and endianness, so packing
+** and unpacking need not look at the string again. struct.compile
+** returns the compiled format; struct.pack and struct.unpack compile
+** the format strings they are given through a cache (weak, so formats
+** no longer in use are collected).
+*/
+
+#define FORMAT		"struct.format"
+
+/* upvalues of the library functions */
+#define CACHE		lua_upvalueindex(1)
+#define FORMATMETA	lua_upvalueindex(2)
+
+/* padding needed at position 'len' for alignment 'a' */
+#define padding(len,a)	(((a) - ((len) & ((a) - 1))) & ((a) - 1))
+
+
+typedef struct Item {
+  char opt;  /* option; never ' ', '<', '>' or '!' */
+  char endian;
+  int align;  /* 1 for items not aligned */
+  size_t size;  /* 0 for 's' and 'c0' */
+} Item;
+
+
+typedef struct Format {
+  int nitems;
+  int nargs;  /* values taken by pack */
+  int fixed;  /* packed size does not depend on the values? */
+  size_t size;  /* packed size, when fixed */
+  int maxalign;  /* largest alignment of the items */
+  Item items[1];
+} Format;
+
+
+static Format *compile (lua_State *L, const char *fmt) {
   Header h;
-  int arg = 2;
-  size_t totalsize = 0;
+  Format *f = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                           strlen(fmt) * sizeof(Item));
+  f->nitems = f->nargs = 0;
+  f->fixed = 1;
+  f->size = 0;
+  f->maxalign = 1;
   defaultoptions(&h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     int opt = *fmt++;
     size_t size = optsize(L, opt, &fmt);
-    int toalign = gettoalign(totalsize, &h, opt, size);
-    totalsize += toalign;
-    while (toalign-- > 0) luaL_putchar(&b, '\0');
     switch (opt) {
+      case ' ': case '<': case '>': case '!': {
+        commoncases(L, opt, &fmt, &h);
+        break;
+      }
+      default: {
+        Item *it = &f->items[f->nitems++];
+        it->opt = opt;
+        it->endian = h.endian;
+        it->size = size;
+        if (size == 0 || opt == 'c') it->align = 1;
+        else it->align = (size > (size_t)h.align) ? h.align : (int)size;
+        if (it->align > f->maxalign) f->maxalign = it->align;
+        if (opt != 'x') f->nargs++;
+        if (size == 0) f->fixed = 0;
+        f->size += padding(f->size, it->align) + size;
+      }
+    }
+  }
+  lua_pushvalue(L, FORMATMETA);
+  lua_setmetatable(L, -2);
+  return f;
+}
+
+
+static Format *checkformat (lua_State *L, int narg) {
+  Format *f = (Format *)lua_touserdata(L, narg);
+  if (f != NULL && lua_getmetatable(L, narg)) {
+    int ok = lua_rawequal(L, -1, FORMATMETA);
+    lua_pop(L, 1);
+    if (ok) return f;
+  }
+  luaL_typerror(L, narg, FORMAT);
+  return NULL;
+}
+
+
+/*
+** Format at 'narg', either compiled or a string. A string is replaced
+** by its compiled format, which stays anchored there while in use.
+*/
+static Format *getformat (lua_State *L, int narg) {
+  Format *f;
+  if (lua_type(L, narg) == LUA_TUSERDATA)
+    return checkformat(L, narg);
+  luaL_checkstring(L, narg);
+  lua_pushvalue(L, narg);
+  lua_rawget(L, CACHE);
+  f = (Format *)lua_touserdata(L, -1);
+  if (f == NULL) {
+    lua_pop(L, 1);
+    f = compile(L, lua_tostring(L, narg));
+    lua_pushvalue(L, narg);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, CACHE);
+  }
+  lua_replace(L, narg);
+  return f;
+}
+
+
+/*
+** Size of the values from 'arg' on, packed with 'f' at position 'len'
+** (alignment is relative to the start of the whole string, as in unpack)
+*/
+static size_t packedsize (lua_State *L, const Format *f, int arg,
+                          size_t len) {
+  size_t start = len;
+  int i;
+  if (f->fixed && (len & (f->maxalign - 1)) == 0) return f->size;
+  for (i = 0; i < f->nitems; i++) {
+    const Item *it = &f->items[i];
+    size_t size = it->size;
+    len += padding(len, it->align);
+    if (it->opt == 's' || (it->opt == 'c' && size == 0)) {
+      luaL_checklstring(L, arg, &size);
+      if (it->opt == 's') size++;
+    }
+    if (it->opt != 'x') arg++;
+    len += size;
+  }
+  return len - start;
+}
+
+
+/* packs the values from 'arg' on at b[len], as sized by 'packedsize' */
+static void packvalues (lua_State *L, const Format *f, int arg, char *b,
+                        size_t totalsize) {
+  int i;
+  for (i = 0; i < f->nitems; i++) {
+    const Item *it = &f->items[i];
+    size_t size = it->size;
+    int toalign = padding(totalsize, it->align);
+    while (toalign-- > 0) b[totalsize++] = '\0';
+    switch (it->opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'i': case 'I': {  /* integer types */
-        putinteger(L, &b, arg++, h.endian, size);
+        putinteger(L, b + totalsize, arg++, it->endian, size);
         break;
       }
       case 'x': {
-        luaL_putchar(&b, '\0');
+        b[totalsize] = '\0';
         break;
       }
       case 'f': {
         float f = (float)luaL_checknumber(L, arg++);
-        correctbytes((char *)&f, size, h.endian);
-        luaL_addlstring(&b, (char *)&f, size);
+        correctbytes((char *)&f, size, it->endian);
+        memcpy(b + totalsize, &f, size);
         break;
       }
       case 'd': {
         double d = luaL_checknumber(L, arg++);
-        correctbytes((char *)&d, size, h.endian);
-        luaL_addlstring(&b, (char *)&d, size);
+        correctbytes((char *)&d, size, it->endian);
+        memcpy(b + totalsize, &d, size);
         break;
       }
       case 'c': case 's': {
@@ -205,86 +381,61 @@ static int b_pack (lua_State *L) {
         const char *s = luaL_checklstring(L, arg++, &l);
         if (size == 0) size = l;
         luaL_argcheck(L, l >= (size_t)size, arg, "string too short");
-        luaL_addlstring(&b, s, size);
-        if (opt == 's') {
-          luaL_putchar(&b, '\0');  /* add zero at the end */
+        memcpy(b + totalsize, s, size);
+        if (it->opt == 's') {
+          b[totalsize + size] = '\0';  /* add zero at the end */
           size++;
         }
         break;
       }
-      default: commoncases(L, opt, &fmt, &h);
     }
     totalsize += size;
   }
-  luaL_pushresult(&b);
-  return 1;
 }
 
 
-static lua_Number getinteger (const char *buff, int endian,
-                        int issigned, int size) {
-  unsigned long l = 0;
-  if (endian == BIG) {
-    int i;
-    for (i = 0; i < size; i++)
-      l |= (unsigned long)(unsigned char)buff[size - i - 1] << (i*8);
-  }
-  else {
-    int i;
-    for (i = 0; i < size; i++)
-      l |= (unsigned long)(unsigned char)buff[i] << (i*8);
-  }
-  if (!issigned)
-    return (lua_Number)l;
-  else {  /* signed format */
-    unsigned long mask = ~(0UL) << (size*8 - 1);
-    if (l & mask)  /* negative value? */
-      l |= mask;  /* signal extension */
-    return (lua_Number)(long)l;
-  }
-}
-
-
-static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = luaL_optinteger(L, 3, 1) - 1;
-  defaultoptions(&h);
-  lua_settop(L, 2);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
+/*
+** Unpacks one record at 'pos' and returns the position after it. The
+** values are pushed, or stored in t[1], t[2], ... if 't' is not 0.
+*/
+static size_t unpackvalues (lua_State *L, const Format *f, const char *data,
+                            size_t ld, size_t pos, int t) {
+  int i, k = 0;
+  for (i = 0; i < f->nitems; i++) {
+    const Item *it = &f->items[i];
+    size_t size = it->size;
+    pos += padding(pos, it->align);
     luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
-    switch (opt) {
+    switch (it->opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'i':  case 'I': {  /* integer types */
-        int issigned = islower(opt);
-        lua_Number res = getinteger(data+pos, h.endian, issigned, size);
+        int issigned = islower((unsigned char)it->opt);
+        lua_Number res = getinteger(data+pos, it->endian, issigned, size);
         lua_pushnumber(L, res);
         break;
       }
       case 'x': {
-        break;
+        pos += size;
+        continue;
       }
       case 'f': {
         float f;
         memcpy(&f, data+pos, size);
-        correctbytes((char *)&f, sizeof(f), h.endian);
+        correctbytes((char *)&f, sizeof(f), it->endian);
         lua_pushnumber(L, f);
         break;
       }
       case 'd': {
         double d;
         memcpy(&d, data+pos, size);
-        correctbytes((char *)&d, sizeof(d), h.endian);
+        correctbytes((char *)&d, sizeof(d), it->endian);
         lua_pushnumber(L, d);
         break;
       }
       case 'c': {
         if (size == 0) {
+          if (t != 0)  /* previous value is in the table */
+            lua_rawgeti(L, t, k--);
           if (!lua_isnumber(L, -1))
             luaL_error(L, "format `c0' needs a previous size");
           size = lua_tonumber(L, -1);
@@ -302,14 +453,186 @@ static int b_unpack (lua_State *L) {
         lua_pushlstring(L, data+pos, size - 1);
         break;
       }
-      default: commoncases(L, opt, &fmt, &h);
     }
+    if (t != 0) lua_rawseti(L, t, ++k);
     pos += size;
   }
+  return pos;
+}
+
+
+static int b_pack (lua_State *L) {
+  char buff[LUAL_BUFFERSIZE];
+  Format *f = getformat(L, 1);
+  size_t size = packedsize(L, f, 2, 0);
+  char *b = (size <= sizeof(buff)) ? buff : (char *)lua_newuserdata(L, size);
+  packvalues(L, f, 2, b, 0);
+  lua_pushlstring(L, b, size);
+  return 1;
+}
+
+
+static int b_unpack (lua_State *L) {
+  Format *f = getformat(L, 1);
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  if (lua_istable(L, 4)) {  /* unpack into a given table? */
+    lua_settop(L, 4);
+    pos = unpackvalues(L, f, data, ld, pos, 4);
+    lua_pushinteger(L, pos + 1);
+    return 2;
+  }
+  lua_settop(L, 2);
+  luaL_checkstack(L, f->nitems + 1, "too many results to unpack");
+  pos = unpackvalues(L, f, data, ld, pos, 0);
   lua_pushinteger(L, pos + 1);
   return lua_gettop(L) - 2;
 }
 
+
+static int b_compile (lua_State *L) {
+  getformat(L, 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int f_size (lua_State *L) {
+  Format *f = checkformat(L, 1);
+  if (!f->fixed) return 0;
+  lua_pushinteger(L, f->size);
+  return 1;
+}
+
+
+/*
+** Output of packmany, in a userdata at 'idx' so that it is collected
+** in case of errors
+*/
+typedef struct Sink {
+  char *b;
+  size_t n;  /* bytes used */
+  size_t size;
+  int idx;
+} Sink;
+
+
+/* makes room for 'n' more bytes */
+static void sinkspace (lua_State *L, Sink *s, size_t n) {
+  if (s->n + n > s->size) {
+    char *b;
+    size_t size = s->size * 2;
+    if (size < s->n + n) size = s->n + n;
+    b = (char *)lua_newuserdata(L, size);
+    memcpy(b, s->b, s->n);
+    lua_replace(L, s->idx);
+    s->b = b;
+    s->size = size;
+  }
+}
+
+
+/*
+** fmt:packmany(list [, n]): packs the records list[1] to list[n], each
+** an array of values, one after the other (as unpackmany reads them)
+*/
+static int f_packmany (lua_State *L) {
+  Format *f = checkformat(L, 1);
+  int n, r;
+  Sink s;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = luaL_optint(L, 3, lua_objlen(L, 2));
+  lua_settop(L, 2);
+  luaL_checkstack(L, f->nargs + 2, "too many values in record");
+  s.n = 0;
+  s.size = (f->fixed && n > 0) ? f->size * n : LUAL_BUFFERSIZE;
+  if (s.size == 0) s.size = 1;
+  s.b = (char *)lua_newuserdata(L, s.size);
+  s.idx = 3;
+  for (r = 1; r <= n; r++) {
+    size_t size;
+    int j;
+    lua_rawgeti(L, 2, r);
+    if (!lua_istable(L, 4))
+      luaL_error(L, "record %d is not a table", r);
+    for (j = 1; j <= f->nargs; j++)
+      lua_rawgeti(L, 4, j);
+    size = packedsize(L, f, 5, s.n);
+    sinkspace(L, &s, size);
+    packvalues(L, f, 5, s.b, s.n);
+    s.n += size;
+    lua_settop(L, 3);
+  }
+  lua_pushlstring(L, s.b, s.n);
+  return 1;
+}
+
+
+/*
+** fmt:unpackmany(data [, pos [, n [, list]]]): unpacks 'n' records (or
+** up to the end of the data) into tables list[1] to list[n], reusing
+** the tables already in 'list'. Returns the list, the position after
+** the last record and the number of records.
+*/
+static int f_unpackmany (lua_State *L) {
+  Format *f = checkformat(L, 1);
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  int n = luaL_optint(L, 4, -1);
+  int r;
+  luaL_argcheck(L, n >= 0 || !f->fixed || f->size > 0, 1, "empty format");
+  if (lua_isnoneornil(L, 5)) {
+    lua_settop(L, 4);
+    lua_createtable(L, (n > 0) ? n : 0, 0);
+  }
+  else {
+    luaL_checktype(L, 5, LUA_TTABLE);
+    lua_settop(L, 5);
+  }
+  for (r = 1; (n < 0) ? pos < ld : r <= n; r++) {
+    lua_rawgeti(L, 5, r);
+    if (!lua_istable(L, 6)) {
+      lua_pop(L, 1);
+      lua_createtable(L, f->nargs, 0);
+      lua_pushvalue(L, 6);
+      lua_rawseti(L, 5, r);
+    }
+    pos = unpackvalues(L, f, data, ld, pos, 6);
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, pos + 1);
+  lua_pushinteger(L, r - 1);
+  return 3;
+}
+
+
+#ifdef STRUCT_LBUFFER
+/*
+** fmt:packinto(b, pos, ...): packs the values into lbuffer 'b' at 'pos'
+** (#b + 1 to append), growing it as needed. Returns the position after
+** the packed values.
+*/
+static int f_packinto (lua_State *L) {
+  Format *f = checkformat(L, 1);
+  buffer *b = lb_checkbuffer(L, 2);
+  size_t pos = luaL_checkinteger(L, 3) - 1;
+  size_t len = b->len;
+  size_t size;
+  luaL_argcheck(L, pos <= len, 3, "position out of buffer");
+  size = packedsize(L, f, 4, pos);
+  if (pos + size > len) {
+    if (lb_realloc(L, b, pos + size) == NULL)
+      luaL_error(L, "not enough memory");
+    memset(b->str + len, 0, pos + size - len);
+  }
+  packvalues(L, f, 4, b->str, pos);
+  lua_pushinteger(L, pos + size + 1);
+  return 1;
+}
+#endif
+
 /* }====================================================== */
 
 
@@ -317,12 +640,37 @@ static int b_unpack (lua_State *L) {
 static const struct luaL_reg thislib[] = {
   {"pack", b_pack},
   {"unpack", b_unpack},
+  {"compile", b_compile},
+  {NULL, NULL}
+};
+
+
+static const struct luaL_reg formatlib[] = {
+  {"pack", b_pack},
+  {"unpack", b_unpack},
+  {"packmany", f_packmany},
+  {"unpackmany", f_unpackmany},
+#ifdef STRUCT_LBUFFER
+  {"packinto", f_packinto},
+#endif
+  {"size", f_size},
   {NULL, NULL}
 };
 
 
 LUALIB_API int luaopen_struct (lua_State *L) {
-  luaL_register(L, "struct", thislib);
+  lua_newtable(L);  /* cache of compiled format strings */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  luaL_newmetatable(L, FORMAT);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaI_openlib(L, NULL, formatlib, 2);
+  luaI_openlib(L, "struct", thislib, 2);
   return 1;
 }
 
@@ -0,0 +1,94 @@
+-- tests for the struct library
+
+local lib = require"struct"
+
+local function checkerr (msg, f, ...)
+  local st, err = pcall(f, ...)
+  assert(not st and string.find(err, msg, 1, true), err)
+end
+
+
+-- basic packing and unpacking
+assert(lib.pack("<i4", 0x01020304) == "\4\3\2\1")
+assert(lib.pack(">i2", 258) == "\1\2")
+assert(lib.unpack("<h", "\255\255") == -1)
+assert(lib.unpack("<H", "\255\255") == 65535)
+local a, b, c, pos = lib.unpack("<B c2 s", "\2xyz\0!")
+assert(a == 2 and b == "xy" and c == "z" and pos == 6)
+assert(lib.pack("!4 B i4", 1, 2) == "\1\0\0\0" .. lib.pack("i4", 2))
+print"+"
+
+
+-- compiled formats
+local f = lib.compile("<B h i4")
+assert(lib.compile("<B h i4") == f)  -- cached while in use
+assert(f:size() == 7)
+assert(lib.compile("<B c0"):size() == nil)
+assert(lib.compile("!4 B i4"):size() == 8)
+assert(f:pack(1, -2, 3) == lib.pack("<B h i4", 1, -2, 3))
+assert(lib.pack(f, 1, -2, 3) == f:pack(1, -2, 3))
+a, b, c, pos = f:unpack(f:pack(1, -2, 3))
+assert(a == 1 and b == -2 and c == 3 and pos == 8)
+local t = {}
+assert(f:unpack("\0" .. f:pack(4, 5, 6), 2, t) == t)
+assert(t[1] == 4 and t[2] == 5 and t[3] == 6)
+checkerr("data string too short", f.unpack, f, "\1\2")
+checkerr("invalid format option", lib.compile, "<q")
+print"+"
+
+
+-- packmany and unpackmany
+local recs = {{1, -2, 3}, {4, 5, 6}, {255, 32767, -1}}
+local s = f:packmany(recs)
+assert(s == f:pack(1, -2, 3) .. f:pack(4, 5, 6) .. f:pack(255, 32767, -1))
+assert(f:packmany(recs, 2) == f:pack(1, -2, 3) .. f:pack(4, 5, 6))
+assert(f:packmany({}) == "")
+
+local list, n
+list, pos, n = f:unpackmany(s)
+assert(#list == 3 and pos == #s + 1 and n == 3)
+for i = 1, 3 do
+  for j = 1, 3 do assert(list[i][j] == recs[i][j]) end
+end
+local first = list[1]
+list, pos, n = f:unpackmany(s, 8, 1, list)  -- reuses the tables
+assert(list[1] == first and first[1] == 4 and pos == 15 and n == 1)
+list, pos, n = f:unpackmany("", 1)
+assert(#list == 0 and pos == 1 and n == 0)
+
+-- variable-size records, with alignment relative to the whole string
+local v = lib.compile("!4 B c0 i4")
+s = v:packmany{{2, "ab", 7}, {0, "", 8}}
+assert(s == lib.pack("!4 B c0 i4 B c0 i4", 2, "ab", 7, 0, "", 8))
+list, pos, n = v:unpackmany(s)
+-- (the length read for 'c0' is not returned)
+assert(n == 2 and list[1][1] == "ab" and list[1][2] == 7 and
+       list[2][1] == "" and list[2][2] == 8)
+
+-- mismatched counts
+checkerr("number expected", f.packmany, f, {{1, 2}})
+checkerr("record 4 is not a table", f.packmany, f, recs, 4)
+checkerr("data string too short", f.unpackmany, f, f:packmany(recs), 1, 4)
+checkerr("data string too short", f.unpackmany, f, f:packmany(recs) .. "x")
+checkerr("empty format", lib.compile("").unpackmany, lib.compile(""), "abc")
+print"+"
+
+
+-- packinto, when built with lbuffer support
+if f.packinto then
+  local buffer = require"buffer"
+  local p = lib.compile("<i2")
+  local bf = buffer.new("abcd")
+  assert(p:packinto(bf, 2, 258) == 4)  -- overwrites in place
+  assert(bf:tostring() == "a\2\1d")
+  assert(p:packinto(bf, 4, 3) == 6)  -- grows past the end
+  assert(bf:tostring() == "a\2\1\3\0")
+  assert(p:packinto(bf, #bf + 1, 4) == 8)  -- appends
+  assert(bf:tostring() == "a\2\1\3\0\4\0")
+  checkerr("position out of buffer", p.packinto, p, bf, #bf + 2, 5)
+  checkerr("number expected", p.packinto, p, bf, 1)
+  assert(bf:tostring() == "a\2\1\3\0\4\0")  -- unchanged by the errors
+  print"+"
+end
+
+print"OK"
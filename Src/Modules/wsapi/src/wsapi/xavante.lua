@@ -13,6 +13,9 @@ xpcall = coxpcall
 
 local common = require"wsapi.common"
 
+local ok, httpparser = pcall(require, "xavante.httpparser")
+if not ok then httpparser = nil end
+
 module (..., package.seeall)
 
 -------------------------------------------------------------------------------
@@ -41,8 +44,12 @@ local function set_cgivars (req, diskpath, path_info_pat, script_name_pat, extra
   for n,v in pairs(extra_vars or {}) do
     req.cgivars[n] = v
   end
-  for n,v in pairs (req.headers) do
-    req.cgivars ["HTTP_"..string.gsub (string.upper (n), "-", "_")] = v
+  if httpparser then
+    httpparser.cgi_headers(req.headers, req.cgivars)
+  else
+    for n,v in pairs (req.headers) do
+      req.cgivars ["HTTP_"..string.gsub (string.upper (n), "-", "_")] = v
+    end
   end
 end
 
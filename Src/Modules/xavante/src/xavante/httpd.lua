@@ -9,12 +9,32 @@
 
 local url = require "socket.url"
 
+-- native request head parser, when the C module is available
+local _httpparser
+do
+	local ok, mod = pcall (require, "xavante.httpparser")
+	if ok then _httpparser = mod end
+end
+
 module ("xavante.httpd", package.seeall)
 
 local _serversoftware = ""
 
+-- size of the blocks read while looking for the end of a request head
+local _READSIZE = 8192
+
+-- largest unread request body skipped to keep a connection open
+local _MAXSKIP = 65536
+
 local _serverports = {}
 
+-- listening sockets, and connections being served
+local _servers = {}
+local _connections = 0
+
+-- set by stop(): persistent connections end after their current request
+local _stopping = false
+
 -- handles the change of string.find in 5.1 to string.match
 string.gmatch = string.gmatch or string.gfind
 
@@ -35,6 +55,7 @@ end
 
 function connection (skt)
 	copas.setErrorHandler (errorhandler)
+	_connections = _connections + 1
 	
 	skt:setoption ("tcp-nodelay", true)
 	local srv, port = skt:getsockname ()
@@ -44,12 +65,11 @@ function connection (skt)
 		port = port,
 		copasskt = copas.wrap (skt),
 	}
-	req.socket = req.copasskt
+	req.socket = _httpparser and bufferedsocket (req.copasskt, skt) or req.copasskt
 	req.serversoftware = _serversoftware
 	
-	while read_method (req) do
+	while read_request (req) do
 		local res
-		read_headers (req)
 
 		repeat
 			req.params = nil
@@ -59,14 +79,16 @@ function connection (skt)
 		send_response (req, res)
 
 		req.socket:flush ()
-		if not res.keep_alive then
+		if not res.keep_alive or not skip_body (req) then
 			break
 		end
 	end
+	_connections = _connections - 1
 end
 
 
 function errorhandler (msg, co, skt)
+	_connections = _connections - 1
     msg = tostring(msg)
 	io.stderr:write("  Xavante Error: "..msg.."\n", "  "..tostring(co).."\n", "  "..tostring(skt).."\n")
 	skt:send ("HTTP/1.0 200 OK\r\n")
@@ -80,6 +102,150 @@ function errorhandler (msg, co, skt)
 ]], string.gsub (msg, "\n", "<br/>\n")))
 end
 
+-- Wraps a copas socket with an input buffer holding bytes already read
+-- past a request head: the start of the request body, or pipelined requests.
+-- Buffered bytes are served before reading from the socket again.
+-- Lines are read through the buffer too, so that `consumed' counts exactly
+-- the bytes taken from the connection.
+local _bufskt_mt = { __index = {
+	receive = function (self, pattern)
+		local buf = self.inbuf
+		pattern = pattern or "*l"
+		if type (pattern) == "number" then
+			if string.len (buf) >= pattern then
+				self.inbuf = string.sub (buf, pattern + 1)
+				self.consumed = self.consumed + pattern
+				return string.sub (buf, 1, pattern)
+			end
+			pattern = pattern - string.len (buf)
+		elseif string.sub (pattern, 1, 2) == "*l" then
+			local nl = string.find (buf, "\n", 1, true)
+			while not nl do
+				local data, err, part = copas.receivePartial (self.rawskt, _READSIZE)
+				data = data or part
+				if not data or data == "" then
+					self.inbuf = ""
+					self.consumed = self.consumed + string.len (buf)
+					return nil, err or "closed", (string.gsub (buf, "\r", ""))
+				end
+				nl = string.find (data, "\n", 1, true)
+				if nl then nl = nl + string.len (buf) end
+				buf = buf .. data
+			end
+			self.inbuf = string.sub (buf, nl + 1)
+			self.consumed = self.consumed + nl
+			return (string.gsub (string.sub (buf, 1, nl - 1), "\r", ""))
+		else
+			-- "*a" reads up to the end of the connection
+			self.consumed = math.huge
+		end
+		self.inbuf = ""
+		self.consumed = self.consumed + string.len (buf)
+		local data, err, part = self.socket:receive (pattern)
+		if type (pattern) == "number" then
+			self.consumed = self.consumed + string.len (data or part or "")
+		end
+		if data then
+			return buf .. data
+		end
+		return nil, err, buf .. (part or "")
+	end,
+
+	send = function (self, ...)
+		return self.socket:send (...)
+	end,
+
+	flush = function (self)
+		return self.socket:flush ()
+	end,
+
+	settimeout = function (self, time)
+		return self.socket:settimeout (time)
+	end,
+}}
+
+function bufferedsocket (skt, rawskt)
+	return setmetatable ({ socket = skt, rawskt = rawskt, inbuf = "",
+		consumed = 0 }, _bufskt_mt)
+end
+
+-- reads and parses a request head
+-- params:
+--		req: request object
+-- returns:
+--		true if ok
+--		false if connection closed, or the head was rejected (after
+--		answering with an error status)
+-- sets:
+--		the same fields as read_method and read_headers
+function read_request (req)
+	if not _httpparser then
+		if not read_method (req) then return nil end
+		read_headers (req)
+		return true
+	end
+	
+	local skt = req.socket
+	local buf = skt.inbuf
+	while true do
+		local mth, url, version, headers, pos = _httpparser.parse_request (buf)
+		if mth then
+			skt.inbuf = string.sub (buf, pos)
+			skt.consumed = 0
+			req.cmd_mth, req.cmd_url, req.cmd_version = mth, url, version
+			req.cmdline = table.concat ({ mth, url, version }, " ")
+			req.headers = headers
+			return true
+		elseif url ~= "incomplete" then
+			-- tell the client why the connection is closed
+			local status = url == "head too large" and
+				"431 Request Header Fields Too Large" or "400 Bad Request"
+			skt:send ("HTTP/1.1 "..status.."\r\nConnection: close\r\nContent-Length: 0\r\n\r\n")
+			skt:flush ()
+			return nil
+		end
+		-- unblocks on any data received
+		local data, err, part = copas.receivePartial (req.rawskt, _READSIZE)
+		data = data or part
+		if not data or data == "" then
+			return nil
+		end
+		buf = buf .. data
+	end
+end
+
+-- skips what the handler left unread of the request body, so that the
+-- next request head is read from where it starts
+-- params:
+--		req: request object
+-- returns:
+--		true if the connection can serve another request
+function skip_body (req)
+	local skt = req.socket
+	local te = req.headers ["transfer-encoding"]
+	local length = tonumber (req.headers ["content-length"] or 0)
+	if (te and string.lower (te) ~= "identity") or not length then
+		-- where a chunked body ends is only known to whoever read it
+		return false
+	end
+	if not skt.consumed then
+		-- the line by line reader does not count what was read
+		return length == 0
+	end
+	local left = length - skt.consumed
+	if left < 0 or left > _MAXSKIP then
+		return false
+	end
+	while left > 0 do
+		local data = skt:receive (math.min (left, _READSIZE))
+		if not data then
+			return false
+		end
+		left = left - string.len (data)
+	end
+	return true
+end
+
 -- gets and parses the request line
 -- params:
 --		req: request object
@@ -270,11 +436,25 @@ function send_response (req, res)
         res:add_header ("Transfer-Encoding", "chunked")
     end
     
-	if res.chunked or ((res.headers ["Content-Length"]) and req.headers ["connection"] == "Keep-Alive")
+	-- HTTP/1.1 connections are persistent unless the client asks otherwise,
+	-- HTTP/1.0 ones only if the client asks for it
+	local connection = string.lower (req.headers ["connection"] or "")
+	local persistent
+	if req.cmd_version == "HTTP/1.1" then
+		persistent = connection ~= "close"
+	else
+		persistent = connection == "keep-alive"
+	end
+	
+	if persistent and not _stopping and
+		(res.chunked or res.headers ["Content-Length"])
 	then
 		res.headers ["Connection"] = "Keep-Alive"
 		res.keep_alive = true
 	else
+		if persistent and not res.sent_headers then
+			res.headers ["Connection"] = "close"
+		end
 		res.keep_alive = nil
 	end
 	
@@ -367,10 +547,33 @@ end
 
 function register (host, port, serversoftware)
 	local _server = assert(socket.bind(host, port))
+	add_server(_server, serversoftware)
+end
+
+-- serves the connections accepted on an already listening socket
+-- (timeout is the accept timeout, as in copas.addserver)
+function add_server (server, serversoftware, timeout)
 	_serversoftware = serversoftware
-	local _ip, _port = _server:getsockname()
+	local _ip, _port = server:getsockname()
 	_serverports[_port] = true
-	copas.addserver(_server, connection)
+	_servers[server] = true
+	copas.addserver(server, connection, timeout)
+end
+
+-- stops accepting connections and closes the listening sockets;
+-- persistent connections are closed after their current request.
+-- With drain, connections already queued on the sockets are served first
+function stop (drain)
+	_stopping = true
+	for server in pairs(_servers) do
+		copas.removeserver(server, drain)
+	end
+	_servers = {}
+end
+
+-- returns the number of connections being served
+function connections ()
+	return _connections
 end
 
 function get_ports()
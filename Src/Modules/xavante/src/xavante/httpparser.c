@@ -0,0 +1,296 @@
+/*
+** Xavante HTTP header parser
+**
+** Parses a complete request (or response) head out of a raw buffer in a
+** single call, so servers can read from the socket in large chunks and
+** keep any bytes that follow the head (request body or pipelined
+** requests). Incomplete heads are reported as such, so callers simply
+** append more input and retry.
+**
+** Copyright (c) 2004-2007 Kepler Project
+*/
+
+#include <ctype.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#ifndef XAVANTE_API
+#define XAVANTE_API
+#endif
+
+/* header names up to this size are lowercased without a luaL_Buffer */
+#define HP_NAMESIZE 64
+
+/* largest accepted head; bigger ones are reported as "head too large" */
+#define HP_MAXHEAD (64*1024)
+
+#define isblank_(c) ((c) == ' ' || (c) == '\t')
+
+/*
+** Finds the end of the head that starts at s. Returns the offset just
+** past the empty line that terminates it, or 0 if it is not complete yet.
+** Leading empty lines are skipped, as RFC 2616 asks servers to do.
+*/
+static size_t find_end (const char *s, size_t len, size_t *first) {
+  size_t pos = 0;
+  while (pos < len && (s[pos] == '\r' || s[pos] == '\n'))
+    pos++;
+  *first = pos;
+  while (pos < len) {
+    const char *nl = (const char *) memchr(s + pos, '\n', len - pos);
+    if (nl == NULL)
+      return 0;
+    pos = (nl - s) + 1;
+    if (pos < len && s[pos] == '\n')
+      return pos + 1;
+    if (pos + 1 < len && s[pos] == '\r' && s[pos + 1] == '\n')
+      return pos + 2;
+  }
+  return 0;
+}
+
+/* returns the next line in [*pos, end), without its CR LF */
+static const char *next_line (const char *s, size_t *pos, size_t end,
+                              size_t *len) {
+  const char *line = s + *pos;
+  const char *nl = (const char *) memchr(line, '\n', end - *pos);
+  size_t n = nl ? (size_t) (nl - line) : end - *pos;
+  *pos += nl ? n + 1 : n;
+  while (n > 0 && line[n - 1] == '\r')
+    n--;
+  *len = n;
+  return line;
+}
+
+static void push_lower (lua_State *L, const char *s, size_t len) {
+  size_t i;
+  if (len <= HP_NAMESIZE) {
+    char buff[HP_NAMESIZE];
+    for (i = 0; i < len; i++)
+      buff[i] = (char) tolower((unsigned char) s[i]);
+    lua_pushlstring(L, buff, len);
+  }
+  else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (i = 0; i < len; i++)
+      luaL_addchar(&b, (char) tolower((unsigned char) s[i]));
+    luaL_pushresult(&b);
+  }
+}
+
+/* pushes the next whitespace separated word of a line, or nil */
+static void push_word (lua_State *L, const char *line, size_t len,
+                       size_t *pos, int upper) {
+  size_t start;
+  while (*pos < len && isblank_(line[*pos]))
+    (*pos)++;
+  start = *pos;
+  while (*pos < len && !isblank_(line[*pos]))
+    (*pos)++;
+  if (*pos == start)
+    lua_pushnil(L);
+  else if (upper) {
+    luaL_Buffer b;
+    size_t i;
+    luaL_buffinit(L, &b);
+    for (i = start; i < *pos; i++)
+      luaL_addchar(&b, (char) toupper((unsigned char) line[i]));
+    luaL_pushresult(&b);
+  }
+  else
+    lua_pushlstring(L, line + start, *pos - start);
+}
+
+/*
+** Parses header fields in [pos, end) into a new table pushed on the stack.
+** Names are lowercased, repeated fields are joined with "," and folded
+** continuation lines are appended to the previous field.
+*/
+static void parse_headers (lua_State *L, const char *s, size_t pos,
+                           size_t end) {
+  int tab, name = 0;
+  lua_newtable(L);
+  tab = lua_gettop(L);
+  while (pos < end) {
+    size_t len, i, v;
+    const char *line = next_line(s, &pos, end, &len);
+    if (len == 0)
+      break;
+    if (isblank_(line[0])) {
+      /* continuation of the previous field */
+      if (name == 0)
+        continue;
+      for (i = 0; i < len && isblank_(line[i]); i++) ;
+      lua_pushvalue(L, name);
+      lua_pushvalue(L, name);
+      lua_rawget(L, tab);
+      lua_pushliteral(L, " ");
+      lua_pushlstring(L, line + i, len - i);
+      lua_concat(L, 3);
+      lua_rawset(L, tab);
+      continue;
+    }
+    for (i = 0; i < len && line[i] != ':' && !isblank_(line[i]); i++) ;
+    for (v = i; v < len && isblank_(line[v]); v++) ;
+    if (i == 0 || v >= len || line[v] != ':')
+      continue;  /* not a header field; ignore it */
+    for (v++; v < len && isblank_(line[v]); v++) ;
+    while (len > v && isblank_(line[len - 1]))
+      len--;
+    if (name != 0)
+      lua_remove(L, name);
+    push_lower(L, line, i);
+    name = lua_gettop(L);
+    lua_pushvalue(L, name);
+    lua_pushvalue(L, name);
+    lua_rawget(L, tab);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_pushlstring(L, line + v, len - v);
+    }
+    else {
+      lua_pushliteral(L, ",");
+      lua_pushlstring(L, line + v, len - v);
+      lua_concat(L, 3);
+    }
+    lua_rawset(L, tab);
+  }
+  if (name != 0)
+    lua_remove(L, name);
+}
+
+/* common prologue: locates the head, or returns the failure results */
+static int locate_head (lua_State *L, const char **s, size_t *len,
+                        size_t *first, size_t *end, size_t *init) {
+  size_t l;
+  const char *str = luaL_checklstring(L, 1, &l);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  if (i < 0)
+    i = (lua_Integer) l + i + 1;
+  if (i < 1)
+    i = 1;
+  *init = (size_t) i - 1;
+  if (*init > l)
+    *init = l;
+  *s = str + *init;
+  *len = l - *init;
+  *end = find_end(*s, *len, first);
+  if (*end == 0 ? *len - *first > HP_MAXHEAD : *end - *first > HP_MAXHEAD) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "head too large");
+    return 2;
+  }
+  if (*end == 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "incomplete");
+    return 2;
+  }
+  return 0;
+}
+
+/*
+** parse_request(data [, init])
+** Returns method, url, version, headers and the position just past the
+** head, or nil followed by "incomplete" or "head too large".
+*/
+static int parse_request (lua_State *L) {
+  const char *s, *line;
+  size_t len, first, end, init, pos, linelen, w = 0;
+  int n = locate_head(L, &s, &len, &first, &end, &init);
+  if (n)
+    return n;
+  pos = first;
+  line = next_line(s, &pos, end, &linelen);
+  push_word(L, line, linelen, &w, 1);
+  push_word(L, line, linelen, &w, 0);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushliteral(L, "/");
+  }
+  push_word(L, line, linelen, &w, 0);
+  parse_headers(L, s, pos, end);
+  lua_pushinteger(L, (lua_Integer) (init + end + 1));
+  return 5;
+}
+
+/*
+** parse_response(data [, init])
+** Returns version, status code, reason phrase, headers and the position
+** just past the head, or nil followed by "incomplete", "head too large"
+** or "bad response".
+*/
+static int parse_response (lua_State *L) {
+  const char *s, *line;
+  size_t len, first, end, init, pos, linelen, w = 0;
+  int n = locate_head(L, &s, &len, &first, &end, &init);
+  if (n)
+    return n;
+  pos = first;
+  line = next_line(s, &pos, end, &linelen);
+  push_word(L, line, linelen, &w, 0);
+  push_word(L, line, linelen, &w, 0);
+  if (lua_isnil(L, -1) || !lua_isnumber(L, -1)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "bad response");
+    return 2;
+  }
+  lua_pushnumber(L, lua_tonumber(L, -1));
+  lua_replace(L, -2);
+  while (w < linelen && isblank_(line[w]))
+    w++;
+  lua_pushlstring(L, line + w, linelen - w);
+  parse_headers(L, s, pos, end);
+  lua_pushinteger(L, (lua_Integer) (init + end + 1));
+  return 5;
+}
+
+/*
+** cgi_headers(headers [, vars])
+** Adds the CGI meta-variables for a headers table ("content-type" becomes
+** HTTP_CONTENT_TYPE) to vars, which is created if absent and returned.
+*/
+static int cgi_headers (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  }
+  else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, 1) != 0) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      size_t len, i;
+      const char *name = lua_tolstring(L, -2, &len);
+      luaL_Buffer b;
+      luaL_buffinit(L, &b);
+      luaL_addstring(&b, "HTTP_");
+      for (i = 0; i < len; i++) {
+        char c = name[i] == '-' ? '_' : (char) toupper((unsigned char) name[i]);
+        luaL_addchar(&b, c);
+      }
+      luaL_pushresult(&b);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+static const luaL_reg httpparser_funcs[] = {
+  {"parse_request", parse_request},
+  {"parse_response", parse_response},
+  {"cgi_headers", cgi_headers},
+  {NULL, NULL}
+};
+
+XAVANTE_API int luaopen_xavante_httpparser (lua_State *L) {
+  luaL_register(L, "xavante.httpparser", httpparser_funcs);
+  return 1;
+}
@@ -0,0 +1,209 @@
+-------------------------------------------------------------------------------
+-- Xavante preforking server
+--
+-- The master process binds the server address and forks a number of
+-- workers, each running its own Copas dispatcher with the configured rules.
+-- Where SO_REUSEPORT is available every worker listens on a socket of its
+-- own and the kernel distributes the connections among them; otherwise
+-- the workers share a listening socket created by the master.
+--
+-- The master replaces workers that die, replaces all of them on SIGHUP
+-- (the new workers start listening before the old ones stop) and stops
+-- them on SIGTERM or SIGINT. A stopping worker closes its listening socket
+-- and exits once its connections are done, or after a grace period.
+--
+-- With SO_REUSEPORT the kernel has already queued some connections on each
+-- old worker's own socket, so a stopping worker accepts and serves those
+-- before closing it. Connections the kernel hands to that socket in the
+-- moment between the last accept and the close are still reset; a reload
+-- under load may drop a few of them.
+--
+-- Requires the xavante.process C module (POSIX only).
+--
+-- Copyright (c) 2004-2010 Kepler Project
+-------------------------------------------------------------------------------
+
+local process = require "xavante.process"
+
+module ("xavante.prefork", package.seeall)
+
+-- how often the master and stopping workers check for events, in seconds
+local _TICK = 0.2
+
+-- workers that die sooner than this after starting are respawned slowly
+local _MINLIFE = 1
+
+local _config          -- the server table of the configuration
+local _serversoftware
+local _listener        -- socket bound by the master
+local _reuseport       -- whether each worker listens on its own socket
+local _workers = {}    -- pid -> worker record
+local _generation = 0  -- incremented by each reload
+
+-------------------------------------------------------------------------------
+-- Binds the server address in the master process.
+-- server: the server table of the configuration, with the host, the port,
+--   the number of workers and optionally grace (seconds given to stopping
+--   workers to finish their connections, 10 by default) and backlog
+-------------------------------------------------------------------------------
+function configure (server, serversoftware)
+	_config = server
+	_serversoftware = serversoftware
+	local skt = assert (socket.tcp ())
+	skt:setoption ("reuseaddr", true)
+	_reuseport = skt:setoption ("reuseport", true) and true or false
+	assert (skt:bind (server.host, server.port))
+	if not _reuseport then
+		-- only a shared socket listens in the master; a bound but not
+		-- listening one just reserves the address and port for the workers
+		assert (skt:listen (server.backlog))
+	end
+	_listener = skt
+end
+
+-- returns the ports being served, as strings
+function get_ports ()
+	local _, port = _listener:getsockname ()
+	return { tostring (port) }
+end
+
+-------------------------------------------------------------------------------
+-- Worker process
+-------------------------------------------------------------------------------
+local function worker (timeout)
+	process.signal ("term", "trap")
+	process.signal ("int", "trap")
+	process.signal ("hup", "ignore")
+	process.signal ("chld", "default")
+	process.signals ()
+
+	local server = _listener
+	if _reuseport then
+		local ip, port = _listener:getsockname ()
+		_listener:close ()
+		server = assert (socket.tcp ())
+		server:setoption ("reuseaddr", true)
+		assert (server:setoption ("reuseport", true))
+		assert (server:bind (ip, port))
+		assert (server:listen (_config.backlog))
+	end
+	-- with a shared socket another worker may take the connection first,
+	-- so accepting must not block
+	xavante.httpd.add_server (server, _serversoftware, 0)
+
+	-- trapped signals do not interrupt the dispatcher, so it never waits
+	-- for longer than a second
+	if not timeout or timeout < 0 or timeout > 1 then
+		timeout = 1
+	end
+	local master = process.getppid ()
+	local deadline
+	while true do
+		if not deadline and (process.signals () or process.getppid () ~= master) then
+			-- a socket of its own may hold queued connections no other
+			-- worker can take
+			xavante.httpd.stop (_reuseport)
+			deadline = socket.gettime () + (_config.grace or 10)
+		end
+		if deadline and (xavante.httpd.connections () == 0 or
+				socket.gettime () > deadline) then
+			break
+		end
+		copas.step (deadline and _TICK or timeout)
+	end
+end
+
+-------------------------------------------------------------------------------
+-- Master process
+-------------------------------------------------------------------------------
+local function spawn (timeout)
+	-- or the children would write buffered output again
+	io.stdout:flush ()
+	io.stderr:flush ()
+	local pid, err = process.fork ()
+	if not pid then
+		io.stderr:write ("  Xavante Error: cannot fork worker: "..err.."\n")
+		return
+	end
+	if pid == 0 then
+		local ok, err = pcall (worker, timeout)
+		if not ok then
+			io.stderr:write ("  Xavante Error: "..tostring (err).."\n")
+		end
+		os.exit (ok and 0 or 1)
+	end
+	_workers [pid] = { generation = _generation, started = socket.gettime () }
+end
+
+local function signal_workers (sig, generation)
+	for pid, w in pairs (_workers) do
+		if not generation or w.generation == generation then
+			process.kill (pid, sig)
+		end
+	end
+end
+
+-------------------------------------------------------------------------------
+-- Forks the workers and supervises them until the master is told to stop,
+-- either by SIGTERM or SIGINT or by isFinished returning true.
+-- timeout is the dispatcher timeout used by the workers.
+-------------------------------------------------------------------------------
+function start (isFinished, timeout)
+	process.signal ("term", "trap")
+	process.signal ("int", "trap")
+	process.signal ("hup", "trap")
+	process.signals ()
+
+	local count = _config.workers
+	for i = 1, count do
+		spawn (timeout)
+	end
+
+	local missing, nextspawn = 0, 0
+	local stopping, killtime
+	while true do
+		local sigs = process.signals ()
+		if not stopping and ((sigs and (sigs.term or sigs.int)) or
+				(isFinished and isFinished ())) then
+			stopping = true
+			killtime = socket.gettime () + (_config.grace or 10) + 5
+			signal_workers ("term")
+		elseif not stopping and sigs and sigs.hup then
+			-- graceful reload: start a new generation, then stop the old one
+			_generation = _generation + 1
+			missing = 0
+			for i = 1, count do
+				spawn (timeout)
+			end
+			signal_workers ("term", _generation - 1)
+		end
+
+		-- reaps dead workers, replacing the ones that should be running
+		while true do
+			local pid = process.wait (-1, true)
+			if not pid then break end
+			local w = _workers [pid]
+			_workers [pid] = nil
+			if w and w.generation == _generation and not stopping then
+				io.stderr:write ("  Xavante Error: worker "..pid.." died\n")
+				missing = missing + 1
+				if socket.gettime () - w.started < _MINLIFE then
+					nextspawn = socket.gettime () + _MINLIFE
+				end
+			end
+		end
+		if stopping then
+			if next (_workers) == nil then break end
+			if socket.gettime () > killtime then
+				signal_workers ("kill")
+			end
+		elseif missing > 0 and socket.gettime () >= nextspawn then
+			for i = 1, missing do
+				spawn (timeout)
+			end
+			missing = 0
+		end
+		socket.sleep (_TICK)
+	end
+	_listener:close ()
+end
@@ -0,0 +1,212 @@
+/*
+** Xavante process control
+**
+** The few POSIX process primitives a preforking server master needs:
+** fork, waitpid, kill and signal trapping. Trapped signals are only
+** recorded by the handler and collected later with signals(), so no Lua
+** code ever runs inside a signal handler.
+**
+** Copyright (c) 2004-2010 Kepler Project
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#ifndef XAVANTE_API
+#define XAVANTE_API
+#endif
+
+static const struct {
+  const char *name;
+  int sig;
+} signames[] = {
+  {"hup", SIGHUP},
+  {"int", SIGINT},
+  {"quit", SIGQUIT},
+  {"term", SIGTERM},
+  {"kill", SIGKILL},
+  {"usr1", SIGUSR1},
+  {"usr2", SIGUSR2},
+  {"chld", SIGCHLD},
+  {NULL, 0}
+};
+
+#define NSIGNAMES (sizeof(signames) / sizeof(signames[0]) - 1)
+
+/* deliveries of each trapped signal not yet collected by signals() */
+static volatile sig_atomic_t pending[NSIGNAMES];
+
+static int checksig (lua_State *L, int idx, int *which) {
+  int i;
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    int sig = (int) lua_tointeger(L, idx);
+    for (i = 0; signames[i].name; i++)
+      if (signames[i].sig == sig)
+        break;
+    if (which) *which = signames[i].name ? i : -1;
+    return sig;
+  }
+  else {
+    const char *name = luaL_checkstring(L, idx);
+    for (i = 0; signames[i].name; i++)
+      if (strcmp(name, signames[i].name) == 0) {
+        if (which) *which = i;
+        return signames[i].sig;
+      }
+    return luaL_argerror(L, idx,
+                         lua_pushfstring(L, "unknown signal '%s'", name));
+  }
+}
+
+static int pusherror (lua_State *L) {
+  lua_pushnil(L);
+  lua_pushstring(L, strerror(errno));
+  return 2;
+}
+
+static void handler (int sig) {
+  int i;
+  for (i = 0; signames[i].name; i++)
+    if (signames[i].sig == sig) {
+      pending[i]++;
+      break;
+    }
+}
+
+/*
+** fork()
+** Returns the pid of the child in the parent, 0 in the child, or nil and
+** an error message.
+*/
+static int process_fork (lua_State *L) {
+  pid_t pid = fork();
+  if (pid < 0)
+    return pusherror(L);
+  lua_pushinteger(L, (lua_Integer) pid);
+  return 1;
+}
+
+/*
+** wait([pid [, nohang]])
+** Waits for a child (any child by default) to terminate. Returns its pid,
+** "exited" or "signaled", and the exit status or signal number. With
+** nohang, returns nil if no child has terminated yet.
+*/
+static int process_wait (lua_State *L) {
+  pid_t pid = (pid_t) luaL_optinteger(L, 1, -1);
+  int status, options = lua_toboolean(L, 2) ? WNOHANG : 0;
+  do {
+    pid = waitpid(pid, &status, options);
+  } while (pid < 0 && errno == EINTR);
+  if (pid < 0)
+    return pusherror(L);
+  if (pid == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushinteger(L, (lua_Integer) pid);
+  if (WIFSIGNALED(status)) {
+    lua_pushliteral(L, "signaled");
+    lua_pushinteger(L, WTERMSIG(status));
+  }
+  else {
+    lua_pushliteral(L, "exited");
+    lua_pushinteger(L, WIFEXITED(status) ? WEXITSTATUS(status) : 0);
+  }
+  return 3;
+}
+
+/*
+** kill(pid, signal)
+** Sends a signal, given by name ("term", "hup", ...) or number.
+*/
+static int process_kill (lua_State *L) {
+  pid_t pid = (pid_t) luaL_checkinteger(L, 1);
+  if (kill(pid, checksig(L, 2, NULL)) < 0)
+    return pusherror(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+** signal(signal, action)
+** Sets the action for a signal: "trap" records its deliveries for
+** signals(), "ignore" ignores it and "default" restores the default.
+*/
+static int process_signal (lua_State *L) {
+  static const char *const actions[] = {"trap", "ignore", "default", NULL};
+  int which;
+  int sig = checksig(L, 1, &which);
+  int action = luaL_checkoption(L, 2, NULL, actions);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  if (action == 0) {
+    luaL_argcheck(L, which >= 0, 1, "signal cannot be trapped");
+    sa.sa_handler = handler;
+    pending[which] = 0;
+  }
+  else
+    sa.sa_handler = action == 1 ? SIG_IGN : SIG_DFL;
+  if (sigaction(sig, &sa, NULL) < 0)
+    return pusherror(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+** signals()
+** Returns a table with the names of the trapped signals delivered since
+** the last call, as keys and as an array, or nil if there were none.
+*/
+static int process_signals (lua_State *L) {
+  int i, n = 0;
+  for (i = 0; signames[i].name; i++) {
+    if (pending[i] == 0)
+      continue;
+    pending[i] = 0;
+    if (n == 0)
+      lua_newtable(L);
+    lua_pushstring(L, signames[i].name);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, ++n);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+  }
+  if (n == 0)
+    lua_pushnil(L);
+  return 1;
+}
+
+static int process_getpid (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer) getpid());
+  return 1;
+}
+
+static int process_getppid (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer) getppid());
+  return 1;
+}
+
+static const luaL_reg process_funcs[] = {
+  {"fork", process_fork},
+  {"wait", process_wait},
+  {"kill", process_kill},
+  {"signal", process_signal},
+  {"signals", process_signals},
+  {"getpid", process_getpid},
+  {"getppid", process_getppid},
+  {NULL, NULL}
+};
+
+XAVANTE_API int luaopen_xavante_process (lua_State *L) {
+  luaL_register(L, "xavante.process", process_funcs);
+  return 1;
+}
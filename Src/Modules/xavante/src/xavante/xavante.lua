@@ -24,6 +24,9 @@ _COPYRIGHT   = "Copyright (C) 2004-2010 Kepler Project"
 _DESCRIPTION = "A Copas based Lua Web server with WSAPI support"
 _VERSION     = "Xavante 2.2.0"
 
+-- set when the server is configured to run several worker processes
+local _prefork = false
+
 local _startmessage = function (ports)
   print(string.format("Xavante started on port(s) %s", table.concat(ports, ", ")))
 end
@@ -82,13 +85,24 @@ function HTTP(config)
     end
 
     xavante.httpd.handle_request = xavante.vhostshandler(vhosts_table)
-    xavante.httpd.register(config.server.host, config.server.port, _VERSION)
+    if (config.server.workers or 1) > 1 then
+        -- preforking mode: the workers are forked by start()
+        require "xavante.prefork"
+        xavante.prefork.configure(config.server, _VERSION)
+        _prefork = true
+    else
+        xavante.httpd.register(config.server.host, config.server.port, _VERSION)
+    end
 end
 
 -------------------------------------------------------------------------------
 -- Starts the server
 -------------------------------------------------------------------------------
 function start(isFinished, timeout)
+    if _prefork then
+        _startmessage(xavante.prefork.get_ports())
+        return xavante.prefork.start(isFinished, timeout)
+    end
     _startmessage(xavante.httpd.get_ports())
     while true do
       if isFinished and isFinished() then break end
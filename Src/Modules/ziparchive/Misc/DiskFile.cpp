@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #endif
 
 namespace Misc {
@@ -214,6 +215,43 @@ ULONGLONG DiskFile::Write(const void* buffer, ULONGLONG count)
 }
 
 
+/**
+	Maps the whole file read-only into memory.
+
+	@param size Filled in with the size of the view.
+	@return Returns the start of the view or NULL if the file is empty or
+		couldn't be mapped.  Release it with UnmapView().
+**/
+const void* DiskFile::MapView(ULONGLONG& size)
+{
+	size = GetLength();
+	if (size == 0  ||  size == (ULONGLONG)-1)
+		return NULL;
+
+#if defined(PLATFORM_WINDOWS)
+	HANDLE mapping = ::CreateFileMapping(m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+		return NULL;
+	void* view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	::CloseHandle(mapping);
+	return view;
+#else
+	void* view = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, m_fileHandle, 0);
+	return view != MAP_FAILED ? view : NULL;
+#endif
+}
+
+
+void DiskFile::UnmapView(const void* view, ULONGLONG size)
+{
+#if defined(PLATFORM_WINDOWS)
+	::UnmapViewOfFile(view);
+#else
+	munmap((void*)view, (size_t)size);
+#endif
+}
+
+
 #if defined(PLATFORM_WINDOWS)
 extern time_t ConvertFILETIME_To_time_t(const FILETIME& fileTime);
 #endif
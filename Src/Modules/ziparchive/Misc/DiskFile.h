@@ -28,6 +28,9 @@ public:
 	time_t GetLastWriteTime();
 	void SetLastWriteTime(time_t lastWriteTime);
 
+	const void* MapView(ULONGLONG& size);
+	static void UnmapView(const void* view, ULONGLONG size);
+
 private:
     char* m_fileName;
 #if defined(WIN32)
@@ -17,6 +17,7 @@
 #include "zlib.h"
 #include <assert.h>
 #include <stdio.h>
+#include "mthread.h"
 #if defined(WIN32)
 #include <windows.h>
 #include <io.h>
@@ -368,6 +369,7 @@ public:
 	Detail()
 		: fileEntryIndex(ZipArchive::INVALID_FILE_ENTRY)
 		, bufferedData(NULL)
+		, mappedData(NULL)
 		, curUncompressedFilePosition(0)
 	{
 	}
@@ -376,6 +378,7 @@ public:
     size_t headerSize;
     z_stream stream;
     uint8_t* bufferedData;
+	const uint8_t* mappedData;				// The entry's data within a memory mapped archive.
 	uint32_t posInBufferedData;
 	uint64_t curCompressedFilePosition;
 	uint64_t curUncompressedFilePosition;
@@ -440,6 +443,52 @@ static int entropy_fun(unsigned char buf[], unsigned int len)
 }
 #endif
 
+/**
+	A read-only memory map of an archive.  It is reference counted so the
+	data handed out by FileMapIndex() may outlive Close().
+**/
+class ZipArchive::MappedView
+{
+public:
+	MappedView(const void* _data, uint64_t _size)
+		: data((const uint8_t*)_data)
+		, size(_size)
+		, refCount(1)
+	{
+	}
+
+	~MappedView()
+	{
+		DiskFile::UnmapView(data, size);
+	}
+
+	const uint8_t* data;
+	uint64_t size;
+	int refCount;
+};
+
+
+/**
+	Adds a reference to the archive's memory map, keeping it valid until the
+	matching ReleaseMappedView() call even if the archive is closed.
+
+	@return Returns the view or NULL if the archive isn't memory mapped.
+**/
+ZipArchive::MappedView* ZipArchive::AcquireMappedView()
+{
+	if (m_mappedView)
+		m_mappedView->refCount++;
+	return m_mappedView;
+}
+
+
+void ZipArchive::ReleaseMappedView(MappedView* view)
+{
+	if (view  &&  --view->refCount == 0)
+		delete view;
+}
+
+
 /**
 	The constructor.
 **/
@@ -458,6 +507,7 @@ ZipArchive::ZipArchive() :
 	m_fileEntriesMaxSizeBytes(0),
 	m_parentFile(NULL),
 	m_ownParentFile(false),
+	m_mappedView(NULL),
 	m_changed(false),
 	m_curWriteFile(NULL),
 	m_headOpenFile(NULL),
@@ -634,6 +684,19 @@ bool ZipArchive::Open(const char* fileName, bool readOnly, uint32_t flags, const
 		m_parentFile = NULL;
 	}
 	m_ownParentFile = true;
+
+	// Read-only archives can be read straight out of a memory map.  Encrypted
+	// entries still have to be decrypted through a buffer.
+	if (ret  &&  m_readOnly  &&  (flags & MEMORY_MAPPED)
+#if ZIPARCHIVE_ENCRYPTION
+			&&  this->defaultPassword.Length() == 0
+#endif // ZIPARCHIVE_ENCRYPTION
+			) {
+		ULONGLONG mappedSize;
+		const void* view = parentFile->MapView(mappedSize);
+		if (view)
+			m_mappedView = new MappedView(view, mappedSize);
+	}
 	return ret;
 }
 
@@ -867,6 +930,11 @@ bool ZipArchive::Close()
 	this->defaultPassword.Clear();
 #endif // ZIPARCHIVE_ENCRYPTION
 
+	// Let go of the memory map.  Anything still holding a reference to it
+	// keeps it alive.
+	ReleaseMappedView(m_mappedView);
+	m_mappedView = NULL;
+
 	// Destroy the File.
 	if (m_ownParentFile) {
 		delete m_parentFile;
@@ -1160,7 +1228,7 @@ bool ZipArchive::FileCreateInternal(const char* fileName, ZipEntryFileHandle& fi
 			m_fileEntryMaxCount += 100;
 	        m_fileEntryOffsets = new size_t[m_fileEntryMaxCount + 1];
 			if (origOffsets) {
-	            memcpy(m_fileEntryOffsets, origOffsets, m_fileEntryCount * sizeof(unsigned int));
+	            memcpy(m_fileEntryOffsets, origOffsets, m_fileEntryCount * sizeof(size_t));
 				delete[] origOffsets;
 			}
 		}
@@ -1217,6 +1285,7 @@ bool ZipArchive::FileCreateInternal(const char* fileName, ZipEntryFileHandle& fi
 		fileHandle.detail->bufferedData = NULL;
 		fileHandle.detail->posInBufferedData = 0;
 	}
+	fileHandle.detail->mappedData = NULL;
 
 	if (fileNameLen == 0)
 		fileNameLen = strlen(fileName);
@@ -1306,6 +1375,7 @@ bool ZipArchive::FileOpenIndexInternal(size_t index, ZipEntryFileHandle& fileHan
     fileHandle.detail->curCompressedFilePosition = 0;
 
 	fileHandle.detail->bufferedData = NULL;
+	fileHandle.detail->mappedData = NULL;
 
     // Add this virtual file to the open files list.
 	fileHandle.nextOpenFile = m_headOpenFile;
@@ -1360,6 +1430,36 @@ bool ZipArchive::FileOpenIndex(size_t index, ZipEntryFileHandle& fileHandle)
 	// Grab the entry.
 	ZipEntryInfo& fileEntry = *GetFileEntry(index);
 
+	// Memory mapped archives read the entry in place.  Deflated entries inflate
+	// straight from the map, so no read buffer is needed.
+	if (m_mappedView) {
+		const uint8_t* data = MappedEntryData(fileEntry);
+		if (!data) {
+			FileCloseInternal(fileHandle);
+			return false;
+		}
+		fileHandle.detail->mappedData = data;
+		fileHandle.detail->headerSize = data - (m_mappedView->data + fileEntry.m_offset);
+
+		if (fileEntry.m_compressionMethod != 0) {
+			memset(&fileHandle.detail->stream, 0, sizeof(fileHandle.detail->stream));
+			fileHandle.detail->stream.next_in = (Bytef*)data;
+			fileHandle.detail->stream.avail_in = fileEntry.m_compressedSize;
+			fileHandle.detail->stream.zalloc = zlib_alloc_func;
+			fileHandle.detail->stream.zfree = zlib_free_func;
+			fileHandle.detail->curCompressedFilePosition = fileEntry.m_compressedSize;
+
+			if (inflateInit2(&fileHandle.detail->stream, -MAX_WBITS) != Z_OK) {
+				// There is no stream to end, so let go of the map before closing.
+				fileHandle.detail->mappedData = NULL;
+				FileCloseInternal(fileHandle);
+				return false;
+			}
+		}
+
+		return ret;
+	}
+
 	ZipLocalHeader localHeader;
 
 	m_parentFile->Seek(fileEntry.m_offset);
@@ -1403,7 +1503,13 @@ bool ZipArchive::FileOpenIndex(size_t index, ZipEntryFileHandle& fileHandle)
 		fileHandle.detail->stream.zalloc = zlib_alloc_func;
         fileHandle.detail->stream.zfree = zlib_free_func;
 
-		inflateInit2(&fileHandle.detail->stream, -MAX_WBITS);
+		if (inflateInit2(&fileHandle.detail->stream, -MAX_WBITS) != Z_OK)
+		{
+			delete[] fileHandle.detail->bufferedData;
+			fileHandle.detail->bufferedData = NULL;
+			FileCloseInternal(fileHandle);
+			return false;
+		}
     }
 
 #if ZIPARCHIVE_ENCRYPTION
@@ -1419,6 +1525,121 @@ bool ZipArchive::FileOpenIndex(size_t index, ZipEntryFileHandle& fileHandle)
 } // FileOpen()
 
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+	Finds the data of [fileEntry] within the memory map by way of its local
+	header.
+
+	@return Returns a pointer to the entry's (possibly compressed) data or
+		NULL if the local header is damaged or the data runs past the end of
+		the archive.
+**/
+const uint8_t* ZipArchive::MappedEntryData(const ZipEntryInfo& fileEntry)
+{
+	const uint8_t* mapped = m_mappedView->data;
+	uint64_t mappedSize = m_mappedView->size;
+	if ((uint64_t)fileEntry.m_offset + sizeof(ZipLocalHeader) > mappedSize)
+		return NULL;
+
+	ZipLocalHeader localHeader;
+	memcpy(&localHeader, mapped + fileEntry.m_offset, sizeof(ZipLocalHeader));
+	if (m_swap)
+	{
+		localHeader.signature = SwapEndian(localHeader.signature);
+		localHeader.size_filename = SwapEndian(localHeader.size_filename);
+		localHeader.size_file_extra = SwapEndian(localHeader.size_file_extra);
+	}
+
+	if (localHeader.signature != ZipLocalHeader::SIGNATURE)
+		return NULL;
+
+	uint64_t dataOffset = (uint64_t)fileEntry.m_offset + sizeof(ZipLocalHeader) + localHeader.size_filename + localHeader.size_file_extra;
+	if (dataOffset + fileEntry.m_compressedSize > mappedSize)
+		return NULL;
+
+	return mapped + dataOffset;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+	Returns a direct pointer to the data of an uncompressed file entry in a
+	memory mapped archive.  The pointer is valid until the archive is closed,
+	or for as long as a reference from AcquireMappedView() is held.
+
+	@param index The index of the file entry.
+	@return Returns the pointer to GetUncompressedSize() bytes of data or NULL
+		if the archive isn't memory mapped or the entry is compressed.
+**/
+const void* ZipArchive::FileMapIndex(size_t index)
+{
+	if (!m_mappedView)
+		return NULL;
+
+	ZipEntryInfo* fileEntry = GetFileEntry(index);
+	if (!fileEntry  ||  fileEntry->m_compressionMethod != UNCOMPRESSED)
+		return NULL;
+
+	return MappedEntryData(*fileEntry);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+	Reads the whole file entry at [index] into [buffer].  In a memory mapped
+	archive, deflated entries are inflated straight from the map into
+	[buffer] in one pass without opening a file handle, so separate threads
+	may read entries this way at the same time.
+
+	@param index The index of the file entry.
+	@param buffer Memory for the GetUncompressedSize() bytes of the entry.
+	@return Returns true if the entire file entry was read.
+**/
+bool ZipArchive::FileReadIndex(size_t index, void* buffer)
+{
+	ZipEntryInfo* fileEntry = GetFileEntry(index);
+	if (!fileEntry)
+		return false;
+
+	if (!m_mappedView)
+	{
+		ZipEntryFileHandle fileHandle;
+		if (!FileOpenIndex(index, fileHandle))
+			return false;
+		bool ret = FileRead(fileHandle, buffer, fileEntry->m_uncompressedSize) == fileEntry->m_uncompressedSize;
+		FileClose(fileHandle);
+		return ret;
+	}
+
+	const uint8_t* data = MappedEntryData(*fileEntry);
+	if (!data)
+		return false;
+
+	if (fileEntry->m_compressionMethod == UNCOMPRESSED)
+	{
+		memcpy(buffer, data, fileEntry->m_uncompressedSize);
+		return true;
+	}
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.zalloc = zlib_alloc_func;
+	stream.zfree = zlib_free_func;
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		return false;
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = fileEntry->m_compressedSize;
+	stream.next_out = (Bytef*)buffer;
+	stream.avail_out = fileEntry->m_uncompressedSize;
+	int err = inflate(&stream, Z_FINISH);
+	bool ret = (err == Z_STREAM_END  ||  (err == Z_BUF_ERROR  &&  stream.avail_out == 0))  &&
+			stream.total_out == fileEntry->m_uncompressedSize;
+	inflateEnd(&stream);
+	return ret;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 /**
 	Closes an open file entry.  This function should never really need to be
@@ -1570,12 +1791,13 @@ void ZipArchive::FileCloseInternal(ZipEntryFileHandle& fileHandle)
 	}
     else
     {
-    	if (fileEntry->m_compressionMethod == DEFLATED  &&  fileHandle.detail->bufferedData)
+    	if (fileEntry->m_compressionMethod == DEFLATED  &&  (fileHandle.detail->bufferedData  ||  fileHandle.detail->mappedData))
     		inflateEnd(&fileHandle.detail->stream);
     }
 
     delete[] fileHandle.detail->bufferedData;
     fileHandle.detail->bufferedData = NULL;
+	fileHandle.detail->mappedData = NULL;
 	fileHandle.detail->fileEntryIndex = ZipArchive::INVALID_FILE_ENTRY;
 
 	// Remove the file from the open files list.
@@ -1695,7 +1917,15 @@ int64_t ZipArchive::FileSeek(ZipEntryFileHandle& fileHandle, int64_t offset, Fil
 		switch (seekFlags)
 		{
 			case File::SEEKFLAG_BEGIN:
-				if (offset == 0)
+				if (offset == 0  &&  fileHandle.detail->mappedData)
+				{
+					// Start inflating from the beginning of the mapped data again.
+					inflateReset(&fileHandle.detail->stream);
+					fileHandle.detail->stream.next_in = (Bytef*)fileHandle.detail->mappedData;
+					fileHandle.detail->stream.avail_in = fileEntry->m_compressedSize;
+					fileHandle.detail->curUncompressedFilePosition = 0;
+				}
+				else if (offset == 0)
 				{
 					fileHandle.detail->curCompressedFilePosition = offset;
 					fileHandle.detail->curUncompressedFilePosition = offset;
@@ -1728,8 +1958,15 @@ uint64_t ZipArchive::FileRead(ZipEntryFileHandle& fileHandle, void* buffer, uint
 		if (fileHandle.detail->curUncompressedFilePosition >= fileEntry->m_uncompressedSize)
 			return 0;
 
-		m_parentFile->Seek(fileHandle.detail->curCompressedFilePosition + fileEntry->m_offset + fileHandle.detail->headerSize);
-		count = m_parentFile->Read(buffer, (unsigned int)count);
+		if (fileHandle.detail->mappedData)
+		{
+			memcpy(buffer, fileHandle.detail->mappedData + fileHandle.detail->curCompressedFilePosition, (size_t)count);
+		}
+		else
+		{
+			m_parentFile->Seek(fileHandle.detail->curCompressedFilePosition + fileEntry->m_offset + fileHandle.detail->headerSize);
+			count = m_parentFile->Read(buffer, (unsigned int)count);
+		}
 #if ZIPARCHIVE_ENCRYPTION
 		if (this->defaultPassword.Length() > 0)
 			fcrypt_decrypt_offset((unsigned char*)buffer, (unsigned int)count, fileHandle.detail->zcx, (unsigned long)fileHandle.detail->curCompressedFilePosition);
@@ -1924,7 +2161,7 @@ bool ZipArchive::FileErase(const char* fileName)
 
 		size_t sizeToRemove = m_fileEntryOffsets[index + 1] - m_fileEntryOffsets[index];
 		memcpy(GetFileEntry(index), GetFileEntry(index + 1), m_fileEntriesSizeBytes - m_fileEntryOffsets[index + 1]);
-        memcpy(m_fileEntryOffsets + index, m_fileEntryOffsets + index + 1, (m_fileEntryCount - index - 1) * sizeof(unsigned int));
+        memmove(m_fileEntryOffsets + index, m_fileEntryOffsets + index + 1, (m_fileEntryCount - index - 1) * sizeof(size_t));
 		m_fileEntryCount--;
 
 		// Reinsert all following entries into the map.
@@ -2116,9 +2353,10 @@ bool ZipArchive::FileCopy(File& srcFile, const char* destFilename, int compressi
 	if (m_readOnly)
 		return false;
 
-	// Create the destination file entry.
+	// Create the destination file entry.  FileCreate() sets up the deflate
+	// stream and MD5 context FileWrite() needs.
 	ZipEntryFileHandle destFileHandle;
-	if (!FileCreateInternal(destFilename, destFileHandle, compressionMethod, compressionLevel, fileTime))
+	if (!FileCreate(destFilename, destFileHandle, compressionMethod, compressionLevel, fileTime))
 		return false;
 
 	// Operate in 64k buffers.
@@ -2170,6 +2408,56 @@ bool ZipArchive::FileCopy(const char* srcFileName, const char* destFileName, int
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+	Writes a file entry whose data was already compressed elsewhere, as
+	with the ProcessFileList() worker threads.  The data is copied raw, just
+	like FileCopy() does from another archive.
+
+	@param destFilename The fileName of the file entry to create.
+	@param compressionMethod The compression method [buffer] was written with.
+	@param fileTime The file entry's creation date and time.
+	@param buffer The compressed data.
+	@param compressedSize The size of [buffer].
+	@param uncompressedSize The size of the data before compression.
+	@param crc The CRC of the uncompressed data.
+	@param md5 The MD5 of the uncompressed data.
+**/
+bool ZipArchive::FileWritePrecompressed(const char* destFilename, int compressionMethod, const time_t* fileTime,
+		const void* buffer, uint64_t compressedSize, uint64_t uncompressedSize, uint32_t crc, const unsigned char md5[16])
+{
+	if (m_readOnly)
+		return false;
+
+	// Create the destination file entry.
+	ZipEntryFileHandle destFileHandle;
+	if (!FileCreateInternal(destFilename, destFileHandle, compressionMethod, Z_DEFAULT_COMPRESSION, fileTime))
+		return false;
+    ZipEntryInfo* destFileEntry = GetFileEntry(destFileHandle.detail->fileEntryIndex);
+
+    int64_t destOffset = destFileEntry->m_offset + destFileHandle.detail->headerSize;
+	if (m_parentFile->Seek(destOffset) != destOffset  ||
+			m_parentFile->Write(buffer, compressedSize) != compressedSize) {
+		FileCloseInternal(destFileHandle);
+		return false;
+	}
+
+	destFileEntry->m_crc = crc;
+	if (m_flags & SUPPORT_MD5)
+		memcpy(destFileEntry->m_md5, md5, sizeof(destFileEntry->m_md5));
+	destFileEntry->m_compressedSize = (uint32_t)compressedSize;
+	destFileEntry->m_uncompressedSize = (uint32_t)uncompressedSize;
+
+	destFileHandle.detail->curUncompressedFilePosition = uncompressedSize;
+    destFileHandle.detail->curCompressedFilePosition = compressedSize;
+
+	// Close the destination file entry.
+	FileCloseInternal(destFileHandle);
+
+	return true;
+} // FileWritePrecompressed()
+
+
 /**
 **/
 bool ZipArchive::BufferCopy(const void* buffer, uint64_t size, ZipEntryFileHandle& destFile)
@@ -2765,6 +3053,282 @@ static ZipArchive* PFL_OpenArchive(const HeapString& archiveFileName, PFL_OpenZi
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// The ProcessFileList() compression pipeline.  Worker threads read files from
+// disk, checksum and compress them into memory while the calling thread
+// writes the finished entries into the archive in file order list order.
+///////////////////////////////////////////////////////////////////////////////
+
+
+struct PFL_CompressJob
+{
+	PFL_CompressJob(const ZipArchive::FileOrderInfo* _info)
+		: nextWork(NULL)
+		, nextPending(NULL)
+		, info(_info)
+		, srcPath(_info->srcPath)
+		, compressionMethod(_info->compressionMethod)
+		, compressionLevel(_info->compressionLevel)
+		, sizeHint(0)
+		, done(false)
+		, failed(false)
+		, buffer(NULL)
+		, compressedSize(0)
+		, uncompressedSize(0)
+		, crc(0)
+	{
+		memset(md5, 0, sizeof(md5));
+	}
+
+	~PFL_CompressJob()
+	{
+		delete[] buffer;
+	}
+
+	PFL_CompressJob* nextWork;				// Next job for the worker threads to pick up.
+	PFL_CompressJob* nextPending;			// Next job for the writer to pick up.
+	const ZipArchive::FileOrderInfo* info;
+
+	HeapString srcPath;
+	int compressionMethod;
+	int compressionLevel;
+	size_t sizeHint;						// Counted against the pipeline memory until written.
+
+	bool done;
+	bool failed;
+	uint8_t* buffer;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+	uint32_t crc;
+	unsigned char md5[16];
+};
+
+
+/**
+	Reads [job]'s source file, then fills in its CRC, MD5 and the entry data
+	compressed the same way FileWrite() would.
+**/
+static void PFL_CompressFile(PFL_CompressJob* job, bool computeMD5)
+{
+	DiskFile file;
+	if (!file.Open(job->srcPath)) {
+		job->failed = true;
+		return;
+	}
+
+	uint64_t fileSize = file.GetLength();
+	uint8_t* data = new uint8_t[fileSize > 0 ? (size_t)fileSize : 1];
+	if (file.Read(data, fileSize) != fileSize) {
+		delete[] data;
+		job->failed = true;
+		return;
+	}
+	file.Close();
+
+	job->uncompressedSize = fileSize;
+	job->crc = crc32(0, data, (uInt)fileSize);
+	if (computeMD5) {
+		MD5_CTX c;
+		MD5Init(&c);
+		MD5Update(&c, data, (unsigned int)fileSize);
+		MD5Final(job->md5, &c);
+	}
+
+	if (job->compressionMethod == ZipArchive::UNCOMPRESSED) {
+		job->buffer = data;
+		job->compressedSize = fileSize;
+		return;
+	}
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.zalloc = zlib_alloc_func;
+	stream.zfree = zlib_free_func;
+	if (deflateInit2(&stream, job->compressionLevel, Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL, 0) != Z_OK) {
+		delete[] data;
+		job->failed = true;
+		return;
+	}
+
+	uLong bound = deflateBound(&stream, (uLong)fileSize);
+	job->buffer = new uint8_t[bound];
+	stream.next_in = data;
+	stream.avail_in = (uInt)fileSize;
+	stream.next_out = job->buffer;
+	stream.avail_out = (uInt)bound;
+	int err = deflate(&stream, Z_FINISH);
+	job->compressedSize = stream.total_out;
+	deflateEnd(&stream);
+	delete[] data;
+
+	if (err != Z_STREAM_END)
+		job->failed = true;
+}
+
+
+class PFL_Pipeline
+{
+public:
+	PFL_Pipeline()
+		: m_threads(NULL)
+		, m_threadCount(0)
+		, m_computeMD5(false)
+		, m_quit(false)
+		, m_workHead(NULL)
+		, m_workTail(NULL)
+		, m_pendingHead(NULL)
+		, m_pendingTail(NULL)
+		, m_pendingCount(0)
+		, m_pendingBytes(0)
+	{
+	}
+
+	~PFL_Pipeline()
+	{
+		Stop();
+	}
+
+	bool IsRunning() const						{  return m_threadCount > 0;  }
+	size_t GetPendingCount() const				{  return m_pendingCount;  }
+	size_t GetPendingBytes() const				{  return m_pendingBytes;  }
+	int GetThreadCount() const					{  return m_threadCount;  }
+	const PFL_CompressJob* GetNextPending() const	{  return m_pendingHead;  }
+
+	bool Start(int threadCount, bool computeMD5)
+	{
+		mt_mutex_init(&m_lock);
+		mt_cond_init(&m_work);
+		mt_cond_init(&m_done);
+		m_computeMD5 = computeMD5;
+		m_quit = false;
+		m_threads = new mt_thread[threadCount];
+		for (m_threadCount = 0; m_threadCount < threadCount; ++m_threadCount) {
+			if (!mt_thread_start(&m_threads[m_threadCount], Worker, this))
+				break;
+		}
+		if (m_threadCount == 0) {
+			Stop();
+			return false;
+		}
+		return true;
+	}
+
+	void Stop()
+	{
+		if (!m_threads)
+			return;
+
+		mt_mutex_lock(&m_lock);
+		m_quit = true;
+		mt_cond_broadcast(&m_work);
+		mt_mutex_unlock(&m_lock);
+
+		for (int i = 0; i < m_threadCount; ++i) {
+			mt_thread_join(m_threads[i]);
+		}
+		delete[] m_threads;
+		m_threads = NULL;
+		m_threadCount = 0;
+
+		while (m_pendingHead) {
+			PFL_CompressJob* job = m_pendingHead;
+			m_pendingHead = job->nextPending;
+			delete job;
+		}
+		m_pendingTail = NULL;
+		m_pendingCount = 0;
+		m_pendingBytes = 0;
+
+		mt_mutex_free(&m_lock);
+		mt_cond_free(&m_work);
+		mt_cond_free(&m_done);
+	}
+
+	// Queues [job] for the worker threads.
+	void Submit(PFL_CompressJob* job)
+	{
+		if (m_pendingTail)
+			m_pendingTail->nextPending = job;
+		else
+			m_pendingHead = job;
+		m_pendingTail = job;
+		m_pendingCount++;
+		m_pendingBytes += job->sizeHint;
+
+		mt_mutex_lock(&m_lock);
+		if (m_workTail)
+			m_workTail->nextWork = job;
+		else
+			m_workHead = job;
+		m_workTail = job;
+		mt_cond_broadcast(&m_work);
+		mt_mutex_unlock(&m_lock);
+	}
+
+	// Waits for the oldest submitted job to finish and hands it to the
+	// caller, who deletes it.
+	PFL_CompressJob* Wait()
+	{
+		PFL_CompressJob* job = m_pendingHead;
+		mt_mutex_lock(&m_lock);
+		while (!job->done)
+			mt_cond_wait(&m_done, &m_lock);
+		mt_mutex_unlock(&m_lock);
+
+		m_pendingHead = job->nextPending;
+		if (!m_pendingHead)
+			m_pendingTail = NULL;
+		m_pendingCount--;
+		m_pendingBytes -= job->sizeHint;
+		return job;
+	}
+
+private:
+	static MT_THREAD_RETURN Worker(void* userData)
+	{
+		PFL_Pipeline* pipeline = (PFL_Pipeline*)userData;
+		mt_mutex_lock(&pipeline->m_lock);
+		for (;;) {
+			while (!pipeline->m_quit  &&  !pipeline->m_workHead)
+				mt_cond_wait(&pipeline->m_work, &pipeline->m_lock);
+			if (pipeline->m_quit)
+				break;
+
+			PFL_CompressJob* job = pipeline->m_workHead;
+			pipeline->m_workHead = job->nextWork;
+			if (!pipeline->m_workHead)
+				pipeline->m_workTail = NULL;
+			mt_mutex_unlock(&pipeline->m_lock);
+
+			PFL_CompressFile(job, pipeline->m_computeMD5);
+
+			mt_mutex_lock(&pipeline->m_lock);
+			job->done = true;
+			mt_cond_broadcast(&pipeline->m_done);
+		}
+		mt_mutex_unlock(&pipeline->m_lock);
+		return 0;
+	}
+
+	mt_thread* m_threads;
+	int m_threadCount;
+	bool m_computeMD5;
+
+	mt_mutex m_lock;
+	mt_cond m_work;
+	mt_cond m_done;
+	bool m_quit;
+	PFL_CompressJob* m_workHead;
+	PFL_CompressJob* m_workTail;
+
+	// Only touched by the writer.
+	PFL_CompressJob* m_pendingHead;
+	PFL_CompressJob* m_pendingTail;
+	size_t m_pendingCount;
+	size_t m_pendingBytes;
+};
+
+
 bool ZipArchive::ProcessFileList(ZipArchive::FileOrderList& fileOrderList, ProcessFileListOptions* options)
 {
 	if (!IsOpened())
@@ -3179,9 +3743,42 @@ bool ZipArchive::ProcessFileList(ZipArchive::FileOrderList& fileOrderList, Proce
 		}
 	}
 
+	// With worker threads, the files coming straight from disk are read, checksummed
+	// and compressed ahead of the loop below, which writes them in order.
+	PFL_Pipeline pipeline;
+	FileOrderList::Node* prefetchNode = NULL;
+	if (options->threads > 1  &&  needsUpdate  &&  !options->checkOnly
+#if ZIPARCHIVE_ENCRYPTION
+			&&  this->defaultPassword.Length() == 0
+#endif // ZIPARCHIVE_ENCRYPTION
+			) {
+		if (pipeline.Start(options->threads, (m_flags & SUPPORT_MD5) != 0))
+			prefetchNode = fileOrderList.Head();
+	}
+
 	// Iterate each entry in the file order list.
 	for (FileOrderList::Node* node = fileOrderList.Head(); needsUpdate  &&  node; node = fileOrderList.Next(node), ++index) {
 		FileOrderInfo& info = fileOrderList.Value(node);
+
+		// Keep the worker threads busy with upcoming files from disk.  Anything
+		// copied from another archive or possibly found in the network cache
+		// stays on this thread.
+		for ( ; prefetchNode  &&  (pipeline.GetPendingCount() == 0  ||
+					(pipeline.GetPendingCount() < (size_t)pipeline.GetThreadCount() * 4  &&
+					pipeline.GetPendingBytes() < options->pipelineMemory));
+				prefetchNode = fileOrderList.Next(prefetchNode)) {
+			FileOrderInfo& prefetchInfo = fileOrderList.Value(prefetchNode);
+			if (!prefetchInfo.used  ||  !prefetchInfo.needUpdate  ||  prefetchInfo.srcPath.ReverseFind('|') != -1)
+				continue;
+			if (prefetchInfo.compressionMethod != UNCOMPRESSED  &&  networkCache.IsNotEmpty()  &&
+					(prefetchInfo.size == 0  ||  prefetchInfo.size >= options->fileCacheSizeThreshold))
+				continue;
+
+			PFL_CompressJob* job = new PFL_CompressJob(&prefetchInfo);
+			job->sizeHint = prefetchInfo.size;
+			pipeline.Submit(job);
+		}
+
 		if (!info.used)
 			continue;
 
@@ -3354,6 +3951,34 @@ bool ZipArchive::ProcessFileList(ZipArchive::FileOrderList& fileOrderList, Proce
 			} // if (access(cacheFileName, 0) != -1)
 		} // if networkcache
 
+		// Was the file already compressed by the worker threads?
+		if (pipeline.GetNextPending()  &&  pipeline.GetNextPending()->info == &info) {
+			PFL_CompressJob* job = pipeline.Wait();
+
+			// Inform the user we are updating the archive.
+			if (!filenameShown) {
+				if (options->statusUpdateCallback)
+					options->statusUpdateCallback(UPDATING_ARCHIVE, m_filename, options->statusUpdateUserData);
+				filenameShown = true;
+			}
+			if (options->statusUpdateCallback)
+				options->statusUpdateCallback(UPDATING_ENTRY, info.entryName, options->statusUpdateUserData);
+
+			if (job->failed) {
+				this->errorString = "Unable to open file [" + info.srcPath + "].";
+				delete job;
+				return false;
+			}
+
+			// Transfer the compressed data into the archive.
+			bool ret = activeArchive->FileWritePrecompressed(info.entryName, job->compressionMethod, &info.lastWriteTime,
+					job->buffer, job->compressedSize, job->uncompressedSize, job->crc, job->md5);
+			delete job;
+			if (!ret)
+				return false;
+			continue;
+		}
+
 		// Open the file from the disk.
 		DiskFile diskFile;
 		if (!diskFile.Open(info.srcPath))
@@ -101,6 +101,7 @@ public:
     enum {
 		SUPPORT_MD5 = 0x00000001,
 		EXTRA_DIRECTORY_AT_BEGINNING = 0x00000002,
+		MEMORY_MAPPED = 0x00000004,				// Read-only archives opened by name are read through a memory map.
 	};
 
     struct FileOrderInfo {
@@ -187,6 +188,7 @@ public:
 
 	bool IsReadOnly() const					{  return m_readOnly;  }
 	bool IsOpened() const					{  return m_parentFile != NULL;  }
+	bool IsMemoryMapped() const				{  return m_mappedView != NULL;  }
 
 	bool FileCreate(const char* filename, ZipEntryFileHandle& fileHandle, int compressionMethod = DEFLATED,
 			int compressionLevel = Z_DEFAULT_COMPRESSION, const time_t* fileTime = NULL);
@@ -195,6 +197,13 @@ public:
 	bool FileClose(ZipEntryFileHandle& fileHandle);
 	void FileCloseAll();
 
+	const void* FileMapIndex(size_t index);
+	bool FileReadIndex(size_t index, void* buffer);
+
+	class MappedView;
+	MappedView* AcquireMappedView();
+	static void ReleaseMappedView(MappedView* view);
+
     const char* FileGetFileName(ZipEntryFileHandle& fileHandle);
 	uint64_t FileGetPosition(ZipEntryFileHandle& fileHandle);
 	void FileSetLength(ZipEntryFileHandle& fileHandle, uint64_t newLength);
@@ -258,6 +267,8 @@ public:
 			, retrieveChecksumUserData(NULL)
 			, statusUpdateCallback(NULL)
 			, statusUpdateUserData(NULL)
+			, threads(1)
+			, pipelineMemory(256 * 1024 * 1024)
 		{
 		}
 
@@ -273,6 +284,9 @@ public:
 
 		fnStatusUpdate statusUpdateCallback;
 		void* statusUpdateUserData;
+
+		int threads;								// With more than 1, files from disk are read, checksummed and compressed on this many worker threads.
+		size_t pipelineMemory;						// Source bytes the worker threads may have in flight ahead of the writer.
 	};
 
     bool ProcessFileList(FileOrderList& fileOrder, ProcessFileListOptions* options = 0);
@@ -297,6 +311,9 @@ private:
 	void FileCloseInternal(ZipEntryFileHandle& fileHandle);
 	bool FileCreateInternal(const char* fileName, ZipEntryFileHandle& fileHandle, int compressionMethod, int compressionLevel, const time_t* fileTime);
 	bool FileOpenIndexInternal(size_t index, ZipEntryFileHandle& fileHandle);
+	const uint8_t* MappedEntryData(const ZipEntryInfo& fileEntry);
+	bool FileWritePrecompressed(const char* destFilename, int compressionMethod, const time_t* fileTime,
+			const void* buffer, uint64_t compressedSize, uint64_t uncompressedSize, uint32_t crc, const unsigned char md5[16]);
 	void _WriteDirectory(int64_t dirOffset, int64_t dirHeaderOffset);
 
 	uint32_t	m_flags;
@@ -319,6 +336,7 @@ private:
 
 	File* m_parentFile;
 	bool m_ownParentFile;
+	MappedView* m_mappedView;						//!< The read-only view of m_parentFile, if MEMORY_MAPPED.
 
 	ZipEntryFileHandle* m_curWriteFile;				//!< The current file being written to.
 
@@ -616,6 +616,16 @@ int lziparchive_processfilelist(lua_State* L)
 			options.fileCacheSizeThreshold = (size_t)lua_tonumber(L, -1);
 		lua_pop(L, 1);
 
+		lua_getfield(L, 3, "Threads");
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			options.threads = (int)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "PipelineMemory");
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			options.pipelineMemory = (size_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+
 		lua_getfield(L, 3, "RetrieveChecksum");
 		if (lua_type(L, -1) == LUA_TFUNCTION)
 		{
@@ -874,24 +884,159 @@ static int _zafe_index_table(lua_State* L, fileentry_info* info, ZipEntryInfo* e
 
 
 static int _zafe_index_contents(lua_State* L, fileentry_info* info, ZipEntryInfo* entry) {
-	ZipEntryFileHandle fileHandle;
-	if (!info->archive->FileOpenIndex(info->entryIndex, fileHandle)) {
-		return 0;
+	size_t bufferSize = entry->GetUncompressedSize();
+	const void* mapped = info->archive->FileMapIndex(info->entryIndex);
+	if (mapped) {
+		lua_pushlstring(L, (const char*)mapped, bufferSize);
+		return 1;
 	}
-	int64_t bufferSize = info->archive->FileGetLength(fileHandle);
-	unsigned char* buffer = (unsigned char*)malloc((size_t)bufferSize);
-	if (info->archive->FileRead(fileHandle, buffer, bufferSize) != bufferSize) {
+	unsigned char* buffer = (unsigned char*)malloc(bufferSize > 0 ? bufferSize : 1);
+	if (!info->archive->FileReadIndex(info->entryIndex, buffer)) {
 		free(buffer);
-		info->archive->FileClose(fileHandle);
 		return 0;
 	}
-	info->archive->FileClose(fileHandle);
-	lua_pushlstring(L, (const char*)buffer, (size_t)bufferSize);
+	lua_pushlstring(L, (const char*)buffer, bufferSize);
 	free(buffer);
 	return 1;
 }
 
 
+#define ZIPARCHIVE_BUFFER_METATABLE "ZipArchive_BufferMetatable"
+
+/**
+	A read-only view of a file entry's contents.  Uncompressed entries of a
+	memory mapped archive point straight into the map.  Everything else is
+	inflated directly into the userdata's own memory.
+**/
+struct zipbuffer_info {
+	ZipArchive::MappedView* view;
+	const char* data;
+	size_t size;
+};
+
+
+static zipbuffer_info* zipbuffer_check(lua_State* L, int index) {
+	return (zipbuffer_info*)luaL_checkudata(L, index, ZIPARCHIVE_BUFFER_METATABLE);
+}
+
+
+static int _zafe_index_buffer(lua_State* L, fileentry_info* info, ZipEntryInfo* entry) {
+	size_t bufferSize = entry->GetUncompressedSize();
+	const void* mapped = info->archive->FileMapIndex(info->entryIndex);
+	zipbuffer_info* buffer;
+	if (mapped) {
+		buffer = (zipbuffer_info*)lua_newuserdata(L, sizeof(zipbuffer_info));
+		buffer->view = NULL;
+		buffer->data = (const char*)mapped;
+		buffer->size = bufferSize;
+		luaL_getmetatable(L, ZIPARCHIVE_BUFFER_METATABLE);
+		lua_setmetatable(L, -2);
+		buffer->view = info->archive->AcquireMappedView();
+		return 1;
+	}
+
+	buffer = (zipbuffer_info*)lua_newuserdata(L, sizeof(zipbuffer_info) + bufferSize);
+	buffer->view = NULL;
+	buffer->data = (const char*)(buffer + 1);
+	buffer->size = bufferSize;
+	luaL_getmetatable(L, ZIPARCHIVE_BUFFER_METATABLE);
+	lua_setmetatable(L, -2);
+	if (!info->archive->FileReadIndex(info->entryIndex, buffer + 1))
+		return 0;
+	return 1;
+}
+
+
+static int zipbuffer_gc(lua_State* L) {
+	zipbuffer_info* buffer = zipbuffer_check(L, 1);
+	ZipArchive::ReleaseMappedView(buffer->view);
+	buffer->view = NULL;
+	return 0;
+}
+
+
+static int zipbuffer_len(lua_State* L) {
+	zipbuffer_info* buffer = zipbuffer_check(L, 1);
+	lua_pushnumber(L, (lua_Number)buffer->size);
+	return 1;
+}
+
+
+static int zipbuffer_tostring(lua_State* L) {
+	zipbuffer_info* buffer = zipbuffer_check(L, 1);
+	lua_pushlstring(L, buffer->data, buffer->size);
+	return 1;
+}
+
+
+/* Turns a string.sub() style position into a 1 based offset. */
+static ptrdiff_t zipbuffer_posrelat(ptrdiff_t pos, size_t len) {
+	if (pos < 0) pos += (ptrdiff_t)len + 1;
+	return (pos >= 0) ? pos : 0;
+}
+
+
+static int zipbuffer_sub(lua_State* L) {
+	zipbuffer_info* buffer = zipbuffer_check(L, 1);
+	ptrdiff_t start = zipbuffer_posrelat(luaL_checkinteger(L, 2), buffer->size);
+	ptrdiff_t end = zipbuffer_posrelat(luaL_optinteger(L, 3, -1), buffer->size);
+	if (start < 1) start = 1;
+	if (end > (ptrdiff_t)buffer->size) end = (ptrdiff_t)buffer->size;
+	if (start <= end)
+		lua_pushlstring(L, buffer->data + start - 1, end - start + 1);
+	else
+		lua_pushliteral(L, "");
+	return 1;
+}
+
+
+static int zipbuffer_byte(lua_State* L) {
+	zipbuffer_info* buffer = zipbuffer_check(L, 1);
+	ptrdiff_t posi = zipbuffer_posrelat(luaL_optinteger(L, 2, 1), buffer->size);
+	ptrdiff_t pose = zipbuffer_posrelat(luaL_optinteger(L, 3, posi), buffer->size);
+	if (posi <= 0) posi = 1;
+	if (pose > (ptrdiff_t)buffer->size) pose = (ptrdiff_t)buffer->size;
+	if (posi > pose)
+		return 0;
+	int n = (int)(pose - posi + 1);
+	luaL_checkstack(L, n, "buffer slice too long");
+	for (int i = 0; i < n; i++)
+		lua_pushinteger(L, (unsigned char)buffer->data[posi + i - 1]);
+	return n;
+}
+
+
+static const struct luaL_reg zipbuffer_funcs[] = {
+	{ "sub",				zipbuffer_sub },
+	{ "byte",				zipbuffer_byte },
+	{ NULL, NULL },
+};
+
+
+static int ziparchive_buffer_create_metatable(lua_State *L) {
+	luaL_newmetatable(L, ZIPARCHIVE_BUFFER_METATABLE);		// metatable
+	lua_pushliteral(L, "__gc");								// metatable __gc
+	lua_pushcfunction(L, zipbuffer_gc);						// metatable __gc function
+	lua_settable(L, -3);									// metatable
+
+	lua_pushliteral(L, "__len");							// metatable __len
+	lua_pushcfunction(L, zipbuffer_len);					// metatable __len function
+	lua_settable(L, -3);									// metatable
+
+	lua_pushliteral(L, "__tostring");						// metatable __tostring
+	lua_pushcfunction(L, zipbuffer_tostring);				// metatable __tostring function
+	lua_settable(L, -3);									// metatable
+
+	lua_pushliteral(L, "__index");							// metatable __index
+	lua_newtable(L);										// metatable __index table
+	luaL_register(L, NULL, zipbuffer_funcs);
+	lua_settable(L, -3);									// metatable
+
+	lua_pop(L, 1);
+	return 0;
+}
+
+
 typedef int (*_zafe_index_property_func)(lua_State*, fileentry_info*, ZipEntryInfo* entry);
 typedef struct _zafe_index_properties_reg {
 	const char *name;
@@ -910,6 +1055,7 @@ static const struct _zafe_index_properties_reg _zafe_index_properties[] = {
 	{ "uncompressed_size",		_zafe_index_uncompressed_size },
 	{ "table",					_zafe_index_table },
 	{ "contents",				_zafe_index_contents },
+	{ "buffer",					_zafe_index_buffer },
 	{ NULL, NULL },
 };
 
@@ -1250,6 +1396,7 @@ int LS_Help(lua_State* L)
 "\t\t'a' - open existing archive writable or create new archive\n"
 "\topenflags:\tSUPPORT_MD5 - Calculate md5sums for every file\n"
 "\t\t\tEXTRA_DIRECTORY_AT_BEGINNING - Write an extra directory structure\n"
+"\t\t\tMEMORY_MAPPED - Read a read-only archive through a memory map\n"
 "time = ziparchive.AdjustTime_t(timeToAdjust) - Adjusts a timestamp to zip format\n"
 "\n"
 "Drive commands:\n"
@@ -1291,6 +1438,8 @@ int LS_Help(lua_State* L)
 "        integer FileCacheSizeThreshold,\n"
 "        crc, md5 = function RetrieveChecksum(sourcePath),\n"
 "        function StatusUpdate(FileListStatus, text),\n"
+"        integer Threads (default 1),\n"
+"        integer PipelineMemory (default 256 MB),\n"
 "    }\n"
 "    archive:processfilelist(fileNameTable, ProcessFileListOptions)\n"
 "\n"
@@ -1309,6 +1458,8 @@ int LS_Help(lua_State* L)
 "            uint32_t uncompressed_size\n"
 "            uint32_t compressed_size\n"
 "            uint32_t compression_method\n"
+"            string contents\n"
+"            buffer buffer - read-only: #buffer, tostring(buffer), buffer:sub(i [, j]), buffer:byte(i [, j])\n"
 "        }\n"
 "    int entryIndex = archive:fileentryindex(fileName)\n"
 "\n"
@@ -1457,6 +1608,7 @@ static void lziparchive_createmetatables(lua_State* L)
 */
 	ziparchive_fileiterator_create_metatable(L);
 	ziparchive_fileentry_create_metatable(L);
+	ziparchive_buffer_create_metatable(L);
 }
 
 
@@ -1526,6 +1678,8 @@ extern "C" int luaopen_ziparchive(lua_State* L)
 	lua_setfield(L, -2, "SUPPORT_MD5");
 	lua_pushnumber(L, ZipArchive::EXTRA_DIRECTORY_AT_BEGINNING);
 	lua_setfield(L, -2, "EXTRA_DIRECTORY_AT_BEGINNING");
+	lua_pushnumber(L, ZipArchive::MEMORY_MAPPED);
+	lua_setfield(L, -2, "MEMORY_MAPPED");
 
 	lziparchive_createmetatables(L);
 	return 1;
@@ -602,5 +602,88 @@ os.remove('FileC')
 
 
 
+-------------------------------------------------------------------------------
+-------------------------------------------------------------------------------
+-- Process a file list into an archive using worker threads.
+-------------------------------------------------------------------------------
+-------------------------------------------------------------------------------
+print("archive:processfilelist - Threads...")
+fileList = {}
+for i = 1, 150 do
+	local fileName = ('File%04u'):format(i)
+	io.writeall(fileName, lowerAlphabet:rep(i))
+	fileList[#fileList + 1] = { EntryName = fileName:lower(), SourcePath = './' .. fileName, Compressed = i % 3 ~= 0 }
+end
+
+archive = ziparchive.new()
+assert(archive:open('tempfile.zip', 'w') == true)
+assert(archive:processfilelist(fileList, { Threads = 4, PipelineMemory = 1000 }) == true)
+assert(archive:close() == true)
+
+assert(archive:open('tempfile.zip') == true)
+assert(archive:fileentrycount() == 150)
+for i = 1, 150 do
+	local fileName = ('File%04u'):format(i)
+	entry = archive:fileentry(i)
+	assert(entry.filename == fileName:lower())
+	local crc, md5 = ziparchive.filecrcmd5(fileName)
+	assert(entry.crc == crc)
+	assert(entry.md5 == md5)
+
+	local file = archive:fileopen(entry.filename)
+	assert(archive:fileread(file) == lowerAlphabet:rep(i))
+	archive:fileclose(file)
+	os.remove(fileName)
+end
+assert(archive:close() == true)
+
+os.remove('tempfile.zip')
+
+
+
+-------------------------------------------------------------------------------
+-------------------------------------------------------------------------------
+-- Read entries through a memory map.
+-------------------------------------------------------------------------------
+-------------------------------------------------------------------------------
+print("archive:open - MEMORY_MAPPED...")
+archive = ziparchive.new()
+assert(archive:open('tempfile.zip', 'w') == true)
+for i = 1, 20 do
+	local file = archive:filecreate(('File%04u'):format(i), i % 2 == 0 and ziparchive.DEFLATED or ziparchive.UNCOMPRESSED)
+	archive:filewrite(file, lowerAlphabet:rep(i))
+	archive:fileclose(file)
+end
+assert(archive:close() == true)
+
+archive = assert(ziparchive.open('tempfile.zip', 'r', ziparchive.SUPPORT_MD5 + ziparchive.MEMORY_MAPPED))
+buffers = {}
+for i = 1, 20 do
+	entry = archive:fileentry(i)
+	assert(entry.contents == lowerAlphabet:rep(i))
+
+	local buffer = entry.buffer
+	assert(#buffer == 26 * i)
+	assert(tostring(buffer) == lowerAlphabet:rep(i))
+	assert(buffer:sub(2, 4) == 'bcd')
+	assert(buffer:sub(-2) == 'yz')
+	assert(buffer:byte(1) == string.byte('a'))
+	buffers[i] = buffer
+
+	local file = archive:fileopen(entry.filename)
+	assert(archive:fileread(file) == lowerAlphabet:rep(i))
+	archive:fileclose(file)
+end
+assert(archive:close() == true)
+
+-- Buffers stay valid after the archive is closed.
+for i = 1, 20 do
+	assert(tostring(buffers[i]) == lowerAlphabet:rep(i))
+end
+buffers = nil
+
+os.remove('tempfile.zip')
+
+
 
 